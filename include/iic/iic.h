@@ -22,7 +22,8 @@
 #include <iic/common.h>
 
 #ifdef __AVR_ATmega328PB__
-// The 328PB has 2 iic modules - we're only using one
+// The 328PB has 2 iic modules - TWI0 goes by the legacy names, TWI1 is
+// IIC_MODULE1 (see below)
 	#define TWCR TWCR0
 	#define TWDR TWDR0
 	#define TWSR TWSR0
@@ -31,6 +32,62 @@
 	#define TWI_vect TWI0_vect
 #endif
 
+/* iic_twi_t
+ * The registers of one TWI peripheral, in data-space order. Every TWI on
+ * the 328P/328PB has the same layout, so an iic_t reaches its own
+ * peripheral through a pointer to one of these.
+ */
+typedef struct iic_twi_t{
+	uint8_t twbr;
+	uint8_t twsr;
+	uint8_t twar;
+	uint8_t twdr;
+	uint8_t twcr;
+	uint8_t twamr;
+} iic_twi_t;
+
+#define IIC_TWI0 ((volatile iic_twi_t*)&TWBR)
+#ifdef __AVR_ATmega328PB__
+	#define IIC_TWI1 ((volatile iic_twi_t*)&TWBR1)
+#endif
+
+// PINx, DDRx and PORTx sit next to each other, so one pointer covers all three
+#define IIC_GPIO_PIN(pin) ((pin)[0])
+#define IIC_GPIO_DDR(pin) ((pin)[1])
+#define IIC_GPIO_PORT(pin) ((pin)[2])
+
+#ifndef IIC_RECOVERY_HALF_PERIOD_CYCLES
+	#define IIC_RECOVERY_HALF_PERIOD_CYCLES 80 // CPU cycles per half SCL period while recovering (5 us at 16 MHz)
+#endif
+#ifndef IIC_RECOVERY_RETRIES
+	#define IIC_RECOVERY_RETRIES 2 // times a queued transaction is replayed after a bus recovery
+#endif
+#ifndef IIC_WATCHDOG_TICKS
+	#define IIC_WATCHDOG_TICKS 10 // iic_watchdog_tick calls without a TWI interrupt before a master transaction is declared stuck
+#endif
+
+// Multi-master buses: a queued transaction that loses arbitration keeps its
+// START pending and goes again as soon as the winner's STOP frees the bus.
+// The winner yields without a timer: a START it chains onto its own STOP
+// goes out with TWBR raised by IIC_ARBITRATION_YIELD_TWBR, and the TWI
+// times the free bus it waits for from TWBR, so the masters that lost
+// START first and the winner has to wait for the next STOP. Once everyone
+// waiting has had a turn, the yielding STARTs tie and arbitration starts a
+// new round, lowest address first. That only holds between masters running
+// at the same bus speed. A master alone on the bus loses about 2 us per
+// back-to-back transaction at 400 kHz (the STOP and START are clocked
+// slower too) and no CPU time; a START that isn't chained onto our own
+// STOP is never slowed. Only
+// direct calls, and transactions that have lost IIC_ARBITRATION_RETRIES
+// times, fail with an arbitration error; in a round a transaction loses at
+// most once per other master (see bench_arbitration).
+#ifndef IIC_ARBITRATION_RETRIES
+	#define IIC_ARBITRATION_RETRIES 8
+#endif
+#ifndef IIC_ARBITRATION_YIELD_TWBR
+	#define IIC_ARBITRATION_YIELD_TWBR 8
+#endif
+
 #define TWCR_ENABLE (1 << TWEN) | (1 << TWIE) | (1 << TWEA)
 #define TWCR_DISABLE 0
 #define TWCR_NEXT TWCR_ENABLE | (1 << TWINT)
@@ -45,6 +102,10 @@ typedef enum{
 	IIC_PRESCALER_64_gc = 3
 } iic_prescaler_t;
 
+#include <iic/iic_bitrate.h>
+#include <iic/iic_stats.h>
+#include <iic/iic_trace.h>
+
 typedef enum{
 	IIC_TRYING_TO_SEIZE_BUS,
 	IIC_SLAVE_TRANSMITTER,
@@ -69,30 +130,205 @@ typedef enum{
 	IIC_ST_DATA_NACK,                     // I
 	IIC_SR_DATA_NACK,                     // J
 	IIC_SR_STOP,                          // K
-	IIC_BUS_ERROR                         // L
+	IIC_BUS_ERROR,                        // L
+	IIC_QUEUE_FULL                        // M: a follow-up transaction couldn't be queued
 } iic_error_t;
 
+// Event flags, set in the module's events by the ISR. Collect them with
+// iic_take_events, or sleep until one arrives with iic_wait_events.
+#define IIC_EVENT_MASTER_DONE  (1 << 0) // a master transaction finished successfully
+#define IIC_EVENT_MASTER_ERROR (1 << 1) // a master transaction failed (see its error / error_state)
+#define IIC_EVENT_QUEUE_EMPTY  (1 << 2) // the last queued master transaction has finished
+#define IIC_EVENT_SLAVE_RX     (1 << 3) // a master finished writing to us
+#define IIC_EVENT_SLAVE_TX     (1 << 4) // a master finished reading from us
+#define IIC_EVENT_BUS_ERROR    (1 << 5) // illegal START/STOP seen on the bus
+#define IIC_EVENT_BUS_RECOVERY (1 << 6) // the bus was reset by iic_recover (or a bus error / the watchdog)
+#define IIC_EVENT_SLAVE_REFILL (1 << 7) // deferred callback mode: the preloaded reply went out - call iic_slave_poll
+
+typedef enum{
+	IIC_SLAVE_CALLBACK, // call `callback` for every byte received or sent (default)
+	IIC_SLAVE_BUFFERED, // received frames go into a ring, reads are served from a preloaded buffer
+	IIC_SLAVE_REGISTER_MAP // reads and writes go straight to a block of RAM with an auto-incrementing pointer
+} iic_slave_mode_t;
+
+/* iic_device_profile_t
+ * Bus speed and retry policy for one remote device. Given a table of these
+ * (iic_set_device_profiles), the bus is reclocked at the START of each
+ * transaction to suit the device being addressed, so fast devices don't have
+ * to run at the speed of the slowest one.
+ */
+typedef struct iic_device_profile_t{
+	uint8_t         address; // 7-bit address of the device
+	uint8_t         bitrate; // TWBR (see IIC_TWBR_FOR)
+	iic_prescaler_t bitrate_prescaler; // see IIC_PRESCALER_FOR
+	uint8_t         retry_max; // retries for this device
+} iic_device_profile_t;
+
+// Bulk mode: 16-bit transfer lengths, for pushing framebuffers or EEPROM
+// contents in one transaction. Costs a few cycles per byte, so it's opt-in.
+#ifdef IIC_BULK_TRANSFERS
+	typedef uint16_t iic_len_t;
+#else
+	typedef uint8_t iic_len_t;
+#endif
+
+#ifndef IIC_QUEUE_LEN
+	#define IIC_QUEUE_LEN 8 // maximum number of queued master transactions
+#endif
+#if (IIC_QUEUE_LEN & (IIC_QUEUE_LEN - 1)) != 0
+	#error "IIC_QUEUE_LEN must be a power of two"
+#endif
+
+#ifndef IIC_URGENT_QUEUE_LEN
+	#define IIC_URGENT_QUEUE_LEN 4 // maximum number of queued IIC_FLAG_URGENT transactions
+#endif
+#if (IIC_URGENT_QUEUE_LEN & (IIC_URGENT_QUEUE_LEN - 1)) != 0
+	#error "IIC_URGENT_QUEUE_LEN must be a power of two"
+#endif
+
+/* iic_segment_t
+ * One piece of a scatter/gather transfer. A list of segments is sent (or
+ * filled) back-to-back in a single transaction, so a command byte and its
+ * payload don't have to be copied into one staging buffer first.
+ */
+typedef struct iic_segment_t{
+	uint8_t *data;
+	iic_len_t len;
+} iic_segment_t;
+
+// iic_transaction_t flags
+#define IIC_FLAG_NO_RETRY         (1 << 0) // give up on the first address NACK, whatever retry_max says
+#define IIC_FLAG_IGNORE_PRESENCE  (1 << 1) // go to the bus even if the device is known to be absent
+#define IIC_FLAG_URGENT           (1 << 2) // queue ahead of every normal transaction (see iic_set_preempt_chunk)
+#define IIC_FLAG_PREEMPTIBLE      (1 << 3) // plain write that may be split for urgent work (see iic_set_preempt_chunk)
+
+/* iic_transaction_t
+ * A queued master transaction. The descriptor (and its buffer) belongs to the
+ * caller and must stay valid until `pending` goes false; the queue only holds
+ * a pointer to it, so nothing is copied.
+ *
+ * There are two priority classes. IIC_FLAG_URGENT transactions have their own
+ * queue, which is always emptied before the next normal transaction starts.
+ * On top of that, a long plain write flagged IIC_FLAG_PREEMPTIBLE is checked
+ * every iic_set_preempt_chunk bytes: if urgent work is waiting, the write is
+ * parked and the bus goes straight over to the urgent transaction with a
+ * repeated START. Afterwards the write carries on in a new transaction from
+ * the byte where it stopped, so only flag writes the device can take in
+ * pieces (a display in data mode, say - not an EEPROM page). The wait for an
+ * urgent transaction is then at most one chunk, not one whole buffer.
+ */
+typedef struct iic_transaction_t{
+	uint8_t     remote_address; // 7-bit address of the remote device
+	iic_state_t direction; // IIC_MASTER_TRANSMITTER or IIC_MASTER_RECEIVER
+	uint8_t     *buffer; // bytes to send, or space for the bytes received
+	iic_len_t   buffer_len; // number of bytes to send/receive
+	const iic_segment_t *segments; // if not NULL, used instead of buffer/buffer_len
+	uint8_t     segment_count; // number of entries in segments
+	uint8_t     *read_buffer; // transmitter only: read into here after a repeated START
+	iic_len_t   read_len; // transmitter only: bytes to read after the write (0 for a plain write)
+	uint8_t     flags; // IIC_FLAG_* (0 for normal behaviour)
+	void (*callback)(struct iic_transaction_t*, iic_error_t); // called from the ISR when the transaction ends (may be NULL)
+	volatile struct iic_t *iic; // bus the transaction was queued on (set by iic_enqueue)
+	iic_len_t   sent; // bytes already on the wire when the transaction was preempted (driver use)
+	volatile bool        pending; // set by iic_enqueue, cleared once the transaction has ended
+	volatile iic_error_t error; // result of the transaction, valid once pending is false
+} iic_transaction_t;
+
+/* iic_t
+ * One TWI peripheral and its driver state. Every function takes the module
+ * to work on: &IIC_MODULE for TWI0, and on the 328PB &IIC_MODULE1 for TWI1.
+ * The two are completely independent, so each can run its own queue, speed
+ * and slave personality at the same time.
+ */
 typedef struct iic_t{
+	volatile iic_twi_t *twi; // registers of this module's peripheral
+	volatile uint8_t *pins; // PINx of the port SDA and SCL are on (for bus recovery)
+	uint8_t     sda_mask;
+	uint8_t     scl_mask;
+	uint8_t     watchdog; // iic_watchdog_tick calls since the last TWI interrupt
+	uint8_t     recoveries; // times the current transaction has been replayed after a recovery
+	uint8_t     arbitration_losses; // times the current transaction has lost arbitration
 	bool        data_ready; // read data is ready in data_buf
 	iic_error_t error_state; // errors on the IIC bus
 	uint8_t     data_buf; // small data buffer
 	uint8_t     data_buf_high; // extension for 2-byte commands
 	uint8_t     *big_data_buf;  // multi-byte data buffer for 3-byte (or more) transactions
-	uint8_t     data_buf_index; // index for multi-byte transactions
+	const iic_segment_t *segment; // segment big_data_buf belongs to (NULL for a contiguous buffer)
+	iic_len_t   segment_end; // data_buf_index at which the current segment runs out
+	iic_len_t   data_buf_index; // index for multi-byte transactions
 	uint8_t     remote_addr_buf; // remote address buffer
 	iic_state_t state; // current state (slave/master/disconnected)
 	iic_state_t intent; // the state the module is trying to reach
 	bool        slave_enable; // allow the system to be addressed as a slave device
 	bool        force_small_multibyte_read; // for people who call iic_read_many for 1 or 2-byte transactions
-	uint8_t     transaction_len; // number of bytes left to tx/rx this transaction
-	uint8_t     retry_max; // number of times to retry a data transmission before giving up
+	iic_len_t   transaction_len; // number of bytes left to tx/rx this transaction
+	uint8_t     retry_max; // number of times to retry a data transmission before giving up (for the current device)
 	uint8_t     retry_count; // number of times the current data transmission has been retried
+	bool        no_retry; // current transaction gives up on the first address NACK
+	uint8_t     *read_after_write_buf; // buffer for the read half of a write-then-read transaction
+	iic_len_t   read_after_write_len; // length of the read half (0 = release the bus after writing)
 	uint8_t (*callback)(volatile struct iic_t*, uint8_t); // callback function for slave functionality
+	iic_transaction_t *queue[IIC_QUEUE_LEN]; // pending master transactions; queue[queue_head] is the one on the bus
+	uint8_t     queue_head; // index of the oldest queued transaction
+	uint8_t     queue_tail; // index of the next free queue slot
+	iic_transaction_t *urgent_queue[IIC_URGENT_QUEUE_LEN]; // IIC_FLAG_URGENT transactions, always served first
+	uint8_t     urgent_head;
+	uint8_t     urgent_tail;
+	iic_transaction_t *current; // queued transaction currently on the bus (NULL for direct calls)
+	bool        current_urgent; // current came from urgent_queue
+	iic_len_t   preempt_chunk; // bytes between preemption points (0 = never preempt)
+	iic_len_t   chunk_left; // bytes until the next preemption point
+	uint8_t     events; // IIC_EVENT_* flags not yet collected by the application
+	const iic_device_profile_t *profiles; // per-device speed/retry profiles (may be NULL)
+	uint8_t     profile_count; // number of entries in profiles
+	uint8_t     profile_address; // address the current speed/retry settings were chosen for (0xFF = none)
+	uint8_t     default_bitrate; // settings for devices without a profile
+	iic_prescaler_t default_prescaler;
+	uint8_t     default_retry_max;
+	uint8_t     active_bitrate; // settings currently in TWBR/TWSR
+	iic_prescaler_t active_prescaler;
+	uint8_t     yield_bitrate; // TWBR while a START chained onto our own STOP waits for the bus
+	uint8_t     presence_known[16]; // bit per 7-bit address: has this address ACKed, or NACKed a probe?
+	uint8_t     presence[16]; // bit per 7-bit address: did it ACK last time it was checked?
+	uint8_t     groups[32]; // bit per group ID: are we a member?
+	uint8_t     group_header[2]; // iic_write_group: [ IIC_COMMAND_GROUP_MULTICAST | GROUP_ID ]
+	iic_segment_t group_segments[2]; // iic_write_group: header, payload
+	iic_slave_mode_t slave_mode; // how slave transactions are handled
+	bool        slave_tx_deferred; // callback mode: reads are answered from slave_tx_preload, and iic_slave_poll runs the callback outside the ISR
+	uint8_t     slave_tx_preload; // deferred callback mode: the next byte a master reading from us gets
+	uint8_t     *slave_rx_ring; // buffered mode: received frames, each as [ GC << 7 | LENGTH ] [ data ... ]
+	uint8_t     slave_rx_mask; // ring length - 1
+	uint8_t     slave_rx_head; // end of the last complete frame (written by the ISR only)
+	uint8_t     slave_rx_write; // where the ISR puts the next byte of the frame in progress
+	uint8_t     slave_rx_tail; // start of the oldest unread frame (written by the reader only)
+	bool        slave_rx_gcall; // frame in progress was sent to the general-call address
+	bool        slave_rx_overflow; // frame in progress didn't fit and will be dropped
+	uint8_t     slave_rx_filter; // general call in progress: the group check's next step (IIC_GROUP_FILTER_*), 0 once it is decided
+	uint8_t     *slave_tx_buf; // buffered mode: bytes sent when a master reads from us
+	uint8_t     slave_tx_len; // number of bytes in slave_tx_buf
+	uint8_t     slave_tx_index; // next byte of slave_tx_buf to send
+	void (*frame_callback)(volatile struct iic_t*); // buffered mode: called from the ISR after each complete frame (may be NULL)
+	uint8_t     *reg_map; // register-map mode: the registers
+	uint8_t     reg_len; // number of registers
+	const uint8_t *reg_read_only; // bitmap, bit (n & 7) of byte (n >> 3) set = register n is read-only (may be NULL; read at setup only)
+	const uint8_t *reg_write_mask; // one byte per register, set bits are the ones a master may change (may be NULL)
+	uint8_t     reg_writable[32]; // bit per register: may a master write it at all? (read_only and write_mask folded together at setup)
+	bool        reg_protected; // some register is read-only or masked - false skips both lookups on a write
+	uint8_t     reg_pointer; // next register to read/write
+	bool        reg_pointer_set; // false until the first byte of a write has set reg_pointer
+	bool        reg_dirty; // registers were written during this frame
+	uint8_t     reg_dirty_first; // lowest register written during this frame
+	uint8_t     reg_dirty_last; // highest register written during this frame
+	void (*dirty_callback)(volatile struct iic_t*, uint8_t, uint8_t); // called at the end of a write with the range written (may be NULL)
 } iic_t;
 
-volatile iic_t IIC_MODULE;
+extern volatile iic_t IIC_MODULE;
+#ifdef IIC_TWI1
+extern volatile iic_t IIC_MODULE1;
+#endif
 
 void setup_iic(
+	volatile iic_t *iic,
 	uint8_t address, 
 	bool slave_enable,
 	bool respond_to_general_call,
@@ -102,14 +338,54 @@ void setup_iic(
 	uint8_t (*callback)(volatile iic_t *iic, uint8_t received_data)
 	);
 
-void enable_iic();
-void disable_iic();
+bool iic_compute_bitrate(uint32_t f_cpu, uint32_t scl_hz, uint8_t *bitrate, iic_prescaler_t *bitrate_prescaler);
+void iic_set_bitrate(volatile iic_t *iic, uint8_t bitrate, iic_prescaler_t bitrate_prescaler);
+bool iic_set_bus_speed(volatile iic_t *iic, uint32_t f_cpu, uint32_t scl_hz);
+void iic_set_device_profiles(volatile iic_t *iic, const iic_device_profile_t *profiles, uint8_t profile_count);
+
+void enable_iic(volatile iic_t *iic);
+void disable_iic(volatile iic_t *iic);
+
+void iic_write_one(volatile iic_t *iic, uint8_t remote_address, uint8_t dat);
+void iic_write_two(volatile iic_t *iic, uint8_t remote_address, uint8_t dat_low, uint8_t dat_high);
+void iic_write_many(volatile iic_t *iic, uint8_t remote_address, uint8_t *data_buffer, iic_len_t buffer_len);
+void iic_read_one(volatile iic_t *iic, uint8_t remote_address);
+void iic_read_two(volatile iic_t *iic, uint8_t remote_address);
+void iic_read_many(volatile iic_t *iic, uint8_t remote_address, uint8_t *buffer, iic_len_t buffer_len);
+void iic_write_segments(volatile iic_t *iic, uint8_t remote_address, const iic_segment_t *segments, uint8_t segment_count);
+void iic_read_segments(volatile iic_t *iic, uint8_t remote_address, const iic_segment_t *segments, uint8_t segment_count);
+void iic_slave_buffers(volatile iic_t *iic, uint8_t *rx_ring, uint8_t rx_ring_len, void (*frame_callback)(volatile iic_t *iic));
+void iic_slave_set_reply(volatile iic_t *iic, uint8_t *tx_buffer, uint8_t tx_len);
+void iic_slave_register_map(
+	volatile iic_t *iic,
+	uint8_t *registers,
+	uint8_t register_count,
+	const uint8_t *read_only,
+	void (*dirty_callback)(volatile iic_t *iic, uint8_t first, uint8_t last)
+	);
+void iic_slave_register_write_mask(volatile iic_t *iic, const uint8_t *write_mask);
+void iic_slave_defer_callback(volatile iic_t *iic, bool defer, uint8_t first_reply);
+void iic_slave_preload(volatile iic_t *iic, uint8_t dat);
+bool iic_slave_poll(volatile iic_t *iic);
+uint8_t iic_slave_read_frame(volatile iic_t *iic, uint8_t *frame, uint8_t max_len, bool *general_call);
+void iic_write_read(volatile iic_t *iic, uint8_t remote_address, uint8_t *write_buffer, iic_len_t write_len, uint8_t *read_buffer, iic_len_t read_len);
+
+bool iic_enqueue(volatile iic_t *iic, iic_transaction_t *transaction);
+void iic_set_preempt_chunk(volatile iic_t *iic, iic_len_t chunk);
+
+bool iic_device_absent(volatile iic_t *iic, uint8_t address);
+bool iic_device_present(volatile iic_t *iic, uint8_t address);
+void iic_presence_forget(volatile iic_t *iic, uint8_t address);
+
+void iic_join_group(volatile iic_t *iic, uint8_t group);
+void iic_leave_group(volatile iic_t *iic, uint8_t group);
+bool iic_in_group(volatile iic_t *iic, uint8_t group);
+void iic_write_group(volatile iic_t *iic, uint8_t group, uint8_t *data_buffer, iic_len_t buffer_len);
+
+uint8_t iic_take_events(volatile iic_t *iic, uint8_t mask);
+uint8_t iic_wait_events(volatile iic_t *iic, uint8_t mask);
 
-void iic_write_one(uint8_t remote_address, uint8_t dat);
-void iic_write_two(uint8_t remote_address, uint8_t dat_low, uint8_t dat_high);
-void iic_write_many(uint8_t remote_address, uint8_t *data_buffer, uint8_t buffer_len);
-void iic_read_one(uint8_t remote_address);
-void iic_read_two(uint8_t remote_address);
-void iic_read_many(uint8_t remote_address, uint8_t *buffer, uint8_t buffer_len);
+void iic_clear_error(volatile iic_t *iic);
 
-void iic_clear_error();
+bool iic_recover(volatile iic_t *iic);
+void iic_watchdog_tick(volatile iic_t *iic);
@@ -0,0 +1,66 @@
+/* 
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ 
+ * iic_bitrate.h
+ * compile-time TWBR/prescaler selection for a target SCL frequency
+ *
+ * SCL = F_CPU / (16 + 2 * TWBR * PRESCALER)
+ *
+ * The smallest prescaler that keeps TWBR in range gives the finest steps,
+ * so that's the one picked. TWBR is rounded up, so the bus never runs
+ * faster than asked for.
+ */
+
+#pragma once
+
+// prescaler multiplier (1, 4, 16, 64) for an iic_prescaler_t value
+#define IIC_PRESCALER_VALUE(prescaler_gc) (1UL << (2 * (prescaler_gc)))
+
+// F_CPU / SCL, rounded up
+#define IIC_SCL_DIVIDER(f_cpu, scl_hz) (((f_cpu) + (scl_hz) - 1) / (scl_hz))
+
+// TWBR for a given prescaler multiplier (may come out above 255 - see below)
+#define IIC_TWBR_FOR_PRESCALER(f_cpu, scl_hz, prescaler) \
+	(IIC_SCL_DIVIDER(f_cpu, scl_hz) <= 16 ? 0 : \
+	 (IIC_SCL_DIVIDER(f_cpu, scl_hz) - 16 + 2 * (prescaler) - 1) / (2 * (prescaler)))
+
+// best iic_prescaler_t for the target frequency
+#define IIC_PRESCALER_FOR(f_cpu, scl_hz) \
+	(IIC_TWBR_FOR_PRESCALER(f_cpu, scl_hz, 1) <= 255 ? IIC_PRESCALER_1_gc : \
+	 IIC_TWBR_FOR_PRESCALER(f_cpu, scl_hz, 4) <= 255 ? IIC_PRESCALER_4_gc : \
+	 IIC_TWBR_FOR_PRESCALER(f_cpu, scl_hz, 16) <= 255 ? IIC_PRESCALER_16_gc : IIC_PRESCALER_64_gc)
+
+// TWBR to go with IIC_PRESCALER_FOR
+#define IIC_TWBR_FOR(f_cpu, scl_hz) \
+	IIC_TWBR_FOR_PRESCALER(f_cpu, scl_hz, IIC_PRESCALER_VALUE(IIC_PRESCALER_FOR(f_cpu, scl_hz)))
+
+// SCL frequency actually produced by a TWBR/prescaler pair
+#define IIC_SCL_HZ(f_cpu, twbr, prescaler_gc) \
+	((f_cpu) / (16 + 2UL * (twbr) * IIC_PRESCALER_VALUE(prescaler_gc)))
+
+#define IIC_SCL_ACHIEVED(f_cpu, scl_hz) \
+	IIC_SCL_HZ(f_cpu, IIC_TWBR_FOR(f_cpu, scl_hz), IIC_PRESCALER_FOR(f_cpu, scl_hz))
+
+/* IIC_BITRATE_CHECK
+ * Fails the build unless IIC_TWBR_FOR/IIC_PRESCALER_FOR can produce scl_hz
+ * from f_cpu to within tolerance_pct percent.
+ * e.g. IIC_BITRATE_CHECK(F_CPU, 400000UL, 5);
+ */
+#define IIC_BITRATE_CHECK(f_cpu, scl_hz, tolerance_pct) \
+	_Static_assert( \
+		IIC_TWBR_FOR(f_cpu, scl_hz) <= 255 && \
+		IIC_SCL_ACHIEVED(f_cpu, scl_hz) * 100 >= (scl_hz) * (100 - (tolerance_pct)) && \
+		IIC_SCL_ACHIEVED(f_cpu, scl_hz) * 100 <= (scl_hz) * (100 + (tolerance_pct)), \
+		"IIC: SCL frequency can't be reached from this F_CPU within tolerance")
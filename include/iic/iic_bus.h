@@ -0,0 +1,66 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * iic_bus.h
+ * one master interface over both back ends: the hardware TWI (src/iic.c)
+ * and the bit-banged bus (src/iic_soft.c)
+ *
+ * A driver written against an iic_bus_t doesn't know which back end it is
+ * on, so a device moves between buses by setting its iic_bus_t up with
+ * IIC_BUS_HW or IIC_BUS_SOFT instead:
+ *
+ *   iic_bus_t sensors = IIC_BUS_HW(&IIC_MODULE);
+ *   iic_bus_t slow = IIC_BUS_SOFT(&soft_bus);
+ *
+ * Everything goes through the back end's transaction queue. The write and
+ * read calls fill in the caller's descriptor and queue it; they return
+ * false if the descriptor is still pending or the queue is full. The result
+ * is in transaction->error once transaction->pending is false, or is handed
+ * to transaction->callback (set it after the call, or enqueue your own
+ * descriptor for anything more than a plain write or read).
+ */
+
+#pragma once
+#include <iic/iic.h>
+
+typedef struct iic_bus_ops_t{
+	bool (*enqueue)(volatile void *port, iic_transaction_t *transaction);
+	uint8_t (*take_events)(volatile void *port, uint8_t mask);
+} iic_bus_ops_t;
+
+typedef struct iic_bus_t{
+	const iic_bus_ops_t *ops;
+	volatile void *port; // the iic_t or iic_soft_t behind this bus
+} iic_bus_t;
+
+extern const iic_bus_ops_t iic_hw_bus_ops; // src/iic.c
+extern const iic_bus_ops_t iic_soft_bus_ops; // src/iic_soft.c
+
+#define IIC_BUS_HW(iic) {&iic_hw_bus_ops, (iic)}
+#define IIC_BUS_SOFT(soft) {&iic_soft_bus_ops, (soft)}
+
+bool iic_bus_enqueue(const iic_bus_t *bus, iic_transaction_t *transaction);
+bool iic_bus_write_many(const iic_bus_t *bus, iic_transaction_t *transaction, uint8_t remote_address, uint8_t *data_buffer, iic_len_t buffer_len);
+bool iic_bus_read_many(const iic_bus_t *bus, iic_transaction_t *transaction, uint8_t remote_address, uint8_t *buffer, iic_len_t buffer_len);
+bool iic_bus_write_read(
+	const iic_bus_t *bus,
+	iic_transaction_t *transaction,
+	uint8_t remote_address,
+	uint8_t *write_buffer,
+	iic_len_t write_len,
+	uint8_t *read_buffer,
+	iic_len_t read_len
+	);
+uint8_t iic_bus_take_events(const iic_bus_t *bus, uint8_t mask);
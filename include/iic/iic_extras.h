@@ -19,24 +19,32 @@
 
 #pragma once
 #include <iic/common.h>
+#include <iic/iic.h>
 
 typedef uint8_t IIC_COMMAND_t;
 
+#define IIC_ADDRESS_SERVER_ADDRESS 0x01
+
 //===========================================================================//
 //== Dynamic-address-allocation commands                                   ==//
 //===========================================================================//
 
 /* IIC_COMMAND_REQUEST_ADDRESS
  * target address: 0x01 (address server) ONLY
- * length: 0
+ * length: 0 or 2
+ * syntax: [ command | ID_LO | ID_HI ]
  * purpose: request an address from the address server
+ * note: ID is a 16-bit number unique to the device (e.g. its serial number)
+ *       that the server echoes in its reply, so several devices asking at
+ *       once can tell whose reply is whose. Asking again with the same ID
+ *       gets the same address while the server still remembers it.
  */
 #define IIC_COMMAND_REQUEST_ADDRESS 0xA0
 
 /* IIC_COMMAND_ADDRESS_ALLOCATION
  * target address: 0x00 (general-call) ONLY
- * length: 1
- * syntax: [ command | NEW_ADDRESS ]
+ * length: 3
+ * syntax: [ command | NEW_ADDRESS | ID_LO | ID_HI ]
  * purpose: inform the device which last sent IIC_COMMAND_REQUEST_ADDRESS that
  *          the address "NEW_ADDRESS" has been allocated for it.
  */
@@ -44,7 +52,8 @@ typedef uint8_t IIC_COMMAND_t;
 
 /* IIC_COMMAND_NO_ROOM_ON_BUS
  * target address: 0x00 (general-call) ONLY
- * length: 0
+ * length: 2
+ * syntax: [ command | ID_LO | ID_HI ]
  * purpose: inform the device which last sent IIC_COMMAND_REQUEST_ADDRESS that
  *          an address could not be allocated for it, as the iic bus is
  *          currently full.
@@ -53,15 +62,33 @@ typedef uint8_t IIC_COMMAND_t;
  */
 #define IIC_COMMAND_NO_ROOM_ON_BUS 0xA2
 
-/* IIC_COMMAND_RELEASE_ADDRESS
+/* IIC_COMMAND_ADDRESS_CONFIRM
  * target address: 0x01 (address server) ONLY
  * length: 1
+ * syntax: [ command | NEW_ADDRESS ]
+ * purpose: sent by a device as soon as it takes up the address an
+ *          IIC_COMMAND_ADDRESS_ALLOCATION gave it.
+ * note: the server sends a release request to an allocation that isn't
+ *       confirmed within IIC_ADDRESS_OFFER_TICKS. If nobody answers at the
+ *       address (e.g. it was a second allocation to a device that already
+ *       had one), the server takes it back and announces it with
+ *       IIC_COMMAND_RELEASE_ACKNOWLEDGE.
+ */
+#define IIC_COMMAND_ADDRESS_CONFIRM 0xA3
+
+/* IIC_COMMAND_RELEASE_ADDRESS
+ * target address: 0x01 (address server), or ADDRESS_TO_RELEASE (see below)
+ * length: 1
  * syntax: [ command | ADDRESS_TO_RELEASE ]
  * purpose: request that the address "ADDRESS_TO_RELEASE" be un-allocated. Used
  *          by slaves that are about to disconnect from the bus, and by the
  *          address server when it wants to release an inactive address.
+ * note: when a lease runs out, the address server sends this command to the
+ *       device at ADDRESS_TO_RELEASE. A device that is still using the
+ *       address answers with IIC_COMMAND_RELEASE_DISPUTED.
  */
 #define IIC_COMMAND_RELEASE_REQUEST 0xA9
+#define IIC_COMMAND_RELEASE_ADDRESS IIC_COMMAND_RELEASE_REQUEST
 
 /* IIC_COMMAND_RELEASE_ACKNOWLEDGE
  * target address: 0x00 (general-call) ONLY
@@ -72,9 +99,44 @@ typedef uint8_t IIC_COMMAND_t;
  *          address. Also inform other devices that the address is now free.
  */
 #define IIC_COMMAND_RELEASE_ACKNOWLEDGE 0xAA
+
+/* IIC_COMMAND_RELEASE_DISPUTED
+ * target address: 0x01 (address server) ONLY
+ * length: 1
+ * syntax: [ command | DISPUTED_ADDRESS ]
+ * purpose: sent by the device at DISPUTED_ADDRESS in reply to a release
+ *          request it didn't ask for; it is still using the address, and
+ *          the address server renews its lease.
+ */
 #define IIC_COMMAND_RELEASE_DISPUTED 0xAB
 #define IIC_COMMAND_RELEASE_FORCE 0xAC
-#define IIC_COMMAND_RELEASE_NOT_ALLOCATED 0xAD // sent when we have no record of a slave at the requested address
+
+/* IIC_COMMAND_RELEASE_NOT_ALLOCATED
+ * target address: 0x00 (general-call) ONLY
+ * length: 1
+ * syntax: [ command | ADDRESS ]
+ * purpose: sent in reply to a release request for an address the server
+ *          has no record of.
+ */
+#define IIC_COMMAND_RELEASE_NOT_ALLOCATED 0xAD
+
+
+//===========================================================================//
+//== Group commands                                                        ==//
+//===========================================================================//
+/* IIC_COMMAND_GROUP_MULTICAST
+ * target address: 0x00 (general-call) ONLY
+ * length: 1 or more
+ * syntax: [ command | GROUP_ID | payload ... ]
+ * purpose: deliver one frame to every node in group GROUP_ID at once.
+ * note: in every slave mode, nodes outside the group NACK the payload in
+ *       the ISR and drop the frame: it never reaches their frame ring or
+ *       their callback. Members' rings and callbacks still see the whole
+ *       frame, header included; a register map takes the payload as an
+ *       ordinary register write. Join groups with iic_join_group; send with
+ *       iic_write_group.
+ */
+#define IIC_COMMAND_GROUP_MULTICAST 0x30
 
 
 //===========================================================================//
@@ -166,8 +228,232 @@ typedef uint8_t IIC_COMMAND_t;
  */
 #define IIC_COMMAND_LED_EXCLUSIVE_SYNCHRONIZE 0x2B
 
+//===========================================================================//
+//== LED waveform engine                                                   ==//
+//===========================================================================//
+/* Build with LED_ENGINE on LED slaves. The engine keeps the waveform and
+ * phase locally, so the master only sends the occasional pattern change and
+ * a general-call SYNCHRONIZE to line the nodes back up, instead of streaming
+ * every sample.
+ *
+ * Call led_engine_setup with the pattern table and an output function, pass
+ * every received frame to led_engine_handle_frame (from the buffered-slave
+ * frame callback, so synchronize lands as soon as the STOP does), and call
+ * led_engine_tick from a timer interrupt at a fixed rate. Each tick adds the
+ * pattern's step to a 16-bit phase and hands each channel's level, scaled
+ * by the waveform sample at (phase >> 8), to the output function. The PHASE
+ * byte in the LED commands is that same high byte.
+ *
+ * Pattern 0 (IIC_LED_PATTERN_STEADY) ignores the waveform and outputs the
+ * levels from IIC_COMMAND_LED_WRITE_WORD as they are.
+ *
+ * The INCLUDE_GROUP / EXCLUDE_GROUP commands use IIC_MODULE's group table
+ * (see iic_join_group), and LED commands sent with iic_write_group arrive wrapped
+ * in a multicast header, which led_engine_handle_frame strips.
+ */
+#ifdef LED_ENGINE
+#define IIC_LED_CHANNELS 3
+#define IIC_LED_PATTERN_STEADY 0
+
+typedef struct led_waveform_t{
+	const uint8_t *samples; // 256 samples, 0 = off, 255 = full channel level
+	uint16_t step; // phase added per tick - a full cycle takes 65536 / step ticks
+} led_waveform_t;
+
+void led_engine_setup(
+	const led_waveform_t *patterns,
+	uint8_t pattern_count,
+	void (*output)(uint8_t channel, uint16_t level)
+	);
+bool led_engine_handle_frame(uint8_t *frame, uint8_t len, bool general_call);
+void led_engine_tick();
+uint16_t led_engine_phase();
+#endif
+
+//===========================================================================//
+//== Paged EEPROM writes                                                   ==//
+//===========================================================================//
+/* iic_eeprom_write_t
+ * A bulk write to a 24LCxx-style EEPROM with a 16-bit memory address. The
+ * data are split at page boundaries and each page goes out as its own queued
+ * transaction of [ ADDRESS_HIGH | ADDRESS_LOW | page data ], without copying
+ * the data. The next page is queued from the ISR as soon as the previous one
+ * finishes.
+ *
+ * note: the EEPROM NACKs its address for a few ms while it commits a page, so
+ *       retry_max has to cover that write cycle.
+ */
+typedef struct iic_eeprom_write_t{
+	iic_transaction_t transaction; // must stay first - the page callback casts back to the job
+	iic_segment_t segments[2]; // memory address, page data
+	uint8_t       address_bytes[2]; // big-endian memory address of the current page
+	uint16_t      mem_address; // memory address of the next byte to write
+	uint8_t       *data; // next byte to write
+	iic_len_t     remaining; // bytes not yet handed to the bus
+	uint16_t      page_size; // EEPROM page size in bytes (e.g. 64 for a 24LC256)
+	void (*callback)(struct iic_eeprom_write_t*, iic_error_t); // called from the ISR when done (may be NULL)
+	volatile bool pending; // true until every page has been written or one failed
+} iic_eeprom_write_t;
+
+bool iic_eeprom_write(
+	volatile iic_t *iic,
+	iic_eeprom_write_t *job,
+	uint8_t remote_address,
+	uint16_t mem_address,
+	uint8_t *data,
+	iic_len_t len,
+	uint16_t page_size,
+	void (*callback)(iic_eeprom_write_t *job, iic_error_t error)
+	);
+
+//===========================================================================//
+//== Bus scanning                                                          ==//
+//===========================================================================//
+/* iic_scan_t
+ * Probes a range of addresses with address-only writes, no retries. The
+ * answers land in the presence cache of the bus being scanned (iic_device_present /
+ * iic_device_absent), after which queued transactions to missing devices
+ * fail straight away without using the bus. Probes are queued one after
+ * another from the ISR, so a full scan runs in the background.
+ *
+ * Once the scan is done, call iic_scan_reprobe every so often to check one
+ * missing address at a time for devices that have turned up since.
+ */
+typedef struct iic_scan_t{
+	iic_transaction_t transaction; // must stay first - the probe callback casts back to the scan
+	uint8_t       first_address; // scan range
+	uint8_t       last_address;
+	uint8_t       next_address; // next address to probe
+	bool          full_scan; // probing the whole range, rather than re-probing one address
+	void (*callback)(struct iic_scan_t*); // called from the ISR when a full scan is done (may be NULL)
+	volatile bool pending; // true while a scan or re-probe is running
+} iic_scan_t;
+
+#define IIC_SCAN_FIRST_ADDRESS 0x08 // 0x00-0x07 and 0x78-0x7F are reserved
+#define IIC_SCAN_LAST_ADDRESS 0x77
+
+bool iic_scan_bus(volatile iic_t *iic, iic_scan_t *scan, uint8_t first_address, uint8_t last_address, void (*callback)(iic_scan_t *scan));
+bool iic_scan_reprobe(iic_scan_t *scan);
+
+//===========================================================================//
+//== Periodic polling                                                      ==//
+//===========================================================================//
+/* iic_poll_t
+ * A sensor register read repeated at a fixed rate, without the main loop
+ * issuing it: [ REGISTER ], repeated START, then len bytes read. Give
+ * iic_poll_start a table of jobs and call iic_poll_tick from a timer compare
+ * interrupt; every job whose period has run out is queued from there, so
+ * samples are taken on the timer's schedule however busy the main loop is.
+ * Set IIC_FLAG_URGENT in flags to keep a job ahead of bulk traffic.
+ *
+ * Results are double-buffered in `buffers` (2 * len bytes, owned by the
+ * caller): each read fills the slot the application isn't looking at, and
+ * a successful one is published by flipping `front` and bumping `seq`. A
+ * failed read leaves the previous sample in place and only sets `error`.
+ * iic_poll_read copies the latest sample out without blocking, and retries
+ * the copy if a new sample was published under it, so it never tears.
+ */
+typedef struct iic_poll_t{
+	iic_transaction_t transaction; // must stay first - the sample callback casts back to the job
+	uint8_t       reg; // register the read starts at
+	uint8_t       *buffers; // two result slots of transaction.read_len bytes each
+	uint16_t      period; // iic_poll_tick calls between samples
+	uint16_t      countdown; // ticks until the next sample
+	volatile uint8_t front; // slot holding the latest complete sample (0 or 1)
+	volatile uint8_t seq; // bumped every time a new sample is published
+	volatile uint8_t overruns; // samples skipped because the previous one was still on the bus
+	volatile iic_error_t error; // result of the last sample
+} iic_poll_t;
+
+void iic_poll_setup(
+	iic_poll_t *job,
+	uint8_t remote_address,
+	uint8_t reg,
+	uint8_t *buffers,
+	iic_len_t len,
+	uint16_t period,
+	uint16_t first,
+	uint8_t flags
+	);
+void iic_poll_start(volatile iic_t *iic, iic_poll_t *jobs, uint8_t job_count);
+void iic_poll_stop();
+void iic_poll_tick();
+uint8_t iic_poll_read(iic_poll_t *job, uint8_t *dest);
+
+//===========================================================================//
+//== Address server                                                        ==//
+//===========================================================================//
+/* Build with ADDRESS_SERVER on the board at IIC_ADDRESS_SERVER_ADDRESS.
+ * Feed it the frames received as a slave (e.g. from iic_slave_read_frame):
+ * handle_address_negotiation for [ REQUEST_ADDRESS ], handle_address_release
+ * for ADDRESS_CONFIRM and the RELEASE_* commands, and call
+ * address_server_tick at a steady rate to age the leases and take back
+ * allocations nobody confirmed. Replies go out through the transaction
+ * queue, so the handlers never wait for the bus and are safe to call from
+ * the ISR. The server runs on IIC_MODULE.
+ */
 #ifdef ADDRESS_SERVER
-bool handle_address_negotiation(uint8_t command);
-bool handle_address_release(uint8_t command, uint8_t slave_address, uint8_t dispute_byte);
-void do_address_response(uint8_t allocated_address);
+#ifndef IIC_ADDRESS_LEASE_TICKS
+	#define IIC_ADDRESS_LEASE_TICKS 60 // address_server_tick calls before a silent device is asked to release
+#endif
+#ifndef IIC_ADDRESS_OFFER_TICKS
+	#define IIC_ADDRESS_OFFER_TICKS 2 // ticks after an allocation goes out to wait for its ADDRESS_CONFIRM
+#endif
+#ifndef IIC_ADDRESS_RELEASE_GRACE_TICKS
+	#define IIC_ADDRESS_RELEASE_GRACE_TICKS 2 // ticks to wait for a RELEASE_DISPUTED
+#endif
+#ifndef IIC_ADDRESS_SERVER_REPLIES
+	#define IIC_ADDRESS_SERVER_REPLIES 8 // replies that can be waiting for the bus at once
+#endif
+
+bool handle_address_negotiation(uint8_t command, uint16_t id);
+bool handle_address_release(uint8_t command, uint8_t address);
+void address_server_renew(uint8_t address);
+void address_server_tick();
+#endif
+
+//===========================================================================//
+//== Address client                                                        ==//
+//===========================================================================//
+/* Build with ADDRESS_CLIENT on hot-plugged slaves that get their address
+ * from the address server. Call setup_iic with slave_enable set (the
+ * address is ignored - the client listens on general call only until it is
+ * allocated one), then address_client_start with an id unique to the
+ * board (its serial number); it also seeds the backoff. Call address_client_tick
+ * at a steady rate and pass every received frame to
+ * address_client_handle_frame, which returns true if it used the frame.
+ * The client confirms each address it takes up (ADDRESS_CONFIRM) and
+ * starts over if the server takes it back.
+ *
+ * Requests are spread out with randomized exponential backoff: the first
+ * one waits a random number of ticks inside IIC_ADDRESS_CLIENT_FIRST_WINDOW,
+ * and each failed attempt doubles the window, up to
+ * IIC_ADDRESS_CLIENT_MAX_WINDOW. A board that was told there is no room
+ * waits out the largest window before trying again. The client runs on
+ * IIC_MODULE.
+ */
+#ifdef ADDRESS_CLIENT
+#ifndef IIC_ADDRESS_CLIENT_FIRST_WINDOW
+	#define IIC_ADDRESS_CLIENT_FIRST_WINDOW 8 // ticks; must be a power of two
+#endif
+#ifndef IIC_ADDRESS_CLIENT_MAX_WINDOW
+	#define IIC_ADDRESS_CLIENT_MAX_WINDOW 256 // ticks; must be a power of two
+#endif
+#ifndef IIC_ADDRESS_CLIENT_REPLY_TICKS
+	#define IIC_ADDRESS_CLIENT_REPLY_TICKS 4 // ticks to wait for the server's reply
+#endif
+
+typedef enum{
+	ADDRESS_CLIENT_STOPPED,
+	ADDRESS_CLIENT_BACKOFF, // waiting to send a request
+	ADDRESS_CLIENT_WAITING, // request sent, waiting for the reply
+	ADDRESS_CLIENT_ADDRESSED
+} address_client_state_t;
+
+void address_client_start(uint16_t id);
+void address_client_tick();
+bool address_client_handle_frame(uint8_t *frame, uint8_t len, bool general_call);
+void address_client_release();
+address_client_state_t address_client_state();
+uint8_t address_client_address();
 #endif
@@ -0,0 +1,120 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * iic_soft.h
+ * bit-banged iic master on any two GPIO pins
+ *
+ * A second, slower bus for devices that don't need the hardware TWI. It
+ * takes the same iic_transaction_t descriptors as iic_enqueue, reports
+ * through the same callbacks, error codes and IIC_EVENT_* flags, and
+ * honours IIC_FLAG_NO_RETRY. There is no presence cache, so
+ * IIC_FLAG_IGNORE_PRESENCE has no effect, and transaction->iic is left
+ * NULL.
+ *
+ * iic_soft_write_many, iic_soft_read_many and iic_soft_write_read look like
+ * the hardware calls but don't behave like them. They queue bus->direct, so
+ * they return false while the previous direct transfer is still pending
+ * (or the queue is full), and the result is in bus->direct.error rather
+ * than an error_state. Code that should run on either bus uses iic_bus.h,
+ * which both back ends implement.
+ *
+ * Nothing blocks: the application calls iic_soft_tick from a timer
+ * interrupt, and every tick moves the bus on by half an SCL period. Run the
+ * timer at IIC_SOFT_TICK_HZ(scl_hz) times tick_divider. With tick_divider,
+ * buses with different speeds can share one timer.
+ *
+ * The pins are driven open-drain: a line is pulled low by making the pin an
+ * output (PORT bit cleared), and released by making it an input again, so
+ * both lines need pull-up resistors. A slave holding SCL low (clock
+ * stretching) pauses the bus for up to stretch_max half periods before the
+ * transaction fails with IIC_BUS_ERROR.
+ */
+
+#pragma once
+#include <iic/iic.h>
+
+#ifndef IIC_SOFT_QUEUE_LEN
+	#define IIC_SOFT_QUEUE_LEN 4 // maximum number of queued transactions per software bus
+#endif
+#if (IIC_SOFT_QUEUE_LEN & (IIC_SOFT_QUEUE_LEN - 1)) != 0
+	#error "IIC_SOFT_QUEUE_LEN must be a power of two"
+#endif
+
+#define IIC_SOFT_TICK_HZ(scl_hz) (2 * (uint32_t)(scl_hz)) // iic_soft_tick rate for scl_hz (tick_divider = 1)
+
+typedef enum{
+	IIC_SOFT_IDLE,
+	IIC_SOFT_START, // waiting for a free bus, then SDA low
+	IIC_SOFT_BIT_LOW, // sample the last bit, SCL low, put out the next one
+	IIC_SOFT_BIT_HIGH, // release SCL
+	IIC_SOFT_STOP_SCL, // SCL/SDA are low - release SCL
+	IIC_SOFT_STOP_SDA, // once SCL is high, release SDA
+	IIC_SOFT_RESTART_SCL, // SCL low, SDA released - release SCL
+	IIC_SOFT_RESTART_SDA // once SCL is high, SDA low
+} iic_soft_state_t;
+
+typedef enum{
+	IIC_SOFT_STAGE_ADDRESS,
+	IIC_SOFT_STAGE_WRITE,
+	IIC_SOFT_STAGE_READ
+} iic_soft_stage_t;
+
+typedef struct iic_soft_t{
+	volatile uint8_t *sda_pin; // PINx of the SDA pin
+	uint8_t     sda_mask;
+	volatile uint8_t *scl_pin; // PINx of the SCL pin
+	uint8_t     scl_mask;
+	uint8_t     tick_divider; // iic_soft_tick calls per half SCL period
+	uint8_t     tick_count;
+	uint16_t    stretch_max; // half periods SCL may be held low (or the bus busy) before giving up
+	uint16_t    stretch_count;
+	uint8_t     retry_max; // number of times to retry a NACKed address or data byte
+	uint8_t     retry_count;
+	iic_soft_state_t state;
+	iic_soft_stage_t stage; // what the byte on the wire is
+	bool        reading; // current half of the transaction is a read
+	uint16_t    tx_bits; // the 9 bits of the current byte (8 data + ACK), MSB first
+	uint16_t    rx_bits; // bits sampled so far in the current byte
+	uint8_t     bit_count; // bits put out so far in the current byte
+	uint8_t     *data; // next byte to send/receive
+	iic_len_t   segment_left; // bytes left at data
+	const iic_segment_t *segment; // next segment (segment lists only)
+	iic_len_t   len_left; // bytes left in this half of the transaction
+	iic_error_t error; // result to report once the STOP is out
+	iic_transaction_t *queue[IIC_SOFT_QUEUE_LEN]; // pending transactions; queue[queue_head] is the one on the bus
+	uint8_t     queue_head;
+	uint8_t     queue_tail;
+	iic_transaction_t *current; // transaction on the bus (NULL when idle)
+	iic_transaction_t direct; // used by iic_soft_write_many and friends
+	uint8_t     events; // IIC_EVENT_* flags not yet collected by the application
+} iic_soft_t;
+
+void iic_soft_setup(
+	volatile iic_soft_t *bus,
+	volatile uint8_t *sda_pin,
+	uint8_t sda_bit,
+	volatile uint8_t *scl_pin,
+	uint8_t scl_bit,
+	uint8_t tick_divider,
+	uint16_t stretch_max,
+	uint8_t retry_max
+	);
+
+bool iic_soft_enqueue(volatile iic_soft_t *bus, iic_transaction_t *transaction);
+bool iic_soft_write_many(volatile iic_soft_t *bus, uint8_t remote_address, uint8_t *data_buffer, iic_len_t buffer_len);
+bool iic_soft_read_many(volatile iic_soft_t *bus, uint8_t remote_address, uint8_t *buffer, iic_len_t buffer_len);
+bool iic_soft_write_read(volatile iic_soft_t *bus, uint8_t remote_address, uint8_t *write_buffer, iic_len_t write_len, uint8_t *read_buffer, iic_len_t read_len);
+void iic_soft_tick(volatile iic_soft_t *bus);
+uint8_t iic_soft_take_events(volatile iic_soft_t *bus, uint8_t mask);
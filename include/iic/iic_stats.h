@@ -0,0 +1,93 @@
+/* 
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ 
+ * iic_stats.h
+ * opt-in ISR cost and transaction statistics (build with IIC_ENABLE_STATS)
+ *
+ * Times are read from IIC_STATS_TIMER, a free-running 16-bit timer that the
+ * application sets up (TCNT1 by default - e.g. TCCR1B = 1 << CS10 for one
+ * count per CPU cycle). The ISR time runs from just after the ISR prologue
+ * to just before the epilogue; SCL is held low for about that long, plus
+ * interrupt latency, on every status code.
+ *
+ * Only IIC_MODULE (TWI0) is measured; the hooks compare the bus pointer
+ * against it, which folds away in the ISR.
+ *
+ * Without IIC_ENABLE_STATS the hooks below expand to nothing.
+ */
+
+#pragma once
+
+#ifdef IIC_ENABLE_STATS
+
+#ifndef IIC_STATS_TIMER
+	#define IIC_STATS_TIMER TCNT1
+#endif
+#ifndef IIC_STATS_TIME_SHIFT
+	#define IIC_STATS_TIME_SHIFT 6 // time_histogram[0] counts transactions under (1 << IIC_STATS_TIME_SHIFT) timer counts
+#endif
+#define IIC_STATS_BUCKETS 8
+
+/* iic_stats_t
+ * time_histogram[n] counts transactions that took fewer than
+ * (1 << (IIC_STATS_TIME_SHIFT + n)) timer counts from START to finish (the
+ * last bucket takes everything longer). retry_histogram[n] counts
+ * transactions that needed n retries (the last bucket: that many or more).
+ * Counters stick at their maximum rather than wrapping.
+ */
+typedef struct iic_stats_t{
+	uint16_t status_count[32]; // ISR entries per TWSR status code, indexed by status >> 3
+	uint16_t status_max[32]; // longest ISR per TWSR status code, indexed by status >> 3
+	uint16_t isr_min; // shortest ISR, in timer counts
+	uint16_t isr_max; // longest ISR, in timer counts
+	uint32_t isr_total; // sum of all ISR times, for the mean
+	uint32_t isr_count; // number of ISRs timed
+	uint16_t time_histogram[IIC_STATS_BUCKETS];
+	uint16_t retry_histogram[IIC_STATS_BUCKETS];
+	uint16_t transaction_start; // timer reading at the first START of the current transaction
+	uint8_t  transaction_retries; // retries so far in the current transaction
+	bool     in_transaction; // transaction_start is valid
+	uint16_t st_stretch_last; // SCL hold on the last slave read: ISR start to TWINT release on SLA+R, in timer counts
+	uint16_t st_stretch_max; // longest such hold
+	uint16_t arb_lost; // arbitration losses (each one backs off and retries, or fails the transaction)
+	uint8_t  arb_lost_max; // most losses of a single transaction - how close this master came to starving
+} iic_stats_t;
+
+extern volatile iic_stats_t IIC_STATS;
+
+void iic_stats_reset();
+uint16_t iic_stats_isr_mean();
+
+#define IIC_STATS_ISR_BEGIN(iic, status) \
+	uint16_t iic_stats_isr_start = IIC_STATS_TIMER; \
+	if((iic) == &IIC_MODULE) iic_stats_count(&IIC_STATS.status_count[(status) >> 3])
+#define IIC_STATS_ISR_END(iic, status) do{ if((iic) == &IIC_MODULE) iic_stats_isr_done(iic_stats_isr_start, status); }while(0)
+#define IIC_STATS_TRANSACTION_START(iic) do{ if((iic) == &IIC_MODULE) iic_stats_transaction_start(); }while(0)
+#define IIC_STATS_RETRY(iic) do{ if((iic) == &IIC_MODULE) IIC_STATS.transaction_retries++; }while(0)
+#define IIC_STATS_TRANSACTION_END(iic) do{ if((iic) == &IIC_MODULE) iic_stats_transaction_end(); }while(0)
+#define IIC_STATS_SLAVE_RELEASE(iic) do{ if((iic) == &IIC_MODULE) iic_stats_slave_release(iic_stats_isr_start); }while(0)
+#define IIC_STATS_ARBITRATION_LOST(iic, losses) do{ if((iic) == &IIC_MODULE) iic_stats_arbitration_lost(losses); }while(0)
+
+#else
+
+#define IIC_STATS_ISR_BEGIN(iic, status)
+#define IIC_STATS_ISR_END(iic, status)
+#define IIC_STATS_TRANSACTION_START(iic)
+#define IIC_STATS_RETRY(iic)
+#define IIC_STATS_TRANSACTION_END(iic)
+#define IIC_STATS_SLAVE_RELEASE(iic)
+#define IIC_STATS_ARBITRATION_LOST(iic, losses)
+
+#endif
@@ -0,0 +1,102 @@
+/* 
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ 
+ * iic_trace.h
+ * bus trace recorder (build with IIC_ENABLE_TRACE)
+ *
+ * Every TWI interrupt appends [ STATUS | TWDR | TICK_LOW | TICK_HIGH ] to a
+ * ring, so the last IIC_TRACE_LEN bus events are always on hand. The first
+ * master error (or a bus error) freezes the ring, keeping the lead-up to the
+ * failure until iic_trace_rearm is called.
+ *
+ * TICK comes from IIC_TRACE_TIMER, a free-running 16-bit timer that the
+ * application sets up (TCNT1 by default). TWDR is the byte just received,
+ * or the byte last sent for master/slave-transmitter states.
+ *
+ * iic_trace_dump writes the ring out, oldest entry first, behind a 5-byte
+ * header: [ 'I' | 'T' | IIC_TRACE_VERSION | ENTRY_COUNT | FREEZE_ERROR ],
+ * where FREEZE_ERROR is the iic_error_t that froze the trace (0 if it
+ * wasn't frozen by an error). tools/iic_trace_decode.c turns a dump into a
+ * readable transaction log.
+ *
+ * Only IIC_MODULE (TWI0) is traced.
+ *
+ * Without IIC_ENABLE_TRACE the hooks below expand to nothing.
+ */
+
+#pragma once
+
+#define IIC_TRACE_VERSION 1
+
+#ifdef IIC_ENABLE_TRACE
+
+#ifndef IIC_TRACE_TIMER
+	#define IIC_TRACE_TIMER TCNT1
+#endif
+#ifndef IIC_TRACE_LEN
+	#define IIC_TRACE_LEN 32 // entries (4 bytes each)
+#endif
+#if (IIC_TRACE_LEN & (IIC_TRACE_LEN - 1)) != 0 || IIC_TRACE_LEN > 128
+	#error "IIC_TRACE_LEN must be a power of two, 128 at most"
+#endif
+
+typedef struct iic_trace_entry_t{
+	uint8_t  status; // TWSR & TW_STATUS_MASK
+	uint8_t  data; // TWDR
+	uint16_t tick; // IIC_TRACE_TIMER on ISR entry
+} iic_trace_entry_t;
+
+typedef struct iic_trace_t{
+	iic_trace_entry_t entries[IIC_TRACE_LEN];
+	uint8_t  head; // next entry to write
+	uint8_t  count; // valid entries (stops at IIC_TRACE_LEN)
+	bool     frozen; // recording stopped
+	uint8_t  freeze_error; // iic_error_t that froze the trace, or 0
+} iic_trace_t;
+
+extern volatile iic_trace_t IIC_TRACE;
+
+void iic_trace_freeze();
+void iic_trace_rearm();
+void iic_trace_dump(void (*put)(uint8_t byte));
+
+#define IIC_TRACE_RECORD(iic, status_code) \
+	do{ \
+		if((iic) == &IIC_MODULE && !IIC_TRACE.frozen){ \
+			volatile iic_trace_entry_t *iic_trace_entry = &IIC_TRACE.entries[IIC_TRACE.head]; \
+			iic_trace_entry -> status = (status_code); \
+			iic_trace_entry -> data = (iic) -> twi -> twdr; \
+			iic_trace_entry -> tick = IIC_TRACE_TIMER; \
+			IIC_TRACE.head = (IIC_TRACE.head + 1) & (IIC_TRACE_LEN - 1); \
+			if(IIC_TRACE.count != IIC_TRACE_LEN){ \
+				IIC_TRACE.count++; \
+			} \
+		} \
+	}while(0)
+
+#define IIC_TRACE_TRIGGER(iic, error) \
+	do{ \
+		if((iic) == &IIC_MODULE && !IIC_TRACE.frozen){ \
+			IIC_TRACE.freeze_error = (error); \
+			IIC_TRACE.frozen = true; \
+		} \
+	}while(0)
+
+#else
+
+#define IIC_TRACE_RECORD(iic, status_code)
+#define IIC_TRACE_TRIGGER(iic, error)
+
+#endif
@@ -26,7 +26,7 @@
 #include <util/delay.h>
 #include <util/twi.h>
 
-#include "iic.h"
+#include <iic/iic.h>
 
 //#define SLAVE
 
@@ -43,8 +43,10 @@
 	#define REMOTE_2 0x6B
 	#define GEN_CALL 0x0
 	#define REMOTE_ADDRESS 0x6A
-	#define BITRATE_PRESCALER 0
-	#define BITRATE 0
+	#define SCL_HZ 400000UL
+	#define BITRATE_PRESCALER IIC_PRESCALER_FOR(F_CPU, SCL_HZ)
+	#define BITRATE IIC_TWBR_FOR(F_CPU, SCL_HZ)
+	IIC_BITRATE_CHECK(F_CPU, SCL_HZ, 5);
 uint8_t sine_lut[] = {0x80,0x83,0x86,0x89,0x8c,0x8f,0x92,0x95,
 0x98,0x9b,0x9e,0xa2,0xa5,0xa7,0xaa,0xad,
 0xb0,0xb3,0xb6,0xb9,0xbc,0xbe,0xc1,0xc4,
@@ -114,7 +116,7 @@ int main(void){
 
 	setup_usart();
 
-	setup_iic(ADDRESS, false, false, BITRATE, BITRATE_PRESCALER, 20, &iic_callback_fun);
+	setup_iic(&IIC_MODULE, ADDRESS, false, false, BITRATE, BITRATE_PRESCALER, 20, &iic_callback_fun);
 
 	PORTD = 1 << PD5;
 	_delay_ms(100);
@@ -130,10 +132,10 @@ int main(void){
 	TCCR0A |= (2 << COM0A0) | (1 << WGM00);
 	OCR0A = 0;
 	TCCR0B |= (1 << CS00) | (0 << WGM02);
-	setup_iic(ADDRESS, true, true, BITRATE, BITRATE_PRESCALER, 20, &iic_callback_fun);
+	setup_iic(&IIC_MODULE, ADDRESS, true, true, BITRATE, BITRATE_PRESCALER, 20, &iic_callback_fun);
 	#endif
 
-	enable_iic();
+	enable_iic(&IIC_MODULE);
 	sei();
 
 	#ifndef SLAVE
@@ -151,29 +153,29 @@ int main(void){
 		PORTB |= (1 << PB4);
 		PORTD &= ~((1 << PD7) | (1 << PD5));
 
-		iic_write_one(dest_addr, sine_lut[dat]);
-		while(IIC_MODULE.state != IIC_IDLE);
+		iic_write_one(&IIC_MODULE, dest_addr, sine_lut[dat]);
+		iic_wait_events(&IIC_MODULE, IIC_EVENT_MASTER_DONE | IIC_EVENT_MASTER_ERROR);
 		if(IIC_MODULE.error_state != IIC_NO_ERROR){
 			PORTD |= (1 << PD5);
 			PORTB |= (1 << PB3);
 			out_string("IIC error on write - type ");
 			out_char(IIC_MODULE.error_state + 'A' - 1);
 			out_string("!\n\r");
-			iic_clear_error();
+			iic_clear_error(&IIC_MODULE);
 		}else{
 			PORTD |= (1 << PD7);
 		}
 
 		if(dest_addr != GEN_CALL){ // can't read gencall
-			iic_read_one(dest_addr);
-			while(IIC_MODULE.state != IIC_IDLE);
+			iic_read_one(&IIC_MODULE, dest_addr);
+			iic_wait_events(&IIC_MODULE, IIC_EVENT_MASTER_DONE | IIC_EVENT_MASTER_ERROR);
 			if(IIC_MODULE.error_state != IIC_NO_ERROR){
 				out_string("IIC error on read - type ");
 				out_char(IIC_MODULE.error_state + 'A' - 1);
 				out_string("!\n\r");
 				PORTD |= (1 << PD5);
 				PORTB |= (1 << PB1);
-				iic_clear_error();
+				iic_clear_error(&IIC_MODULE);
 			}else{
 				if(IIC_MODULE.data_buf != sine_lut[dat]){
 					PORTD |= (1 << PD5);
@@ -17,14 +17,167 @@
  * main library file
  */
 
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 #include <util/twi.h>
 
 #include <iic/iic.h>
+#include <iic/iic_extras.h> // IIC_COMMAND_GROUP_MULTICAST
+#include <iic/iic_bus.h>
 #include <iic/common.h>
 
+// The ISR dispatches on status >> 3: the TWSR codes are multiples of 8, so
+// this gives the compiler a dense 0-31 range to turn into a jump table
+// instead of a tree of compares. Build with IIC_REFERENCE_ISR for the
+// original dispatch and the separate one- and two-byte paths (data_buf /
+// data_buf_high), e.g. to compare size (`make SIZE`) or ISR timing
+// (IIC_ENABLE_STATS) against the default build.
+#ifdef IIC_REFERENCE_ISR
+	#define IIC_STATUS(status) (status)
+	#define IIC_ISR_SMALL_PATHS 1
+#else
+	#define IIC_STATUS(status) ((status) >> 3)
+	#define IIC_ISR_SMALL_PATHS 0
+#endif
+
+volatile iic_t IIC_MODULE = {.twi = IIC_TWI0, .pins = &PINC, .sda_mask = 1 << PC4, .scl_mask = 1 << PC5};
+#ifdef IIC_TWI1
+volatile iic_t IIC_MODULE1 = {.twi = IIC_TWI1, .pins = &PINE, .sda_mask = 1 << PE0, .scl_mask = 1 << PE1};
+#endif
+
+#ifdef IIC_ENABLE_STATS
+volatile iic_stats_t IIC_STATS = {.isr_min = 0xFFFF};
+
+void iic_stats_reset(){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		uint8_t *stats = (uint8_t*)&IIC_STATS;
+		for(size_t dex = 0; dex < sizeof(iic_stats_t); dex++){
+			stats[dex] = 0;
+		}
+		IIC_STATS.isr_min = 0xFFFF;
+	}
+}
+
+uint16_t iic_stats_isr_mean(){
+	uint32_t total, count;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		total = IIC_STATS.isr_total;
+		count = IIC_STATS.isr_count;
+	}
+	return count == 0 ? 0 : total / count;
+}
+
+static inline void iic_stats_count(volatile uint16_t *counter){
+	if(*counter != 0xFFFF){
+		(*counter)++;
+	}
+}
+
+static inline void iic_stats_isr_done(uint16_t start, uint8_t status){
+	uint16_t elapsed = IIC_STATS_TIMER - start;
+	if(elapsed > IIC_STATS.status_max[status >> 3]){
+		IIC_STATS.status_max[status >> 3] = elapsed;
+	}
+	if(elapsed < IIC_STATS.isr_min){
+		IIC_STATS.isr_min = elapsed;
+	}
+	if(elapsed > IIC_STATS.isr_max){
+		IIC_STATS.isr_max = elapsed;
+	}
+	if(IIC_STATS.isr_count != 0xFFFFFFFF){
+		IIC_STATS.isr_total += elapsed;
+		IIC_STATS.isr_count++;
+	}
+}
+
+// Called right after TWINT is cleared on SLA+R: how long SCL was held.
+static inline void iic_stats_slave_release(uint16_t start){
+	uint16_t elapsed = IIC_STATS_TIMER - start;
+	IIC_STATS.st_stretch_last = elapsed;
+	if(elapsed > IIC_STATS.st_stretch_max){
+		IIC_STATS.st_stretch_max = elapsed;
+	}
+}
+
+static inline void iic_stats_arbitration_lost(uint8_t losses){
+	iic_stats_count(&IIC_STATS.arb_lost);
+	if(losses > IIC_STATS.arb_lost_max){
+		IIC_STATS.arb_lost_max = losses;
+	}
+}
+
+// Called at every master START; only the first one of a transaction counts.
+static inline void iic_stats_transaction_start(){
+	if(!IIC_STATS.in_transaction){
+		IIC_STATS.transaction_start = IIC_STATS_TIMER;
+		IIC_STATS.transaction_retries = 0;
+		IIC_STATS.in_transaction = true;
+	}
+}
+
+static inline void iic_stats_transaction_end(){
+	if(!IIC_STATS.in_transaction){
+		return; // failed before reaching the bus
+	}
+	IIC_STATS.in_transaction = false;
+
+	uint16_t elapsed = (IIC_STATS_TIMER - IIC_STATS.transaction_start) >> IIC_STATS_TIME_SHIFT;
+	uint8_t bucket = 0;
+	while(elapsed != 0 && bucket < IIC_STATS_BUCKETS - 1){
+		elapsed >>= 1;
+		bucket++;
+	}
+	iic_stats_count(&IIC_STATS.time_histogram[bucket]);
+
+	uint8_t retries = IIC_STATS.transaction_retries;
+	iic_stats_count(&IIC_STATS.retry_histogram[retries < IIC_STATS_BUCKETS ? retries : IIC_STATS_BUCKETS - 1]);
+}
+#endif
+
+#ifdef IIC_ENABLE_TRACE
+volatile iic_trace_t IIC_TRACE;
+
+// Stops recording by hand, e.g. before dumping a trace that wasn't
+// frozen by an error.
+void iic_trace_freeze(){
+	IIC_TRACE.frozen = true;
+}
+
+// Clears the trace and starts recording again.
+void iic_trace_rearm(){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		IIC_TRACE.head = 0;
+		IIC_TRACE.count = 0;
+		IIC_TRACE.freeze_error = IIC_NO_ERROR;
+		IIC_TRACE.frozen = false;
+	}
+}
+
+// Writes the trace out a byte at a time (format in iic_trace.h). Freeze it
+// first; a trace that is still recording can change under the dump.
+void iic_trace_dump(void (*put)(uint8_t byte)){
+	uint8_t count = IIC_TRACE.count;
+	uint8_t dex = (IIC_TRACE.head - count) & (IIC_TRACE_LEN - 1);
+	put('I');
+	put('T');
+	put(IIC_TRACE_VERSION);
+	put(count);
+	put(IIC_TRACE.freeze_error);
+	for(; count != 0; count--){
+		put(IIC_TRACE.entries[dex].status);
+		put(IIC_TRACE.entries[dex].data);
+		put(IIC_TRACE.entries[dex].tick & 0xFF);
+		put(IIC_TRACE.entries[dex].tick >> 8);
+		dex = (dex + 1) & (IIC_TRACE_LEN - 1);
+	}
+}
+#endif
+
 void setup_iic(
+	volatile iic_t *iic,
 	uint8_t address, 
 	bool slave_enable, 
 	bool respond_to_general_call, 
@@ -33,364 +186,1429 @@ void setup_iic(
 	uint8_t retry_max,
 	uint8_t (*callback)(volatile iic_t *iic, uint8_t received_data)
 ){
-	IIC_MODULE.state = IIC_DISCONNECTED;
-	IIC_MODULE.slave_enable = slave_enable;
-	IIC_MODULE.error_state = IIC_NO_ERROR;
-	IIC_MODULE.callback = callback;
-	IIC_MODULE.retry_max = retry_max;
+	iic -> state = IIC_DISCONNECTED;
+	iic -> slave_enable = slave_enable;
+	iic -> error_state = IIC_NO_ERROR;
+	iic -> callback = callback;
+	iic -> retry_max = retry_max;
+	iic -> default_retry_max = retry_max;
 
 	if(slave_enable){
-		TWAR = (address << 1) | (respond_to_general_call);
+		iic -> twi -> twar = (address << 1) | (respond_to_general_call);
+	}
+
+	iic_set_bitrate(iic, bitrate, bitrate_prescaler);
+}
+
+// Runtime version of IIC_TWBR_FOR/IIC_PRESCALER_FOR (see iic_bitrate.h).
+// Returns false if scl_hz is out of reach (too fast for f_cpu, or too slow
+// even with TWBR = 255 and the largest prescaler); the closest pair is
+// still filled in.
+bool iic_compute_bitrate(uint32_t f_cpu, uint32_t scl_hz, uint8_t *bitrate, iic_prescaler_t *bitrate_prescaler){
+	uint32_t divider = IIC_SCL_DIVIDER(f_cpu, scl_hz);
+	if(divider < 16){
+		*bitrate = 0;
+		*bitrate_prescaler = IIC_PRESCALER_1_gc;
+		return false;
+	}
+
+	for(iic_prescaler_t prescaler = IIC_PRESCALER_1_gc; prescaler <= IIC_PRESCALER_64_gc; prescaler++){
+		uint32_t twbr = IIC_TWBR_FOR_PRESCALER(f_cpu, scl_hz, IIC_PRESCALER_VALUE(prescaler));
+		if(twbr <= 255){
+			*bitrate = twbr;
+			*bitrate_prescaler = prescaler;
+			return true;
+		}
+	}
+	*bitrate = 255;
+	*bitrate_prescaler = IIC_PRESCALER_64_gc;
+	return false;
+}
+
+static void iic_write_bitrate(volatile iic_t *iic, uint8_t bitrate, iic_prescaler_t bitrate_prescaler){
+	iic -> twi -> twbr = bitrate;
+	iic -> twi -> twsr = (iic -> twi -> twsr & ~((1 << TWPS1) | (1 << TWPS0))) | bitrate_prescaler;
+	iic -> active_bitrate = bitrate;
+	iic -> active_prescaler = bitrate_prescaler;
+	uint16_t yield_bitrate = (uint16_t)bitrate + IIC_ARBITRATION_YIELD_TWBR;
+	iic -> yield_bitrate = yield_bitrate > 255 ? 255 : yield_bitrate;
+}
+
+// Sets the bus speed used for devices without a profile, and applies it now.
+// Only call this between transactions.
+void iic_set_bitrate(volatile iic_t *iic, uint8_t bitrate, iic_prescaler_t bitrate_prescaler){
+	iic -> default_bitrate = bitrate;
+	iic -> default_prescaler = bitrate_prescaler;
+	iic -> profile_address = 0xFF; // look the next device up again
+	iic_write_bitrate(iic, bitrate, bitrate_prescaler);
+}
+
+// Installs a table of per-device speed/retry profiles. Devices not in the
+// table use the setup_iic (or iic_set_bitrate) settings. The table is used
+// in place, not copied.
+void iic_set_device_profiles(volatile iic_t *iic, const iic_device_profile_t *profiles, uint8_t profile_count){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> profiles = profiles;
+		iic -> profile_count = profile_count;
+		iic -> profile_address = 0xFF;
+	}
+}
+
+// Switches to the speed/retry profile for remote_addr_buf. Called on every
+// START, but only searches the table when the address changes, and only
+// touches TWBR/TWSR when the speed actually differs.
+static void iic_apply_profile(volatile iic_t *iic){
+	uint8_t address = iic -> remote_addr_buf;
+	if(address == iic -> profile_address){
+		return;
+	}
+	iic -> profile_address = address;
+
+	uint8_t bitrate = iic -> default_bitrate;
+	iic_prescaler_t bitrate_prescaler = iic -> default_prescaler;
+	uint8_t retry_max = iic -> default_retry_max;
+	for(uint8_t dex = 0; dex < iic -> profile_count; dex++){
+		const iic_device_profile_t *profile = &iic -> profiles[dex];
+		if(profile -> address == address){
+			bitrate = profile -> bitrate;
+			bitrate_prescaler = profile -> bitrate_prescaler;
+			retry_max = profile -> retry_max;
+			break;
+		}
+	}
+
+	iic -> retry_max = retry_max;
+	if(bitrate != iic -> active_bitrate || bitrate_prescaler != iic -> active_prescaler){
+		iic_write_bitrate(iic, bitrate, bitrate_prescaler);
+	}
+}
+
+// Reclocks the bus to scl_hz (e.g. to drop to 100 kHz for a slow device).
+// Only call this between transactions. Returns false, leaving the bus
+// speed alone, if scl_hz can't be reached.
+bool iic_set_bus_speed(volatile iic_t *iic, uint32_t f_cpu, uint32_t scl_hz){
+	uint8_t bitrate;
+	iic_prescaler_t bitrate_prescaler;
+	if(!iic_compute_bitrate(f_cpu, scl_hz, &bitrate, &bitrate_prescaler)){
+		return false;
+	}
+	iic_set_bitrate(iic, bitrate, bitrate_prescaler);
+	return true;
+}
+
+static bool iic_load_next(volatile iic_t *iic);
+
+void enable_iic(volatile iic_t *iic){
+	iic -> twi -> twcr = TWCR_ENABLE;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> state = IIC_IDLE;
+		if(iic -> current == NULL && iic_load_next(iic)){
+			iic -> twi -> twcr = TWCR_START;
+		}
+	}
+}
+
+void disable_iic(volatile iic_t *iic){
+	iic -> twi -> twcr = TWCR_DISABLE;
+	iic -> state = IIC_DISCONNECTED;
+}
+
+static void iic_use_buffer(volatile iic_t *iic, uint8_t *buffer, iic_len_t buffer_len);
+
+// data_buf and data_buf_high double as the buffer for the one- and two-byte
+// calls, so those run through the same per-byte code as everything else.
+_Static_assert(offsetof(iic_t, data_buf_high) == offsetof(iic_t, data_buf) + 1, "data_buf_high must follow data_buf");
+
+void iic_write_one(volatile iic_t *iic, uint8_t remote_address, uint8_t dat){
+	iic -> data_ready = false;
+	iic -> no_retry = false;
+	iic -> data_buf = dat;
+	iic_use_buffer(iic, (uint8_t*)&iic -> data_buf, 1);
+	iic -> remote_addr_buf = remote_address;
+	iic -> intent = IIC_MASTER_TRANSMITTER;
+	iic -> state = IIC_TRYING_TO_SEIZE_BUS;
+	iic -> twi -> twcr = TWCR_START;
+}
+
+void iic_write_two(volatile iic_t *iic, uint8_t remote_address, uint8_t dat_low, uint8_t dat_high){
+	iic -> data_ready = false;
+	iic -> no_retry = false;
+	iic -> data_buf = dat_low;
+	iic -> data_buf_high = dat_high;
+	iic_use_buffer(iic, (uint8_t*)&iic -> data_buf, 2);
+	iic -> remote_addr_buf = remote_address;
+	iic -> intent = IIC_MASTER_TRANSMITTER;
+	iic -> state = IIC_TRYING_TO_SEIZE_BUS;
+	iic -> twi -> twcr = TWCR_START;
+}
+
+// Points the multi-byte path at a single contiguous buffer.
+static void iic_use_buffer(volatile iic_t *iic, uint8_t *buffer, iic_len_t buffer_len){
+	iic -> big_data_buf = buffer;
+	iic -> segment = NULL;
+	iic -> segment_end = buffer_len;
+	iic -> transaction_len = buffer_len;
+	iic -> data_buf_index = 0;
+}
+
+// Points the multi-byte path at a list of segments (at least one).
+static void iic_use_segments(volatile iic_t *iic, const iic_segment_t *segments, uint8_t segment_count){
+	iic_len_t total_len = 0;
+	for(uint8_t dex = 0; dex < segment_count; dex++){
+		total_len += segments[dex].len;
 	}
+	iic -> big_data_buf = segments[0].data;
+	iic -> segment = segments;
+	iic -> segment_end = segments[0].len;
+	iic -> transaction_len = total_len;
+	iic -> data_buf_index = 0;
+}
 
-	TWBR = bitrate;
-	TWSR |= bitrate_prescaler;
+// Moves on to the next segment once byte `index` has reached segment_end,
+// and returns the new segment_end. big_data_buf is rebased so that
+// big_data_buf[index] is still the right byte - the per-byte code doesn't
+// need to know about segments at all, and a contiguous buffer never gets
+// here (segment_end == transaction_len).
+static iic_len_t iic_next_segment(volatile iic_t *iic, iic_len_t index){
+	const iic_segment_t *segment = iic -> segment + 1;
+	iic_len_t end = iic -> segment_end + segment -> len;
+	iic -> segment = segment;
+	iic -> big_data_buf = segment -> data - index;
+	iic -> segment_end = end;
+	return end;
 }
 
-void enable_iic(){
-	TWCR = TWCR_ENABLE;
-	IIC_MODULE.state = IIC_IDLE;
+// Points big_data_buf at byte `index`'s segment and returns it. The caller
+// has data_buf_index in a register already; segment_end and big_data_buf
+// are read once each, since every access through iic is a separate load or
+// store.
+static inline uint8_t *iic_buffer_at(volatile iic_t *iic, iic_len_t index){
+	iic_len_t end = iic -> segment_end;
+	while(index == end){
+		end = iic_next_segment(iic, index);
+	}
+	return iic -> big_data_buf;
 }
 
-void disable_iic(){
-	TWCR = TWCR_DISABLE;
-	IIC_MODULE.state = IIC_DISCONNECTED;
+static inline uint8_t iic_next_tx_byte(volatile iic_t *iic){
+	iic_len_t index = iic -> data_buf_index;
+	uint8_t dat = iic_buffer_at(iic, index)[index];
+	iic -> data_buf_index = index + 1;
+	return dat;
 }
 
-void iic_write_one(uint8_t remote_address, uint8_t dat){
-	IIC_MODULE.data_ready = false;
-	IIC_MODULE.data_buf = dat;
-	IIC_MODULE.transaction_len = 1;
-	IIC_MODULE.data_buf_index = 0;
-	IIC_MODULE.remote_addr_buf = remote_address;
-	IIC_MODULE.intent = IIC_MASTER_TRANSMITTER;
-	IIC_MODULE.state = IIC_TRYING_TO_SEIZE_BUS;
-	TWCR = TWCR_START;
+static inline void iic_store_rx_byte(volatile iic_t *iic, uint8_t dat){
+	iic_len_t index = iic -> data_buf_index;
+	iic_buffer_at(iic, index)[index] = dat;
+}
+
+// Moves the multi-byte path on to byte `index` without sending anything, for
+// a preempted write picking up where it left off.
+static void iic_skip_to(volatile iic_t *iic, iic_len_t index){
+	iic_len_t end = iic -> segment_end;
+	while(end <= index){
+		end = iic_next_segment(iic, end);
+	}
+	iic -> data_buf_index = index;
+}
+
+// Loads a write of the buffer/segments set up by iic_use_* into the module
+// without starting it.
+static void iic_prepare_write(volatile iic_t *iic, uint8_t remote_address){
+	if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 1){ // one-byte mode is handled separately
+		iic -> data_buf = iic_next_tx_byte(iic);
+	}else if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 2){ // two-byte mode is handled separately
+		iic -> data_buf = iic_next_tx_byte(iic);
+		iic -> data_buf_high = iic_next_tx_byte(iic);
+	}
+
+	iic -> data_ready = false;
+	iic -> no_retry = false;
+	iic -> remote_addr_buf = remote_address;
+	iic -> intent = IIC_MASTER_TRANSMITTER;
+	iic -> state = IIC_TRYING_TO_SEIZE_BUS;
+	iic -> data_buf_index = 0;
+	iic -> read_after_write_len = 0;
 }
 
-void iic_write_two(uint8_t remote_address, uint8_t dat_low, uint8_t dat_high){
-	IIC_MODULE.data_ready = false;
-	IIC_MODULE.data_buf = dat_low;
-	IIC_MODULE.data_buf_high = dat_high;
-	IIC_MODULE.transaction_len = 2;
-	IIC_MODULE.data_buf_index = 0;
-	IIC_MODULE.remote_addr_buf = remote_address;
-	IIC_MODULE.intent = IIC_MASTER_TRANSMITTER;
-	IIC_MODULE.state = IIC_TRYING_TO_SEIZE_BUS;
-	TWCR = TWCR_START;
+void iic_write_many(volatile iic_t *iic, uint8_t remote_address, uint8_t *data_buffer, iic_len_t buffer_len){
+	iic_use_buffer(iic, data_buffer, buffer_len);
+	iic_prepare_write(iic, remote_address);
+	iic -> twi -> twcr = TWCR_START;
 }
 
-void iic_write_many(uint8_t remote_address, uint8_t *data_buffer, uint8_t buffer_len){
-	if(buffer_len == 1){ // one-byte mode is handled separately
-		IIC_MODULE.data_buf = data_buffer[0];
-	}else if(buffer_len == 2){ // two-byte mode is handled separately
-		IIC_MODULE.data_buf = data_buffer[0];
-		IIC_MODULE.data_buf_high = data_buffer[1];
+// Sends every segment, in order, as one transaction.
+void iic_write_segments(volatile iic_t *iic, uint8_t remote_address, const iic_segment_t *segments, uint8_t segment_count){
+	iic_use_segments(iic, segments, segment_count);
+	iic_prepare_write(iic, remote_address);
+	iic -> twi -> twcr = TWCR_START;
+}
+
+void iic_read_one(volatile iic_t *iic, uint8_t remote_address){
+	iic -> force_small_multibyte_read = false;
+	iic -> data_ready = false;
+	iic -> no_retry = false;
+	iic -> remote_addr_buf = remote_address;
+	iic_use_buffer(iic, (uint8_t*)&iic -> data_buf, 1);
+	iic -> intent = IIC_MASTER_RECEIVER;
+	iic -> state = IIC_TRYING_TO_SEIZE_BUS;
+	iic -> twi -> twcr = TWCR_START;
+}
+
+void iic_read_two(volatile iic_t *iic, uint8_t remote_address){
+	iic -> force_small_multibyte_read = false;
+	iic -> data_ready = false;
+	iic -> no_retry = false;
+	iic -> remote_addr_buf = remote_address;
+	iic_use_buffer(iic, (uint8_t*)&iic -> data_buf, 2);
+	iic -> intent = IIC_MASTER_RECEIVER;
+	iic -> state = IIC_TRYING_TO_SEIZE_BUS;
+	iic -> twi -> twcr = TWCR_START;
+}
+
+// Loads a read into the buffer/segments set up by iic_use_* into the module
+// without starting it.
+static void iic_prepare_read(volatile iic_t *iic, uint8_t remote_address){
+	iic -> data_ready = false;
+	iic -> no_retry = false;
+	iic -> remote_addr_buf = remote_address;
+	iic -> force_small_multibyte_read = true;
+	iic -> intent = IIC_MASTER_RECEIVER;
+	iic -> state = IIC_TRYING_TO_SEIZE_BUS;
+}
+
+void iic_read_many(volatile iic_t *iic, uint8_t remote_address, uint8_t *buffer, iic_len_t buffer_len){
+	iic_use_buffer(iic, buffer, buffer_len);
+	iic_prepare_read(iic, remote_address);
+	iic -> twi -> twcr = TWCR_START;
+}
+
+// Fills every segment, in order, from one transaction.
+void iic_read_segments(volatile iic_t *iic, uint8_t remote_address, const iic_segment_t *segments, uint8_t segment_count){
+	iic_use_segments(iic, segments, segment_count);
+	iic_prepare_read(iic, remote_address);
+	iic -> twi -> twcr = TWCR_START;
+}
+
+// Writes write_len bytes (typically a register pointer), then issues a
+// repeated START and reads read_len bytes without releasing the bus.
+// The result lands in read_buffer, as with iic_read_many. With write_len 0
+// only the address goes out before the repeated START.
+void iic_write_read(volatile iic_t *iic, uint8_t remote_address, uint8_t *write_buffer, iic_len_t write_len, uint8_t *read_buffer, iic_len_t read_len){
+	iic_use_buffer(iic, write_buffer, write_len);
+	iic_prepare_write(iic, remote_address);
+	iic -> read_after_write_buf = read_buffer;
+	iic -> read_after_write_len = read_len;
+	iic -> twi -> twcr = TWCR_START;
+}
+
+// Loads the next queued transaction into the module, urgent ones first.
+// Returns false (and leaves the module alone) if both queues are empty.
+// Must be called with interrupts disabled or from the ISR.
+static void iic_master_finish(volatile iic_t *iic, iic_error_t error);
+
+static bool iic_load_next(volatile iic_t *iic){
+	iic_transaction_t *transaction;
+	while(1){
+		if(iic -> urgent_head != iic -> urgent_tail){
+			transaction = iic -> urgent_queue[iic -> urgent_head];
+			iic -> current_urgent = true;
+		}else if(iic -> queue_head != iic -> queue_tail){
+			transaction = iic -> queue[iic -> queue_head];
+			iic -> current_urgent = false;
+		}else{
+			return false;
+		}
+		iic -> current = transaction;
+		if(!(transaction -> flags & IIC_FLAG_IGNORE_PRESENCE) && iic_device_absent(iic, transaction -> remote_address)){
+			// known to be missing - fail it without touching the bus, and try the next one
+			iic -> state = IIC_TRYING_TO_SEIZE_BUS; // so the callback can't start the bus under us
+			iic_master_finish(iic, transaction -> direction == IIC_MASTER_RECEIVER ? IIC_MR_ADDR_NACK : IIC_MT_ADDR_NACK);
+		}else{
+			break;
+		}
+	}
+
+	if(transaction -> segments != NULL){
+		iic_use_segments(iic, transaction -> segments, transaction -> segment_count);
 	}else{
-		IIC_MODULE.big_data_buf = data_buffer;
+		iic_use_buffer(iic, transaction -> buffer, transaction -> buffer_len);
 	}
+	if(transaction -> direction == IIC_MASTER_RECEIVER){
+		iic_prepare_read(iic, transaction -> remote_address);
+	}else{
+		iic_prepare_write(iic, transaction -> remote_address);
+		iic -> read_after_write_buf = transaction -> read_buffer;
+		iic -> read_after_write_len = transaction -> read_len;
+		if(transaction -> sent != 0){
+			iic_skip_to(iic, transaction -> sent); // resuming after being preempted
+		}
+	}
+	iic -> no_retry = transaction -> flags & IIC_FLAG_NO_RETRY;
+	iic -> chunk_left = iic -> preempt_chunk;
+	return true;
+}
 
-	IIC_MODULE.data_ready = false;
-	IIC_MODULE.remote_addr_buf = remote_address;
-	IIC_MODULE.intent = IIC_MASTER_TRANSMITTER;
-	IIC_MODULE.state = IIC_TRYING_TO_SEIZE_BUS;
-	IIC_MODULE.transaction_len = buffer_len;
-	IIC_MODULE.data_buf_index = 0;
-	TWCR = TWCR_START;
+// Presence cache: an address ACK marks the device present. Only a probe
+// (IIC_FLAG_NO_RETRY) that goes unanswered marks it absent - an ordinary
+// transaction that runs out of retries may just have met a busy device,
+// such as an EEPROM in its write cycle, and must not lock it out.
+static void iic_presence_mark(volatile iic_t *iic, uint8_t address, bool present){
+	uint8_t bit = 1 << (address & 0x07);
+	address = (address & 0x7F) >> 3;
+	iic -> presence_known[address] |= bit;
+	if(present){
+		iic -> presence[address] |= bit;
+	}else{
+		iic -> presence[address] &= ~bit;
+	}
 }
 
-void iic_read_one(uint8_t remote_address){
-	IIC_MODULE.force_small_multibyte_read = false;
-	IIC_MODULE.data_ready = false;
-	IIC_MODULE.remote_addr_buf = remote_address;
-	IIC_MODULE.transaction_len = 1;
-	IIC_MODULE.data_buf_index = 0;
-	IIC_MODULE.intent = IIC_MASTER_RECEIVER;
-	IIC_MODULE.state = IIC_TRYING_TO_SEIZE_BUS;
-	TWCR = TWCR_START;
+// True if the device didn't answer the last probe of its address. Queued
+// transactions to such devices fail immediately (unless they carry
+// IIC_FLAG_IGNORE_PRESENCE) until something re-probes the address.
+bool iic_device_absent(volatile iic_t *iic, uint8_t address){
+	uint8_t bit = 1 << (address & 0x07);
+	address = (address & 0x7F) >> 3;
+	return (iic -> presence_known[address] & bit) && !(iic -> presence[address] & bit);
 }
 
-void iic_read_two(uint8_t remote_address){
-	IIC_MODULE.force_small_multibyte_read = false;
-	IIC_MODULE.data_ready = false;
-	IIC_MODULE.remote_addr_buf = remote_address;
-	IIC_MODULE.transaction_len = 2;
-	IIC_MODULE.data_buf_index = 0;
-	IIC_MODULE.intent = IIC_MASTER_RECEIVER;
-	IIC_MODULE.state = IIC_TRYING_TO_SEIZE_BUS;
-	TWCR = TWCR_START;
+// True if the device answered the last time it was addressed.
+bool iic_device_present(volatile iic_t *iic, uint8_t address){
+	uint8_t bit = 1 << (address & 0x07);
+	return (iic -> presence[(address & 0x7F) >> 3] & bit) != 0; // bool is a uint8_t here - make it 0 or 1
 }
 
-void iic_read_many(uint8_t remote_address, uint8_t *buffer, uint8_t buffer_len){
-	IIC_MODULE.data_ready = false;
-	IIC_MODULE.remote_addr_buf = remote_address;
-	IIC_MODULE.transaction_len = buffer_len;
-	IIC_MODULE.big_data_buf = buffer;
-	IIC_MODULE.data_buf_index = 0;
-	IIC_MODULE.force_small_multibyte_read = true;
-	IIC_MODULE.intent = IIC_MASTER_RECEIVER;
-	IIC_MODULE.state = IIC_TRYING_TO_SEIZE_BUS;
-	TWCR = TWCR_START;
+// Forgets what is known about an address, e.g. after a device is plugged in.
+void iic_presence_forget(volatile iic_t *iic, uint8_t address){
+	uint8_t bit = 1 << (address & 0x07);
+	address = (address & 0x7F) >> 3;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> presence_known[address] &= ~bit;
+		iic -> presence[address] &= ~bit;
+	}
 }
 
-void iic_clear_error(){
-	IIC_MODULE.error_state = IIC_NO_ERROR;
+void iic_join_group(volatile iic_t *iic, uint8_t group){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> groups[group >> 3] |= 1 << (group & 0x07);
+	}
 }
 
-ISR(TWI_vect){
-	switch(TWSR & TW_STATUS_MASK){
-		case TW_START:
-		case TW_REP_START:; // kludge to allow declaring a variable directly after the case statement.
+void iic_leave_group(volatile iic_t *iic, uint8_t group){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> groups[group >> 3] &= ~(1 << (group & 0x07));
+	}
+}
+
+bool iic_in_group(volatile iic_t *iic, uint8_t group){
+	return iic -> groups[group >> 3] & (1 << (group & 0x07));
+}
+
+// Sends [ IIC_COMMAND_GROUP_MULTICAST | group | data ... ] to general call;
+// only members of the group keep it. The header is sent from the module, so
+// only data_buffer has to stay valid until the transfer is done.
+void iic_write_group(volatile iic_t *iic, uint8_t group, uint8_t *data_buffer, iic_len_t buffer_len){
+	iic -> group_header[0] = IIC_COMMAND_GROUP_MULTICAST;
+	iic -> group_header[1] = group;
+	iic -> group_segments[0].data = (uint8_t*)iic -> group_header;
+	iic -> group_segments[0].len = 2;
+	iic -> group_segments[1].data = data_buffer;
+	iic -> group_segments[1].len = buffer_len;
+	iic_write_segments(iic, 0x00, (const iic_segment_t*)iic -> group_segments, 2);
+}
+
+static inline bool iic_master_active(volatile iic_t *iic){
+	return iic -> intent == IIC_MASTER_TRANSMITTER || iic -> intent == IIC_MASTER_RECEIVER;
+}
+
+// Retires the master transaction that just ended and reports its result.
+// Every way a master transaction can end comes through here exactly once.
+// Does not touch TWCR - the caller decides how the bus is released.
+static void iic_master_finish(volatile iic_t *iic, iic_error_t error){
+	iic_transaction_t *transaction = iic -> current;
+	IIC_STATS_TRANSACTION_END(iic);
+	if(error != IIC_NO_ERROR && (transaction == NULL || !(transaction -> flags & IIC_FLAG_NO_RETRY))){
+		IIC_TRACE_TRIGGER(iic, error); // probes (IIC_FLAG_NO_RETRY) expect to fail, so they don't freeze the trace
+	}
+	iic -> retry_count = 0;
+	iic -> recoveries = 0;
+	iic -> arbitration_losses = 0;
+	iic -> read_after_write_len = 0; // a write half that failed must not leave its read half to the next write
+	iic -> events |= error == IIC_NO_ERROR ? IIC_EVENT_MASTER_DONE : IIC_EVENT_MASTER_ERROR;
+	if(transaction != NULL){
+		iic -> current = NULL;
+		if(iic -> current_urgent){
+			iic -> urgent_head = (iic -> urgent_head + 1) & (IIC_URGENT_QUEUE_LEN - 1);
+		}else{
+			iic -> queue_head = (iic -> queue_head + 1) & (IIC_QUEUE_LEN - 1);
+		}
+		transaction -> error = error;
+		transaction -> pending = false;
+		if(transaction -> callback != NULL){
+			// state is still MASTER_*, so anything the callback enqueues waits for iic_release
+			transaction -> callback(transaction, error);
+		}
+		if(iic -> queue_head == iic -> queue_tail && iic -> urgent_head == iic -> urgent_tail){
+			iic -> events |= IIC_EVENT_QUEUE_EMPTY;
+		}
+	}else if(error != IIC_NO_ERROR){
+		iic -> error_state = error;
+	}
+	iic -> state = IIC_IDLE;
+	iic -> intent = IIC_IDLE;
+}
+
+// Another master addressed us while our START was still waiting for the
+// bus; the TWCR write for the slave transfer drops TWSTA. Nothing was lost,
+// so a queued transaction is parked at the head of its queue, and the
+// iic_release that ends the slave transfer starts it again. Returns false
+// for direct calls, which can't be parked.
+static bool iic_master_park(volatile iic_t *iic){
+	if(iic -> current == NULL){
+		return false;
+	}
+	iic -> current = NULL;
+	iic -> retry_count = 0;
+	iic -> state = IIC_IDLE;
+	iic -> intent = IIC_IDLE;
+	return true;
+}
+
+// Arbitration was lost. A queued transaction is parked the same way, and
+// the caller's iic_release loads it again from the start with its START
+// pending, so it goes out as soon as the winner's STOP frees the bus -
+// there is no timer involved. Returns false (leaving the transaction to be
+// failed) for direct calls and for transactions out of retries.
+static bool iic_arbitration_retry(volatile iic_t *iic){
+	uint8_t losses = iic -> arbitration_losses + 1;
+	IIC_STATS_ARBITRATION_LOST(iic, losses);
+	if(losses > IIC_ARBITRATION_RETRIES || !iic_master_park(iic)){
+		return false;
+	}
+	iic -> arbitration_losses = losses;
+	return true;
+}
+
+// Returns the TWCR value that releases the bus. If another transaction is
+// queued, a START is chained on so the hardware goes straight into it
+// (STOP followed by START, or START as soon as the bus is free). A START
+// chained onto our own STOP is our turn given up: it goes out with TWBR
+// raised by IIC_ARBITRATION_YIELD_TWBR, so it needs the bus free a little
+// longer than the START of any master that lost to us. The START case puts
+// TWBR back.
+static uint8_t iic_release(volatile iic_t *iic, uint8_t twcr){
+	if(iic -> current == NULL && iic_load_next(iic)){
+		iic -> twi -> twbr = (twcr & (1 << TWSTO)) ? iic -> yield_bitrate : iic -> active_bitrate;
+		return twcr | (1 << TWSTA);
+	}
+	return twcr;
+}
+
+// A write-then-read whose write half is done: switch the module over to
+// the read half, for the repeated START the caller is about to send.
+static inline void iic_start_read_half(volatile iic_t *iic){
+	iic_use_buffer(iic, iic -> read_after_write_buf, iic -> read_after_write_len);
+	iic_prepare_read(iic, iic -> remote_addr_buf);
+	iic -> read_after_write_len = 0;
+}
+
+// Preemption point, called before each byte of a multi-byte write: true if
+// the write should be parked now to let urgent work on the bus.
+static inline bool iic_preempt_due(volatile iic_t *iic){
+	iic_transaction_t *transaction = iic -> current;
+	if(transaction == NULL || !(transaction -> flags & IIC_FLAG_PREEMPTIBLE) || iic -> current_urgent
+			|| iic -> read_after_write_len != 0 || iic -> preempt_chunk == 0){
+		return false;
+	}
+	if(--iic -> chunk_left != 0){
+		return false;
+	}
+	iic -> chunk_left = iic -> preempt_chunk;
+	return iic -> urgent_head != iic -> urgent_tail;
+}
+
+// Queues a master transaction. The ISR works through the queue on its own, so
+// the caller doesn't have to wait for the bus; watch transaction->pending or
+// use the callback to find out when it has finished. IIC_FLAG_URGENT
+// transactions go on the urgent queue, which is served first.
+// Returns false if the queue is full.
+bool iic_enqueue(volatile iic_t *iic, iic_transaction_t *transaction){
+	bool queued = false;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(transaction -> flags & IIC_FLAG_URGENT){
+			uint8_t next_tail = (iic -> urgent_tail + 1) & (IIC_URGENT_QUEUE_LEN - 1);
+			if(next_tail != iic -> urgent_head){
+				iic -> urgent_queue[iic -> urgent_tail] = transaction;
+				iic -> urgent_tail = next_tail;
+				queued = true;
+			}
+		}else{
+			uint8_t next_tail = (iic -> queue_tail + 1) & (IIC_QUEUE_LEN - 1);
+			if(next_tail != iic -> queue_head){
+				iic -> queue[iic -> queue_tail] = transaction;
+				iic -> queue_tail = next_tail;
+				queued = true;
+			}
+		}
+
+		if(queued){
+			transaction -> pending = true;
+			transaction -> error = IIC_NO_ERROR;
+			transaction -> iic = iic;
+			transaction -> sent = 0;
+			if(iic -> current == NULL && iic -> state == IIC_IDLE && iic_load_next(iic)){
+				iic -> twi -> twcr = TWCR_START;
+			}
+		}
+	}
+	return queued;
+}
+
+// Sets how often (in bytes) an IIC_FLAG_PREEMPTIBLE write checks for urgent
+// work. Smaller chunks bound the urgent latency more tightly, at the cost of
+// an extra address byte each time a write is actually split. 0 turns
+// preemption off.
+void iic_set_preempt_chunk(volatile iic_t *iic, iic_len_t chunk){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> preempt_chunk = chunk;
+		iic -> chunk_left = chunk;
+	}
+}
+
+// Switches slave handling to buffered mode. Received frames (delimited by the
+// master's STOP) are stored in rx_ring, and frame_callback is called once per
+// frame. Only a power of two of rx_ring_len bytes is used (rounded down, at
+// most 128), so the ISR wraps the ring with a mask. Reads are answered from
+// the buffer given to iic_slave_set_reply.
+void iic_slave_buffers(volatile iic_t *iic, uint8_t *rx_ring, uint8_t rx_ring_len, void (*frame_callback)(volatile iic_t *iic)){
+	uint8_t ring_len = 128;
+	while(ring_len > 1 && ring_len > rx_ring_len){
+		ring_len >>= 1;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> slave_rx_ring = rx_ring;
+		iic -> slave_rx_mask = ring_len - 1;
+		iic -> slave_rx_head = 0;
+		iic -> slave_rx_write = 0;
+		iic -> slave_rx_tail = 0;
+		iic -> frame_callback = frame_callback;
+		iic -> slave_mode = IIC_SLAVE_BUFFERED;
+	}
+}
+
+// Sets the bytes sent the next time a master reads from us (buffered mode).
+void iic_slave_set_reply(volatile iic_t *iic, uint8_t *tx_buffer, uint8_t tx_len){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> slave_tx_buf = tx_buffer;
+		iic -> slave_tx_len = tx_len;
+	}
+}
+
+// Switches slave handling (back) to callback mode, deferred or not.
+// Deferred: when a master reads from us, the ISR sends the byte published
+// with iic_slave_preload (first_reply to begin with), releases SCL and
+// raises IIC_EVENT_SLAVE_REFILL. The callback is not run in the interrupt
+// at all: iic_slave_poll, from the main loop, calls it and preloads its
+// return value for the next byte read. That keeps every
+// interrupt of a read down to a few instructions whatever the callback
+// does, at the cost of the reply being worked out one read ahead - and a
+// master that reads again before iic_slave_poll has run gets the same byte
+// again (multi-byte replies belong in buffered mode).
+void iic_slave_defer_callback(volatile iic_t *iic, bool defer, uint8_t first_reply){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> slave_mode = IIC_SLAVE_CALLBACK;
+		iic -> slave_tx_preload = first_reply;
+		iic -> slave_tx_deferred = defer;
+	}
+}
+
+// Publishes the next byte a master reading from us gets (deferred callback
+// mode), e.g. as soon as a new measurement is ready.
+void iic_slave_preload(volatile iic_t *iic, uint8_t dat){
+	iic -> slave_tx_preload = dat;
+}
+
+// Deferred callback mode: if the preloaded reply has gone out since the
+// last call, calls the callback for the next one and preloads it. Returns
+// true if the callback ran. Call it from the main loop, e.g. whenever
+// iic_wait_events returns IIC_EVENT_SLAVE_REFILL.
+bool iic_slave_poll(volatile iic_t *iic){
+	if(!iic_take_events(iic, IIC_EVENT_SLAVE_REFILL)){
+		return false;
+	}
+	iic_slave_preload(iic, iic -> callback(iic, 0));
+	return true;
+}
+
+// Register-map mode: works out once which registers a master may write at
+// all. The per-byte path then tests one bit, and reads the write mask only
+// for registers it can change; a map with no read-only or masked register
+// (reg_protected false) skips both.
+static void iic_reg_writable_update(volatile iic_t *iic){
+	iic -> reg_protected = iic -> reg_write_mask != NULL;
+	for(uint16_t reg = 0; reg < sizeof(iic -> reg_writable) * 8; reg++){
+		uint8_t bit = 1 << (reg & 0x07);
+		bool read_only = iic -> reg_read_only != NULL && reg < iic -> reg_len && (iic -> reg_read_only[reg >> 3] & bit);
+		bool masked = iic -> reg_write_mask != NULL && reg < iic -> reg_len && iic -> reg_write_mask[reg] == 0;
+		if(read_only || masked){
+			iic -> reg_writable[reg >> 3] &= ~bit;
+			iic -> reg_protected = true;
+		}else{
+			iic -> reg_writable[reg >> 3] |= bit;
+		}
+	}
+}
+
+// Switches slave handling to register-map mode: the slave looks like a
+// standard register file backed by `registers`. The first byte of every
+// write sets the register pointer, the rest are stored from there on, and
+// reads start at the pointer; the pointer auto-increments and wraps at
+// register_count. Registers flagged in the read_only bitmap (may be NULL)
+// ignore writes; iic_slave_register_write_mask narrows that down to single
+// bits. The bitmap is read here, not per byte: call again after changing
+// it. dirty_callback (may be NULL) is told which range was written once
+// the master finishes.
+void iic_slave_register_map(
+	volatile iic_t *iic,
+	uint8_t *registers,
+	uint8_t register_count,
+	const uint8_t *read_only,
+	void (*dirty_callback)(volatile iic_t *iic, uint8_t first, uint8_t last)
+){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> reg_map = registers;
+		iic -> reg_len = register_count;
+		iic -> reg_read_only = read_only;
+		iic -> reg_write_mask = NULL;
+		iic_reg_writable_update(iic);
+		iic -> reg_pointer = 0;
+		iic -> reg_dirty = false;
+		iic -> dirty_callback = dirty_callback;
+		iic -> slave_mode = IIC_SLAVE_REGISTER_MAP;
+	}
+}
+
+// Register-map mode: write_mask holds one byte per register, and a write
+// from the master only changes the bits set in it (status registers with a
+// few control bits, say). Registers with a mask of 0 behave as read-only;
+// which ones those are is worked out here, so changing a mask to or from 0
+// later needs another call. NULL makes every bit writable again (except in
+// read-only registers). Call after iic_slave_register_map.
+void iic_slave_register_write_mask(volatile iic_t *iic, const uint8_t *write_mask){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		iic -> reg_write_mask = write_mask;
+		iic_reg_writable_update(iic);
+	}
+}
+
+// Copies the oldest received frame into `frame` (truncated to max_len) and
+// removes it from the ring. Returns the number of bytes copied, or 0 if no
+// frame is waiting. general_call (may be NULL) is set if the frame was sent
+// to the general-call address.
+// Safe to call from the frame callback or from the main loop, but not both.
+uint8_t iic_slave_read_frame(volatile iic_t *iic, uint8_t *frame, uint8_t max_len, bool *general_call){
+	uint8_t mask = iic -> slave_rx_mask;
+	uint8_t tail = iic -> slave_rx_tail;
+	if(tail == iic -> slave_rx_head){
+		return 0;
+	}
+
+	uint8_t header = iic -> slave_rx_ring[tail];
+	uint8_t len = header & 0x7F;
+	if(general_call != NULL){
+		*general_call = header >> 7;
+	}
+	for(uint8_t dex = 0; dex < len; dex++){
+		tail = (tail + 1) & mask;
+		if(dex < max_len){
+			frame[dex] = iic -> slave_rx_ring[tail];
+		}
+	}
+	iic -> slave_rx_tail = (tail + 1) & mask;
+	return len < max_len ? len : max_len;
+}
+
+// Steps of the group check on a general call (slave_rx_filter).
+#define IIC_GROUP_FILTER_COMMAND 1 // the next byte is the command
+#define IIC_GROUP_FILTER_GROUP   2 // the command was IIC_COMMAND_GROUP_MULTICAST - the next byte is the group
+
+// General call: runs the group check armed at the address match (in every
+// slave mode) on one received byte. Returns false once a multicast turns out to be for a group
+// we're not in. Either way the check is over after the group byte (or after
+// a command that isn't a multicast), so the rest of the frame - and every
+// frame addressed to us directly - costs one test of slave_rx_filter.
+static inline bool iic_group_filter(volatile iic_t *iic, uint8_t dat){
+	if(iic -> slave_rx_filter == IIC_GROUP_FILTER_COMMAND){
+		iic -> slave_rx_filter = dat == IIC_COMMAND_GROUP_MULTICAST ? IIC_GROUP_FILTER_GROUP : 0;
+		return true;
+	}
+	iic -> slave_rx_filter = 0;
+	return iic_in_group(iic, dat);
+}
+
+// Callback and register-map modes: the group check on a general call. The
+// multicast command is held back until the group byte shows whether the
+// frame is for us. A member's callback then gets the whole frame, header
+// included, as the ring does in buffered mode; the register map skips the
+// header and takes the payload as an ordinary register write. Returns the
+// TWCR value if the byte was dealt with here, 0 if it is handled as usual.
+static uint8_t iic_slave_group_byte(volatile iic_t *iic, uint8_t dat){
+	uint8_t step = iic -> slave_rx_filter;
+	if(!iic_group_filter(iic, dat)){
+		return TWCR_LAST_BYTE; // not for us - NACK the rest
+	}
+	if(iic -> slave_rx_filter == IIC_GROUP_FILTER_GROUP){
+		return TWCR_NEXT; // a multicast - wait for the group
+	}
+	if(step == IIC_GROUP_FILTER_GROUP){
+		if(iic -> slave_mode == IIC_SLAVE_REGISTER_MAP){
+			return TWCR_NEXT;
+		}
+		iic -> callback(iic, IIC_COMMAND_GROUP_MULTICAST); // the command held back
+	}
+	return 0;
+}
+
+// Buffered slave mode: reserve the header slot for a new frame.
+static void iic_slave_rx_begin(volatile iic_t *iic, bool general_call){
+	iic -> slave_rx_gcall = general_call;
+	iic -> slave_rx_write = (iic -> slave_rx_head + 1) & iic -> slave_rx_mask;
+	iic -> slave_rx_overflow = (iic -> slave_rx_write == iic -> slave_rx_tail);
+}
+
+// Buffered slave mode: store one received byte. Returns the TWCR value to
+// continue with - once the ring (or the 127-byte frame limit) is full, the
+// next byte is NACKed and the frame is dropped. The same goes for a
+// multicast to a group we're not in, as soon as its group byte arrives.
+static uint8_t iic_slave_rx_byte(volatile iic_t *iic, uint8_t dat){
+	uint8_t write = iic -> slave_rx_write;
+	uint8_t next = (write + 1) & iic -> slave_rx_mask;
+	uint8_t offset = (write - iic -> slave_rx_head) & iic -> slave_rx_mask;
+	if(iic -> slave_rx_overflow || next == iic -> slave_rx_tail || offset > 0x7F){
+		iic -> slave_rx_overflow = true;
+		return TWCR_LAST_BYTE;
+	}
+	if(iic -> slave_rx_filter != 0 && !iic_group_filter(iic, dat)){
+		iic -> slave_rx_overflow = true; // not for us
+		return TWCR_LAST_BYTE;
+	}
+	iic -> slave_rx_ring[write] = dat;
+	iic -> slave_rx_write = next;
+	return TWCR_NEXT;
+}
+
+// Buffered slave mode: publish the frame in progress (or drop it).
+static void iic_slave_rx_end(volatile iic_t *iic, bool keep){
+	uint8_t len = (iic -> slave_rx_write - iic -> slave_rx_head - 1) & iic -> slave_rx_mask;
+	if(keep && !iic -> slave_rx_overflow && len != 0){
+		iic -> slave_rx_ring[iic -> slave_rx_head] = len | (iic -> slave_rx_gcall << 7);
+		iic -> slave_rx_head = iic -> slave_rx_write;
+		if(iic -> frame_callback != NULL){
+			iic -> frame_callback(iic);
+		}
+	}else{
+		iic -> slave_rx_write = iic -> slave_rx_head;
+	}
+}
+
+// Deferred callback mode, after the preloaded byte has gone out: the
+// callback for the next one is left to iic_slave_poll, outside the ISR.
+static inline void iic_slave_tx_refill(volatile iic_t *iic){
+	iic -> data_buf = iic -> slave_tx_preload;
+	iic -> events |= IIC_EVENT_SLAVE_REFILL;
+}
+
+// Buffered slave mode: load the next reply byte into TWDR. Returns the TWCR
+// value that sends it - without TWEA on the last byte, so the hardware
+// stops expecting more.
+static uint8_t iic_slave_tx_next(volatile iic_t *iic){
+	if(iic -> slave_tx_index < iic -> slave_tx_len){
+		iic -> twi -> twdr = iic -> slave_tx_buf[iic -> slave_tx_index++];
+	}else{
+		iic -> twi -> twdr = 0xFF; // master is reading past the end of the reply
+	}
+	return iic -> slave_tx_index >= iic -> slave_tx_len ? TWCR_LAST_BYTE : TWCR_NEXT;
+}
+
+static inline uint8_t iic_reg_advance(volatile iic_t *iic, uint8_t reg){
+	return ++reg >= iic -> reg_len ? 0 : reg;
+}
+
+// Register-map mode: handle one received byte.
+static void iic_reg_write(volatile iic_t *iic, uint8_t dat){
+	if(!iic -> reg_pointer_set){
+		iic -> reg_pointer = dat < iic -> reg_len ? dat : 0;
+		iic -> reg_pointer_set = true;
+		return;
+	}
+
+	uint8_t reg = iic -> reg_pointer;
+	uint8_t mask = 0xFF;
+	if(iic -> reg_protected){
+		if(!(iic -> reg_writable[reg >> 3] & (1 << (reg & 0x07)))){
+			mask = 0;
+		}else if(iic -> reg_write_mask != NULL){
+			mask = iic -> reg_write_mask[reg];
+		}
+	}
+	if(mask != 0){
+		iic -> reg_map[reg] = (iic -> reg_map[reg] & ~mask) | (dat & mask);
+		if(!iic -> reg_dirty){
+			iic -> reg_dirty = true;
+			iic -> reg_dirty_first = reg;
+			iic -> reg_dirty_last = reg;
+		}else if(reg < iic -> reg_dirty_first){
+			iic -> reg_dirty_first = reg;
+		}else if(reg > iic -> reg_dirty_last){
+			iic -> reg_dirty_last = reg;
+		}
+	}
+	iic -> reg_pointer = iic_reg_advance(iic, reg);
+}
+
+// Register-map mode: the master has finished writing - report what changed.
+static void iic_reg_write_done(volatile iic_t *iic){
+	if(iic -> reg_dirty){
+		iic -> reg_dirty = false;
+		if(iic -> dirty_callback != NULL){
+			iic -> dirty_callback(iic, iic -> reg_dirty_first, iic -> reg_dirty_last);
+		}
+	}
+}
+
+// Register-map mode: load the register at the pointer into TWDR.
+static void iic_reg_read(volatile iic_t *iic){
+	uint8_t reg = iic -> reg_pointer;
+	iic -> twi -> twdr = iic -> reg_map[reg];
+	iic -> reg_pointer = iic_reg_advance(iic, reg);
+}
+
+// Frees a bus that a slave is holding down (typically SDA stuck low after
+// it was reset halfway through a byte): with the TWI off, clocks SCL by hand
+// until the slave lets go of SDA (9 clocks at most), then sends a STOP.
+// Leaves the TWI disabled. Returns false if SDA is still stuck.
+static bool iic_bus_recover(volatile iic_t *iic){
+	volatile uint8_t *pins = iic -> pins;
+	uint8_t sda = iic -> sda_mask;
+	uint8_t scl = iic -> scl_mask;
+	uint8_t pullups = IIC_GPIO_PORT(pins) & (sda | scl);
+
+	iic -> twi -> twcr = TWCR_DISABLE;
+	IIC_GPIO_PORT(pins) &= ~(sda | scl); // open-drain: a line is pulled low through DDR, released otherwise
+	IIC_GPIO_DDR(pins) &= ~(sda | scl);
+	__builtin_avr_delay_cycles(IIC_RECOVERY_HALF_PERIOD_CYCLES);
+
+	for(uint8_t clocks = 0; clocks < 9 && !(IIC_GPIO_PIN(pins) & sda); clocks++){
+		IIC_GPIO_DDR(pins) |= scl;
+		__builtin_avr_delay_cycles(IIC_RECOVERY_HALF_PERIOD_CYCLES);
+		IIC_GPIO_DDR(pins) &= ~scl;
+		__builtin_avr_delay_cycles(IIC_RECOVERY_HALF_PERIOD_CYCLES);
+	}
+
+	// STOP: SDA goes low, then high again while SCL is high
+	IIC_GPIO_DDR(pins) |= scl;
+	__builtin_avr_delay_cycles(IIC_RECOVERY_HALF_PERIOD_CYCLES);
+	IIC_GPIO_DDR(pins) |= sda;
+	__builtin_avr_delay_cycles(IIC_RECOVERY_HALF_PERIOD_CYCLES);
+	IIC_GPIO_DDR(pins) &= ~scl;
+	__builtin_avr_delay_cycles(IIC_RECOVERY_HALF_PERIOD_CYCLES);
+	IIC_GPIO_DDR(pins) &= ~sda;
+	__builtin_avr_delay_cycles(IIC_RECOVERY_HALF_PERIOD_CYCLES);
+
+	bool released = (IIC_GPIO_PIN(pins) & sda) != 0;
+	IIC_GPIO_PORT(pins) |= pullups;
+	iic -> events |= IIC_EVENT_BUS_RECOVERY;
+	return released;
+}
+
+// Deals with the master transaction a recovery cut short. A queued one is
+// left at the head of the queue so that iic_release starts it again (up to
+// IIC_RECOVERY_RETRIES times); anything else fails with IIC_BUS_ERROR.
+static void iic_master_replay(volatile iic_t *iic, bool bus_free){
+	if(bus_free && iic -> current != NULL && iic -> recoveries++ < IIC_RECOVERY_RETRIES){
+		iic -> current = NULL;
+		iic -> retry_count = 0;
+		iic -> state = IIC_IDLE;
+		iic -> intent = IIC_IDLE;
+	}else{
+		iic_master_finish(iic, IIC_BUS_ERROR);
+	}
+}
+
+// Recovers the bus and restarts the TWI, replaying any master transaction
+// that was in progress. Runs with interrupts off for up to ~24 half periods
+// of IIC_RECOVERY_HALF_PERIOD_CYCLES. Returns false if SDA is still stuck.
+bool iic_recover(volatile iic_t *iic){
+	bool released;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		released = iic_bus_recover(iic);
+		if(iic_master_active(iic)){
+			iic_master_replay(iic, released);
+		}
+		iic -> state = IIC_IDLE;
+		iic -> intent = IIC_IDLE;
+		iic -> watchdog = 0;
+		iic -> twi -> twcr = iic_release(iic, TWCR_NEXT);
+	}
+	return released;
+}
+
+// True if the watchdog should count this tick: we own the bus and are
+// waiting for an interrupt, or our START can't get out because SDA is low
+// while SCL is high - nobody is clocking, so a slave is holding SDA. A
+// START that is only waiting for another master's transfer to end doesn't
+// count; that master may take as long as it likes.
+static bool iic_watchdog_stalled(volatile iic_t *iic){
+	if(iic -> state == IIC_MASTER_TRANSMITTER || iic -> state == IIC_MASTER_RECEIVER){
+		return true;
+	}
+	return iic -> state == IIC_TRYING_TO_SEIZE_BUS && (*iic -> pins & (iic -> sda_mask | iic -> scl_mask)) == iic -> scl_mask;
+}
+
+// Call at a steady rate (e.g. from a timer interrupt). If one of our master
+// transfers has seen no TWI interrupt for IIC_WATCHDOG_TICKS calls, or a
+// stuck slave has kept our START off the bus that long, the bus is assumed
+// stuck and iic_recover is run. Choose the rate so that this is well beyond
+// the longest legitimate gap (clock stretching).
+void iic_watchdog_tick(volatile iic_t *iic){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(!iic_watchdog_stalled(iic)){
+			iic -> watchdog = 0;
+		}else if(++iic -> watchdog >= IIC_WATCHDOG_TICKS){
+			iic -> error_state = IIC_BUS_ERROR;
+			IIC_TRACE_TRIGGER(iic, IIC_BUS_ERROR);
+			iic_recover(iic);
+		}
+	}
+}
+
+// Returns the events in mask that have happened since they were last
+// taken, and clears them.
+uint8_t iic_take_events(volatile iic_t *iic, uint8_t mask){
+	uint8_t events;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		events = iic -> events & mask;
+		iic -> events &= ~events;
+	}
+	return events;
+}
+
+// The hardware back end of iic_bus_t.
+static bool iic_hw_bus_enqueue(volatile void *port, iic_transaction_t *transaction){
+	return iic_enqueue(port, transaction);
+}
+
+static uint8_t iic_hw_bus_take_events(volatile void *port, uint8_t mask){
+	return iic_take_events(port, mask);
+}
+
+const iic_bus_ops_t iic_hw_bus_ops = {iic_hw_bus_enqueue, iic_hw_bus_take_events};
+
+// Sleeps (idle mode, so the TWI keeps running) until at least one of the
+// events in mask has happened, then takes and returns them. Other
+// interrupts wake the CPU too, but it goes back to sleep until the TWI
+// reports something. Leaves interrupts enabled.
+uint8_t iic_wait_events(volatile iic_t *iic, uint8_t mask){
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	while(1){
+		cli();
+		uint8_t events = iic -> events & mask;
+		if(events){
+			iic -> events &= ~events;
+			sei();
+			return events;
+		}
+		sleep_enable();
+		sei(); // sleep_cpu runs before any pending interrupt, so a wakeup can't be missed
+		sleep_cpu();
+		sleep_disable();
+	}
+}
+
+void iic_clear_error(volatile iic_t *iic){
+	iic -> error_state = IIC_NO_ERROR;
+}
+
+// The ISR body, shared by every TWI peripheral. It is inlined into each
+// vector with a constant iic, so the module fields are still accessed
+// directly; twi is read once and kept in a register.
+static inline __attribute__((always_inline)) void iic_isr(volatile iic_t *iic){
+	volatile iic_twi_t *twi = iic -> twi;
+	uint8_t status = twi -> twsr & TW_STATUS_MASK;
+	IIC_STATS_ISR_BEGIN(iic, status);
+	IIC_TRACE_RECORD(iic, status);
+	iic -> watchdog = 0;
+	switch(IIC_STATUS(status)){
+		case IIC_STATUS(TW_START):
+		case IIC_STATUS(TW_REP_START):; // kludge to allow declaring a variable directly after the case statement.
 			bool read_mode = false;
-			if(IIC_MODULE.intent == IIC_MASTER_TRANSMITTER){
-				IIC_MODULE.state = IIC_MASTER_TRANSMITTER;
+			iic_state_t intent = iic -> intent;
+			IIC_STATS_TRANSACTION_START(iic);
+			twi -> twbr = iic -> active_bitrate; // the START is out - any yield is over (see iic_release)
+			if(intent == IIC_MASTER_TRANSMITTER){
+				iic -> state = IIC_MASTER_TRANSMITTER;
 				read_mode = false;
-			}else if(IIC_MODULE.intent == IIC_MASTER_RECEIVER){
-				IIC_MODULE.state = IIC_MASTER_RECEIVER;
+			}else if(intent == IIC_MASTER_RECEIVER){
+				iic -> state = IIC_MASTER_RECEIVER;
 				read_mode = true;
 			}
+			iic_apply_profile(iic); // reclock for this device before its address goes out
 
-			TWDR = (IIC_MODULE.remote_addr_buf << 1) | (read_mode << 0);
-			TWCR = TWCR_NEXT;
+			twi -> twdr = (iic -> remote_addr_buf << 1) | (read_mode << 0);
+			twi -> twcr = TWCR_NEXT;
 			break;
 		
 
 		// ================================================================
 		// Master-transmitter mode
 		// ================================================================
-		case TW_MT_SLA_ACK: // slave is acknowledging address - send data
-			if(IIC_MODULE.transaction_len <= 2){
-				TWDR = IIC_MODULE.data_buf;
-				IIC_MODULE.data_buf_index++;
+		case IIC_STATUS(TW_MT_SLA_ACK): // slave is acknowledging address - send data
+			iic_presence_mark(iic, iic -> remote_addr_buf, true);
+			if(iic -> transaction_len == 0){
+				if(iic -> read_after_write_len != 0){
+					// a write-then-read with no write half - repeated START straight into the read
+					iic_start_read_half(iic);
+					twi -> twcr = TWCR_START | TWCR_NEXT;
+					break;
+				}
+				// address-only probe - nothing to send
+				iic_master_finish(iic, IIC_NO_ERROR);
+				twi -> twcr = iic_release(iic, TWCR_STOP);
+				break;
+			}else if(IIC_ISR_SMALL_PATHS && iic -> transaction_len <= 2){
+				twi -> twdr = iic -> data_buf;
+				iic -> data_buf_index++;
 			}else{
-				TWDR = IIC_MODULE.big_data_buf[IIC_MODULE.data_buf_index++];
+				twi -> twdr = iic_next_tx_byte(iic);
 			}
-			IIC_MODULE.retry_count = 0;
-			TWCR = TWCR_NEXT;
+			iic -> retry_count = 0;
+			twi -> twcr = TWCR_NEXT;
 			break;
 
-		case TW_MT_SLA_NACK: // no slave is acknowledging address - retry or abort
-			if(IIC_MODULE.retry_count++ >= IIC_MODULE.retry_max){
-				IIC_MODULE.error_state = IIC_MT_ADDR_NACK;
-				IIC_MODULE.state = IIC_IDLE;
-				IIC_MODULE.intent = IIC_IDLE;
-				IIC_MODULE.retry_count = 0;
-				TWCR = TWCR_STOP;
+		case IIC_STATUS(TW_MT_SLA_NACK): // no slave is acknowledging address - retry or abort
+			if(iic -> no_retry || iic -> retry_count++ >= iic -> retry_max){
+				if(iic -> no_retry){
+					iic_presence_mark(iic, iic -> remote_addr_buf, false); // only a probe says the device is gone
+				}
+				iic_master_finish(iic, IIC_MT_ADDR_NACK);
+				twi -> twcr = iic_release(iic, TWCR_STOP);
 			}else{
-				TWCR = TWCR_START | TWCR_NEXT; // retry
+				IIC_STATS_RETRY(iic);
+				twi -> twcr = TWCR_START | TWCR_NEXT; // retry
 			}
 			break;
 
-		case TW_MT_DATA_ACK: // slave is acknowledging data
-			IIC_MODULE.retry_count = 0;
-			if(IIC_MODULE.transaction_len == IIC_MODULE.data_buf_index){
-				// end transaction
-				IIC_MODULE.state = IIC_IDLE;
-				IIC_MODULE.intent = IIC_IDLE;
-				TWCR = TWCR_STOP;
-			}else if(IIC_MODULE.transaction_len == 2){
-				TWDR = IIC_MODULE.data_buf_high;
-				IIC_MODULE.data_buf_index++;
-				TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_MT_DATA_ACK):; // slave is acknowledging data
+			// transaction_len and data_buf_index are loaded once for every test below
+			iic_len_t tx_len = iic -> transaction_len;
+			iic_len_t tx_index = iic -> data_buf_index;
+			iic -> retry_count = 0;
+			if(tx_len == tx_index){
+				if(iic -> read_after_write_len != 0){
+					// write half done - repeated START straight into the read half
+					iic_start_read_half(iic);
+					twi -> twcr = TWCR_START | TWCR_NEXT;
+				}else{
+					// end transaction
+					iic_master_finish(iic, IIC_NO_ERROR);
+					twi -> twcr = iic_release(iic, TWCR_STOP);
+				}
+			}else if(IIC_ISR_SMALL_PATHS && tx_len == 2){
+				twi -> twdr = iic -> data_buf_high;
+				iic -> data_buf_index = tx_index + 1;
+				twi -> twcr = TWCR_NEXT;
+			}else if(iic_preempt_due(iic)){
+				// urgent work is waiting - park this write (it stays at the head of
+				// its queue) and hand the bus straight over with a repeated START
+				IIC_STATS_TRANSACTION_END(iic);
+				iic -> current -> sent = tx_index;
+				iic -> current = NULL;
+				iic -> state = IIC_IDLE;
+				iic -> intent = IIC_IDLE;
+				twi -> twcr = iic_release(iic, TWCR_NEXT);
 			}else{
-				TWDR = IIC_MODULE.big_data_buf[IIC_MODULE.data_buf_index++];
-				TWCR = TWCR_NEXT;
+				twi -> twdr = iic_buffer_at(iic, tx_index)[tx_index];
+				iic -> data_buf_index = tx_index + 1;
+				twi -> twcr = TWCR_NEXT;
 			}
 			break;
 
-		case TW_MT_DATA_NACK: // slave has not acknowledged data
-			if(IIC_MODULE.retry_count++ >= IIC_MODULE.retry_max){
+		case IIC_STATUS(TW_MT_DATA_NACK): // slave has not acknowledged data
+			if(iic -> retry_count++ >= iic -> retry_max){
 				// If we're out of retries, abort
-				IIC_MODULE.retry_count = 0;
-				IIC_MODULE.error_state = IIC_MT_DATA_NACK;
-				IIC_MODULE.state = IIC_IDLE;
-				IIC_MODULE.intent = IIC_IDLE;
-				TWCR = TWCR_STOP;
+				iic_master_finish(iic, IIC_MT_DATA_NACK);
+				twi -> twcr = iic_release(iic, TWCR_STOP);
 			}else{
 				// otherwise, retry
-				if(IIC_MODULE.transaction_len == 1){
-					TWDR = IIC_MODULE.data_buf;
-				}else if(IIC_MODULE.transaction_len == 2){
-					TWDR = IIC_MODULE.data_buf_index == 1 ? IIC_MODULE.data_buf : IIC_MODULE.data_buf_high;
+				IIC_STATS_RETRY(iic);
+				if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 1){
+					twi -> twdr = iic -> data_buf;
+				}else if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 2){
+					twi -> twdr = iic -> data_buf_index == 1 ? iic -> data_buf : iic -> data_buf_high;
 				}else{
-					TWDR = IIC_MODULE.big_data_buf[IIC_MODULE.data_buf_index-1];
+					twi -> twdr = iic -> big_data_buf[iic -> data_buf_index-1];
 				}
-				TWCR = TWCR_NEXT;
+				twi -> twcr = TWCR_NEXT;
 			}
 			break;
 
-		/*case TW_MT_ARB_LOST: // we lost arbitration to another master - abort & set error
-			IIC_MODULE.error_state = IIC_MT_ARBITRATION_LOST;
-			IIC_MODULE.state = IIC_IDLE;
-			IIC_MODULE.intent = IIC_IDLE;
-			TWCR &= ~(TWINT | TWSTA);
-			TWCR |= TWINT;
-			break;*/ // this is the same as TW_MR_ARB_LOST, so it's handled down there.
-			// if we were ALSO selected as a slave, see either:
-			// TW_ST_ARB_LOST_SLA_ACK, in the SLAVE_TRANSMITTER section, below, or 
-			// TW_SR_ARB_LOST_SLA_ACK, in the SLAVE_RECEIVER section, further below.
+		// TW_MT_ARB_LOST is the same code as TW_MR_ARB_LOST, so both are handled
+		// down there. If we were ALSO selected as a slave, see either:
+		// TW_ST_ARB_LOST_SLA_ACK, in the SLAVE_TRANSMITTER section, below, or 
+		// TW_SR_ARB_LOST_SLA_ACK, in the SLAVE_RECEIVER section, further below.
 		
 
 		// ================================================================
 		// Master-receiver mode
 		// ================================================================
-		case TW_MR_SLA_ACK: // slave is acknowledging address & ready to read - continue.
-			IIC_MODULE.data_ready = false;
-			IIC_MODULE.retry_count = 0;
-			TWCR = IIC_MODULE.transaction_len == 1 ? TWCR_LAST_BYTE : TWCR_NEXT;
+		case IIC_STATUS(TW_MR_SLA_ACK): // slave is acknowledging address & ready to read - continue.
+			iic_presence_mark(iic, iic -> remote_addr_buf, true);
+			iic -> data_ready = false;
+			iic -> retry_count = 0;
+			twi -> twcr = iic -> transaction_len == 1 ? TWCR_LAST_BYTE : TWCR_NEXT;
 			break;
 
-		case TW_MR_SLA_NACK: // no slave is acknowledging - retry or abort
-			if(IIC_MODULE.retry_count++ >= IIC_MODULE.retry_max){
-				IIC_MODULE.error_state = IIC_MR_ADDR_NACK;
-				IIC_MODULE.state = IIC_IDLE;
-				IIC_MODULE.intent = IIC_IDLE;
-				IIC_MODULE.retry_count = 0;
-				TWCR = TWCR_STOP;
+		case IIC_STATUS(TW_MR_SLA_NACK): // no slave is acknowledging - retry or abort
+			if(iic -> no_retry || iic -> retry_count++ >= iic -> retry_max){
+				if(iic -> no_retry){
+					iic_presence_mark(iic, iic -> remote_addr_buf, false); // only a probe says the device is gone
+				}
+				iic_master_finish(iic, IIC_MR_ADDR_NACK);
+				twi -> twcr = iic_release(iic, TWCR_STOP);
 			}else{
-				TWCR = TWCR_START | TWCR_NEXT; // retry
+				IIC_STATS_RETRY(iic);
+				twi -> twcr = TWCR_START | TWCR_NEXT; // retry
 			}
 			break;
 
-		case TW_MR_DATA_ACK: // slave has sent data, which we acknowledged
-			if(IIC_MODULE.transaction_len == 1){
+		case IIC_STATUS(TW_MR_DATA_ACK): // slave has sent data, which we acknowledged
+			if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 1){
 				// this should never happen, since we're always going to NACK the last byte
-				IIC_MODULE.data_buf = TWDR;
-				IIC_MODULE.data_ready = true;
-				IIC_MODULE.state = IIC_IDLE;
-				IIC_MODULE.intent = IIC_IDLE;
-				TWCR = TWCR_LAST_BYTE; // continue NACKing
-			}else if(IIC_MODULE.transaction_len == 2){
+				iic -> data_buf = twi -> twdr;
+				twi -> twcr = TWCR_LAST_BYTE; // continue NACKing
+			}else if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 2){
 				// Ask for the last byte
-				IIC_MODULE.data_buf = TWDR;
-				IIC_MODULE.state = IIC_IDLE;
-				IIC_MODULE.intent = IIC_IDLE;
-				TWCR = TWCR_LAST_BYTE;
+				iic -> data_buf = twi -> twdr;
+				twi -> twcr = TWCR_LAST_BYTE;
 			}else{
-				// Get the next byte
-				IIC_MODULE.big_data_buf[IIC_MODULE.data_buf_index] = TWDR;
-				if(IIC_MODULE.data_buf_index++ == IIC_MODULE.transaction_len - 2){
-					// The next byte is the last - NACK it
-					TWCR = TWCR_LAST_BYTE;
-				}else{
-					TWCR = TWCR_NEXT;
-				}
+				// Get the next byte; NACK the one after if it is the last
+				iic_len_t index = iic -> data_buf_index;
+				iic_buffer_at(iic, index)[index] = twi -> twdr;
+				iic -> data_buf_index = index + 1;
+				twi -> twcr = index + 2 >= iic -> transaction_len ? TWCR_LAST_BYTE : TWCR_NEXT;
 			}
 			break;
 
-		case TW_MR_DATA_NACK: // slave has sent the last data byte - finish up
-			if(IIC_MODULE.transaction_len == 1){
-				IIC_MODULE.data_buf = TWDR;
-			}else if(IIC_MODULE.transaction_len == 2){
-				IIC_MODULE.data_buf_high = TWDR;
+		case IIC_STATUS(TW_MR_DATA_NACK): // slave has sent the last data byte - finish up
+			if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 1){
+				iic -> data_buf = twi -> twdr;
+			}else if(IIC_ISR_SMALL_PATHS && iic -> transaction_len == 2){
+				iic -> data_buf_high = twi -> twdr;
 			}else{
-				IIC_MODULE.big_data_buf[IIC_MODULE.data_buf_index] = TWDR;
+				iic_store_rx_byte(iic, twi -> twdr);
+			}
+			if(IIC_ISR_SMALL_PATHS && iic -> force_small_multibyte_read && iic -> transaction_len <= 2){
+				// iic_read_many was asked for 1 or 2 bytes - hand them over in its buffer
+				iic -> data_buf_index = 0;
+				iic_store_rx_byte(iic, iic -> data_buf);
+				if(iic -> transaction_len == 2){
+					iic -> data_buf_index = 1;
+					iic_store_rx_byte(iic, iic -> data_buf_high);
+				}
 			}
-			IIC_MODULE.data_ready = true;
-			IIC_MODULE.state = IIC_IDLE;
-			IIC_MODULE.state = IIC_IDLE;
-			TWCR = TWCR_STOP;
+			iic -> data_ready = true;
+			iic_master_finish(iic, IIC_NO_ERROR);
+			twi -> twcr = iic_release(iic, TWCR_STOP);
 			break;
 
-		case TW_MR_ARB_LOST: // we lost arbitration to another master - abort & set error
-			IIC_MODULE.error_state = IIC_MR_ARBITRATION_LOST;
-			IIC_MODULE.state = IIC_IDLE;
-			IIC_MODULE.intent = IIC_IDLE;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_MR_ARB_LOST): // we lost arbitration to another master (MT or MR) - back off & retry, or abort
+			if(!iic_arbitration_retry(iic)){
+				iic_master_finish(iic, iic -> state == IIC_MASTER_TRANSMITTER ? IIC_MT_ARBITRATION_LOST : IIC_MR_ARBITRATION_LOST);
+			}
+			twi -> twcr = iic_release(iic, TWCR_NEXT); // any queued START waits for the bus to be free
 			break;
 		
 
 		// ================================================================
 		// Slave transmitter
 		// ================================================================
-		case TW_ST_SLA_ACK: // master requests data - call the callback function and send result
-			IIC_MODULE.state = IIC_SLAVE_TRANSMITTER;
-			// NOTE: IIC_MODULE.intent should be IDLE now.
-			IIC_MODULE.data_buf = IIC_MODULE.callback(&IIC_MODULE, 0);
-			TWDR = IIC_MODULE.data_buf;
-			TWCR = TWCR_NEXT;
-			break;
-
-		case TW_ST_ARB_LOST_SLA_ACK: // we lost arbitration and were selected as a slave
-		                             // set an error state, call the callback, and send 
-																 // what the callback returns.
-			IIC_MODULE.error_state = IIC_ARBITRATION_LOST_AND_ST_SELECTED;
-			IIC_MODULE.state = IIC_SLAVE_TRANSMITTER;
-			// NOTE: IIC_MODULE.intent will still be IIC_MASTER_TRANSMITTER or IIC_MASTER_RECEIVER.
-			IIC_MODULE.data_buf = IIC_MODULE.callback(&IIC_MODULE, 0);
-			TWDR = IIC_MODULE.data_buf;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_ST_ARB_LOST_SLA_ACK): // we lost arbitration and were selected as a slave
+			// back off (or set an error state), then serve the read as usual
+			if(iic_master_active(iic) && !iic_arbitration_retry(iic)){
+				iic -> error_state = IIC_ARBITRATION_LOST_AND_ST_SELECTED;
+				iic_master_finish(iic, IIC_ARBITRATION_LOST_AND_ST_SELECTED);
+			}
+			// fall through - intent is IDLE again; a parked transaction restarts when the read is over
+		case IIC_STATUS(TW_ST_SLA_ACK): // master requests data - call the callback function and send result
+			if(iic_master_active(iic) && !iic_master_park(iic)){ // selected before our START went out
+				iic -> error_state = IIC_ARBITRATION_LOST_AND_ST_SELECTED;
+				iic_master_finish(iic, IIC_ARBITRATION_LOST_AND_ST_SELECTED);
+			}
+			iic -> state = IIC_SLAVE_TRANSMITTER;
+			if(iic -> slave_mode == IIC_SLAVE_BUFFERED){
+				iic -> slave_tx_index = 0;
+				twi -> twcr = iic_slave_tx_next(iic);
+				IIC_STATS_SLAVE_RELEASE(iic);
+				break;
+			}else if(iic -> slave_mode == IIC_SLAVE_REGISTER_MAP){
+				iic_reg_read(iic);
+				twi -> twcr = TWCR_NEXT;
+				IIC_STATS_SLAVE_RELEASE(iic);
+				break;
+			}else if(iic -> slave_tx_deferred){
+				// reply was published ahead of time - send it, and leave the callback to iic_slave_poll
+				twi -> twdr = iic -> slave_tx_preload;
+				twi -> twcr = TWCR_NEXT;
+				IIC_STATS_SLAVE_RELEASE(iic);
+				iic_slave_tx_refill(iic);
+				break;
+			}
+			// NOTE: iic -> intent should be IDLE now.
+			iic -> data_buf = iic -> callback(iic, 0);
+			twi -> twdr = iic -> data_buf;
+			twi -> twcr = TWCR_NEXT;
+			IIC_STATS_SLAVE_RELEASE(iic);
 			break;
 
-		case TW_ST_DATA_ACK: // master has successfully received data - finish.
-		case TW_ST_LAST_DATA:
-			IIC_MODULE.state = IIC_IDLE;
-			IIC_MODULE.intent = IIC_IDLE;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_ST_DATA_ACK): // master has successfully received data - finish.
+			if(iic -> slave_mode == IIC_SLAVE_BUFFERED){
+				twi -> twcr = iic_slave_tx_next(iic); // master wants more - keep streaming the reply
+				break;
+			}else if(iic -> slave_mode == IIC_SLAVE_REGISTER_MAP){
+				iic_reg_read(iic); // master wants more - next register
+				twi -> twcr = TWCR_NEXT;
+				break;
+			}else if(iic -> slave_tx_deferred){
+				twi -> twdr = iic -> slave_tx_preload; // master wants more - the next byte is ready
+				twi -> twcr = TWCR_NEXT;
+				iic_slave_tx_refill(iic);
+				break;
+			}
+			iic -> state = IIC_IDLE;
+			iic -> intent = IIC_IDLE;
+			twi -> twcr = TWCR_NEXT;
 			break;
 
-		case TW_ST_DATA_NACK: // master has not received data - set error & finish.
-			IIC_MODULE.state = IIC_IDLE;
-			IIC_MODULE.intent = IIC_IDLE;
-			IIC_MODULE.error_state = IIC_ST_DATA_NACK;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_ST_DATA_NACK): // master has not received data - set error & finish.
+			if(iic -> slave_mode == IIC_SLAVE_CALLBACK){
+				// (otherwise the master NACKing our last byte is the normal end of a read)
+				iic -> error_state = IIC_ST_DATA_NACK;
+			}
+			// fall through
+		case IIC_STATUS(TW_ST_LAST_DATA):
+			if(iic -> slave_mode == IIC_SLAVE_BUFFERED && iic -> frame_callback != NULL){
+				iic -> frame_callback(iic); // state is still IIC_SLAVE_TRANSMITTER
+			}
+			iic -> events |= IIC_EVENT_SLAVE_TX;
+			iic -> state = IIC_IDLE;
+			iic -> intent = IIC_IDLE;
+			twi -> twcr = iic_release(iic, TWCR_NEXT);
 			break;
 
 
 		// ================================================================
 		// slave-receiver mode
 		// ================================================================
-		case TW_SR_SLA_ACK: // master is sending data - acknowledge.
-		case TW_SR_GCALL_ACK:
-			IIC_MODULE.state = IIC_SLAVE_RECEIVER;
-			IIC_MODULE.data_ready = false;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_SR_ARB_LOST_GCALL_ACK):
+		case IIC_STATUS(TW_SR_ARB_LOST_SLA_ACK): // we lost arbitration and were selected as a slave
+			// back off (or set an error state), then acknowledge as usual
+			if(iic_master_active(iic) && !iic_arbitration_retry(iic)){
+				iic -> error_state = IIC_ARBITRATION_LOST_AND_SR_SELECTED;
+				iic_master_finish(iic, IIC_ARBITRATION_LOST_AND_SR_SELECTED);
+			}
+			// fall through
+		case IIC_STATUS(TW_SR_SLA_ACK): // master is sending data - acknowledge.
+		case IIC_STATUS(TW_SR_GCALL_ACK):
+			if(iic_master_active(iic) && !iic_master_park(iic)){ // selected before our START went out
+				iic -> error_state = IIC_ARBITRATION_LOST_AND_SR_SELECTED;
+				iic_master_finish(iic, IIC_ARBITRATION_LOST_AND_SR_SELECTED);
+			}
+			iic -> state = IIC_SLAVE_RECEIVER;
+			iic -> data_ready = false;
+			iic -> slave_rx_filter = status == TW_SR_GCALL_ACK || status == TW_SR_ARB_LOST_GCALL_ACK ? IIC_GROUP_FILTER_COMMAND : 0;
+			if(iic -> slave_mode == IIC_SLAVE_BUFFERED){
+				iic_slave_rx_begin(iic, status == TW_SR_GCALL_ACK || status == TW_SR_ARB_LOST_GCALL_ACK);
+			}else if(iic -> slave_mode == IIC_SLAVE_REGISTER_MAP){
+				iic -> reg_pointer_set = false;
+			}
+			twi -> twcr = TWCR_NEXT;
 			break;
 
-		case TW_SR_ARB_LOST_GCALL_ACK:
-		case TW_SR_ARB_LOST_SLA_ACK: // we lost arbitration and were selected as a slave
-		                             // set an error state and acknowledge.
-			IIC_MODULE.error_state = IIC_ARBITRATION_LOST_AND_SR_SELECTED;
-			IIC_MODULE.state = IIC_SLAVE_RECEIVER;
-			IIC_MODULE.data_ready = false;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_SR_DATA_NACK): // we NACKed this byte: the frame is being dropped (ring full, or a multicast to a group we're not in)
+		case IIC_STATUS(TW_SR_GCALL_DATA_NACK):
+			if(iic -> slave_mode == IIC_SLAVE_BUFFERED){
+				iic_slave_rx_end(iic, false);
+			}
+			// we're no longer addressed, so no STOP will follow
+			iic -> state = IIC_IDLE;
+			iic -> intent = IIC_IDLE;
+			twi -> twcr = iic_release(iic, TWCR_NEXT);
 			break;
 
-		case TW_SR_DATA_NACK: // we NACK'ed this byte to indicate EOT - continue, but set error flag.
-		case TW_SR_GCALL_DATA_NACK:
-			IIC_MODULE.error_state = IIC_SR_DATA_NACK;
-		case TW_SR_DATA_ACK: // call the callback function with the returned data
-		case TW_SR_GCALL_DATA_ACK:
-			IIC_MODULE.callback(&IIC_MODULE, TWDR);
+		case IIC_STATUS(TW_SR_DATA_ACK): // call the callback function with the returned data
+		case IIC_STATUS(TW_SR_GCALL_DATA_ACK):
+			if(iic -> slave_mode == IIC_SLAVE_BUFFERED){
+				twi -> twcr = iic_slave_rx_byte(iic, twi -> twdr); // no callback on the per-byte path
+				break;
+			}
+			if(iic -> slave_rx_filter != 0){
+				uint8_t twcr = iic_slave_group_byte(iic, twi -> twdr);
+				if(twcr != 0){
+					twi -> twcr = twcr;
+					break;
+				}
+			}
+			if(iic -> slave_mode == IIC_SLAVE_REGISTER_MAP){
+				iic_reg_write(iic, twi -> twdr);
+				twi -> twcr = TWCR_NEXT;
+				break;
+			}
+			iic -> callback(iic, twi -> twdr);
 			// NOTE: if this SR cycle follows an arbitration loss from an MT-cycle attempt,
-			// IIC_MODULE.data_buf will still contain the data that were going to be transmitted.
+			// iic -> data_buf will still contain the data that were going to be transmitted.
 			// Check for this condition by seeing if the error state is IIC_ARBITRATION_LOST_AND_SR_SELECTED
 			// AND that the intent state is IIC_MASTER_TRANSMITTER.
 			
-			IIC_MODULE.state = IIC_SLAVE_RECEIVER_WAITING;
-			IIC_MODULE.intent = IIC_SLAVE_RECEIVER_WAITING;
-			IIC_MODULE.data_ready = true;
-			TWCR = TWCR_NEXT;
+			iic -> state = IIC_SLAVE_RECEIVER_WAITING;
+			iic -> intent = IIC_SLAVE_RECEIVER_WAITING;
+			iic -> data_ready = true;
+			twi -> twcr = TWCR_NEXT;
 			break;
 		
-		case TW_SR_STOP: // master canceled or finished data send
-			IIC_MODULE.state = IIC_IDLE;
-			IIC_MODULE.intent = IIC_IDLE;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_SR_STOP): // master canceled or finished data send
+			if(iic -> slave_mode == IIC_SLAVE_BUFFERED){
+				iic_slave_rx_end(iic, true);
+			}else if(iic -> slave_mode == IIC_SLAVE_REGISTER_MAP){
+				iic_reg_write_done(iic);
+			}
+			iic -> events |= IIC_EVENT_SLAVE_RX;
+			iic -> state = IIC_IDLE;
+			iic -> intent = IIC_IDLE;
+			twi -> twcr = iic_release(iic, TWCR_NEXT); // start queued master work once the bus is free
 			break;
 
 
 		// ================================================================
 		// misc
 		// ================================================================
-		case TW_BUS_ERROR: // someone is being naughty with the iic lines
-			IIC_MODULE.error_state = IIC_BUS_ERROR;
-			IIC_MODULE.state = IIC_IDLE;
-			IIC_MODULE.state = IIC_IDLE;
-			TWCR = TWCR_NEXT;
+		case IIC_STATUS(TW_BUS_ERROR): // someone is being naughty with the iic lines
+		default: // or something that should never happen - either way, reset the bus
+			iic -> error_state = IIC_BUS_ERROR;
+			IIC_TRACE_TRIGGER(iic, IIC_BUS_ERROR);
+			iic -> events |= IIC_EVENT_BUS_ERROR;
+			iic_recover(iic); // replays the master transaction that was cut short
 			break;
-
-		default: // something else - just abort, acknowledge and hope it goes away
-			TWCR = TWCR_STOP;
 	}
+	IIC_STATS_ISR_END(iic, status);
+}
+
+ISR(TWI_vect){
+	iic_isr(&IIC_MODULE);
+}
+
+#ifdef IIC_TWI1
+ISR(TWI1_vect){
+	iic_isr(&IIC_MODULE1);
 }
+#endif
@@ -0,0 +1,81 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * iic_bus.c
+ * the back-end independent master calls (see iic_bus.h)
+ */
+
+#include <stddef.h>
+
+#include <iic/common.h>
+#include <iic/iic_bus.h>
+
+bool iic_bus_enqueue(const iic_bus_t *bus, iic_transaction_t *transaction){
+	return bus -> ops -> enqueue(bus -> port, transaction);
+}
+
+// Fills in a plain buffer transfer and queues it. Returns false if the
+// descriptor is still in use or the queue is full.
+static bool iic_bus_transfer(
+	const iic_bus_t *bus,
+	iic_transaction_t *transaction,
+	uint8_t remote_address,
+	iic_state_t direction,
+	uint8_t *buffer,
+	iic_len_t buffer_len,
+	uint8_t *read_buffer,
+	iic_len_t read_len
+){
+	if(transaction -> pending){
+		return false;
+	}
+	transaction -> remote_address = remote_address;
+	transaction -> direction = direction;
+	transaction -> buffer = buffer;
+	transaction -> buffer_len = buffer_len;
+	transaction -> segments = NULL;
+	transaction -> segment_count = 0;
+	transaction -> read_buffer = read_buffer;
+	transaction -> read_len = read_len;
+	transaction -> flags = 0;
+	transaction -> callback = NULL;
+	return bus -> ops -> enqueue(bus -> port, transaction);
+}
+
+bool iic_bus_write_many(const iic_bus_t *bus, iic_transaction_t *transaction, uint8_t remote_address, uint8_t *data_buffer, iic_len_t buffer_len){
+	return iic_bus_transfer(bus, transaction, remote_address, IIC_MASTER_TRANSMITTER, data_buffer, buffer_len, NULL, 0);
+}
+
+bool iic_bus_read_many(const iic_bus_t *bus, iic_transaction_t *transaction, uint8_t remote_address, uint8_t *buffer, iic_len_t buffer_len){
+	return iic_bus_transfer(bus, transaction, remote_address, IIC_MASTER_RECEIVER, buffer, buffer_len, NULL, 0);
+}
+
+// Writes write_buffer (typically a register pointer), then reads read_len
+// bytes after a repeated START.
+bool iic_bus_write_read(
+	const iic_bus_t *bus,
+	iic_transaction_t *transaction,
+	uint8_t remote_address,
+	uint8_t *write_buffer,
+	iic_len_t write_len,
+	uint8_t *read_buffer,
+	iic_len_t read_len
+){
+	return iic_bus_transfer(bus, transaction, remote_address, IIC_MASTER_TRANSMITTER, write_buffer, write_len, read_buffer, read_len);
+}
+
+uint8_t iic_bus_take_events(const iic_bus_t *bus, uint8_t mask){
+	return bus -> ops -> take_events(bus -> port, mask);
+}
@@ -17,46 +17,819 @@
  * Extra iic functions
  */
 
+#include <stddef.h>
+#include <util/atomic.h>
+
 #include <iic/common.h>
 #include <iic/iic_extras.h>
 #include <iic/iic.h>
 
+// Points the job's transaction at the next page-sized chunk of data.
+static void iic_eeprom_next_page(iic_eeprom_write_t *job){
+	uint16_t page_room = job -> page_size - (job -> mem_address % job -> page_size);
+	iic_len_t chunk = job -> remaining < page_room ? job -> remaining : page_room;
+
+	job -> address_bytes[0] = job -> mem_address >> 8;
+	job -> address_bytes[1] = job -> mem_address & 0xFF;
+	job -> segments[1].data = job -> data;
+	job -> segments[1].len = chunk;
+
+	job -> mem_address += chunk;
+	job -> data += chunk;
+	job -> remaining -= chunk;
+}
+
+// Transaction callback for each page: queue the next one or finish the job.
+static void iic_eeprom_page_done(iic_transaction_t *transaction, iic_error_t error){
+	iic_eeprom_write_t *job = (iic_eeprom_write_t*)transaction;
+	if(error == IIC_NO_ERROR && job -> remaining != 0){
+		iic_eeprom_next_page(job);
+		if(iic_enqueue(transaction -> iic, transaction)){
+			return;
+		}
+		error = IIC_QUEUE_FULL; // the rest of the job can't go out
+	}
+
+	job -> pending = false;
+	if(job -> callback != NULL){
+		job -> callback(job, error);
+	}
+}
+
+// Starts a paged write of len bytes to mem_address. Returns false if
+// page_size is 0 or the first page couldn't be queued. If a later page
+// can't be queued, the job ends with IIC_QUEUE_FULL.
+bool iic_eeprom_write(
+	volatile iic_t *iic,
+	iic_eeprom_write_t *job,
+	uint8_t remote_address,
+	uint16_t mem_address,
+	uint8_t *data,
+	iic_len_t len,
+	uint16_t page_size,
+	void (*callback)(iic_eeprom_write_t *job, iic_error_t error)
+){
+	if(page_size == 0){
+		job -> pending = false;
+		return false;
+	}
+	job -> mem_address = mem_address;
+	job -> data = data;
+	job -> remaining = len;
+	job -> page_size = page_size;
+	job -> callback = callback;
+
+	job -> segments[0].data = job -> address_bytes;
+	job -> segments[0].len = 2;
+	job -> transaction.remote_address = remote_address;
+	job -> transaction.direction = IIC_MASTER_TRANSMITTER;
+	job -> transaction.buffer = NULL;
+	job -> transaction.buffer_len = 0;
+	job -> transaction.segments = job -> segments;
+	job -> transaction.segment_count = 2;
+	job -> transaction.read_buffer = NULL;
+	job -> transaction.read_len = 0;
+	job -> transaction.flags = 0;
+	job -> transaction.callback = &iic_eeprom_page_done;
+
+	iic_eeprom_next_page(job);
+	job -> pending = true;
+	if(!iic_enqueue(iic, &job -> transaction)){
+		job -> pending = false;
+	}
+	return job -> pending;
+}
+
+// Probe callback: queue the next address of a full scan, or finish.
+static void iic_scan_probe_done(iic_transaction_t *transaction, iic_error_t error){
+	iic_scan_t *scan = (iic_scan_t*)transaction;
+	if(scan -> next_address == scan -> last_address){
+		scan -> next_address = scan -> first_address;
+	}else{
+		scan -> next_address++;
+	}
+
+	if(scan -> full_scan){
+		if(scan -> next_address != scan -> first_address){
+			transaction -> remote_address = scan -> next_address;
+			if(iic_enqueue(transaction -> iic, transaction)){
+				return;
+			}
+		}
+		scan -> full_scan = false;
+		scan -> pending = false;
+		if(scan -> callback != NULL){
+			scan -> callback(scan);
+		}
+	}else{
+		scan -> pending = false;
+	}
+}
+
+static bool iic_scan_queue_probe(iic_scan_t *scan){
+	scan -> transaction.remote_address = scan -> next_address;
+	scan -> pending = true;
+	if(!iic_enqueue(scan -> transaction.iic, &scan -> transaction)){
+		scan -> pending = false;
+	}
+	return scan -> pending;
+}
+
+// Probes every address from first_address to last_address (e.g.
+// IIC_SCAN_FIRST_ADDRESS, IIC_SCAN_LAST_ADDRESS). Returns false if the
+// first probe couldn't be queued.
+bool iic_scan_bus(volatile iic_t *iic, iic_scan_t *scan, uint8_t first_address, uint8_t last_address, void (*callback)(iic_scan_t *scan)){
+	scan -> first_address = first_address;
+	scan -> last_address = last_address;
+	scan -> next_address = first_address;
+	scan -> full_scan = true;
+	scan -> callback = callback;
+
+	scan -> transaction.direction = IIC_MASTER_TRANSMITTER;
+	scan -> transaction.buffer = NULL;
+	scan -> transaction.buffer_len = 0; // address only
+	scan -> transaction.segments = NULL;
+	scan -> transaction.read_buffer = NULL;
+	scan -> transaction.read_len = 0;
+	scan -> transaction.flags = IIC_FLAG_NO_RETRY | IIC_FLAG_IGNORE_PRESENCE;
+	scan -> transaction.callback = &iic_scan_probe_done;
+	scan -> transaction.iic = iic; // iic_enqueue sets it too, but re-probes need it before then
+
+	if(!iic_scan_queue_probe(scan)){
+		scan -> full_scan = false;
+		return false;
+	}
+	return true;
+}
+
+// Background re-probing, once iic_scan_bus has finished: probes the next
+// address in the range that is known to be absent, if any. Call it from the
+// main loop as often as you can spare the bus. Returns true if a probe was
+// queued.
+bool iic_scan_reprobe(iic_scan_t *scan){
+	if(scan -> pending){
+		return false;
+	}
+
+	uint8_t address = scan -> next_address;
+	do{
+		if(iic_device_absent(scan -> transaction.iic, address)){
+			scan -> next_address = address;
+			return iic_scan_queue_probe(scan);
+		}
+		address = address == scan -> last_address ? scan -> first_address : address + 1;
+	}while(address != scan -> next_address);
+	return false;
+}
+
+static iic_poll_t *poll_jobs;
+static volatile uint8_t poll_job_count;
+
+// Sample callback: publish the new sample, or keep the old one on failure.
+static void iic_poll_done(iic_transaction_t *transaction, iic_error_t error){
+	iic_poll_t *job = (iic_poll_t*)transaction;
+	job -> error = error;
+	if(error == IIC_NO_ERROR){
+		job -> front ^= 1;
+		job -> seq++;
+	}
+}
+
+// Fills in a job. buffers holds 2 * len bytes. The first sample is taken on
+// tick `first` (at least 1) and then every `period` ticks; give jobs with
+// the same period different `first`s to spread them out.
+void iic_poll_setup(
+	iic_poll_t *job,
+	uint8_t remote_address,
+	uint8_t reg,
+	uint8_t *buffers,
+	iic_len_t len,
+	uint16_t period,
+	uint16_t first,
+	uint8_t flags
+){
+	job -> reg = reg;
+	job -> buffers = buffers;
+	job -> period = period;
+	job -> countdown = first == 0 ? 1 : first;
+	job -> front = 0;
+	job -> seq = 0;
+	job -> overruns = 0;
+	job -> error = IIC_NO_ERROR;
+
+	job -> transaction.remote_address = remote_address;
+	job -> transaction.direction = IIC_MASTER_TRANSMITTER;
+	job -> transaction.buffer = &job -> reg;
+	job -> transaction.buffer_len = 1;
+	job -> transaction.segments = NULL;
+	job -> transaction.read_buffer = buffers + len;
+	job -> transaction.read_len = len;
+	job -> transaction.flags = flags;
+	job -> transaction.callback = &iic_poll_done;
+	job -> transaction.pending = false;
+}
+
+// Hands the job table to iic_poll_tick; every job is sampled on bus iic.
+// The table must stay valid until iic_poll_stop.
+void iic_poll_start(volatile iic_t *iic, iic_poll_t *jobs, uint8_t job_count){
+	for(uint8_t dex = 0; dex < job_count; dex++){
+		jobs[dex].transaction.iic = iic;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		poll_jobs = jobs;
+		poll_job_count = job_count;
+	}
+}
+
+// Stops queueing samples. Reads already on the bus still finish.
+void iic_poll_stop(){
+	poll_job_count = 0;
+}
+
+// Counts every job down one tick and queues the ones that are due. Call from
+// a timer interrupt at a fixed rate. A job whose previous sample hasn't
+// finished yet skips this one and counts an overrun.
+void iic_poll_tick(){
+	for(uint8_t dex = 0; dex < poll_job_count; dex++){
+		iic_poll_t *job = &poll_jobs[dex];
+		if(--job -> countdown != 0){
+			continue;
+		}
+		job -> countdown = job -> period;
+
+		if(job -> transaction.pending){
+			if(job -> overruns != 0xFF){
+				job -> overruns++;
+			}
+			continue;
+		}
+		// fill the slot the application isn't reading
+		job -> transaction.read_buffer = job -> buffers + (job -> front ^ 1) * job -> transaction.read_len;
+		if(!iic_enqueue(job -> transaction.iic, &job -> transaction) && job -> overruns != 0xFF){
+			job -> overruns++;
+		}
+	}
+}
+
+// Copies the latest sample (transaction.read_len bytes) into dest and
+// returns its sequence number, which changes whenever there is a new
+// sample. Safe to call from the main loop at any time.
+uint8_t iic_poll_read(iic_poll_t *job, uint8_t *dest){
+	uint8_t seq;
+	do{
+		seq = job -> seq;
+		const volatile uint8_t *sample = job -> buffers + job -> front * job -> transaction.read_len;
+		for(iic_len_t dex = 0; dex < job -> transaction.read_len; dex++){
+			dest[dex] = sample[dex];
+		}
+	}while(seq != job -> seq); // a sample was published mid-copy - take the new one
+	return seq;
+}
+
 #ifdef ADDRESS_SERVER
 
-volatile uint8_t address_arr[16]={3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+volatile uint8_t address_arr[16]={0xFF,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0xFF};
 // address size = 8 * 16 = 128 possible addresses
-// 0 and 1 (GC and our address, respectively) should begin as taken.
+// 0x00-0x07 (general call, us at 0x01, reserved) and 0x78-0x7F (reserved)
+// begin as taken.
+static volatile uint16_t address_full = (1 << 0) | (1 << 15); // bit n set: address_arr[n] is full
+static volatile uint8_t release_pending[16]; // bit per address: asked to release, waiting for a dispute
+static volatile uint8_t unconfirmed[16]; // bit per address: allocated, no ADDRESS_CONFIRM yet
+static volatile uint8_t lease[128]; // ticks left on each allocated address's lease
 
-bool handle_address_negotiation(uint8_t command){
-	if(command == IIC_COMMAND_REQUEST_ADDRESS){
-		// scan through address table and find the lowest free address
-		for(int i = 0; i < 16; i++){
-			for(int j = 0; j < 8; j++){
-				if(!(address_arr[i] & i(1 << j))){
-					address_arr[i] |= (1 << j); // set address as taken
-					// broadcast newly-allocated address
-					iic_write_two(0x0, IIC_COMMAND_ADDRESS_ALLOCATION, (i << 3) + j);
-					return true;
-				}
+typedef struct address_reply_t{
+	iic_transaction_t transaction; // must stay first
+	uint8_t payload[4];
+	uint8_t allocated; // the address an ALLOCATION handed out, 0 once it is freed
+} address_reply_t;
+
+static address_reply_t replies[IIC_ADDRESS_SERVER_REPLIES];
+static uint8_t next_reply;
+
+static void address_take(uint8_t address){
+	address_arr[address >> 3] |= 1 << (address & 0x07);
+	if(address_arr[address >> 3] == 0xFF){
+		address_full |= 1 << (address >> 3);
+	}
+	release_pending[address >> 3] &= ~(1 << (address & 0x07));
+	unconfirmed[address >> 3] &= ~(1 << (address & 0x07));
+	lease[address] = IIC_ADDRESS_LEASE_TICKS;
+}
+
+static void address_free(uint8_t address){
+	address_arr[address >> 3] &= ~(1 << (address & 0x07));
+	address_full &= ~(1 << (address >> 3));
+	release_pending[address >> 3] &= ~(1 << (address & 0x07));
+	unconfirmed[address >> 3] &= ~(1 << (address & 0x07));
+	lease[address] = 0;
+	for(uint8_t dex = 0; dex < IIC_ADDRESS_SERVER_REPLIES; dex++){
+		if(replies[dex].allocated == address){
+			replies[dex].allocated = 0; // a repeat request must not get it back
+		}
+	}
+}
+
+static bool address_taken(uint8_t address){
+	return address_arr[address >> 3] & (1 << (address & 0x07));
+}
+
+// Lowest free address in constant time: the first byte that isn't full,
+// then the first clear bit in it. Returns 0 (never free) if the bus is full.
+static uint8_t address_find_free(){
+	uint16_t open_bytes = ~address_full;
+	if(open_bytes == 0){
+		return 0;
+	}
+	uint8_t byte = __builtin_ctz(open_bytes);
+	return (byte << 3) + __builtin_ctz((uint8_t)~address_arr[byte]);
+}
+
+static void address_reply_done(iic_transaction_t *transaction, iic_error_t error);
+
+// Queues [ command | argument | ID_LO | ID_HI ] to target; argument_len 0
+// to 3 bytes of that follow the command. Returns false if every reply slot
+// is still waiting for the bus.
+static bool address_reply(uint8_t target, uint8_t command, uint8_t argument, uint16_t id, uint8_t argument_len){
+	for(uint8_t tries = 0; tries < IIC_ADDRESS_SERVER_REPLIES; tries++){
+		address_reply_t *reply = &replies[next_reply];
+		next_reply = next_reply + 1 == IIC_ADDRESS_SERVER_REPLIES ? 0 : next_reply + 1;
+		if(reply -> transaction.pending){
+			continue;
+		}
+
+		reply -> payload[0] = command;
+		reply -> payload[1] = argument;
+		reply -> payload[2] = id;
+		reply -> payload[3] = id >> 8;
+		reply -> allocated = command == IIC_COMMAND_ADDRESS_ALLOCATION ? argument : 0;
+		reply -> transaction.remote_address = target;
+		reply -> transaction.direction = IIC_MASTER_TRANSMITTER;
+		reply -> transaction.buffer = reply -> payload;
+		reply -> transaction.buffer_len = 1 + argument_len;
+		reply -> transaction.segments = NULL;
+		reply -> transaction.read_buffer = NULL;
+		reply -> transaction.read_len = 0;
+		reply -> transaction.flags = IIC_FLAG_IGNORE_PRESENCE;
+		reply -> transaction.callback = &address_reply_done;
+		if(!iic_enqueue(&IIC_MODULE, &reply -> transaction)){
+			reply -> allocated = 0; // never queued - not an allocation a repeat request may get back
+			return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+// Follow-up once a reply has gone out, or failed to.
+static void address_reply_done(iic_transaction_t *transaction, iic_error_t error){
+	address_reply_t *reply = (address_reply_t*)transaction;
+	if(error == IIC_NO_ERROR){
+		uint8_t address = reply -> payload[1] & 0x7F;
+		if(unconfirmed[address >> 3] & (1 << (address & 0x07))){
+			if(reply -> payload[0] == IIC_COMMAND_ADDRESS_ALLOCATION){
+				lease[address] = IIC_ADDRESS_OFFER_TICKS; // the reply window starts now
+			}else if(reply -> payload[0] == IIC_COMMAND_RELEASE_REQUEST){
+				address_take(address); // not confirmed, but someone answers at it
 			}
 		}
-	}else{
+		return;
+	}
+
+	if(reply -> payload[0] == IIC_COMMAND_ADDRESS_ALLOCATION){
+		// nobody heard the allocation - hand the address out again later
+		address_free(reply -> payload[1]);
+	}else if(reply -> payload[0] == IIC_COMMAND_RELEASE_REQUEST
+	         && (error == IIC_MT_ADDR_NACK || error == IIC_MR_ADDR_NACK)){
+		// the lease holder has gone - free the address and tell everyone
+		address_free(reply -> payload[1]);
+		address_reply(0x00, IIC_COMMAND_RELEASE_ACKNOWLEDGE, reply -> payload[1], 0, 1);
+	}
+}
+
+// The reply slot holding a live allocation to id, or NULL. The slots keep
+// their payload after the reply has gone out, so this remembers the last
+// IIC_ADDRESS_SERVER_REPLIES allocations.
+static address_reply_t *address_allocation_to(uint16_t id){
+	for(uint8_t dex = 0; dex < IIC_ADDRESS_SERVER_REPLIES; dex++){
+		address_reply_t *reply = &replies[dex];
+		if(reply -> allocated != 0
+		   && reply -> payload[2] == (uint8_t)id && reply -> payload[3] == (uint8_t)(id >> 8)){
+			return reply;
+		}
+	}
+	return NULL;
+}
+
+// id is the board id the requester sent after the command (0 if it sent
+// none); it is echoed so the requester can tell the reply is meant for it.
+// Asking again is harmless: a requester whose allocation is still queued,
+// or went out recently and is still held, gets that same address again
+// instead of a second one. A second one that does go out (the first was
+// forgotten) is never confirmed, and address_server_tick takes it back.
+bool handle_address_negotiation(uint8_t command, uint16_t id){
+	if(command != IIC_COMMAND_REQUEST_ADDRESS){
 		return false;
 	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		address_reply_t *last = id != 0 ? address_allocation_to(id) : NULL;
+		uint8_t address;
+		if(last != NULL && last -> transaction.pending){
+			// already on its way
+		}else if(last != NULL){
+			address_reply(0x00, IIC_COMMAND_ADDRESS_ALLOCATION, last -> allocated, id, 3);
+		}else if((address = address_find_free()) == 0){
+			address_reply(0x00, IIC_COMMAND_NO_ROOM_ON_BUS, (uint8_t)id, id >> 8, 2);
+		}else if(address_reply(0x00, IIC_COMMAND_ADDRESS_ALLOCATION, address, id, 3)){
+			address_take(address);
+			unconfirmed[address >> 3] |= 1 << (address & 0x07);
+		}
+		// if the reply couldn't be queued, the requester times out and asks again
+	}
+	return true;
 }
 
-bool handle_address_release(uint8_t command, uint8_t slave_address, uint8_t dispute_byte){
-	if(command == IIC_COMMAND_RELEASE_ADDRESS){
-		if(address_arr[(slave_address & 0x78) >> 3] & (1 << (slave_address & 0x07))){
-			address_arr[(slave_address & 0x78) >> 3] &= ~(1 << (slave_address & 0x07));
-			iic_write_one(slave_address, IIC_COMMAND_RELEASE_ACKNOWLEDGE);
-			return true
+bool handle_address_release(uint8_t command, uint8_t address){
+	if(command != IIC_COMMAND_RELEASE_REQUEST
+	   && command != IIC_COMMAND_RELEASE_FORCE
+	   && command != IIC_COMMAND_RELEASE_DISPUTED
+	   && command != IIC_COMMAND_ADDRESS_CONFIRM){
+		return false;
+	}
+
+	address &= 0x7F;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(address < 0x08 || address > 0x77 || !address_taken(address)){
+			address_reply(0x00, IIC_COMMAND_RELEASE_NOT_ALLOCATED, address, 0, 1);
+		}else if(command == IIC_COMMAND_RELEASE_DISPUTED || command == IIC_COMMAND_ADDRESS_CONFIRM){
+			address_take(address); // in use - start or renew the lease
 		}else{
-			iic_write_one(slave_address, IIC_COMMAND_RELEASE_NOT_ALLOCATED);
-			return true
+			address_free(address);
+			address_reply(0x00, IIC_COMMAND_RELEASE_ACKNOWLEDGE, address, 0, 1);
 		}
-	}else{
+	}
+	return true;
+}
+
+// Renews the lease on an address, e.g. whenever the server hears from it.
+void address_server_renew(uint8_t address){
+	address &= 0x7F;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(address >= 0x08 && address <= 0x77 && address_taken(address)){
+			lease[address] = IIC_ADDRESS_LEASE_TICKS;
+			release_pending[address >> 3] &= ~(1 << (address & 0x07));
+			unconfirmed[address >> 3] &= ~(1 << (address & 0x07));
+		}
+	}
+}
+
+// Ages every lease by one tick. An expired lease gets a release request
+// sent to its device; if the device neither disputes it within the grace
+// period nor answers its address, the address is freed. An allocation
+// that isn't confirmed within IIC_ADDRESS_OFFER_TICKS of going out gets
+// the same request, but answering at the address is enough to keep it: a
+// storm of joining boards can hold up a confirmation, while nobody answers
+// at an allocation its board never took up.
+void address_server_tick(){
+	for(uint8_t address = 0x08; address <= 0x77; address++){
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			if(lease[address] != 0 && --lease[address] == 0){
+				uint8_t bit = 1 << (address & 0x07);
+				if(release_pending[address >> 3] & bit){
+					address_free(address);
+					address_reply(0x00, IIC_COMMAND_RELEASE_ACKNOWLEDGE, address, 0, 1);
+				}else if(address_reply(address, IIC_COMMAND_RELEASE_REQUEST, address, 0, 1)){
+					release_pending[address >> 3] |= bit;
+					lease[address] = IIC_ADDRESS_RELEASE_GRACE_TICKS;
+				}else{
+					lease[address] = 1; // no room to ask - try again next tick
+				}
+			}
+		}
+	}
+}
+#endif
+
+#ifdef ADDRESS_CLIENT
+
+#if (IIC_ADDRESS_CLIENT_FIRST_WINDOW & (IIC_ADDRESS_CLIENT_FIRST_WINDOW - 1)) || (IIC_ADDRESS_CLIENT_MAX_WINDOW & (IIC_ADDRESS_CLIENT_MAX_WINDOW - 1))
+	#error "IIC_ADDRESS_CLIENT_FIRST_WINDOW and IIC_ADDRESS_CLIENT_MAX_WINDOW must be powers of two"
+#endif
+
+static volatile address_client_state_t client_state = ADDRESS_CLIENT_STOPPED;
+static volatile uint8_t client_address;
+static volatile uint16_t client_id; // echoed in the server's replies
+static volatile uint16_t client_random = 1;
+static volatile uint16_t client_window; // current backoff window, in ticks
+static volatile uint16_t client_timer; // ticks left in the current state
+
+static iic_transaction_t client_request; // REQUEST_ADDRESS to the server
+static iic_transaction_t client_notice; // ADDRESS_CONFIRM / RELEASE_DISPUTED / RELEASE_REQUEST to the server
+static uint8_t client_request_payload[3];
+static uint8_t client_notice_payload[2];
+
+// xorshift16 - plenty to keep boards with different seeds out of lockstep
+static uint16_t address_client_random(){
+	uint16_t x = client_random;
+	x ^= x << 7;
+	x ^= x >> 9;
+	x ^= x << 8;
+	client_random = x;
+	return x;
+}
+
+// Queues [ command | argument ] to the server, argument_len (1 or 2) bytes
+// of argument low byte first.
+static bool address_client_send(iic_transaction_t *transaction, uint8_t *payload, uint8_t command, uint16_t argument, uint8_t argument_len){
+	if(transaction -> pending){
+		return false;
+	}
+
+	payload[0] = command;
+	payload[1] = argument;
+	if(argument_len > 1){
+		payload[2] = argument >> 8;
+	}
+	transaction -> remote_address = IIC_ADDRESS_SERVER_ADDRESS;
+	transaction -> direction = IIC_MASTER_TRANSMITTER;
+	transaction -> buffer = payload;
+	transaction -> buffer_len = 1 + argument_len;
+	transaction -> segments = NULL;
+	transaction -> read_buffer = NULL;
+	transaction -> read_len = 0;
+	transaction -> flags = IIC_FLAG_IGNORE_PRESENCE;
+	return iic_enqueue(&IIC_MODULE, transaction);
+}
+
+// Waits a random number of ticks in [1, window] before the next request.
+static void address_client_backoff(uint16_t window){
+	client_window = window;
+	client_timer = 1 + (address_client_random() & (window - 1));
+	client_state = ADDRESS_CLIENT_BACKOFF;
+}
+
+static void address_client_failed(){
+	uint16_t window = client_window << 1;
+	address_client_backoff(window > IIC_ADDRESS_CLIENT_MAX_WINDOW ? IIC_ADDRESS_CLIENT_MAX_WINDOW : window);
+}
+
+// Back to listening on general call only.
+static void address_client_forget(){
+	client_address = 0;
+	IIC_MODULE.twi -> twar = 1;
+}
+
+static void address_client_request_done(iic_transaction_t *transaction, iic_error_t error){
+	if(error != IIC_NO_ERROR && client_state == ADDRESS_CLIENT_WAITING){
+		address_client_failed(); // server missing or busy - don't wait for a reply that isn't coming
+	}
+}
+
+void address_client_start(uint16_t id){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		client_id = id ? id : 1; // 0 is what the server echoes for a request without one
+		client_random = client_id;
+		address_client_random();
+		client_request.callback = &address_client_request_done;
+		client_notice.callback = NULL;
+		address_client_forget();
+		address_client_backoff(IIC_ADDRESS_CLIENT_FIRST_WINDOW);
+	}
+}
+
+void address_client_tick(){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(client_state == ADDRESS_CLIENT_BACKOFF && --client_timer == 0){
+			if(address_client_send(&client_request, client_request_payload, IIC_COMMAND_REQUEST_ADDRESS, client_id, 2)){
+				client_timer = IIC_ADDRESS_CLIENT_REPLY_TICKS;
+				client_state = ADDRESS_CLIENT_WAITING;
+			}else{
+				client_timer = 1; // queue full - try again next tick
+			}
+		}else if(client_state == ADDRESS_CLIENT_WAITING && !client_request.pending && --client_timer == 0){
+			address_client_failed(); // the wait starts once the request is out, not while it queues for the bus
+		}
+	}
+}
+
+// True if the ID_LO | ID_HI at id is ours.
+static bool address_client_mine(const uint8_t *id){
+	return (id[0] | (uint16_t)id[1] << 8) == client_id;
+}
+
+bool address_client_handle_frame(uint8_t *frame, uint8_t len, bool general_call){
+	if(len == 0){
+		return false;
+	}
+
+	switch(frame[0]){
+		case IIC_COMMAND_ADDRESS_ALLOCATION:
+			// one that turns up after we gave up waiting still counts - the
+			// server has handed the address out either way
+			if(general_call && len >= 4 && address_client_mine(frame + 2)
+			   && (client_state == ADDRESS_CLIENT_WAITING || client_state == ADDRESS_CLIENT_BACKOFF)){
+				client_address = frame[1] & 0x7F;
+				IIC_MODULE.twi -> twar = (client_address << 1) | 1;
+				client_state = ADDRESS_CLIENT_ADDRESSED;
+				// spares the server probing the address once its reply window is up
+				address_client_send(&client_notice, client_notice_payload, IIC_COMMAND_ADDRESS_CONFIRM, client_address, 1);
+			}
+			return general_call;
+
+		case IIC_COMMAND_NO_ROOM_ON_BUS:
+			if(general_call && len >= 3 && client_state == ADDRESS_CLIENT_WAITING && address_client_mine(frame + 1)){
+				address_client_backoff(IIC_ADDRESS_CLIENT_MAX_WINDOW);
+			}
+			return general_call;
+
+		case IIC_COMMAND_RELEASE_ACKNOWLEDGE:
+		case IIC_COMMAND_RELEASE_NOT_ALLOCATED:
+			if(general_call && len >= 2 && client_state == ADDRESS_CLIENT_ADDRESSED && frame[1] == client_address){
+				// the server took our address back, or never had it down as ours - start over
+				address_client_forget();
+				address_client_backoff(IIC_ADDRESS_CLIENT_FIRST_WINDOW);
+			}
+			return general_call;
+
+		case IIC_COMMAND_RELEASE_REQUEST:
+			if(!general_call && len >= 2 && client_state == ADDRESS_CLIENT_ADDRESSED && frame[1] == client_address){
+				// lease ran out, but we're still here
+				address_client_send(&client_notice, client_notice_payload, IIC_COMMAND_RELEASE_DISPUTED, client_address, 1);
+				return true;
+			}
+			return false;
+	}
+	return false;
+}
+
+// Hands the address back to the server, e.g. before powering down.
+void address_client_release(){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(client_state == ADDRESS_CLIENT_ADDRESSED){
+			address_client_send(&client_notice, client_notice_payload, IIC_COMMAND_RELEASE_REQUEST, client_address, 1);
+			address_client_forget();
+		}
+		client_state = ADDRESS_CLIENT_STOPPED;
+	}
+}
+
+address_client_state_t address_client_state(){
+	return client_state;
+}
+
+uint8_t address_client_address(){
+	return client_address;
+}
+#endif
+
+#ifdef LED_ENGINE
+
+typedef enum{
+	LED_SYNC_DEFAULT, // follow INCLUSIVE_SYNCHRONIZE, ignore EXCLUSIVE_SYNCHRONIZE
+	LED_SYNC_INCLUDED, // jump to include_phase on either synchronize
+	LED_SYNC_EXCLUDED // ignore the next synchronize
+} led_sync_t;
+
+static const led_waveform_t *led_patterns;
+static uint8_t led_pattern_count;
+static void (*led_output)(uint8_t channel, uint16_t level);
+
+static volatile uint8_t led_pattern = IIC_LED_PATTERN_STEADY;
+static volatile uint16_t led_phase;
+static volatile uint16_t led_level[IIC_LED_CHANNELS];
+static volatile led_sync_t led_sync;
+static volatile uint8_t led_include_phase;
+
+void led_engine_setup(
+	const led_waveform_t *patterns,
+	uint8_t pattern_count,
+	void (*output)(uint8_t channel, uint16_t level)
+){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		led_patterns = patterns;
+		led_pattern_count = pattern_count;
+		led_output = output;
+		led_pattern = IIC_LED_PATTERN_STEADY;
+		led_phase = 0;
+		led_sync = LED_SYNC_DEFAULT;
+	}
+}
+
+// Applies a synchronize; phase is the one from the command (ignored by an
+// exclusive synchronize). Either kind uses up any include/exclude.
+static void led_synchronize(bool inclusive, uint8_t phase){
+	if(led_sync == LED_SYNC_INCLUDED){
+		led_phase = (uint16_t)led_include_phase << 8;
+	}else if(led_sync == LED_SYNC_DEFAULT && inclusive){
+		led_phase = (uint16_t)phase << 8;
+	}
+	led_sync = LED_SYNC_DEFAULT;
+}
+
+// Returns true if the frame was an LED command (well-formed or not).
+bool led_engine_handle_frame(uint8_t *frame, uint8_t len, bool general_call){
+	if(general_call && len >= 3 && frame[0] == IIC_COMMAND_GROUP_MULTICAST){
+		if(!iic_in_group(&IIC_MODULE, frame[1])){
+			return false;
+		}
+		// a multicast is addressed to each member, so treat it like a unicast
+		frame += 2;
+		len -= 2;
+		general_call = false;
+	}
+	if(len == 0){
 		return false;
 	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		switch(frame[0]){
+			case IIC_COMMAND_LED_WRITE_WORD:
+				if(len >= 4 && frame[1] < IIC_LED_CHANNELS){
+					led_level[frame[1]] = frame[2] | ((uint16_t)frame[3] << 8);
+				}
+				return true;
+
+			case IIC_COMMAND_LED_SET_PATTERN:
+				if(len >= 2 && frame[1] < led_pattern_count){
+					led_pattern = frame[1];
+				}
+				return true;
+
+			case IIC_COMMAND_LED_INCLUDE_DEVICE:
+				if(!general_call && len >= 2){
+					led_sync = LED_SYNC_INCLUDED;
+					led_include_phase = frame[1];
+				}
+				return true;
+
+			case IIC_COMMAND_LED_EXCLUDE_DEVICE:
+				if(!general_call){
+					led_sync = LED_SYNC_EXCLUDED;
+				}
+				return true;
+
+			case IIC_COMMAND_LED_INCLUDE_GROUP:
+				if(general_call && len >= 3 && iic_in_group(&IIC_MODULE, frame[1])){
+					led_sync = LED_SYNC_INCLUDED;
+					led_include_phase = frame[2];
+				}
+				return true;
+
+			case IIC_COMMAND_LED_EXCLUDE_GROUP:
+				if(general_call && len >= 2 && iic_in_group(&IIC_MODULE, frame[1])){
+					led_sync = LED_SYNC_EXCLUDED;
+				}
+				return true;
+
+			case IIC_COMMAND_LED_INCLUSIVE_SYNCHRONIZE:
+				if(general_call && len >= 2){
+					led_synchronize(true, frame[1]);
+				}
+				return true;
+
+			case IIC_COMMAND_LED_EXCLUSIVE_SYNCHRONIZE:
+				if(general_call){
+					led_synchronize(false, 0);
+				}
+				return true;
+		}
+	}
+	return false;
+}
+
+// Advances the phase one step and refreshes every channel. Call from a timer
+// interrupt at a fixed rate.
+void led_engine_tick(){
+	if(led_output == NULL){
+		return;
+	}
+
+	uint8_t pattern = led_pattern;
+	if(pattern == IIC_LED_PATTERN_STEADY || led_patterns[pattern].samples == NULL){
+		for(uint8_t channel = 0; channel < IIC_LED_CHANNELS; channel++){
+			led_output(channel, led_level[channel]);
+		}
+		return;
+	}
+
+	uint8_t sample;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		led_phase += led_patterns[pattern].step;
+		sample = led_patterns[pattern].samples[led_phase >> 8];
+	}
+
+	for(uint8_t channel = 0; channel < IIC_LED_CHANNELS; channel++){
+		uint16_t level = led_level[channel];
+		// level * 255 >> 8 would fall a step short of full brightness
+		led_output(channel, sample == 0xFF ? level : ((uint32_t)level * sample) >> 8);
+	}
+}
+
+uint16_t led_engine_phase(){
+	uint16_t phase;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		phase = led_phase;
+	}
+	return phase;
 }
 #endif
@@ -0,0 +1,426 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * iic_soft.c
+ * bit-banged iic master
+ */
+
+#include <stddef.h>
+#include <util/atomic.h>
+
+#include <iic/common.h>
+#include <iic/iic_soft.h>
+#include <iic/iic_bus.h>
+
+static inline void iic_soft_sda(volatile iic_soft_t *bus, bool high){
+	if(high){
+		IIC_GPIO_DDR(bus -> sda_pin) &= ~bus -> sda_mask;
+	}else{
+		IIC_GPIO_DDR(bus -> sda_pin) |= bus -> sda_mask;
+	}
+}
+
+static inline void iic_soft_scl(volatile iic_soft_t *bus, bool high){
+	if(high){
+		IIC_GPIO_DDR(bus -> scl_pin) &= ~bus -> scl_mask;
+	}else{
+		IIC_GPIO_DDR(bus -> scl_pin) |= bus -> scl_mask;
+	}
+}
+
+static inline bool iic_soft_sda_high(volatile iic_soft_t *bus){
+	return (IIC_GPIO_PIN(bus -> sda_pin) & bus -> sda_mask) != 0;
+}
+
+static inline bool iic_soft_scl_high(volatile iic_soft_t *bus){
+	return (IIC_GPIO_PIN(bus -> scl_pin) & bus -> scl_mask) != 0;
+}
+
+void iic_soft_setup(
+	volatile iic_soft_t *bus,
+	volatile uint8_t *sda_pin,
+	uint8_t sda_bit,
+	volatile uint8_t *scl_pin,
+	uint8_t scl_bit,
+	uint8_t tick_divider,
+	uint16_t stretch_max,
+	uint8_t retry_max
+){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		bus -> sda_pin = sda_pin;
+		bus -> sda_mask = 1 << sda_bit;
+		bus -> scl_pin = scl_pin;
+		bus -> scl_mask = 1 << scl_bit;
+		bus -> tick_divider = tick_divider ? tick_divider : 1;
+		bus -> tick_count = 0;
+		bus -> stretch_max = stretch_max;
+		bus -> retry_max = retry_max;
+		bus -> state = IIC_SOFT_IDLE;
+
+		// open-drain: PORT stays 0, DDR decides between "pull low" and "released"
+		IIC_GPIO_PORT(sda_pin) &= ~bus -> sda_mask;
+		IIC_GPIO_PORT(scl_pin) &= ~bus -> scl_mask;
+		iic_soft_sda(bus, true);
+		iic_soft_scl(bus, true);
+	}
+}
+
+// Points the byte cursor at a buffer or a segment list.
+static void iic_soft_use(volatile iic_soft_t *bus, uint8_t *buffer, iic_len_t buffer_len, const iic_segment_t *segments, uint8_t segment_count){
+	if(segments == NULL){
+		bus -> data = buffer;
+		bus -> segment_left = buffer_len;
+		bus -> len_left = buffer_len;
+		return;
+	}
+
+	iic_len_t total_len = 0;
+	for(uint8_t dex = 0; dex < segment_count; dex++){
+		total_len += segments[dex].len;
+	}
+	bus -> data = segments[0].data;
+	bus -> segment_left = segments[0].len;
+	bus -> segment = segments + 1;
+	bus -> len_left = total_len;
+}
+
+// Returns the cursor position of the next byte and moves past it.
+static uint8_t *iic_soft_next_byte(volatile iic_soft_t *bus){
+	while(bus -> segment_left == 0){
+		bus -> data = bus -> segment -> data;
+		bus -> segment_left = bus -> segment -> len;
+		bus -> segment++;
+	}
+	bus -> segment_left--;
+	bus -> len_left--;
+	return bus -> data++;
+}
+
+// Loads the 9 bits of a byte to send; the ACK slot is released for the slave.
+static void iic_soft_load_tx(volatile iic_soft_t *bus, uint8_t dat){
+	bus -> tx_bits = (dat << 1) | 1;
+	bus -> bit_count = 0;
+}
+
+// Loads a byte to receive: SDA stays released for the data, then we ACK
+// (or NACK the last byte).
+static void iic_soft_load_rx(volatile iic_soft_t *bus){
+	bus -> tx_bits = 0x1FE | (bus -> len_left == 1);
+	bus -> bit_count = 0;
+}
+
+static void iic_soft_load_address(volatile iic_soft_t *bus){
+	bus -> stage = IIC_SOFT_STAGE_ADDRESS;
+	iic_soft_load_tx(bus, (bus -> current -> remote_address << 1) | bus -> reading);
+}
+
+// Loads the transaction at the head of the queue. Returns false if the
+// queue is empty. Must be called with interrupts disabled or from the tick.
+static bool iic_soft_load_next(volatile iic_soft_t *bus){
+	if(bus -> queue_head == bus -> queue_tail){
+		return false;
+	}
+
+	iic_transaction_t *transaction = bus -> queue[bus -> queue_head];
+	bus -> current = transaction;
+	bus -> reading = transaction -> direction == IIC_MASTER_RECEIVER;
+	iic_soft_use(bus, transaction -> buffer, transaction -> buffer_len, transaction -> segments, transaction -> segment_count);
+	bus -> retry_count = 0;
+	bus -> stretch_count = 0;
+	bus -> error = IIC_NO_ERROR;
+	iic_soft_load_address(bus);
+	return true;
+}
+
+// Retires the current transaction and reports its result, then moves on
+// to the next one (after at least half a period of free bus).
+static void iic_soft_finish(volatile iic_soft_t *bus, iic_error_t error){
+	iic_transaction_t *transaction = bus -> current;
+	bus -> current = NULL;
+	bus -> queue_head = (bus -> queue_head + 1) & (IIC_SOFT_QUEUE_LEN - 1);
+	bus -> events |= error == IIC_NO_ERROR ? IIC_EVENT_MASTER_DONE : IIC_EVENT_MASTER_ERROR;
+	transaction -> error = error;
+	transaction -> pending = false;
+	if(transaction -> callback != NULL){
+		transaction -> callback(transaction, error);
+	}
+
+	if(iic_soft_load_next(bus)){
+		bus -> state = IIC_SOFT_START;
+	}else{
+		bus -> events |= IIC_EVENT_QUEUE_EMPTY;
+		bus -> state = IIC_SOFT_IDLE;
+	}
+}
+
+// Lets go of both lines and fails the current transaction.
+static void iic_soft_abort(volatile iic_soft_t *bus, iic_error_t error){
+	iic_soft_sda(bus, true);
+	iic_soft_scl(bus, true);
+	iic_soft_finish(bus, error);
+}
+
+// SCL is still low (or the bus is busy) when it should be free. Returns
+// true, after failing the transaction, once that has gone on too long.
+static bool iic_soft_stretched(volatile iic_soft_t *bus){
+	if(++bus -> stretch_count > bus -> stretch_max){
+		iic_soft_abort(bus, IIC_BUS_ERROR);
+		return true;
+	}
+	return false;
+}
+
+static void iic_soft_send_stop(volatile iic_soft_t *bus, iic_error_t error){
+	bus -> error = error;
+	iic_soft_scl(bus, false);
+	iic_soft_sda(bus, false);
+	bus -> state = IIC_SOFT_STOP_SCL;
+}
+
+static void iic_soft_send_restart(volatile iic_soft_t *bus){
+	iic_soft_scl(bus, false);
+	iic_soft_sda(bus, true);
+	bus -> state = IIC_SOFT_RESTART_SCL;
+}
+
+// Queues the next byte of this half of the transaction, or ends it.
+static void iic_soft_next(volatile iic_soft_t *bus){
+	iic_transaction_t *transaction = bus -> current;
+	if(bus -> len_left != 0){
+		if(bus -> reading){
+			bus -> stage = IIC_SOFT_STAGE_READ;
+			iic_soft_load_rx(bus);
+		}else{
+			bus -> stage = IIC_SOFT_STAGE_WRITE;
+			iic_soft_load_tx(bus, *iic_soft_next_byte(bus));
+		}
+		bus -> state = IIC_SOFT_BIT_LOW;
+	}else if(!bus -> reading && transaction -> read_len != 0){
+		// write half done - repeated START into the read half
+		bus -> reading = true;
+		iic_soft_use(bus, transaction -> read_buffer, transaction -> read_len, NULL, 0);
+		iic_soft_load_address(bus);
+		iic_soft_send_restart(bus);
+	}else{
+		iic_soft_send_stop(bus, IIC_NO_ERROR);
+	}
+}
+
+// All 9 bits of a byte are in: act on the ACK (or store the data).
+static void iic_soft_byte_done(volatile iic_soft_t *bus){
+	bool ack = !(bus -> rx_bits & 1);
+	switch(bus -> stage){
+		case IIC_SOFT_STAGE_ADDRESS:
+			if(ack){
+				bus -> retry_count = 0;
+				iic_soft_next(bus);
+			}else if((bus -> current -> flags & IIC_FLAG_NO_RETRY) || bus -> retry_count++ >= bus -> retry_max){
+				iic_soft_send_stop(bus, bus -> reading ? IIC_MR_ADDR_NACK : IIC_MT_ADDR_NACK);
+			}else{
+				iic_soft_load_address(bus);
+				iic_soft_send_restart(bus); // retry
+			}
+			break;
+
+		case IIC_SOFT_STAGE_WRITE:
+			if(ack){
+				bus -> retry_count = 0;
+				iic_soft_next(bus);
+			}else if(bus -> retry_count++ >= bus -> retry_max){
+				iic_soft_send_stop(bus, IIC_MT_DATA_NACK);
+			}else{
+				iic_soft_load_tx(bus, bus -> tx_bits >> 1); // send the same byte again
+				bus -> state = IIC_SOFT_BIT_LOW;
+			}
+			break;
+
+		case IIC_SOFT_STAGE_READ:
+			*iic_soft_next_byte(bus) = bus -> rx_bits >> 1;
+			iic_soft_next(bus);
+			break;
+	}
+}
+
+// Advances the bus by half an SCL period. Call from a timer interrupt at
+// IIC_SOFT_TICK_HZ(scl_hz) * tick_divider.
+void iic_soft_tick(volatile iic_soft_t *bus){
+	if(bus -> state == IIC_SOFT_IDLE || ++bus -> tick_count < bus -> tick_divider){
+		return;
+	}
+	bus -> tick_count = 0;
+
+	switch(bus -> state){
+		case IIC_SOFT_IDLE:
+			break;
+
+		case IIC_SOFT_START:
+			if(!iic_soft_scl_high(bus) || !iic_soft_sda_high(bus)){
+				iic_soft_stretched(bus); // someone else is using the bus
+				break;
+			}
+			bus -> stretch_count = 0;
+			iic_soft_sda(bus, false);
+			bus -> state = IIC_SOFT_BIT_LOW;
+			break;
+
+		case IIC_SOFT_BIT_LOW:
+			if(bus -> bit_count != 0){
+				// SCL was released last tick - sample the bit once the slave lets it go high
+				if(!iic_soft_scl_high(bus)){
+					iic_soft_stretched(bus);
+					break;
+				}
+				bus -> stretch_count = 0;
+				bool bit = iic_soft_sda_high(bus);
+				if(bus -> stage != IIC_SOFT_STAGE_READ && bus -> bit_count < 9 && !bit && ((bus -> tx_bits >> (9 - bus -> bit_count)) & 1)){
+					// we released SDA for a 1 but it's low: another master is on the bus
+					iic_soft_abort(bus, bus -> reading ? IIC_MR_ARBITRATION_LOST : IIC_MT_ARBITRATION_LOST);
+					break;
+				}
+				bus -> rx_bits = (bus -> rx_bits << 1) | bit;
+				if(bus -> bit_count == 9){
+					iic_soft_byte_done(bus);
+					if(bus -> state != IIC_SOFT_BIT_LOW){
+						break;
+					}
+				}
+			}
+			iic_soft_scl(bus, false);
+			iic_soft_sda(bus, (bus -> tx_bits >> (8 - bus -> bit_count)) & 1);
+			bus -> bit_count++;
+			bus -> state = IIC_SOFT_BIT_HIGH;
+			break;
+
+		case IIC_SOFT_BIT_HIGH:
+			iic_soft_scl(bus, true);
+			bus -> state = IIC_SOFT_BIT_LOW;
+			break;
+
+		case IIC_SOFT_STOP_SCL:
+			iic_soft_scl(bus, true);
+			bus -> state = IIC_SOFT_STOP_SDA;
+			break;
+
+		case IIC_SOFT_STOP_SDA:
+			if(!iic_soft_scl_high(bus)){
+				iic_soft_stretched(bus);
+				break;
+			}
+			iic_soft_sda(bus, true);
+			iic_soft_finish(bus, bus -> error);
+			break;
+
+		case IIC_SOFT_RESTART_SCL:
+			iic_soft_scl(bus, true);
+			bus -> state = IIC_SOFT_RESTART_SDA;
+			break;
+
+		case IIC_SOFT_RESTART_SDA:
+			if(!iic_soft_scl_high(bus)){
+				iic_soft_stretched(bus);
+				break;
+			}
+			bus -> stretch_count = 0;
+			iic_soft_sda(bus, false);
+			bus -> state = IIC_SOFT_BIT_LOW;
+			break;
+	}
+}
+
+// Queues a transaction on the software bus, as iic_enqueue does for the
+// hardware one. Returns false if the queue is full.
+bool iic_soft_enqueue(volatile iic_soft_t *bus, iic_transaction_t *transaction){
+	bool queued = false;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		uint8_t next_tail = (bus -> queue_tail + 1) & (IIC_SOFT_QUEUE_LEN - 1);
+		if(next_tail != bus -> queue_head){
+			transaction -> pending = true;
+			transaction -> error = IIC_NO_ERROR;
+			transaction -> iic = NULL;
+			bus -> queue[bus -> queue_tail] = transaction;
+			bus -> queue_tail = next_tail;
+			queued = true;
+
+			if(bus -> state == IIC_SOFT_IDLE && iic_soft_load_next(bus)){
+				bus -> state = IIC_SOFT_START;
+			}
+		}
+	}
+	return queued;
+}
+
+// Fills in bus->direct and queues it. Returns false if the last direct
+// transfer hasn't finished or the queue is full.
+static bool iic_soft_direct(
+	volatile iic_soft_t *bus,
+	uint8_t remote_address,
+	iic_state_t direction,
+	uint8_t *buffer,
+	iic_len_t buffer_len,
+	uint8_t *read_buffer,
+	iic_len_t read_len
+){
+	iic_transaction_t *transaction = (iic_transaction_t*)&bus -> direct;
+	if(transaction -> pending){
+		return false;
+	}
+	transaction -> remote_address = remote_address;
+	transaction -> direction = direction;
+	transaction -> buffer = buffer;
+	transaction -> buffer_len = buffer_len;
+	transaction -> segments = NULL;
+	transaction -> read_buffer = read_buffer;
+	transaction -> read_len = read_len;
+	transaction -> flags = 0;
+	transaction -> callback = NULL;
+	return iic_soft_enqueue(bus, transaction);
+}
+
+// The software-bus versions of iic_write_many, iic_read_many and
+// iic_write_read. They return straight away; the result is in
+// bus->direct.error once IIC_EVENT_MASTER_DONE or _ERROR comes up.
+bool iic_soft_write_many(volatile iic_soft_t *bus, uint8_t remote_address, uint8_t *data_buffer, iic_len_t buffer_len){
+	return iic_soft_direct(bus, remote_address, IIC_MASTER_TRANSMITTER, data_buffer, buffer_len, NULL, 0);
+}
+
+bool iic_soft_read_many(volatile iic_soft_t *bus, uint8_t remote_address, uint8_t *buffer, iic_len_t buffer_len){
+	return iic_soft_direct(bus, remote_address, IIC_MASTER_RECEIVER, buffer, buffer_len, NULL, 0);
+}
+
+bool iic_soft_write_read(volatile iic_soft_t *bus, uint8_t remote_address, uint8_t *write_buffer, iic_len_t write_len, uint8_t *read_buffer, iic_len_t read_len){
+	return iic_soft_direct(bus, remote_address, IIC_MASTER_TRANSMITTER, write_buffer, write_len, read_buffer, read_len);
+}
+
+// Returns the events in mask that have happened since they were last
+// taken, and clears them.
+uint8_t iic_soft_take_events(volatile iic_soft_t *bus, uint8_t mask){
+	uint8_t events;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		events = bus -> events & mask;
+		bus -> events &= ~events;
+	}
+	return events;
+}
+
+// The software back end of iic_bus_t.
+static bool iic_soft_bus_enqueue(volatile void *port, iic_transaction_t *transaction){
+	return iic_soft_enqueue(port, transaction);
+}
+
+static uint8_t iic_soft_bus_take_events(volatile void *port, uint8_t mask){
+	return iic_soft_take_events(port, mask);
+}
+
+const iic_bus_ops_t iic_soft_bus_ops = {iic_soft_bus_enqueue, iic_soft_bus_take_events};
@@ -0,0 +1,117 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_api.c
+ * bus time, TWI interrupts and payload throughput of each master call
+ *
+ * Every call is run RUNS times against a simulated device, from the call
+ * until the STOP is off the wire. bytes/s counts payload only (no address
+ * bytes), over that whole time.
+ */
+
+#include <stdio.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define RUNS 50
+#define LEN 16
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+static uint8_t buffer[LEN];
+static uint8_t read_buffer[LEN];
+static iic_transaction_t queued[4];
+
+typedef struct bench_t{
+	const char *name;
+	int bytes; // payload per run
+	void (*run)(void);
+} bench_t;
+
+static void run_write_one(void){ iic_write_one(&IIC_MODULE, 0x50, 0xA5); }
+static void run_write_two(void){ iic_write_two(&IIC_MODULE, 0x50, 0xA5, 0x5A); }
+static void run_write_many(void){ iic_write_many(&IIC_MODULE, 0x50, buffer, LEN); }
+static void run_read_one(void){ iic_read_one(&IIC_MODULE, 0x50); }
+static void run_read_two(void){ iic_read_two(&IIC_MODULE, 0x50); }
+static void run_read_many(void){ iic_read_many(&IIC_MODULE, 0x50, read_buffer, LEN); }
+static void run_write_read(void){ iic_write_read(&IIC_MODULE, 0x50, buffer, 1, read_buffer, LEN); }
+
+static void run_write_segments(void){
+	static const iic_segment_t segments[] = {{buffer, 1}, {buffer + 1, 7}, {buffer + 8, 8}};
+	iic_write_segments(&IIC_MODULE, 0x50, segments, 3);
+}
+
+static void run_enqueue(void){
+	for(int dex = 0; dex < 4; dex++){
+		queued[dex] = (iic_transaction_t){.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = buffer, .buffer_len = LEN};
+		iic_enqueue(&IIC_MODULE, &queued[dex]);
+	}
+}
+
+static const bench_t benches[] = {
+	{"iic_write_one", 1, run_write_one},
+	{"iic_write_two", 2, run_write_two},
+	{"iic_write_many", LEN, run_write_many},
+	{"iic_write_segments", LEN, run_write_segments},
+	{"iic_read_one", 1, run_read_one},
+	{"iic_read_two", 2, run_read_two},
+	{"iic_read_many", LEN, run_read_many},
+	{"iic_write_read", 1 + LEN, run_write_read},
+	{"iic_enqueue x4", 4 * LEN, run_enqueue}
+};
+
+static void bench_speed(uint32_t scl_hz){
+	iic_set_bus_speed(&IIC_MODULE, F_CPU, scl_hz);
+	printf("\n%lu kHz SCL, %llu cycles per TWI interrupt\n", (unsigned long)(scl_hz / 1000), (unsigned long long)local -> isr_cycles);
+	printf("%-20s %6s %10s %10s %12s %10s\n", "api", "bytes", "bus us", "total us", "interrupts", "bytes/s");
+	for(size_t dex = 0; dex < sizeof(benches) / sizeof(benches[0]); dex++){
+		const bench_t *bench = &benches[dex];
+		sim_time_t busy = bus -> busy_cycles;
+		uint64_t entries = local -> isr_entries;
+		sim_time_t start = sim_now();
+		for(int run = 0; run < RUNS; run++){
+			bench -> run();
+			sim_wait_master(&IIC_MODULE, bus, SIM_MS(50));
+			SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "%s failed with %d", bench -> name, IIC_MODULE.error_state);
+		}
+		double total = (double)(sim_now() - start) / RUNS;
+		double bus_time = (double)(bus -> busy_cycles - busy) / RUNS;
+		printf("%-20s %6d %10.1f %10.1f %12.1f %10.0f\n", bench -> name, bench -> bytes,
+			bus_time * 1e6 / SIM_F_CPU, total * 1e6 / SIM_F_CPU,
+			(double)(local -> isr_entries - entries) / RUNS, bench -> bytes * (double)SIM_F_CPU / total);
+	}
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	sim_device_new(bus, 0x50);
+	for(int dex = 0; dex < LEN; dex++){
+		buffer[dex] = dex * 17;
+	}
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+	printf("bench_api: master calls against one device");
+	bench_speed(100000UL);
+	bench_speed(400000UL);
+	return 0;
+}
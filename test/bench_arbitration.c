@@ -0,0 +1,153 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_arbitration.c
+ * goodput and starvation with 1-4 masters saturating one 400 kHz bus
+ *
+ * Every master keeps one 16-byte write (plus the register pointer) to its
+ * own EEPROM queued at all times, re-queueing it from the callback, so
+ * every STOP is followed by STARTs from all of them. The EEPROMs sit at
+ * 0x50 upwards, master 0 writing to the lowest address.
+ *
+ * Per master: writes completed, payload goodput, the longest time between
+ * two of its writes completing (starvation) and arbitration losses (TWSR
+ * 0x38).
+ */
+
+#include <stdio.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define MASTERS 4
+#define RUN SIM_MS(200)
+#define WATCHDOG_TICK SIM_US(100)
+#define PAYLOAD 16
+
+typedef struct master_t{
+	sim_node_t *node;
+	struct sim_twi_t *twi;
+	sim_api_t api;
+	iic_transaction_t transaction;
+	uint8_t data[PAYLOAD + 1];
+	bool running;
+	uint32_t done;
+	uint32_t failed;
+	sim_time_t last_done;
+	sim_time_t max_gap;
+} master_t;
+
+static sim_bus_t *bus;
+static master_t masters[MASTERS];
+
+static master_t *master_of(iic_transaction_t *transaction){
+	return (master_t*)((char*)transaction - offsetof(master_t, transaction));
+}
+
+static void write_done(iic_transaction_t *transaction, iic_error_t error){
+	master_t *master = master_of(transaction);
+	if(error == IIC_NO_ERROR){
+		master -> done++;
+		sim_time_t gap = sim_now() - master -> last_done;
+		if(gap > master -> max_gap){
+			master -> max_gap = gap;
+		}
+		master -> last_done = sim_now();
+	}else{
+		master -> failed++;
+	}
+	if(master -> running){
+		master -> api.enqueue(master -> api.module, transaction);
+	}
+}
+
+// sim_every takes a plain function, so one per master
+#define TICK(m) static void tick_##m(void){ masters[m].api.watchdog_tick(masters[m].api.module); }
+TICK(0) TICK(1) TICK(2) TICK(3)
+static void (*const ticks[MASTERS])(void) = {tick_0, tick_1, tick_2, tick_3};
+
+static double us(sim_time_t cycles){
+	return (double)cycles * 1e6 / SIM_F_CPU;
+}
+
+static void bench(int count){
+	for(int dex = 0; dex < count; dex++){
+		master_t *master = &masters[dex];
+		master -> done = master -> failed = 0;
+		master -> max_gap = 0;
+		master -> last_done = sim_now();
+		master -> running = true;
+		sim_twi_reset_counts(master -> twi);
+		master -> api.take_events(master -> api.module, 0xFF);
+	}
+	for(int dex = 0; dex < count; dex++){
+		master_t *master = &masters[dex];
+		master -> transaction = (iic_transaction_t){.remote_address = 0x50 + dex, .direction = IIC_MASTER_TRANSMITTER,
+			.buffer = master -> data, .buffer_len = PAYLOAD + 1, .callback = write_done};
+		master -> api.enqueue(master -> api.module, &master -> transaction);
+	}
+	sim_run(RUN);
+
+	uint32_t total = 0;
+	uint8_t recoveries = 0;
+	for(int dex = 0; dex < count; dex++){
+		master_t *master = &masters[dex];
+		master -> running = false;
+		if(sim_now() - master -> last_done > master -> max_gap){
+			master -> max_gap = sim_now() - master -> last_done; // still waiting at the end
+		}
+		total += master -> done;
+	}
+	for(int dex = 0; dex < count; dex++){
+		sim_wait_master(masters[dex].api.module, bus, SIM_MS(50));
+		recoveries |= masters[dex].api.take_events(masters[dex].api.module, IIC_EVENT_BUS_RECOVERY);
+	}
+	printf("%d master%s: goodput %.1f kB/s%s\n", count, count == 1 ? "" : "s",
+		(double)total * PAYLOAD * SIM_F_CPU / RUN / 1000, recoveries ? ", bus recovered (watchdog misfire)" : "");
+	for(int dex = 0; dex < count; dex++){
+		master_t *master = &masters[dex];
+		printf("  master %d %8lu %8lu %10.1f %10.1f %10llu\n", dex, (unsigned long)master -> done, (unsigned long)master -> failed,
+			(double)master -> done * PAYLOAD * SIM_F_CPU / RUN / 1000, us(master -> max_gap),
+			(unsigned long long)sim_twi_entries(master -> twi, 0x38));
+	}
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	for(int dex = 0; dex < MASTERS; dex++){
+		master_t *master = &masters[dex];
+		char name[16];
+		snprintf(name, sizeof(name), "master%d", dex);
+		master -> node = sim_node_load("test/build/fw_node.so", name);
+		master -> twi = sim_connect_twi(master -> node, 0, bus);
+		sim_every(master -> node, WATCHDOG_TICK, ticks[dex]);
+		sim_api_load(master -> node, &master -> api);
+		master -> api.setup(master -> api.module, 0x10 + dex, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+		master -> api.enable(master -> api.module);
+		for(int byte = 0; byte <= PAYLOAD; byte++){
+			master -> data[byte] = byte == 0 ? 0x00 : 0x10 * dex + byte;
+		}
+		sim_device_new(bus, 0x50 + dex) -> pointer_bytes = 1;
+	}
+
+	printf("bench_arbitration: %d-byte writes back to back from every master, 400 kHz, %.0f ms per row\n", PAYLOAD, us(RUN) / 1000);
+	printf("  %-8s %8s %8s %10s %10s %10s\n", "", "writes", "failed", "kB/s", "max gap us", "arb lost");
+	for(int count = 1; count <= MASTERS; count++){
+		bench(count);
+	}
+	return 0;
+}
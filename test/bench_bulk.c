@@ -0,0 +1,87 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_bulk.c
+ * one IIC_BULK_TRANSFERS transaction against the same data in chunks
+ *
+ * A 4 KiB framebuffer goes to a device with a 16-bit memory pointer,
+ * through iic_eeprom_write: with page_size = 4096 it is one transaction,
+ * with smaller pages it is one queued transaction per chunk, each with
+ * its own START, address and pointer - what a uint8_t iic_len_t build
+ * has to do (253 bytes + 2 pointer bytes at most).
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define FRAME 4096
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+static sim_device_t *display;
+static uint8_t frame[FRAME];
+
+static int job_done(void *arg){
+	return !((iic_eeprom_write_t*)arg) -> pending && !bus -> busy;
+}
+
+static void bench_chunk(uint16_t chunk){
+	static iic_eeprom_write_t job;
+	sim_time_t start = sim_now();
+	sim_time_t busy = bus -> busy_cycles;
+	uint64_t entries = local -> isr_entries;
+	uint64_t starts = bus -> starts;
+	memset(display -> mem, 0, FRAME);
+
+	SIM_CHECK(iic_eeprom_write(&IIC_MODULE, &job, 0x3C, 0x0000, frame, FRAME, chunk, NULL), "couldn't queue");
+	SIM_CHECK(sim_run_until(job_done, &job, SIM_MS(2000)), "chunk %u: still running", chunk);
+	SIM_CHECK(memcmp(display -> mem, frame, FRAME) == 0, "chunk %u: frame came out wrong", chunk);
+
+	double seconds = (double)(sim_now() - start) / SIM_F_CPU;
+	printf("%-10u %12llu %10.2f %10.2f %12llu %10.0f\n", chunk, (unsigned long long)(bus -> starts - starts),
+		(double)(bus -> busy_cycles - busy) * 1e3 / SIM_F_CPU, seconds * 1e3,
+		(unsigned long long)(local -> isr_entries - entries), FRAME / seconds);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	display = sim_device_new(bus, 0x3C);
+	display -> pointer_bytes = 2;
+	for(int dex = 0; dex < FRAME; dex++){
+		frame[dex] = dex ^ (dex >> 8);
+	}
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	printf("bench_bulk: %d-byte frame at 400 kHz, %llu cycles per TWI interrupt\n", FRAME, (unsigned long long)local -> isr_cycles);
+	printf("%-10s %12s %10s %10s %12s %10s\n", "chunk", "transactions", "bus ms", "total ms", "interrupts", "bytes/s");
+	bench_chunk(32);
+	bench_chunk(64);
+	bench_chunk(128);
+	bench_chunk(253);
+	bench_chunk(FRAME);
+	return 0;
+}
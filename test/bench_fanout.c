@@ -0,0 +1,132 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_fanout.c
+ * getting one 4-byte frame to 8, 32 and 100 nodes: a unicast write to each
+ * member against a single iic_write_group multicast, at 400 kHz
+ *
+ * All 100 nodes (fw_node.so, buffered slaves) are on the bus in every
+ * round; only the round's members are in the group, so the others see the
+ * multicast too and have to drop it. Every member's ring is checked for
+ * the frame after each method.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/api.h>
+
+#define NODES 100
+#define GROUP 5
+
+extern const sim_image_t iic_sim_image;
+
+typedef struct node_t{
+	sim_node_t *node;
+	sim_api_t api;
+	void (*join_group)(volatile iic_t*, uint8_t);
+	void (*leave_group)(volatile iic_t*, uint8_t);
+	uint8_t ring[32];
+	uint8_t address;
+} node_t;
+
+static sim_bus_t *bus;
+static node_t nodes[NODES];
+static uint8_t payload[] = {IIC_COMMAND_LED_WRITE_WORD, 1, 0xCD, 0xAB};
+
+// The member got exactly the payload, with or without the multicast header;
+// non-members got nothing.
+static void check_delivery(int members, int multicast){
+	for(int dex = 0; dex < NODES; dex++){
+		uint8_t frame[8];
+		bool general_call;
+		uint8_t len = nodes[dex].api.slave_read_frame(nodes[dex].api.module, frame, sizeof(frame), &general_call);
+		if(dex >= members){
+			SIM_CHECK(len == 0, "node %d isn't a member but got a %d-byte frame", dex, len);
+			continue;
+		}
+		uint8_t *body = multicast ? frame + 2 : frame;
+		SIM_CHECK(len == sizeof(payload) + (multicast ? 2 : 0) && memcmp(body, payload, sizeof(payload)) == 0,
+			"node %d got a %d-byte frame", dex, len);
+		SIM_CHECK(!multicast || (general_call && frame[0] == IIC_COMMAND_GROUP_MULTICAST && frame[1] == GROUP), "node %d: bad multicast header", dex);
+	}
+}
+
+static void bench_fanout(int members){
+	for(int dex = 0; dex < NODES; dex++){
+		if(dex < members){
+			nodes[dex].join_group(nodes[dex].api.module, GROUP);
+		}else{
+			nodes[dex].leave_group(nodes[dex].api.module, GROUP);
+		}
+	}
+
+	sim_time_t start = sim_now();
+	uint64_t bytes = bus -> address_bytes + bus -> data_bytes;
+	for(int dex = 0; dex < members; dex++){
+		iic_write_many(&IIC_MODULE, nodes[dex].address, payload, sizeof(payload));
+		sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+		SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "unicast to %02x: error %d", nodes[dex].address, IIC_MODULE.error_state);
+	}
+	sim_time_t unicast = sim_now() - start;
+	uint64_t unicast_bytes = bus -> address_bytes + bus -> data_bytes - bytes;
+	check_delivery(members, 0);
+
+	start = sim_now();
+	bytes = bus -> address_bytes + bus -> data_bytes;
+	iic_write_group(&IIC_MODULE, GROUP, payload, sizeof(payload));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "multicast: error %d", IIC_MODULE.error_state);
+	sim_time_t multicast = sim_now() - start;
+	uint64_t multicast_bytes = bus -> address_bytes + bus -> data_bytes - bytes;
+	check_delivery(members, 1);
+
+	printf("%8d %12.1f %8llu %12.1f %8llu %9.1fx\n", members, (double)unicast * 1e6 / SIM_F_CPU, (unsigned long long)unicast_bytes,
+		(double)multicast * 1e6 / SIM_F_CPU, (unsigned long long)multicast_bytes, (double)unicast / multicast);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "master");
+	sim_connect_twi(local, 0, bus);
+	setup_iic(&IIC_MODULE, 0x7F, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	for(int dex = 0; dex < NODES; dex++){
+		char name[16];
+		snprintf(name, sizeof(name), "node%d", dex);
+		node_t *node = &nodes[dex];
+		node -> node = sim_node_load("test/build/fw_node.so", strdup(name));
+		sim_connect_twi(node -> node, 0, bus);
+		sim_api_load(node -> node, &node -> api);
+		node -> join_group = sim_node_symbol(node -> node, "iic_join_group");
+		node -> leave_group = sim_node_symbol(node -> node, "iic_leave_group");
+		node -> address = 0x08 + dex;
+		node -> api.setup(node -> api.module, node -> address, true, true, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+		node -> api.slave_buffers(node -> api.module, node -> ring, sizeof(node -> ring), NULL);
+		node -> api.enable(node -> api.module);
+	}
+
+	printf("bench_fanout: one %d-byte frame to every member, %d nodes on the bus, 400 kHz\n", (int)sizeof(payload), NODES);
+	printf("%8s %12s %8s %12s %8s %10s\n", "members", "unicast us", "bytes", "group us", "bytes", "speedup");
+	bench_fanout(8);
+	bench_fanout(32);
+	bench_fanout(100);
+	return 0;
+}
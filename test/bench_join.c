@@ -0,0 +1,160 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_join.c
+ * time until every board is addressed when 10, 25 and 50 address clients
+ * (fw_client.so) power up in the same cycle, at 100 kHz
+ *
+ * Each round uses fresh boards; the previous round's boards are switched
+ * off but keep their addresses, so the server fills up as it would on a
+ * real bus. "p50" is when half the round's boards had their address; "left
+ * over" is addresses out beyond the round's boards once the server's reply
+ * window (IIC_ADDRESS_OFFER_TICKS) has passed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/api.h>
+
+#define MAX_CLIENTS 50
+#define CLIENT_TICK SIM_MS(1)
+#define SERVER_TICK SIM_MS(10)
+
+extern const sim_image_t iic_sim_image;
+extern volatile uint8_t address_arr[16];
+
+typedef struct client_t{
+	sim_node_t *node;
+	sim_api_t api;
+	void (*start)(uint16_t, uint8_t, iic_prescaler_t);
+	address_client_state_t (*state)(void);
+	sim_time_t addressed_at;
+} client_t;
+
+static sim_bus_t *bus;
+static uint8_t ring[64];
+static int loaded;
+
+static void server_frames(volatile iic_t *iic){
+	uint8_t frame[8];
+	uint8_t len;
+	while((len = iic_slave_read_frame(iic, frame, sizeof(frame), NULL)) != 0){
+		if(!handle_address_negotiation(frame[0], len > 2 ? frame[1] | frame[2] << 8 : 0) && len > 1){
+			handle_address_release(frame[0], frame[1]);
+		}
+	}
+}
+
+static void server_tick(void){
+	address_server_tick();
+}
+
+static void server_watchdog(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static void client_load(client_t *client){
+	char name[16];
+	snprintf(name, sizeof(name), "client%d", loaded++);
+	client -> node = sim_node_load("test/build/fw_client.so", strdup(name));
+	sim_connect_twi(client -> node, 0, bus);
+	sim_api_load(client -> node, &client -> api);
+	client -> start = sim_node_symbol(client -> node, "fw_client_start");
+	client -> state = sim_node_symbol(client -> node, "address_client_state");
+	sim_every(client -> node, CLIENT_TICK, sim_node_symbol(client -> node, "fw_client_tick"));
+	sim_every(client -> node, SIM_US(100), sim_node_symbol(client -> node, "fw_watchdog"));
+}
+
+static int count_allocated(void){
+	int count = 0;
+	for(uint8_t address = 0x08; address <= 0x77; address++){
+		count += (address_arr[address >> 3] >> (address & 0x07)) & 1;
+	}
+	return count;
+}
+
+typedef struct round_t{
+	client_t *clients;
+	int count;
+	int addressed;
+} round_t;
+
+// Notes when each board got its address; done once they all have.
+static int all_addressed(void *arg){
+	round_t *round = arg;
+	for(int dex = 0; dex < round -> count; dex++){
+		client_t *client = &round -> clients[dex];
+		if(client -> addressed_at == 0 && client -> state() == ADDRESS_CLIENT_ADDRESSED){
+			client -> addressed_at = sim_now();
+			round -> addressed++;
+		}
+	}
+	return round -> addressed == round -> count;
+}
+
+static int by_time(const void *a, const void *b){
+	sim_time_t x = ((const client_t*)a) -> addressed_at, y = ((const client_t*)b) -> addressed_at;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_round(int count, uint16_t first_id){
+	static client_t clients[MAX_CLIENTS];
+	memset(clients, 0, sizeof(clients));
+	for(int dex = 0; dex < count; dex++){
+		client_load(&clients[dex]);
+	}
+	int allocated = count_allocated();
+	uint64_t starts = bus -> starts;
+	sim_time_t start = sim_now();
+	for(int dex = 0; dex < count; dex++){
+		clients[dex].start(first_id + 77 * dex, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL));
+	}
+	round_t round = {clients, count, 0};
+	SIM_CHECK(sim_run_until(all_addressed, &round, SIM_MS(5000)), "%d of %d boards addressed", round.addressed, count);
+	sim_time_t all = sim_now() - start;
+	sim_run(SERVER_TICK * (IIC_ADDRESS_OFFER_TICKS + 2));
+
+	qsort(clients, count, sizeof(client_t), by_time);
+	sim_time_t p50 = clients[(count - 1) / 2].addressed_at - start;
+	printf("%8d %10.1f %10.1f %10llu %10d\n", count, (double)p50 * 1e3 / SIM_F_CPU, (double)all * 1e3 / SIM_F_CPU,
+		(unsigned long long)(bus -> starts - starts), count_allocated() - allocated - count);
+
+	for(int dex = 0; dex < count; dex++){
+		clients[dex].api.disable(clients[dex].api.module); // off the bus for the next round
+	}
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *server = sim_node_attach(&iic_sim_image, "server");
+	sim_connect_twi(server, 0, bus);
+	sim_every(server, SERVER_TICK, server_tick);
+	sim_every(server, SIM_US(100), server_watchdog);
+	setup_iic(&IIC_MODULE, IIC_ADDRESS_SERVER_ADDRESS, true, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), server_frames);
+	enable_iic(&IIC_MODULE);
+
+	printf("bench_join: boards powering up together, client tick %d ms, 100 kHz\n", (int)(CLIENT_TICK * 1000 / SIM_F_CPU));
+	printf("%8s %10s %10s %10s %10s\n", "boards", "p50 ms", "all ms", "STARTs", "left over");
+	bench_round(10, 0x1000);
+	bench_round(25, 0x2000);
+	bench_round(50, 0x3000);
+	return 0;
+}
@@ -0,0 +1,209 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_poll.c
+ * sampling jitter and CPU load of the polling engine (iic_poll_tick from a
+ * 1 kHz timer) with three sensors, at 400 kHz
+ *
+ * The sample instant is the read address going out on the bus; its delay
+ * from the tick that queued it is measured per job. Rows: the jobs alone;
+ * against back-to-back 250-byte display writes on one queue; with the jobs
+ * IIC_FLAG_URGENT; and urgent with the display writes split every 8 bytes.
+ *
+ * CPU load is the interrupt time the simulator charges (isr_cycles per TWI
+ * interrupt) over the elapsed time. With sim_icount the host instructions
+ * per iic_poll_tick call are shown as well; like bench_slave's figures they
+ * compare rows with each other, not with an AVR. The overrun counter stops
+ * at 255 (shown as 255+).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define TICKS 1000
+#define JOBS 3
+#define DISPLAY_LEN 250
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+
+static const struct{
+	const char *name;
+	uint8_t address;
+	uint8_t reg;
+	iic_len_t len;
+	uint16_t period;
+	uint16_t first;
+} sensors[JOBS] = {
+	{"imu 1 ms", 0x68, 0x3B, 6, 1, 1},
+	{"magnetometer 10 ms", 0x1E, 0x03, 6, 10, 4},
+	{"barometer 20 ms", 0x77, 0xF7, 3, 20, 7}
+};
+
+static iic_poll_t jobs[JOBS];
+static uint8_t buffers[JOBS][12];
+static sim_time_t queued_at[JOBS];
+static bool waiting[JOBS]; // queued, read address not seen yet
+static sim_time_t delay[JOBS][TICKS];
+static int samples[JOBS];
+static bool sampling;
+static uint64_t tick_calls, tick_instructions, tick_instructions_max;
+
+static uint8_t display_data[DISPLAY_LEN];
+static iic_transaction_t display;
+static bool display_on;
+
+// Timer interrupt: the polling engine's tick.
+static void poll_tick(void){
+	bool before[JOBS];
+	for(int dex = 0; dex < JOBS; dex++){
+		before[dex] = jobs[dex].transaction.pending;
+	}
+	if(sim_icount_on){
+		sim_icount_begin();
+		iic_poll_tick();
+		uint64_t count = sim_icount_end();
+		tick_calls++;
+		tick_instructions += count;
+		if(count > tick_instructions_max){
+			tick_instructions_max = count;
+		}
+	}else{
+		iic_poll_tick();
+	}
+	for(int dex = 0; dex < JOBS; dex++){
+		if(!before[dex] && jobs[dex].transaction.pending){
+			queued_at[dex] = sim_now();
+			waiting[dex] = sampling;
+		}
+	}
+}
+
+// Bus monitor: a job's sample is taken when its read address goes out.
+static void watch(sim_bus_t *bus, int event, uint8_t byte, int ack, void *ctx){
+	if(event != SIM_EVENT_ADDRESS){
+		return;
+	}
+	for(int dex = 0; dex < JOBS; dex++){
+		if(waiting[dex] && byte == (sensors[dex].address << 1 | 1)){
+			waiting[dex] = false;
+			if(samples[dex] < TICKS){
+				delay[dex][samples[dex]++] = sim_now() - queued_at[dex];
+			}
+		}
+	}
+}
+
+static void display_done(iic_transaction_t *transaction, iic_error_t error){
+	SIM_CHECK(error == IIC_NO_ERROR, "display write failed with %d", error);
+	if(display_on){
+		iic_enqueue(&IIC_MODULE, &display);
+	}
+}
+
+static void watchdog(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static int by_value(const void *a, const void *b){
+	sim_time_t x = *(const sim_time_t*)a, y = *(const sim_time_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double us(sim_time_t cycles){
+	return (double)cycles * 1e6 / SIM_F_CPU;
+}
+
+static void bench(const char *name, bool contention, uint8_t job_flags, uint8_t display_flags, iic_len_t chunk){
+	for(int dex = 0; dex < JOBS; dex++){
+		iic_poll_setup(&jobs[dex], sensors[dex].address, sensors[dex].reg, buffers[dex], sensors[dex].len, sensors[dex].period, sensors[dex].first, job_flags);
+		samples[dex] = 0;
+		waiting[dex] = false;
+	}
+	display = (iic_transaction_t){.remote_address = 0x3C, .direction = IIC_MASTER_TRANSMITTER, .buffer = display_data, .buffer_len = DISPLAY_LEN,
+		.flags = display_flags, .callback = display_done};
+	iic_set_preempt_chunk(&IIC_MODULE, chunk);
+	display_on = contention;
+	if(contention){
+		iic_enqueue(&IIC_MODULE, &display);
+	}
+	tick_calls = tick_instructions = tick_instructions_max = 0;
+	sim_time_t busy = local -> isr_busy;
+	uint64_t entries = local -> isr_entries;
+	sim_time_t start = sim_now();
+	sampling = true;
+	iic_poll_start(&IIC_MODULE, jobs, JOBS);
+	sim_run(SIM_MS(TICKS));
+	iic_poll_stop();
+	sampling = false;
+	sim_time_t elapsed = sim_now() - start;
+	busy = local -> isr_busy - busy;
+	entries = local -> isr_entries - entries;
+	display_on = false;
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(20));
+
+	printf("%s: CPU %.2f%% in TWI interrupts (%.0f per second)", name, 100.0 * busy / elapsed, (double)entries * SIM_F_CPU / elapsed);
+	if(tick_calls != 0){
+		printf(", iic_poll_tick %.1f host instructions avg, %llu max", (double)tick_instructions / tick_calls, (unsigned long long)tick_instructions_max);
+	}
+	printf("\n");
+	for(int dex = 0; dex < JOBS; dex++){
+		int n = samples[dex];
+		SIM_CHECK(n > 0, "%s: no samples from %s", name, sensors[dex].name);
+		SIM_CHECK(jobs[dex].error == IIC_NO_ERROR, "%s: %s failed with %d", name, sensors[dex].name, jobs[dex].error);
+		qsort(delay[dex], n, sizeof(sim_time_t), by_value);
+		printf("  %-22s %8d %7d%c %8.1f %8.1f %8.1f %8.1f\n", sensors[dex].name, n, jobs[dex].overruns, jobs[dex].overruns == 0xFF ? '+' : ' ',
+			us(delay[dex][0]), us(delay[dex][n / 2]), us(delay[dex][n * 99 / 100]), us(delay[dex][n - 1] - delay[dex][0]));
+	}
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	bus -> watch = watch;
+	local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	sim_every(local, SIM_MS(1), poll_tick);
+	sim_every(local, SIM_US(100), watchdog);
+	for(int dex = 0; dex < JOBS; dex++){
+		sim_device_new(bus, sensors[dex].address) -> pointer_bytes = 1;
+	}
+	sim_device_new(bus, 0x3C);
+	for(int dex = 0; dex < DISPLAY_LEN; dex++){
+		display_data[dex] = dex;
+	}
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	printf("bench_poll: three polled sensors on a 1 kHz tick, 400 kHz, %d ticks per row\n", TICKS);
+	if(!sim_icount_enable()){
+		printf("(no instruction counts: sim_icount needs ptrace on x86-64 Linux)\n");
+	}
+	printf("  %-22s %8s %8s %8s %8s %8s %8s\n", "delay from tick, us", "samples", "overruns", "min", "p50", "p99", "jitter");
+	bench("alone", false, 0, 0, 0);
+	bench("display writes, one queue", true, 0, 0, 0);
+	bench("display writes, jobs urgent", true, IIC_FLAG_URGENT, 0, 0);
+	bench("jobs urgent, preempt every 8", true, IIC_FLAG_URGENT, IIC_FLAG_PREEMPTIBLE, 8);
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_priority.c
+ * latency of a 1 kHz IMU read (register pointer + 6 bytes) while a display
+ * takes back-to-back 250-byte writes, at 400 kHz
+ *
+ * Latency runs from iic_enqueue in the timer interrupt to the completion
+ * callback. Rows: the IMU alone; with the display, on one queue; as
+ * IIC_FLAG_URGENT without preemption (it waits for the write on the bus);
+ * and urgent with the display writes IIC_FLAG_PREEMPTIBLE at two chunk
+ * sizes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define SAMPLES 500
+#define DISPLAY_LEN 250
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+
+static uint8_t imu_register = 0x3B;
+static uint8_t imu_data[6];
+static iic_transaction_t imu;
+static sim_time_t imu_queued;
+static sim_time_t latency[SAMPLES];
+static int samples, missed;
+static bool sampling;
+
+static uint8_t display_data[DISPLAY_LEN];
+static iic_transaction_t display;
+static bool display_on;
+
+static void imu_done(iic_transaction_t *transaction, iic_error_t error){
+	SIM_CHECK(error == IIC_NO_ERROR, "IMU read failed with %d", error);
+	if(samples < SAMPLES){
+		latency[samples++] = sim_now() - imu_queued;
+	}
+}
+
+// Timer interrupt: one IMU read per millisecond.
+static void imu_tick(void){
+	if(!sampling){
+		return;
+	}
+	if(imu.pending){
+		missed++;
+		return;
+	}
+	imu_queued = sim_now();
+	SIM_CHECK(iic_enqueue(&IIC_MODULE, &imu), "IMU read not queued");
+}
+
+// Keeps the display writes coming, one after the other.
+static void display_done(iic_transaction_t *transaction, iic_error_t error){
+	SIM_CHECK(error == IIC_NO_ERROR, "display write failed with %d", error);
+	if(display_on){
+		iic_enqueue(&IIC_MODULE, &display);
+	}
+}
+
+static void watchdog(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static int by_value(const void *a, const void *b){
+	sim_time_t x = *(const sim_time_t*)a, y = *(const sim_time_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int all_samples(void *arg){
+	return samples == SAMPLES;
+}
+
+static void bench(const char *name, bool contention, uint8_t imu_flags, uint8_t display_flags, iic_len_t chunk){
+	imu = (iic_transaction_t){.remote_address = 0x68, .direction = IIC_MASTER_TRANSMITTER, .buffer = &imu_register, .buffer_len = 1,
+		.read_buffer = imu_data, .read_len = 6, .flags = imu_flags, .callback = imu_done};
+	display = (iic_transaction_t){.remote_address = 0x3C, .direction = IIC_MASTER_TRANSMITTER, .buffer = display_data, .buffer_len = DISPLAY_LEN,
+		.flags = display_flags, .callback = display_done};
+	iic_set_preempt_chunk(&IIC_MODULE, chunk);
+	samples = 0;
+	missed = 0;
+	display_on = contention;
+	if(contention){
+		iic_enqueue(&IIC_MODULE, &display);
+	}
+	sim_run(SIM_US(317)); // the IMU timer lands somewhere inside a write
+	sampling = true;
+	SIM_CHECK(sim_run_until(all_samples, NULL, SIM_MS(SAMPLES * 20)), "%s: %d samples", name, samples);
+	sampling = false;
+	display_on = false;
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(20));
+
+	qsort(latency, SAMPLES, sizeof(sim_time_t), by_value);
+	printf("%-28s %8.1f %8.1f %8.1f %8d\n", name, (double)latency[SAMPLES / 2] * 1e6 / SIM_F_CPU,
+		(double)latency[SAMPLES * 99 / 100] * 1e6 / SIM_F_CPU, (double)latency[SAMPLES - 1] * 1e6 / SIM_F_CPU, missed);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	sim_every(local, SIM_MS(1), imu_tick);
+	sim_every(local, SIM_US(100), watchdog);
+	sim_device_t *imu_device = sim_device_new(bus, 0x68);
+	imu_device -> pointer_bytes = 1;
+	sim_device_new(bus, 0x3C);
+	for(int dex = 0; dex < DISPLAY_LEN; dex++){
+		display_data[dex] = dex;
+	}
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	printf("bench_priority: 1 kHz IMU read against back-to-back %d-byte display writes, 400 kHz, %d samples\n", DISPLAY_LEN, SAMPLES);
+	printf("%-28s %8s %8s %8s %8s\n", "", "p50 us", "p99 us", "max us", "missed");
+	bench("alone", false, 0, 0, 0);
+	bench("contention, one queue", true, 0, 0, 0);
+	bench("contention, urgent", true, IIC_FLAG_URGENT, 0, 0);
+	bench("urgent, preempt every 32", true, IIC_FLAG_URGENT, IIC_FLAG_PREEMPTIBLE, 32);
+	bench("urgent, preempt every 8", true, IIC_FLAG_URGENT, IIC_FLAG_PREEMPTIBLE, 8);
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_scan.c
+ * boot-to-ready time: finding out which of the 112 usable addresses are
+ * populated, with 0, 8 and 32 devices on the bus
+ *
+ * "write_one" is the old boot sequence, one iic_write_one per address with
+ * retry_max retries on a NACK; "scan" is iic_scan_bus. Both at 100 kHz.
+ */
+
+#include <stdio.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define MAX_DEVICES 32
+#define RETRY_MAX 3
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_device_t *devices[MAX_DEVICES];
+
+static void populate(int count){
+	for(int dex = 0; dex < MAX_DEVICES; dex++){
+		devices[dex] -> present = dex < count;
+	}
+	for(uint8_t address = 0; address < 0x80; address++){
+		iic_presence_forget(&IIC_MODULE, address);
+	}
+}
+
+static int found(void){
+	int count = 0;
+	for(uint8_t address = IIC_SCAN_FIRST_ADDRESS; address <= IIC_SCAN_LAST_ADDRESS; address++){
+		count += iic_device_present(&IIC_MODULE, address);
+	}
+	return count;
+}
+
+static sim_time_t boot_write_one(void){
+	sim_time_t start = sim_now();
+	for(uint8_t address = IIC_SCAN_FIRST_ADDRESS; address <= IIC_SCAN_LAST_ADDRESS; address++){
+		iic_write_one(&IIC_MODULE, address, 0x00);
+		sim_wait_master(&IIC_MODULE, bus, SIM_MS(10));
+		iic_clear_error(&IIC_MODULE);
+	}
+	return sim_now() - start;
+}
+
+static sim_time_t boot_scan(void){
+	iic_scan_t scan;
+	sim_time_t start = sim_now();
+	iic_scan_bus(&IIC_MODULE, &scan, IIC_SCAN_FIRST_ADDRESS, IIC_SCAN_LAST_ADDRESS, NULL);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(100));
+	return sim_now() - start;
+}
+
+static void bench_boot(int count){
+	populate(count);
+	uint64_t starts = bus -> starts + bus -> restarts;
+	sim_time_t slow = boot_write_one();
+	uint64_t slow_starts = bus -> starts + bus -> restarts - starts;
+	SIM_CHECK(found() == count, "write_one found %d of %d", found(), count);
+
+	populate(count);
+	starts = bus -> starts + bus -> restarts;
+	sim_time_t fast = boot_scan();
+	uint64_t fast_starts = bus -> starts + bus -> restarts - starts;
+	SIM_CHECK(found() == count, "scan found %d of %d", found(), count);
+	printf("%8d %14.2f %10llu %14.2f %10llu %9.1fx\n", count, (double)slow * 1e3 / SIM_F_CPU, (unsigned long long)slow_starts,
+		(double)fast * 1e3 / SIM_F_CPU, (unsigned long long)fast_starts, (double)slow / fast);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	for(int dex = 0; dex < MAX_DEVICES; dex++){
+		devices[dex] = sim_device_new(bus, 0x10 + 3 * dex);
+	}
+	setup_iic(&IIC_MODULE, 0x7F, false, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), RETRY_MAX, NULL);
+	enable_iic(&IIC_MODULE);
+
+	printf("bench_scan: boot-to-ready over %d addresses at 100 kHz, retry_max %d\n", IIC_SCAN_LAST_ADDRESS - IIC_SCAN_FIRST_ADDRESS + 1, RETRY_MAX);
+	printf("%8s %14s %10s %14s %10s %10s\n", "devices", "write_one ms", "STARTs", "scan ms", "STARTs", "speedup");
+	bench_boot(0);
+	bench_boot(8);
+	bench_boot(32);
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_slave.c
+ * cost of one received and one sent byte in each slave mode
+ *
+ * A second node writes LEN bytes to us and reads LEN back, RUNS times per
+ * mode. The figures are host instructions per ISR entry (sim_icount) for
+ * the data statuses: 0x80 (byte received, ACK sent) and 0xB8 (byte sent,
+ * ACK received). "map, protected" is the register map with register 0
+ * read-only and a write mask on every other register. The figures compare
+ * the modes with each other, not with an AVR.
+ */
+
+#include <stdio.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/api.h>
+
+#define RUNS 20
+#define LEN 16
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+static sim_api_t remote;
+static uint8_t ring[64];
+static uint8_t reply[LEN];
+static uint8_t registers[LEN + 1];
+static uint8_t scratch[32];
+static const uint8_t read_only[(LEN + 8) / 8] = {0x01}; // register 0 only
+static uint8_t write_mask[LEN + 1];
+
+static uint8_t callback(volatile iic_t *iic, uint8_t dat){
+	(void)iic;
+	return dat + 1;
+}
+
+static void use_callback(void){
+	setup_iic(&IIC_MODULE, 0x20, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, callback);
+}
+
+static void use_buffers(void){
+	setup_iic(&IIC_MODULE, 0x20, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), NULL);
+	iic_slave_set_reply(&IIC_MODULE, reply, sizeof(reply));
+}
+
+static void use_register_map(void){
+	setup_iic(&IIC_MODULE, 0x20, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	iic_slave_register_map(&IIC_MODULE, registers, sizeof(registers), NULL, NULL);
+}
+
+static void use_protected_map(void){
+	use_register_map();
+	iic_slave_register_map(&IIC_MODULE, registers, sizeof(registers), read_only, NULL);
+	for(int dex = 0; dex < LEN + 1; dex++){
+		write_mask[dex] = dex & 1 ? 0x0F : 0xFF;
+	}
+	iic_slave_register_write_mask(&IIC_MODULE, write_mask);
+}
+
+static double per_entry(uint8_t status){
+	uint64_t counted = local -> isr_counted[status >> 3];
+	return counted == 0 ? 0 : (double)local -> isr_instructions[status >> 3] / counted;
+}
+
+static void bench_mode(const char *name, void (*use)(void)){
+	uint8_t data[LEN + 1] = {0}; // register map: pointer byte first
+	uint8_t result[LEN];
+	use();
+	enable_iic(&IIC_MODULE);
+	for(int status = 0; status < 32; status++){
+		local -> isr_counted[status] = local -> isr_instructions[status] = local -> isr_instructions_max[status] = 0;
+	}
+	for(int run = 0; run < RUNS; run++){
+		remote.write_many(remote.module, 0x20, data, LEN + 1);
+		sim_wait_master(remote.module, bus, SIM_MS(5));
+		remote.read_many(remote.module, 0x20, result, LEN);
+		sim_wait_master(remote.module, bus, SIM_MS(5));
+		while(iic_slave_read_frame(&IIC_MODULE, scratch, sizeof(scratch), NULL) != 0){
+		}
+	}
+	printf("%-14s %10.1f %10llu %10.1f %10llu\n", name,
+		per_entry(0x80), (unsigned long long)local -> isr_instructions_max[0x80 >> 3],
+		per_entry(0xB8), (unsigned long long)local -> isr_instructions_max[0xB8 >> 3]);
+	disable_iic(&IIC_MODULE);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	printf("bench_slave: host instructions per slave data byte, %d runs of %d bytes each way\n", RUNS, LEN);
+	if(!sim_icount_enable()){
+		printf("n/a: instruction counting needs ptrace on x86-64 Linux\n");
+		return 0;
+	}
+	printf("%-14s %10s %10s %10s %10s\n", "mode", "rx avg", "rx max", "tx avg", "tx max");
+	bench_mode("callback", use_callback);
+	bench_mode("buffered", use_buffers);
+	bench_mode("register map", use_register_map);
+	bench_mode("map, protected", use_protected_map);
+	return 0;
+}
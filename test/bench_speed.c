@@ -0,0 +1,94 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_speed.c
+ * a mixed polling workload with and without per-device speed profiles
+ *
+ * One legacy device (0x50) that must not be clocked above 100 kHz and
+ * three sensors (0x60..0x62) good for 400 kHz. Each round reads 2 bytes
+ * from the legacy device and 6 from every sensor, each as a
+ * pointer-write-then-read. Throughput counts the bytes read.
+ */
+
+#include <stdio.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define ROUNDS 100
+#define SENSORS 3
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_device_t *legacy;
+static sim_device_t *sensors[SENSORS];
+
+static const iic_device_profile_t profiles[] = {
+	{.address = 0x50, .bitrate = IIC_TWBR_FOR(F_CPU, 100000UL), .bitrate_prescaler = IIC_PRESCALER_FOR(F_CPU, 100000UL), .retry_max = 3}
+};
+
+static double khz(sim_time_t period){
+	return period == 0 ? 0 : (double)SIM_F_CPU / period / 1000;
+}
+
+static void poll(uint8_t address, uint8_t len){
+	uint8_t pointer = 0;
+	uint8_t result[8];
+	iic_write_read(&IIC_MODULE, address, &pointer, 1, result, len);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(10));
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "poll of %02x failed with %d", address, IIC_MODULE.error_state);
+}
+
+static void bench_workload(const char *name, uint32_t default_hz, bool use_profiles){
+	iic_set_bus_speed(&IIC_MODULE, F_CPU, default_hz);
+	iic_set_device_profiles(&IIC_MODULE, use_profiles ? profiles : NULL, use_profiles ? 1 : 0);
+	legacy -> fastest_clock = 0;
+	sensors[0] -> fastest_clock = 0;
+	sim_time_t start = sim_now();
+	for(int round = 0; round < ROUNDS; round++){
+		poll(0x50, 2);
+		for(int dex = 0; dex < SENSORS; dex++){
+			poll(0x60 + dex, 6);
+		}
+	}
+	double round_time = (double)(sim_now() - start) / ROUNDS;
+	int bytes = 2 + 6 * SENSORS;
+	printf("%-22s %10.1f %10.0f %12.0f %12.0f%s\n", name, round_time * 1e6 / SIM_F_CPU, bytes * (double)SIM_F_CPU / round_time,
+		khz(legacy -> fastest_clock), khz(sensors[0] -> fastest_clock), khz(legacy -> fastest_clock) > 101 ? "  (legacy overclocked)" : "");
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	legacy = sim_device_new(bus, 0x50);
+	legacy -> pointer_bytes = 1;
+	for(int dex = 0; dex < SENSORS; dex++){
+		sensors[dex] = sim_device_new(bus, 0x60 + dex);
+		sensors[dex] -> pointer_bytes = 1;
+	}
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	printf("bench_speed: %d rounds of 2 bytes from a 100 kHz device and 6 from each of %d 400 kHz ones\n", ROUNDS, SENSORS);
+	printf("%-22s %10s %10s %12s %12s\n", "setup", "us/round", "bytes/s", "legacy kHz", "sensor kHz");
+	bench_workload("all at 100 kHz", 100000UL, false);
+	bench_workload("profiles", 400000UL, true);
+	bench_workload("all at 400 kHz", 400000UL, false);
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * bench_stretch.c
+ * how long a slave read holds SCL low in callback mode, with the callback
+ * run before the reply goes out and deferred (iic_slave_defer_callback)
+ *
+ * A second node reads one byte from us READS times, at 400 kHz. The
+ * callback busy-waits for `work` to stand in for the application working
+ * out the reply. The hold is the time from TWINT being set on SLA+R (0xA8)
+ * to the ISR releasing it, as the simulated TWI sees it: it includes the
+ * isr_cycles charged for the interrupt itself. Deferred, the callback runs
+ * from the main loop (iic_slave_poll after each read), so neither that
+ * hold nor the one on 0xC0 (reply sent, master NACKed) depends on it. Bus
+ * time is START to STOP per read.
+ */
+
+#include <stdio.h>
+
+#include <iic/iic.h>
+#include <util/delay.h>
+#include <sim/sim.h>
+#include <sim/api.h>
+
+#define READS 50
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static struct sim_twi_t *twi;
+static sim_api_t remote;
+static uint16_t work_us;
+static uint8_t replies;
+
+static uint8_t callback(volatile iic_t *iic, uint8_t dat){
+	(void)iic;
+	for(uint16_t dex = 0; dex < work_us; dex++){
+		_delay_us(1);
+	}
+	return ++replies;
+}
+
+static void bench(bool defer, uint16_t work){
+	work_us = work;
+	replies = 0;
+	setup_iic(&IIC_MODULE, 0x20, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, callback);
+	iic_slave_defer_callback(&IIC_MODULE, defer, 0);
+	enable_iic(&IIC_MODULE);
+	sim_twi_reset_counts(twi);
+	sim_time_t busy = bus -> busy_cycles;
+	for(int read = 1; read <= READS; read++){
+		uint8_t result = 0;
+		remote.read_many(remote.module, 0x20, &result, 1);
+		sim_wait_master(remote.module, bus, SIM_MS(5));
+		iic_slave_poll(&IIC_MODULE); // main loop
+		// deferred replies are worked out one read ahead
+		SIM_CHECK(result == (defer ? read - 1 : read), "%s, %d us: read %d got %d", defer ? "deferred" : "callback", work, read, result);
+	}
+	busy = bus -> busy_cycles - busy;
+	disable_iic(&IIC_MODULE);
+	printf("%-10s %8d %10.1f %10.1f %10.1f %10.1f\n", defer ? "deferred" : "callback", work,
+		(double)sim_twi_hold(twi, 0xA8) * 1e6 / SIM_F_CPU / READS, (double)sim_twi_hold_max(twi, 0xA8) * 1e6 / SIM_F_CPU,
+		(double)sim_twi_hold(twi, 0xC0) * 1e6 / SIM_F_CPU / READS, (double)busy * 1e6 / SIM_F_CPU / READS);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	twi = sim_connect_twi(local, 0, bus);
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	printf("bench_stretch: SCL hold on SLA+R per 1-byte slave read, 400 kHz, %d reads per row (isr_cycles %.1f us)\n", READS,
+		(double)local -> isr_cycles * 1e6 / SIM_F_CPU);
+	printf("%-10s %8s %10s %10s %10s %10s\n", "mode", "work us", "A8 hold us", "A8 max us", "C0 hold us", "bus us");
+	uint16_t work[] = {0, 10, 50, 200};
+	for(unsigned dex = 0; dex < sizeof(work) / sizeof(work[0]); dex++){
+		bench(false, work[dex]);
+		bench(true, work[dex]);
+	}
+	return 0;
+}
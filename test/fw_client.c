@@ -0,0 +1,52 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * fw_client.c
+ * hot-plugged slave firmware: the library built with ADDRESS_CLIENT, asking
+ * the address server for an address after power-up
+ */
+
+#include <stddef.h>
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+
+static uint8_t ring[32];
+
+// Frame callback: every frame goes to the client, straight from the ISR.
+static void fw_client_frames(volatile iic_t *iic){
+	uint8_t frame[8];
+	bool general_call;
+	uint8_t len;
+	while((len = iic_slave_read_frame(iic, frame, sizeof(frame), &general_call)) != 0){
+		address_client_handle_frame(frame, len, general_call);
+	}
+}
+
+// Power-up. id stands in for the board's serial number.
+void fw_client_start(uint16_t id, uint8_t bitrate, iic_prescaler_t prescaler){
+	setup_iic(&IIC_MODULE, 0x00, true, true, bitrate, prescaler, 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), fw_client_frames);
+	enable_iic(&IIC_MODULE);
+	address_client_start(id);
+}
+
+// Timer interrupt bodies for sim_every.
+void fw_client_tick(){
+	address_client_tick();
+}
+
+void fw_watchdog(){
+	iic_watchdog_tick(&IIC_MODULE);
+}
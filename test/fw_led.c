@@ -0,0 +1,66 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * fw_led.c
+ * LED slave firmware: the library built with LED_ENGINE, with a ramp as
+ * pattern 1 and the channel outputs kept where the test can see them
+ */
+
+#include <stddef.h>
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+
+#define FW_LED_RAMP_STEP 0x0100 // one sample per tick
+
+uint16_t fw_led_levels[IIC_LED_CHANNELS]; // last level handed to each output
+
+static uint8_t ring[32];
+static uint8_t ramp[256];
+static const led_waveform_t patterns[] = {
+	{NULL, 0}, // IIC_LED_PATTERN_STEADY
+	{ramp, FW_LED_RAMP_STEP}
+};
+
+static void fw_led_output(uint8_t channel, uint16_t level){
+	fw_led_levels[channel] = level;
+}
+
+static void fw_led_frames(volatile iic_t *iic){
+	uint8_t frame[8];
+	bool general_call;
+	uint8_t len;
+	while((len = iic_slave_read_frame(iic, frame, sizeof(frame), &general_call)) != 0){
+		led_engine_handle_frame(frame, len, general_call);
+	}
+}
+
+void fw_led_start(uint8_t address, uint8_t bitrate, iic_prescaler_t prescaler){
+	for(uint16_t dex = 0; dex < 256; dex++){
+		ramp[dex] = dex;
+	}
+	setup_iic(&IIC_MODULE, address, true, true, bitrate, prescaler, 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), fw_led_frames);
+	enable_iic(&IIC_MODULE);
+	led_engine_setup(patterns, sizeof(patterns) / sizeof(patterns[0]), fw_led_output);
+}
+
+// Timer interrupt bodies for sim_every.
+void fw_led_tick(){
+	led_engine_tick();
+}
+
+void fw_watchdog(){
+	iic_watchdog_tick(&IIC_MODULE);
+}
@@ -0,0 +1,28 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * fw_node.c
+ * plain firmware image: the library and nothing else, driven by the test
+ * through sim_api_t. Also gives the node a register file to serve.
+ */
+
+#include <iic/iic.h>
+
+uint8_t fw_registers[64];
+
+// Timer interrupt body for sim_every.
+void fw_watchdog(){
+	iic_watchdog_tick(&IIC_MODULE);
+}
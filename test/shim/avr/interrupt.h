@@ -0,0 +1,27 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * avr/interrupt.h (host shim)
+ * an ISR is a plain function that the bus model calls; sei/cli flip the
+ * I bit of the simulated SREG, which the model checks before it does
+ */
+
+#pragma once
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+#define sei() do{ SREG |= 0x80; }while(0)
+#define cli() do{ SREG &= 0x7F; }while(0)
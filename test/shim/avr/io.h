@@ -0,0 +1,111 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * avr/io.h (host shim)
+ * the registers the library uses, mapped onto iic_sim_io
+ *
+ * Each firmware image built for the simulator has its own iic_sim_io
+ * (see test/sim/image.c), indexed by data-space address, so the library
+ * compiles unchanged and the bus model (test/sim) can watch the registers.
+ */
+
+#pragma once
+#include <stdint.h>
+
+extern volatile uint8_t iic_sim_io[0x100];
+
+#define _SFR_MEM8(addr) (iic_sim_io[addr])
+#define _SFR_MEM16(addr) (*(volatile uint16_t*)&iic_sim_io[addr])
+
+#define PINB  _SFR_MEM8(0x23)
+#define DDRB  _SFR_MEM8(0x24)
+#define PORTB _SFR_MEM8(0x25)
+#define PINC  _SFR_MEM8(0x26)
+#define DDRC  _SFR_MEM8(0x27)
+#define PORTC _SFR_MEM8(0x28)
+#define PIND  _SFR_MEM8(0x29)
+#define DDRD  _SFR_MEM8(0x2A)
+#define PORTD _SFR_MEM8(0x2B)
+#ifdef __AVR_ATmega328PB__
+	#define PINE  _SFR_MEM8(0x2C)
+	#define DDRE  _SFR_MEM8(0x2D)
+	#define PORTE _SFR_MEM8(0x2E)
+#endif
+#define SREG  _SFR_MEM8(0x5F)
+#define TCNT1 _SFR_MEM16(0x84)
+
+#ifdef __AVR_ATmega328PB__
+	#define TWBR0  _SFR_MEM8(0xB8)
+	#define TWSR0  _SFR_MEM8(0xB9)
+	#define TWAR0  _SFR_MEM8(0xBA)
+	#define TWDR0  _SFR_MEM8(0xBB)
+	#define TWCR0  _SFR_MEM8(0xBC)
+	#define TWAMR0 _SFR_MEM8(0xBD)
+	#define TWBR1  _SFR_MEM8(0xD8)
+	#define TWSR1  _SFR_MEM8(0xD9)
+	#define TWAR1  _SFR_MEM8(0xDA)
+	#define TWDR1  _SFR_MEM8(0xDB)
+	#define TWCR1  _SFR_MEM8(0xDC)
+	#define TWAMR1 _SFR_MEM8(0xDD)
+#else
+	#define TWBR  _SFR_MEM8(0xB8)
+	#define TWSR  _SFR_MEM8(0xB9)
+	#define TWAR  _SFR_MEM8(0xBA)
+	#define TWDR  _SFR_MEM8(0xBB)
+	#define TWCR  _SFR_MEM8(0xBC)
+	#define TWAMR _SFR_MEM8(0xBD)
+#endif
+
+#define TWINT 7
+#define TWEA  6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC  3
+#define TWEN  2
+#define TWIE  0
+#define TWPS1 1
+#define TWPS0 0
+#define TWGCE 0
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#ifdef __AVR_ATmega328PB__
+	#define PE0 0
+	#define PE1 1
+	#define PE2 2
+	#define PE3 3
+#endif
+
+// Busy-waits in the firmware become simulated time (see test/sim/image.c).
+void iic_sim_delay_cycles(uint32_t cycles);
+#define __builtin_avr_delay_cycles(cycles) iic_sim_delay_cycles(cycles)
@@ -0,0 +1,29 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * avr/sleep.h (host shim)
+ * sleep_cpu runs the simulation until this image takes an interrupt
+ */
+
+#pragma once
+
+#define SLEEP_MODE_IDLE 0
+
+void iic_sim_sleep(void);
+
+#define set_sleep_mode(mode) ((void)(mode))
+#define sleep_enable() do{ }while(0)
+#define sleep_disable() do{ }while(0)
+#define sleep_cpu() iic_sim_sleep()
@@ -0,0 +1,34 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * util/atomic.h (host shim)
+ * ATOMIC_BLOCK as in avr-libc: clear the simulated I bit, put SREG back
+ * on the way out
+ */
+
+#pragma once
+#include <avr/io.h>
+
+static __inline__ uint8_t iic_sim_irq_off(void){
+	SREG &= 0x7F;
+	return 1;
+}
+
+static __inline__ void iic_sim_irq_restore(const uint8_t *sreg){
+	SREG = *sreg;
+}
+
+#define ATOMIC_RESTORESTATE uint8_t iic_sim_sreg __attribute__((__cleanup__(iic_sim_irq_restore))) = SREG
+#define ATOMIC_BLOCK(type) for(type, iic_sim_todo = iic_sim_irq_off(); iic_sim_todo; iic_sim_todo = 0)
@@ -0,0 +1,28 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * util/delay.h (host shim)
+ * busy-waits become simulated time; the bus keeps running meanwhile
+ */
+
+#pragma once
+#include <avr/io.h>
+
+#ifndef F_CPU
+	#error "F_CPU must be defined"
+#endif
+
+#define _delay_us(us) iic_sim_delay_cycles((uint32_t)((double)(us) * (F_CPU / 1000000.0)))
+#define _delay_ms(ms) iic_sim_delay_cycles((uint32_t)((double)(ms) * (F_CPU / 1000.0)))
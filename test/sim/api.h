@@ -0,0 +1,77 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * api.h
+ * the library API of a node loaded with sim_node_load
+ *
+ * The test binary calls its own copy of the library directly; a loaded
+ * node's copy is reached through these pointers instead.
+ */
+
+#pragma once
+#include <iic/iic.h>
+#include <sim/sim.h>
+
+typedef struct sim_api_t{
+	volatile iic_t *module; // the node's IIC_MODULE
+	void (*setup)(volatile iic_t*, uint8_t, bool, bool, uint8_t, iic_prescaler_t, uint8_t, uint8_t (*)(volatile iic_t*, uint8_t));
+	void (*enable)(volatile iic_t*);
+	void (*disable)(volatile iic_t*);
+	void (*write_many)(volatile iic_t*, uint8_t, uint8_t*, iic_len_t);
+	void (*read_many)(volatile iic_t*, uint8_t, uint8_t*, iic_len_t);
+	void (*write_read)(volatile iic_t*, uint8_t, uint8_t*, iic_len_t, uint8_t*, iic_len_t);
+	bool (*enqueue)(volatile iic_t*, iic_transaction_t*);
+	uint8_t (*take_events)(volatile iic_t*, uint8_t);
+	void (*watchdog_tick)(volatile iic_t*);
+	void (*slave_buffers)(volatile iic_t*, uint8_t*, uint8_t, void (*)(volatile iic_t*));
+	uint8_t (*slave_read_frame)(volatile iic_t*, uint8_t*, uint8_t, bool*);
+	void (*slave_register_map)(volatile iic_t*, uint8_t*, uint8_t, const uint8_t*, void (*)(volatile iic_t*, uint8_t, uint8_t));
+} sim_api_t;
+
+static inline void sim_api_load(sim_node_t *node, sim_api_t *api){
+	api -> module = sim_node_symbol(node, "IIC_MODULE");
+	api -> setup = sim_node_symbol(node, "setup_iic");
+	api -> enable = sim_node_symbol(node, "enable_iic");
+	api -> disable = sim_node_symbol(node, "disable_iic");
+	api -> write_many = sim_node_symbol(node, "iic_write_many");
+	api -> read_many = sim_node_symbol(node, "iic_read_many");
+	api -> write_read = sim_node_symbol(node, "iic_write_read");
+	api -> enqueue = sim_node_symbol(node, "iic_enqueue");
+	api -> take_events = sim_node_symbol(node, "iic_take_events");
+	api -> watchdog_tick = sim_node_symbol(node, "iic_watchdog_tick");
+	api -> slave_buffers = sim_node_symbol(node, "iic_slave_buffers");
+	api -> slave_read_frame = sim_node_symbol(node, "iic_slave_read_frame");
+	api -> slave_register_map = sim_node_symbol(node, "iic_slave_register_map");
+}
+
+typedef struct sim_idle_t{
+	volatile iic_t *iic;
+	sim_bus_t *bus;
+} sim_idle_t;
+
+// True once the module has no master work left and the bus is free again.
+static inline int sim_master_idle(void *arg){
+	sim_idle_t *idle = arg;
+	volatile iic_t *iic = idle -> iic;
+	return iic -> state == IIC_IDLE && iic -> current == NULL
+		&& iic -> queue_head == iic -> queue_tail && iic -> urgent_head == iic -> urgent_tail
+		&& !idle -> bus -> busy;
+}
+
+// Runs the simulation until sim_master_idle, failing the test after limit cycles.
+static inline void sim_wait_master(volatile iic_t *iic, sim_bus_t *bus, sim_time_t limit){
+	sim_idle_t idle = {.iic = iic, .bus = bus};
+	SIM_CHECK(sim_run_until(sim_master_idle, &idle, limit), "master still busy (state %d, bus: %s)", iic -> state, sim_bus_log_text(bus));
+}
@@ -0,0 +1,272 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * device.c
+ * simulated slave devices (see device.h)
+ *
+ * Like a real slave, the device follows the wires: it samples on rising
+ * SCL edges and changes SDA only after falling ones.
+ */
+
+#include <stdlib.h>
+
+#include <sim/device.h>
+
+enum{
+	D_IDLE,
+	D_ADDRESS,
+	D_ADDRESS_ACK,
+	D_RX,
+	D_RX_ACK,
+	D_TX,
+	D_TX_ACK,
+	D_SKIP
+};
+
+static uint8_t device_next_read(sim_device_t *device){
+	uint8_t byte = device -> mem[device -> pointer++];
+	device -> bytes_read++;
+	return byte;
+}
+
+static void device_store(sim_device_t *device, uint8_t byte){
+	device -> bytes_written++;
+	device -> data_count++;
+	if(device -> pointer_left > 0){
+		if(device -> pointer_bytes == 2 && device -> pointer_left == 2){
+			device -> pointer = (uint16_t)byte << 8; // big-endian, like a 24LCxx
+		}else if(device -> pointer_bytes == 2){
+			device -> pointer |= byte;
+		}else{
+			device -> pointer = byte;
+		}
+		device -> pointer_left--;
+		return;
+	}
+	device -> mem[device -> pointer] = byte;
+	if(device -> page_size != 0){
+		uint16_t page = device -> pointer & ~(device -> page_size - 1);
+		device -> pointer = page | ((device -> pointer + 1) & (device -> page_size - 1));
+	}else{
+		device -> pointer++;
+	}
+	if(device -> on_write != NULL){
+		device -> on_write(device, byte);
+	}
+}
+
+// A transfer to us has ended (STOP or repeated START).
+static void device_transfer_end(sim_device_t *device, int stop){
+	if(!device -> addressed){
+		return;
+	}
+	device -> addressed = 0;
+	device -> transfers++;
+	if(!device -> reading){
+		device -> last_write_len = device -> data_count;
+		if(stop && device -> write_cycle != 0 && device -> data_count > device -> pointer_bytes){
+			device -> busy_until = sim_now() + device -> write_cycle;
+		}
+	}
+	if(stop && device -> on_stop != NULL){
+		device -> on_stop(device);
+	}
+}
+
+static void device_stretch(sim_device_t *device){
+	if(device -> stretch != 0){
+		device -> want_scl = 1;
+		device -> release_at = sim_now() + device -> stretch;
+	}
+}
+
+static void device_address(sim_device_t *device){
+	uint8_t address = device -> shift;
+	int match = (address >> 1) == device -> address || (address == 0x00 && device -> general_call);
+	if(!match){
+		device -> phase = D_SKIP;
+		return;
+	}
+	if(!device -> present || sim_now() < device -> busy_until || device -> nack_address > 0){
+		if(device -> nack_address > 0){
+			device -> nack_address--;
+		}
+		device -> address_nacks++;
+		device -> phase = D_SKIP;
+		return;
+	}
+	device -> address_acks++;
+	device -> addressed = 1;
+	device -> reading = address & 1;
+	device -> data_count = 0;
+	device -> pointer_left = device -> reading ? 0 : device -> pointer_bytes;
+	if(device -> pointer_bytes == 0){
+		device -> pointer = 0;
+	}
+	device -> want_sda = 1;
+	device -> phase = D_ADDRESS_ACK;
+}
+
+static void device_fall(sim_device_t *device){
+	switch(device -> phase){
+		case D_ADDRESS:
+			if(device -> bit == 8){
+				device_address(device);
+			}
+			break;
+
+		case D_ADDRESS_ACK:
+			device -> bit = 0;
+			if(device -> reading){
+				device -> tx = device_next_read(device);
+				device -> want_sda = !(device -> tx & 0x80);
+				device -> phase = D_TX;
+			}else{
+				device -> shift = 0;
+				device -> want_sda = 0;
+				device -> phase = D_RX;
+			}
+			device_stretch(device);
+			break;
+
+		case D_RX:
+			if(device -> bit == 8){
+				device -> acked = device -> nack_after < 0 || device -> data_count < device -> nack_after + device -> pointer_bytes;
+				if(device -> acked){
+					device_store(device, device -> shift);
+				}
+				device -> want_sda = device -> acked;
+				device -> phase = D_RX_ACK;
+			}
+			break;
+
+		case D_RX_ACK:
+			device -> want_sda = 0;
+			device -> bit = 0;
+			device -> shift = 0;
+			device -> phase = device -> acked ? D_RX : D_SKIP;
+			if(device -> acked){
+				device_stretch(device);
+			}
+			break;
+
+		case D_TX:
+			if(device -> bit < 8){
+				device -> want_sda = !((device -> tx >> (7 - device -> bit)) & 1);
+			}else{
+				device -> want_sda = 0;
+				device -> phase = D_TX_ACK;
+			}
+			break;
+
+		case D_TX_ACK:
+			if(device -> master_ack){
+				device -> bit = 0;
+				device -> tx = device_next_read(device);
+				device -> want_sda = !(device -> tx & 0x80);
+				device -> phase = D_TX;
+			}else{
+				device -> phase = D_SKIP; // master is done reading
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void device_edge(sim_agent_t *agent, int line, int level){
+	sim_device_t *device = (sim_device_t*)agent;
+	sim_bus_t *bus = agent -> bus;
+	if(line == SIM_SDA && bus -> scl){
+		if(device -> stuck){
+			return;
+		}
+		device_transfer_end(device, level);
+		device -> want_sda = 0;
+		device -> want_scl = 0;
+		device -> bit = 0;
+		device -> shift = 0;
+		device -> phase = level ? D_IDLE : D_ADDRESS;
+	}else if(line == SIM_SCL && level){
+		if(device -> addressed && device -> last_rise != 0){
+			sim_time_t period = sim_now() - device -> last_rise;
+			if(device -> fastest_clock == 0 || period < device -> fastest_clock){
+				device -> fastest_clock = period;
+			}
+		}
+		device -> last_rise = device -> addressed ? sim_now() : 0;
+		if(device -> stuck && device -> stuck_clocks != 0){
+			device -> stuck_clocks--;
+		}
+		switch(device -> phase){
+			case D_ADDRESS:
+			case D_RX:
+				device -> shift = (device -> shift << 1) | bus -> sda;
+				device -> bit++;
+				break;
+			case D_TX:
+				device -> bit++;
+				break;
+			case D_TX_ACK:
+				device -> master_ack = !bus -> sda;
+				break;
+			default:
+				break;
+		}
+		return;
+	}else if(line == SIM_SCL){
+		if(device -> stuck && device -> stuck_clocks == 0){
+			device -> stuck = 0; // finally lets go, on a falling edge like a real slave
+		}
+		device_fall(device);
+	}else{
+		return;
+	}
+	agent -> due = sim_now();
+}
+
+static void device_step(sim_agent_t *agent){
+	sim_device_t *device = (sim_device_t*)agent;
+	if(device -> want_scl && sim_now() >= device -> release_at){
+		device -> want_scl = 0;
+	}
+	sim_drive(agent, device -> want_sda || device -> stuck, device -> want_scl);
+	if(device -> want_scl){
+		agent -> due = device -> release_at;
+	}
+}
+
+sim_device_t *sim_device_new(sim_bus_t *bus, uint8_t address){
+	sim_device_t *device = calloc(1, sizeof(sim_device_t));
+	device -> address = address;
+	device -> present = 1;
+	device -> nack_after = -1;
+	device -> agent.due = SIM_NEVER;
+	device -> agent.step = device_step;
+	device -> agent.edge = device_edge;
+	sim_agent_add(bus, &device -> agent);
+	return device;
+}
+
+// Makes the device hold SDA low until it has seen `clocks` SCL pulses, as a
+// slave does when it is reset by its master halfway through sending a 0.
+void sim_device_stick(sim_device_t *device, uint32_t clocks){
+	device -> stuck = 1;
+	device -> stuck_clocks = clocks;
+	device -> addressed = 0;
+	device -> phase = D_SKIP;
+	device -> agent.due = sim_now();
+}
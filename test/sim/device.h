@@ -0,0 +1,80 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * device.h
+ * simulated slave devices for the bus model
+ *
+ * sim_device_t is a register-file / EEPROM style slave: the first
+ * pointer_bytes bytes of a write set the memory pointer, the rest are
+ * stored from there on, and reads stream out from the pointer. Knobs cover
+ * the behaviour a driver has to cope with: missing devices, address NACKs
+ * while an EEPROM write cycle runs, data NACKs, clock stretching after
+ * every ACK and a slave stuck holding SDA low.
+ */
+
+#pragma once
+#include <sim/sim.h>
+
+#define SIM_DEVICE_MEM 65536
+
+typedef struct sim_device_t{
+	sim_agent_t agent; // must stay first
+	uint8_t     address; // 7-bit address
+	int         present; // answers its address at all
+	int         general_call; // also answers address 0x00 (writes only)
+	int         pointer_bytes; // 0, 1 or 2; with 0 every transfer starts at mem[0]
+	uint16_t    page_size; // writes wrap within a page of this size (0 = no pages)
+	sim_time_t  write_cycle; // after a STOP ending a write, the address is NACKed this long
+	sim_time_t  stretch; // SCL is held low this long after every ACK
+	int         nack_after; // data bytes ACKed per write before NACKing the rest (-1 = all)
+	int         nack_address; // NACK this many more address phases (counts down)
+	uint8_t     mem[SIM_DEVICE_MEM];
+	uint16_t    pointer;
+
+	void (*on_write)(struct sim_device_t *device, uint8_t byte); // every data byte received (after the pointer)
+	void (*on_stop)(struct sim_device_t *device); // STOP after this device was addressed
+	void *ctx;
+
+	// counters
+	uint64_t    address_acks;
+	uint64_t    address_nacks;
+	uint64_t    bytes_written; // data bytes received, pointer bytes included
+	uint64_t    bytes_read;
+	uint64_t    transfers; // STOPs or repeated STARTs that ended a transfer to us
+	int         last_write_len; // data bytes in the last write, pointer bytes included
+	sim_time_t  fastest_clock; // shortest SCL period seen while addressed (0 = none yet)
+
+	// bus state (device.c)
+	int         phase;
+	int         bit;
+	uint8_t     shift;
+	int         reading;
+	int         pointer_left;
+	int         data_count;
+	int         acked;
+	int         master_ack;
+	uint8_t     tx;
+	int         addressed;
+	int         want_sda;
+	int         want_scl;
+	sim_time_t  release_at;
+	sim_time_t  busy_until;
+	sim_time_t  last_rise;
+	int         stuck;
+	uint32_t    stuck_clocks;
+} sim_device_t;
+
+sim_device_t *sim_device_new(sim_bus_t *bus, uint8_t address);
+void sim_device_stick(sim_device_t *device, uint32_t clocks);
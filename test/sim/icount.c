@@ -0,0 +1,159 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * icount.c
+ * host instruction counts for ISR bodies, by single-stepping under ptrace
+ *
+ * sim_icount_enable forks: the parent becomes a tracer that does nothing
+ * but count, the child carries on with the test. Around every TWI vector
+ * call the simulator puts two int3 markers; the tracer single-steps from
+ * the first to the second and writes the count back into the child.
+ *
+ * These are x86 instructions, not AVR cycles. They are only good for
+ * comparing one code path with another; the AVR figures come from
+ * IIC_ENABLE_STATS on a board.
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <sim/sim.h>
+
+int sim_icount_on;
+volatile uint64_t sim_icount_value;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// marker tails: "int3; nop" begins a count, "int3; xchg %ax, %ax" ends it
+#define BEGIN_TAIL 0x90
+#define END_TAIL 0x9066
+#define NO_PTRACE 77 // exit status of a child that can't be traced
+
+static void tracer(pid_t child) __attribute__((noreturn));
+
+static void tracer_exit(int status){
+	if(WIFEXITED(status)){
+		exit(WEXITSTATUS(status));
+	}
+	fprintf(stderr, "icount: test killed by signal %d\n", WTERMSIG(status));
+	exit(128 + WTERMSIG(status));
+}
+
+static uint64_t tracer_count(pid_t child){
+	uint64_t count = 0;
+	int depth = 0;
+	int status;
+	struct user_regs_struct regs;
+	while(1){
+		ptrace(PTRACE_GETREGS, child, 0, &regs);
+		long word = ptrace(PTRACE_PEEKTEXT, child, (void*)regs.rip, 0);
+		if((word & 0xFF) == 0xCC){
+			regs.rip++; // step over the marker
+			ptrace(PTRACE_SETREGS, child, 0, &regs);
+			if(((word >> 8) & 0xFF) == BEGIN_TAIL){
+				depth++; // a nested interrupt: counted as part of this one
+			}else if(((word >> 8) & 0xFFFF) == END_TAIL && depth-- == 0){
+				return count;
+			}
+			continue;
+		}
+		ptrace(PTRACE_SINGLESTEP, child, 0, 0);
+		waitpid(child, &status, 0);
+		if(!WIFSTOPPED(status)){
+			tracer_exit(status);
+		}
+		count++;
+	}
+}
+
+static void tracer(pid_t child){
+	int status;
+	while(1){
+		waitpid(child, &status, 0);
+		if(!WIFSTOPPED(status)){
+			tracer_exit(status);
+		}
+		int sig = WSTOPSIG(status);
+		if(sig == SIGTRAP){
+			uint64_t count = tracer_count(child);
+			ptrace(PTRACE_POKEDATA, child, (void*)&sim_icount_value, (void*)(uintptr_t)count);
+			sig = 0;
+		}
+		ptrace(PTRACE_CONT, child, 0, (void*)(uintptr_t)sig);
+	}
+}
+
+static uint64_t overhead; // instructions counted for an empty begin/end pair
+
+// Turns instruction counting on for the rest of the run. Returns 0 if the
+// host can't do it (no ptrace, not x86-64); the counts then stay at 0.
+int sim_icount_enable(void){
+	int status;
+	fflush(stdout);
+	fflush(stderr);
+	pid_t child = fork();
+	if(child < 0){
+		return 0;
+	}
+	if(child == 0){
+		if(ptrace(PTRACE_TRACEME, 0, 0, 0) != 0){
+			_exit(NO_PTRACE);
+		}
+		raise(SIGSTOP);
+		sim_icount_on = 1;
+		sim_icount_begin();
+		overhead = sim_icount_end();
+		return 1;
+	}
+	waitpid(child, &status, 0);
+	if(WIFEXITED(status) && WEXITSTATUS(status) == NO_PTRACE){
+		fprintf(stderr, "icount: ptrace not permitted, no instruction counts\n");
+		return 0; // carry on untraced
+	}
+	ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_EXITKILL);
+	ptrace(PTRACE_CONT, child, 0, 0);
+	tracer(child); // never returns
+	return 0;
+}
+
+void sim_icount_begin(void){
+	__asm__ volatile("int3\n\tnop" ::: "memory");
+}
+
+uint64_t sim_icount_end(void){
+	__asm__ volatile("int3\n\txchg %%ax, %%ax" ::: "memory");
+	return sim_icount_value - overhead;
+}
+
+#else
+
+int sim_icount_enable(void){
+	return 0;
+}
+
+void sim_icount_begin(void){
+}
+
+uint64_t sim_icount_end(void){
+	return 0;
+}
+
+#endif
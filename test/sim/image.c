@@ -0,0 +1,59 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * image.c
+ * firmware side of the simulator: the register file and the hooks
+ *
+ * Linked into every firmware image, next to the library sources. The image
+ * only knows the simulator through iic_sim_image, so a .so built from it
+ * can be loaded once per node.
+ */
+
+#include <stddef.h>
+#include <avr/io.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+
+volatile uint8_t iic_sim_io[0x100];
+
+static sim_hooks_t iic_sim_hooks;
+
+void iic_sim_delay_cycles(uint32_t cycles){
+	iic_sim_hooks.delay(iic_sim_hooks.ctx, cycles);
+}
+
+void iic_sim_sleep(void){
+	iic_sim_hooks.sleep(iic_sim_hooks.ctx);
+}
+
+static void iic_sim_bind(const sim_hooks_t *hooks){
+	iic_sim_hooks = *hooks;
+}
+
+void TWI_vect(void);
+#ifdef IIC_TWI1
+void TWI1_vect(void);
+#endif
+
+const sim_image_t iic_sim_image = {
+	.io = iic_sim_io,
+#ifdef IIC_TWI1
+	.vector = {TWI_vect, TWI1_vect},
+#else
+	.vector = {TWI_vect, NULL},
+#endif
+	.bind = iic_sim_bind
+};
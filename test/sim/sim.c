@@ -0,0 +1,509 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * sim.c
+ * event loop, wires, bus monitor, nodes and interrupts
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim/sim.h>
+
+#ifndef SIM_DEFAULT_ISR_CYCLES
+	#define SIM_DEFAULT_ISR_CYCLES 120 // a short status-code path on the AVR, prologue and epilogue included
+#endif
+
+static sim_time_t now;
+static sim_agent_t **agents;
+static size_t agent_count;
+static size_t agent_cap;
+static sim_node_t *nodes;
+static int irq_hint;
+static sim_time_t sleep_limit = SIM_MS(2000);
+
+void sim_fail(const char *file, int line, const char *fmt, ...){
+	va_list args;
+	fprintf(stderr, "%s:%d: FAIL at %llu cycles: ", file, line, (unsigned long long)now);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+sim_time_t sim_now(void){
+	return now;
+}
+
+void sim_irq_hint(void){
+	irq_hint = 1;
+}
+
+void sim_set_sleep_limit(sim_time_t limit){
+	sleep_limit = limit;
+}
+
+//===========================================================================//
+//== Wires and monitor                                                     ==//
+//===========================================================================//
+
+sim_bus_t *sim_bus_new(const char *name){
+	sim_bus_t *bus = calloc(1, sizeof(sim_bus_t));
+	bus -> name = name;
+	bus -> sda = 1;
+	bus -> scl = 1;
+	bus -> bit = -1;
+	return bus;
+}
+
+void sim_bus_log(sim_bus_t *bus, int on){
+	if(on && bus -> log == NULL){
+		bus -> log_cap = 4096;
+		bus -> log = malloc(bus -> log_cap);
+		bus -> log_len = 0;
+		bus -> log[0] = '\0';
+	}else if(!on){
+		free(bus -> log);
+		bus -> log = NULL;
+	}
+}
+
+const char *sim_bus_log_text(sim_bus_t *bus){
+	return bus -> log == NULL ? "" : bus -> log;
+}
+
+void sim_bus_log_clear(sim_bus_t *bus){
+	if(bus -> log != NULL){
+		bus -> log_len = 0;
+		bus -> log[0] = '\0';
+	}
+}
+
+static void log_token(sim_bus_t *bus, const char *token){
+	if(bus -> log == NULL){
+		return;
+	}
+	size_t len = strlen(token);
+	while(bus -> log_len + len + 2 > bus -> log_cap){
+		bus -> log_cap *= 2;
+		bus -> log = realloc(bus -> log, bus -> log_cap);
+	}
+	if(bus -> log_len != 0){
+		bus -> log[bus -> log_len++] = ' ';
+	}
+	memcpy(bus -> log + bus -> log_len, token, len + 1);
+	bus -> log_len += len;
+}
+
+static void monitor_event(sim_bus_t *bus, int event, uint8_t byte, int ack){
+	char token[8];
+	switch(event){
+		case SIM_EVENT_START: log_token(bus, "S"); break;
+		case SIM_EVENT_RESTART: log_token(bus, "Sr"); break;
+		case SIM_EVENT_STOP: log_token(bus, "P"); break;
+		case SIM_EVENT_ADDRESS:
+			snprintf(token, sizeof(token), "%02x%c%c", byte >> 1, byte & 1 ? 'r' : 'w', ack ? '+' : '-');
+			log_token(bus, token);
+			break;
+		default:
+			snprintf(token, sizeof(token), "%02x%c", byte, ack ? '+' : '-');
+			log_token(bus, token);
+			break;
+	}
+	if(bus -> watch != NULL){
+		bus -> watch(bus, event, byte, ack, bus -> watch_ctx);
+	}
+}
+
+static void monitor_edge(sim_bus_t *bus, int line, int level){
+	if(line == SIM_SDA && bus -> scl){
+		if(!level){
+			bus -> bit = 0;
+			bus -> first_byte = 1;
+			if(bus -> busy){
+				bus -> restarts++;
+				monitor_event(bus, SIM_EVENT_RESTART, 0, 0);
+			}else{
+				bus -> busy = 1;
+				bus -> busy_since = now;
+				bus -> starts++;
+				monitor_event(bus, SIM_EVENT_START, 0, 0);
+			}
+		}else{
+			bus -> bit = -1;
+			if(bus -> busy){
+				bus -> busy = 0;
+				bus -> busy_cycles += now - bus -> busy_since;
+				bus -> free_since = now;
+				bus -> stops++;
+				monitor_event(bus, SIM_EVENT_STOP, 0, 0);
+			}
+		}
+	}else if(line == SIM_SCL && level && bus -> bit >= 0){
+		if(bus -> bit < 8){
+			bus -> shift = (bus -> shift << 1) | bus -> sda;
+			bus -> bit++;
+			return;
+		}
+		// ACK bit
+		bus -> last_byte = bus -> shift;
+		bus -> last_ack = !bus -> sda;
+		bus -> bit = 0;
+		if(!bus -> last_ack){
+			bus -> nacks++;
+		}
+		if(bus -> first_byte){
+			bus -> first_byte = 0;
+			bus -> address_bytes++;
+			monitor_event(bus, SIM_EVENT_ADDRESS, bus -> last_byte, bus -> last_ack);
+		}else{
+			bus -> data_bytes++;
+			monitor_event(bus, SIM_EVENT_DATA, bus -> last_byte, bus -> last_ack);
+		}
+	}
+}
+
+static void bus_edge(sim_bus_t *bus, int line, int level){
+	if(line == SIM_SDA){
+		bus -> sda = level;
+	}else{
+		bus -> scl = level;
+	}
+	monitor_edge(bus, line, level);
+	for(sim_agent_t *agent = bus -> agents; agent != NULL; agent = agent -> next){
+		if(agent -> edge != NULL){
+			agent -> edge(agent, line, level);
+		}
+	}
+}
+
+// Applies an agent's new drive to the wires. When both lines change at once,
+// SDA moves while SCL is low, so a simultaneous release doesn't look like a
+// START or STOP that nobody sent.
+void sim_drive(sim_agent_t *agent, int sda_low, int scl_low){
+	sim_bus_t *bus = agent -> bus;
+	sda_low = sda_low != 0;
+	scl_low = scl_low != 0;
+	bus -> sda_pulls += sda_low - agent -> sda_low;
+	bus -> scl_pulls += scl_low - agent -> scl_low;
+	agent -> sda_low = sda_low;
+	agent -> scl_low = scl_low;
+
+	int sda = bus -> sda_pulls == 0;
+	int scl = bus -> scl_pulls == 0;
+	if(scl != bus -> scl && !scl){
+		bus_edge(bus, SIM_SCL, scl);
+	}
+	if(sda != bus -> sda){
+		bus_edge(bus, SIM_SDA, sda);
+	}
+	if(scl != bus -> scl){
+		bus_edge(bus, SIM_SCL, scl);
+	}
+}
+
+static void schedule_add(sim_agent_t *agent){
+	if(agent_count == agent_cap){
+		agent_cap = agent_cap == 0 ? 64 : agent_cap * 2;
+		agents = realloc(agents, agent_cap * sizeof(sim_agent_t*));
+	}
+	agents[agent_count++] = agent;
+}
+
+void sim_agent_add(sim_bus_t *bus, sim_agent_t *agent){
+	agent -> bus = bus;
+	agent -> next = bus -> agents;
+	bus -> agents = agent;
+	schedule_add(agent);
+}
+
+//===========================================================================//
+//== Nodes and interrupts                                                  ==//
+//===========================================================================//
+
+static void node_delay(void *ctx, uint32_t cycles);
+static void node_sleep(void *ctx);
+
+sim_node_t *sim_node_attach(const sim_image_t *image, const char *name){
+	sim_node_t *node = calloc(1, sizeof(sim_node_t));
+	node -> name = name;
+	node -> image = image;
+	node -> io = image -> io;
+	node -> isr_cycles = SIM_DEFAULT_ISR_CYCLES;
+	node -> io[SIM_SREG] = 0x80; // as if main had called sei()
+
+	sim_hooks_t hooks = {.ctx = node, .delay = node_delay, .sleep = node_sleep};
+	image -> bind(&hooks);
+
+	sim_node_t **tail = &nodes;
+	while(*tail != NULL){
+		tail = &(*tail) -> next;
+	}
+	*tail = node;
+	return node;
+}
+
+// Loads a private copy of a firmware .so: dlopen hands out the same copy
+// for the same file, so each node gets its own temporary file.
+sim_node_t *sim_node_load(const char *path, const char *name){
+	char copy[] = "/tmp/iic_sim_XXXXXX";
+	int out = mkstemp(copy);
+	SIM_CHECK(out >= 0, "can't create a copy of %s", path);
+	FILE *in = fopen(path, "rb");
+	SIM_CHECK(in != NULL, "can't open %s", path);
+	char buffer[65536];
+	size_t len;
+	while((len = fread(buffer, 1, sizeof(buffer), in)) != 0){
+		SIM_CHECK(write(out, buffer, len) == (ssize_t)len, "can't copy %s", path);
+	}
+	fclose(in);
+	close(out);
+
+	void *handle = dlopen(copy, RTLD_NOW | RTLD_LOCAL);
+	unlink(copy);
+	SIM_CHECK(handle != NULL, "dlopen %s: %s", path, dlerror());
+	const sim_image_t *image = dlsym(handle, "iic_sim_image");
+	SIM_CHECK(image != NULL, "%s has no iic_sim_image", path);
+	sim_node_t *node = sim_node_attach(image, name);
+	node -> handle = handle;
+	return node;
+}
+
+void *sim_node_symbol(sim_node_t *node, const char *symbol){
+	void *address = dlsym(node -> handle == NULL ? RTLD_DEFAULT : node -> handle, symbol);
+	SIM_CHECK(address != NULL, "%s: no symbol %s", node -> name, symbol);
+	return address;
+}
+
+void sim_node_add_agent(sim_node_t *node, sim_agent_t *agent){
+	sim_agent_t **tail = &node -> agents;
+	while(*tail != NULL){
+		tail = &(*tail) -> node_next;
+	}
+	*tail = agent;
+}
+
+void sim_set_isr_cycles(sim_node_t *node, sim_time_t cycles){
+	node -> isr_cycles = cycles;
+}
+
+// Picks up everything the node's firmware has written to its registers.
+void sim_node_sync(sim_node_t *node){
+	for(sim_agent_t *agent = node -> agents; agent != NULL; agent = agent -> node_next){
+		if(agent -> sync != NULL){
+			agent -> sync(agent);
+		}
+	}
+	irq_hint = 1;
+}
+
+static void sync_all(void){
+	for(sim_node_t *node = nodes; node != NULL; node = node -> next){
+		sim_node_sync(node);
+	}
+}
+
+static void set_tcnt1(sim_node_t *node){
+	node -> io[SIM_TCNT1] = now & 0xFF;
+	node -> io[SIM_TCNT1 + 1] = (now >> 8) & 0xFF;
+}
+
+static void timer_step(sim_agent_t *agent){
+	sim_timer_t *timer = (sim_timer_t*)agent;
+	timer -> pending++;
+	agent -> due = now + timer -> period; // run_one has already set due to SIM_NEVER
+	irq_hint = 1;
+}
+
+// Calls fn every period cycles as a timer interrupt on node. Like any
+// interrupt it waits while the node is in another one or has them off.
+sim_timer_t *sim_every(sim_node_t *node, sim_time_t period, void (*fn)(void)){
+	sim_timer_t *timer = calloc(1, sizeof(sim_timer_t));
+	timer -> node = node;
+	timer -> period = period;
+	timer -> fn = fn;
+	timer -> agent.due = now + period;
+	timer -> agent.step = timer_step;
+	timer -> next = node -> timers;
+	node -> timers = timer;
+	schedule_add(&timer -> agent);
+	return timer;
+}
+
+static void run_to(sim_time_t end);
+
+static void take_twi_interrupt(sim_node_t *node, int index){
+	sim_time_t start = now;
+	uint8_t sreg = node -> io[SIM_SREG];
+	node -> in_isr = 1;
+	node -> io[SIM_SREG] = sreg & 0x7F;
+	irq_hint = 1; // other nodes' interrupts raised at the same moment run alongside this one
+	run_to(now + node -> isr_cycles); // SCL stays held through TWINT meanwhile
+	set_tcnt1(node);
+	node -> isr_entries++;
+	node -> wakeups++;
+	if(sim_icount_on){
+		uint8_t status = sim_twi_status(node -> twi[index]) >> 3;
+		sim_icount_begin();
+		node -> image -> vector[index]();
+		uint64_t count = sim_icount_end();
+		node -> isr_counted[status]++;
+		node -> isr_instructions[status] += count;
+		if(count > node -> isr_instructions_max[status]){
+			node -> isr_instructions_max[status] = count;
+		}
+	}else{
+		node -> image -> vector[index]();
+	}
+	sim_node_sync(node);
+	node -> io[SIM_SREG] |= 0x80; // reti
+	node -> in_isr = 0;
+	node -> isr_busy += now - start;
+}
+
+static void take_timer_interrupt(sim_node_t *node, sim_timer_t *timer){
+	sim_time_t start = now;
+	uint8_t sreg = node -> io[SIM_SREG];
+	timer -> pending--;
+	timer -> calls++;
+	node -> in_isr = 1;
+	node -> io[SIM_SREG] = sreg & 0x7F;
+	set_tcnt1(node);
+	node -> timer_entries++;
+	node -> wakeups++;
+	timer -> fn();
+	sim_node_sync(node);
+	node -> io[SIM_SREG] |= 0x80;
+	node -> in_isr = 0;
+	node -> isr_busy += now - start;
+}
+
+static int node_interrupt(sim_node_t *node){
+	if(node -> in_isr || !(node -> io[SIM_SREG] & 0x80)){
+		return 0;
+	}
+	for(int index = 0; index < 2; index++){
+		if(node -> twi[index] != NULL && node -> image -> vector[index] != NULL && sim_twi_irq(node -> twi[index])){
+			take_twi_interrupt(node, index);
+			return 1;
+		}
+	}
+	for(sim_timer_t *timer = node -> timers; timer != NULL; timer = timer -> next){
+		if(timer -> pending != 0){
+			take_timer_interrupt(node, timer);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void dispatch(void){
+	while(irq_hint){
+		irq_hint = 0;
+		for(sim_node_t *node = nodes; node != NULL; node = node -> next){
+			if(node_interrupt(node)){
+				irq_hint = 1; // the node may have more
+			}
+		}
+	}
+}
+
+static sim_agent_t *earliest(void){
+	sim_agent_t *first = NULL;
+	sim_time_t due = SIM_NEVER;
+	for(size_t dex = 0; dex < agent_count; dex++){
+		if(agents[dex] -> due < due){
+			due = agents[dex] -> due;
+			first = agents[dex];
+		}
+	}
+	return first;
+}
+
+// One event: returns 0 (leaving time at limit) if nothing is due by limit.
+static int run_one(sim_time_t limit){
+	dispatch();
+	sim_agent_t *agent = earliest();
+	if(agent == NULL || agent -> due > limit){
+		if(limit != SIM_NEVER && limit > now){
+			now = limit;
+		}
+		return 0;
+	}
+	if(agent -> due > now){
+		now = agent -> due;
+	}
+	agent -> due = SIM_NEVER;
+	agent -> step(agent);
+	return 1;
+}
+
+static void run_to(sim_time_t end){
+	while(run_one(end)){
+	}
+	dispatch();
+}
+
+void sim_run(sim_time_t cycles){
+	sync_all();
+	run_to(now + cycles);
+}
+
+// Runs until done(arg) is true (checked between events) or limit cycles
+// have passed. Returns whether done was reached.
+int sim_run_until(int (*done)(void *arg), void *arg, sim_time_t limit){
+	sim_time_t end = now + limit;
+	sync_all();
+	while(1){
+		dispatch();
+		if(done(arg)){
+			return 1;
+		}
+		if(!run_one(end)){
+			dispatch();
+			return done(arg);
+		}
+	}
+}
+
+static void node_delay(void *ctx, uint32_t cycles){
+	sim_node_t *node = ctx;
+	sim_node_sync(node);
+	run_to(now + cycles);
+	set_tcnt1(node);
+}
+
+static int node_woken(void *arg){
+	sim_node_t *node = ((void**)arg)[0];
+	uint64_t wakeups = *(uint64_t*)((void**)arg)[1];
+	return node -> wakeups != wakeups;
+}
+
+static void node_sleep(void *ctx){
+	sim_node_t *node = ctx;
+	uint64_t wakeups = node -> wakeups;
+	void *arg[2] = {node, &wakeups};
+	sim_node_sync(node);
+	if(!sim_run_until(node_woken, arg, sleep_limit)){
+		sim_fail(__FILE__, __LINE__, "%s: slept for %llu cycles without an interrupt", node -> name, (unsigned long long)sleep_limit);
+	}
+	set_tcnt1(node);
+}
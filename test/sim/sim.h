@@ -0,0 +1,227 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * sim.h
+ * host-side bus simulator for the tests and benchmarks
+ *
+ * The library is compiled for the host against the AVR shim in test/shim,
+ * so the state machine in src/iic.c runs unmodified. Each "node" is one
+ * such firmware image with its own register file (iic_sim_io). A test can
+ * use the image linked into the test binary (sim_node_attach) and load
+ * any number of extra copies of a firmware .so (sim_node_load), each with
+ * its own globals.
+ *
+ * Time is counted in CPU cycles at SIM_F_CPU. The TWI model (twi.c) drives
+ * SDA and SCL bit by bit, open-drain, so clock stretching, clock
+ * synchronisation and arbitration between masters happen on the wires as
+ * they would on a board. Device models (device.c) and bit-banged GPIO
+ * masters share the same wires.
+ *
+ * Firmware code only runs when the simulator calls it: a TWI interrupt is
+ * taken when TWINT is set, TWIE/TWEN are on and the node's I flag is set.
+ * The node then holds SCL (through TWINT) for isr_cycles before the ISR
+ * body runs, which stands in for the interrupt latency and the ISR's own
+ * run time. Code the test calls directly (the main loop) takes no time.
+ * Busy-waits (__builtin_avr_delay_cycles, _delay_us) and sleep_cpu run the
+ * simulation forward for that node.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint64_t sim_time_t;
+
+#define SIM_F_CPU 16000000UL
+#define SIM_US(us) ((sim_time_t)(us) * (SIM_F_CPU / 1000000UL))
+#define SIM_MS(ms) ((sim_time_t)(ms) * (SIM_F_CPU / 1000UL))
+#define SIM_NEVER UINT64_MAX
+
+#define SIM_SDA 0
+#define SIM_SCL 1
+
+// Data-space addresses used by the shim (test/shim/avr/io.h)
+#define SIM_PINB 0x23
+#define SIM_PINC 0x26
+#define SIM_PIND 0x29
+#define SIM_PINE 0x2C
+#define SIM_SREG 0x5F
+#define SIM_TCNT1 0x84
+#define SIM_TWI0 0xB8
+#define SIM_TWI1 0xD8
+
+/* sim_hooks_t / sim_image_t
+ * The glue between a firmware image and the simulator (see image.c). The
+ * image exports one sim_image_t called iic_sim_image; the simulator binds
+ * its hooks to it, so the image doesn't link against the simulator.
+ */
+typedef struct sim_hooks_t{
+	void *ctx;
+	void (*delay)(void *ctx, uint32_t cycles);
+	void (*sleep)(void *ctx);
+} sim_hooks_t;
+
+typedef struct sim_image_t{
+	volatile uint8_t *io; // the image's register file
+	void (*vector[2])(void); // TWI_vect, TWI1_vect (NULL if not built)
+	void (*bind)(const sim_hooks_t *hooks);
+} sim_image_t;
+
+struct sim_bus_t;
+struct sim_twi_t;
+
+/* sim_agent_t
+ * Anything that drives the wires. An agent pulls a line low by setting
+ * sda_low / scl_low through sim_drive. step is called once simulated time
+ * reaches due. edge is called on every line change (after the bus monitor
+ * has seen it) and must not drive the lines itself - it sets due = now
+ * instead and does the driving in step. sync picks up register writes
+ * made by the agent's firmware.
+ */
+typedef struct sim_agent_t{
+	struct sim_bus_t *bus;
+	struct sim_agent_t *next; // next agent on the same bus
+	struct sim_agent_t *node_next; // next agent of the same node
+	int sda_low;
+	int scl_low;
+	sim_time_t due;
+	void (*step)(struct sim_agent_t *agent);
+	void (*edge)(struct sim_agent_t *agent, int line, int level);
+	void (*sync)(struct sim_agent_t *agent);
+} sim_agent_t;
+
+// Bus monitor events, for sim_bus_t.watch
+#define SIM_EVENT_START   0
+#define SIM_EVENT_RESTART 1
+#define SIM_EVENT_STOP    2
+#define SIM_EVENT_ADDRESS 3 // byte = address byte (address << 1 | R/W)
+#define SIM_EVENT_DATA    4
+
+/* sim_bus_t
+ * One pair of wires, with pull-ups, plus a monitor that decodes what goes
+ * over them.
+ */
+typedef struct sim_bus_t{
+	const char *name;
+	int sda; // line levels, 1 = high
+	int scl;
+	int sda_pulls; // agents pulling each line low
+	int scl_pulls;
+	sim_agent_t *agents;
+
+	// monitor
+	int busy; // between a START and a STOP
+	sim_time_t busy_since;
+	sim_time_t free_since;
+	sim_time_t busy_cycles; // total time the bus has been busy
+	uint64_t starts;
+	uint64_t restarts;
+	uint64_t stops;
+	uint64_t address_bytes;
+	uint64_t data_bytes;
+	uint64_t nacks;
+	int bit; // bits of the current byte clocked so far (-1 = no transfer)
+	uint8_t shift;
+	int first_byte; // the byte being clocked is an address
+	uint8_t last_byte;
+	int last_ack;
+
+	// optional text log: "S 50w+ 01+ 02- P", see sim_bus_log
+	char *log;
+	size_t log_len;
+	size_t log_cap;
+	void (*watch)(struct sim_bus_t *bus, int event, uint8_t byte, int ack, void *ctx);
+	void *watch_ctx;
+} sim_bus_t;
+
+typedef struct sim_timer_t{
+	sim_agent_t agent; // must stay first
+	struct sim_node_t *node;
+	sim_time_t period;
+	void (*fn)(void);
+	int pending;
+	uint64_t calls;
+	struct sim_timer_t *next;
+} sim_timer_t;
+
+/* sim_node_t
+ * One microcontroller running a firmware image.
+ */
+typedef struct sim_node_t{
+	const char *name;
+	volatile uint8_t *io;
+	const sim_image_t *image;
+	void *handle; // dlopen handle, NULL for the test binary's own image
+	struct sim_twi_t *twi[2];
+	sim_agent_t *agents; // TWIs and pins, in the order they were connected
+	sim_timer_t *timers;
+	int in_isr;
+	sim_time_t isr_cycles; // SCL hold charged for every TWI interrupt (latency + ISR body)
+	uint64_t isr_entries; // TWI interrupts taken
+	uint64_t timer_entries; // timer interrupts taken
+	sim_time_t isr_busy; // cycles spent in interrupts (charged cycles plus any busy-waits in them)
+	uint64_t wakeups; // interrupts of any kind, for sleep_cpu
+	uint64_t isr_counted[32]; // TWI interrupts counted by sim_icount, per status code >> 3
+	uint64_t isr_instructions[32]; // host instructions spent in them
+	uint64_t isr_instructions_max[32];
+	struct sim_node_t *next;
+} sim_node_t;
+
+// Simulator
+sim_time_t sim_now(void);
+void sim_run(sim_time_t cycles);
+int sim_run_until(int (*done)(void *arg), void *arg, sim_time_t limit);
+void sim_set_sleep_limit(sim_time_t limit);
+
+// Nodes
+sim_node_t *sim_node_attach(const sim_image_t *image, const char *name);
+sim_node_t *sim_node_load(const char *path, const char *name);
+void *sim_node_symbol(sim_node_t *node, const char *symbol);
+void sim_node_sync(sim_node_t *node);
+sim_timer_t *sim_every(sim_node_t *node, sim_time_t period, void (*fn)(void));
+void sim_set_isr_cycles(sim_node_t *node, sim_time_t cycles);
+
+// Buses
+sim_bus_t *sim_bus_new(const char *name);
+void sim_agent_add(sim_bus_t *bus, sim_agent_t *agent);
+void sim_drive(sim_agent_t *agent, int sda_low, int scl_low);
+void sim_bus_log(sim_bus_t *bus, int on);
+const char *sim_bus_log_text(sim_bus_t *bus);
+void sim_bus_log_clear(sim_bus_t *bus);
+
+// Wiring a node up (twi.c)
+struct sim_twi_t *sim_connect_twi(sim_node_t *node, int index, sim_bus_t *bus);
+sim_agent_t *sim_connect_pins(sim_node_t *node, uint8_t sda_pin, uint8_t sda_bit, uint8_t scl_pin, uint8_t scl_bit, sim_bus_t *bus);
+uint64_t sim_twi_entries(struct sim_twi_t *twi, uint8_t status);
+sim_time_t sim_twi_hold(struct sim_twi_t *twi, uint8_t status);
+sim_time_t sim_twi_hold_max(struct sim_twi_t *twi, uint8_t status);
+const char *sim_twi_status_log(struct sim_twi_t *twi);
+void sim_twi_reset_counts(struct sim_twi_t *twi);
+
+// Internal to the simulator (sim.c / twi.c)
+void sim_node_add_agent(sim_node_t *node, sim_agent_t *agent);
+void sim_irq_hint(void);
+int sim_twi_irq(struct sim_twi_t *twi);
+uint8_t sim_twi_status(struct sim_twi_t *twi);
+
+// Host instruction counts per TWI interrupt (icount.c, x86-64 Linux only)
+extern int sim_icount_on;
+int sim_icount_enable(void);
+void sim_icount_begin(void);
+uint64_t sim_icount_end(void);
+
+// Failing a test: prints the message and exits
+void sim_fail(const char *file, int line, const char *fmt, ...) __attribute__((format(printf, 3, 4), noreturn));
+#define SIM_CHECK(cond, ...) do{ if(!(cond)) sim_fail(__FILE__, __LINE__, __VA_ARGS__); }while(0)
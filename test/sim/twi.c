@@ -0,0 +1,830 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * twi.c
+ * model of the ATmega328P/PB TWI peripheral, and of GPIO pins on a bus
+ *
+ * The model follows the datasheet's status codes and bus behaviour:
+ *  - master: START once the bus has been free for half an SCL period,
+ *    repeated START, STOP, and STOP followed by START (TWSTO | TWSTA)
+ *  - SCL runs at F_CPU / (16 + 2 * TWBR * 4^TWPS), low and high for half a
+ *    period each; the high half only starts once SCL really is high, and a
+ *    master that sees SCL pulled low early goes low with it, so stretching
+ *    and clock synchronisation between masters work
+ *  - arbitration is checked on every rising SCL edge. A master that loses
+ *    in an address byte keeps listening, and gets 0x68 / 0x78 / 0xB0 if
+ *    the winner addressed it, 0x38 otherwise; a loss in a data byte (or a
+ *    NOT ACK bit) gives 0x38 straight away
+ *  - slave: address match against TWAR / TWAMR, general call, TWEA latched
+ *    per byte, 0xA0 on a STOP or repeated START while addressed as a
+ *    receiver
+ *  - SCL is held low while TWINT is set, except after 0xA0, 0x38 and a bus
+ *    error, where the TWI is no longer on the bus
+ *  - a START or STOP in the middle of a byte is a bus error (0x00)
+ *
+ * TWCR writes are spotted with the TWWC bit: the model always shows it
+ * set, the library never writes it, so a cleared TWWC means the firmware
+ * has written TWCR since the model last looked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sim/sim.h>
+
+#define B_TWINT 0x80
+#define B_TWEA  0x40
+#define B_TWSTA 0x20
+#define B_TWSTO 0x10
+#define B_TWWC  0x08
+#define B_TWEN  0x04
+#define B_TWIE  0x01
+#define CTRL_BITS (B_TWEA | B_TWSTA | B_TWSTO | B_TWEN | B_TWIE)
+
+#define R_TWBR  0
+#define R_TWSR  1
+#define R_TWAR  2
+#define R_TWDR  3
+#define R_TWCR  4
+#define R_TWAMR 5
+
+typedef enum{
+	M_IDLE,
+	M_START_WAIT, // TWSTA set, waiting for a free bus
+	M_START, // SDA low, SCL goes low after half a period
+	M_BIT_LOW, // SCL low, bit on SDA
+	M_BIT_RISE, // SCL released, waiting for it to go high
+	M_BIT_HIGH, // SCL high
+	M_HOLD, // TWINT set, holding SCL low
+	M_STOP_LOW, // SDA low, SCL low
+	M_STOP_RISE,
+	M_STOP_HIGH, // SCL high, SDA goes high after half a period
+	M_RESTART_LOW, // SDA released, SCL low
+	M_RESTART_RISE,
+	M_RESTART_HIGH, // SCL high, SDA goes low after half a period
+	M_LISTEN // lost arbitration in an address byte - the slave side decides
+} master_phase_t;
+
+typedef enum{
+	L_IDLE, // waiting for a START
+	L_ADDRESS,
+	L_ADDRESS_ACK,
+	L_HOLD, // addressed, TWINT set, holding SCL low
+	L_RX,
+	L_RX_ACK,
+	L_TX,
+	L_TX_ACK,
+	L_SKIP // not addressed - waiting for the next START or STOP
+} listener_phase_t;
+
+typedef struct sim_twi_t{
+	sim_agent_t agent; // must stay first
+	sim_node_t *node;
+	volatile uint8_t *reg;
+	uint8_t ctrl; // TWCR as last written, TWINT left out
+	int twint;
+	uint8_t status;
+	sim_time_t twint_since;
+
+	master_phase_t mphase;
+	sim_time_t m_due;
+	int m_sda;
+	int m_scl;
+	int restart; // the START being sent is a repeated one
+	int address_next; // next byte is an address
+	int address_byte; // byte on the wire is an address
+	int reading; // address sent was SLA+R
+	int rx; // byte on the wire is being received
+	int bit;
+	uint8_t byte;
+	uint8_t rx_byte;
+	int ack_out; // ACK to send after a received byte
+	int ack_in;
+	sim_time_t half;
+
+	listener_phase_t lphase;
+	sim_time_t l_due;
+	int s_sda;
+	int s_scl;
+	int l_bit;
+	uint8_t l_shift;
+	int l_read;
+	int l_gcall;
+	int l_arbitration; // addressed after losing arbitration
+	int l_tea; // TWEA latched for the byte on the wire
+	int l_acked;
+	int l_master_ack;
+	uint8_t l_tx_byte;
+
+	uint64_t entries[32];
+	sim_time_t hold[32];
+	sim_time_t hold_max[32];
+	char statuses[1024]; // "08 18 28 ..." - every status reported, for sim_twi_status_log
+	size_t statuses_len;
+} sim_twi_t;
+
+static void twi_schedule(sim_twi_t *twi){
+	twi -> agent.due = twi -> m_due < twi -> l_due ? twi -> m_due : twi -> l_due;
+}
+
+static void twi_apply(sim_twi_t *twi){
+	if(twi -> ctrl & B_TWEN){
+		sim_drive(&twi -> agent, twi -> m_sda || twi -> s_sda, twi -> m_scl || twi -> s_scl);
+	}else{
+		sim_drive(&twi -> agent, 0, 0);
+	}
+}
+
+static void twi_render(sim_twi_t *twi){
+	twi -> reg[R_TWCR] = twi -> ctrl | (twi -> twint ? B_TWINT : 0) | B_TWWC;
+	twi -> reg[R_TWSR] = (twi -> reg[R_TWSR] & 0x03) | twi -> status;
+}
+
+static void twi_interrupt(sim_twi_t *twi, uint8_t status){
+	twi -> twint = 1;
+	twi -> status = status;
+	twi -> twint_since = sim_now();
+	twi -> entries[status >> 3]++;
+	if(twi -> statuses_len + 4 < sizeof(twi -> statuses)){
+		twi -> statuses_len += snprintf(twi -> statuses + twi -> statuses_len, 4, twi -> statuses_len == 0 ? "%02x" : " %02x", status);
+	}
+	twi_render(twi);
+	sim_irq_hint();
+}
+
+static sim_time_t twi_half_period(sim_twi_t *twi){
+	uint32_t prescaler = 1UL << (2 * (twi -> reg[R_TWSR] & 0x03));
+	return (16 + 2UL * twi -> reg[R_TWBR] * prescaler) / 2;
+}
+
+static int master_owns_bus(sim_twi_t *twi){
+	return twi -> mphase != M_IDLE && twi -> mphase != M_START_WAIT && twi -> mphase != M_LISTEN;
+}
+
+static int slave_busy(sim_twi_t *twi){
+	return twi -> lphase != L_IDLE && twi -> lphase != L_SKIP && twi -> lphase != L_ADDRESS;
+}
+
+static void twi_reset(sim_twi_t *twi){
+	twi -> mphase = M_IDLE;
+	twi -> lphase = L_IDLE;
+	twi -> m_due = SIM_NEVER;
+	twi -> l_due = SIM_NEVER;
+	twi -> m_sda = twi -> m_scl = 0;
+	twi -> s_sda = twi -> s_scl = 0;
+	twi -> twint = 0;
+	twi -> status = 0xF8;
+	twi_schedule(twi);
+}
+
+//===========================================================================//
+//== Master                                                                ==//
+//===========================================================================//
+
+// Puts the current bit on SDA, with SCL low, and times the low half.
+static void master_bit_low(sim_twi_t *twi){
+	if(twi -> bit < 8){
+		twi -> m_sda = twi -> rx ? 0 : !((twi -> byte >> (7 - twi -> bit)) & 1);
+	}else{
+		twi -> m_sda = twi -> rx ? twi -> ack_out : 0;
+	}
+	twi -> m_scl = 1;
+	twi -> mphase = M_BIT_LOW;
+	twi_apply(twi);
+	twi -> m_due = sim_now() + twi -> half;
+}
+
+static void master_lost(sim_twi_t *twi){
+	twi -> m_sda = twi -> m_scl = 0;
+	if(twi -> address_byte){
+		twi -> mphase = M_LISTEN; // the slave side is following this address too
+		twi_apply(twi);
+	}else{
+		twi -> mphase = M_IDLE;
+		twi_apply(twi);
+		twi_interrupt(twi, 0x38);
+	}
+}
+
+// SCL has gone high: sample, and check arbitration.
+static void master_bit_high(sim_twi_t *twi){
+	int sda = twi -> agent.bus -> sda;
+	int released = !twi -> m_sda;
+	if(released && !sda && (twi -> bit < 8 ? !twi -> rx : twi -> rx)){
+		master_lost(twi); // sent a 1 (or a NOT ACK) and someone else sent a 0
+		return;
+	}
+	if(twi -> bit < 8){
+		twi -> rx_byte = (twi -> rx_byte << 1) | sda;
+	}else{
+		twi -> ack_in = !sda;
+	}
+	twi -> mphase = M_BIT_HIGH;
+	twi -> m_due = sim_now() + twi -> half;
+}
+
+static void master_byte_done(sim_twi_t *twi){
+	uint8_t status;
+	if(twi -> address_byte){
+		status = twi -> reading ? (twi -> ack_in ? 0x40 : 0x48) : (twi -> ack_in ? 0x18 : 0x20);
+	}else if(twi -> rx){
+		twi -> reg[R_TWDR] = twi -> rx_byte;
+		status = twi -> ack_out ? 0x50 : 0x58;
+	}else{
+		status = twi -> ack_in ? 0x28 : 0x30;
+	}
+	twi -> m_sda = 0;
+	twi -> m_scl = 1;
+	twi -> mphase = M_HOLD;
+	twi_apply(twi);
+	twi_interrupt(twi, status);
+}
+
+static void master_start_byte(sim_twi_t *twi){
+	twi -> half = twi_half_period(twi);
+	twi -> byte = twi -> reg[R_TWDR];
+	twi -> address_byte = twi -> address_next;
+	twi -> address_next = 0;
+	if(twi -> address_byte){
+		twi -> reading = twi -> byte & 1;
+		twi -> rx = 0;
+	}else{
+		twi -> rx = twi -> reading;
+	}
+	twi -> ack_out = twi -> rx && (twi -> ctrl & B_TWEA);
+	twi -> rx_byte = 0;
+	twi -> bit = 0;
+	master_bit_low(twi);
+}
+
+static void master_try_start(sim_twi_t *twi){
+	sim_bus_t *bus = twi -> agent.bus;
+	sim_time_t now = sim_now();
+	if(!(twi -> ctrl & B_TWSTA)){
+		twi -> mphase = M_IDLE;
+		return;
+	}
+	if(twi -> twint || slave_busy(twi)){
+		return; // waits for the firmware / the slave transfer
+	}
+	twi -> half = twi_half_period(twi);
+	if(bus -> busy){
+		// another master started in this very cycle: start too, and arbitrate -
+		// if the bus has been free for as long as we wait before a START
+		if(!(bus -> busy_since == now && bus -> scl && !bus -> sda && bus -> bit == 0 && now >= bus -> free_since + twi -> half)){
+			return;
+		}
+	}else{
+		if(!bus -> sda || !bus -> scl){
+			return;
+		}
+		if(now < bus -> free_since + twi -> half){
+			twi -> m_due = bus -> free_since + twi -> half;
+			return;
+		}
+	}
+	twi -> restart = 0;
+	twi -> m_sda = 1;
+	twi -> mphase = M_START;
+	twi_apply(twi);
+	twi -> m_due = now + twi -> half;
+}
+
+static void master_step(sim_twi_t *twi){
+	sim_bus_t *bus = twi -> agent.bus;
+	switch(twi -> mphase){
+		case M_START_WAIT:
+			master_try_start(twi);
+			break;
+
+		case M_START: // START (or repeated START) is out - SCL low, report it
+			twi -> m_scl = 1;
+			twi -> mphase = M_HOLD;
+			twi -> address_next = 1;
+			twi_apply(twi);
+			twi_interrupt(twi, twi -> restart ? 0x10 : 0x08);
+			break;
+
+		case M_BIT_LOW:
+			twi -> m_scl = 0;
+			twi -> mphase = M_BIT_RISE;
+			twi_apply(twi);
+			// fall through
+		case M_BIT_RISE:
+			if(bus -> scl){
+				master_bit_high(twi);
+			}
+			break;
+
+		case M_BIT_HIGH: // end of the high half (or someone pulled SCL low early)
+			twi -> bit++;
+			if(twi -> bit < 9){
+				master_bit_low(twi);
+			}else{
+				master_byte_done(twi);
+			}
+			break;
+
+		case M_STOP_LOW:
+			twi -> m_scl = 0;
+			twi -> mphase = M_STOP_RISE;
+			twi_apply(twi);
+			// fall through
+		case M_STOP_RISE:
+			if(bus -> scl){
+				twi -> mphase = M_STOP_HIGH;
+				twi -> m_due = sim_now() + twi -> half;
+			}
+			break;
+
+		case M_STOP_HIGH:
+			twi -> m_sda = 0;
+			twi -> ctrl &= ~B_TWSTO;
+			twi -> mphase = (twi -> ctrl & B_TWSTA) ? M_START_WAIT : M_IDLE;
+			twi_apply(twi);
+			twi_render(twi);
+			if(twi -> mphase == M_START_WAIT){
+				twi -> m_due = sim_now();
+			}
+			break;
+
+		case M_RESTART_LOW:
+			twi -> m_scl = 0;
+			twi -> mphase = M_RESTART_RISE;
+			twi_apply(twi);
+			// fall through
+		case M_RESTART_RISE:
+			if(bus -> scl){
+				twi -> mphase = M_RESTART_HIGH;
+				twi -> m_due = sim_now() + twi -> half;
+			}
+			break;
+
+		case M_RESTART_HIGH:
+			twi -> restart = 1;
+			twi -> m_sda = 1;
+			twi -> mphase = M_START;
+			twi_apply(twi);
+			twi -> m_due = sim_now() + twi -> half;
+			break;
+
+		default:
+			break;
+	}
+}
+
+// The firmware has cleared TWINT while we were master.
+static void master_resume(sim_twi_t *twi){
+	twi -> half = twi_half_period(twi);
+	if(twi -> ctrl & B_TWSTO){
+		twi -> m_sda = 1;
+		twi -> mphase = M_STOP_LOW;
+		twi_apply(twi);
+		twi -> m_due = sim_now() + twi -> half;
+	}else if(twi -> ctrl & B_TWSTA){
+		twi -> m_sda = 0;
+		twi -> mphase = M_RESTART_LOW;
+		twi_apply(twi);
+		twi -> m_due = sim_now() + twi -> half;
+	}else{
+		master_start_byte(twi);
+	}
+}
+
+static void master_edge(sim_twi_t *twi, int line, int level){
+	switch(twi -> mphase){
+		case M_START_WAIT:
+			twi -> m_due = sim_now();
+			break;
+		case M_START:
+		case M_BIT_HIGH:
+			if(line == SIM_SCL && !level){
+				twi -> m_due = sim_now(); // clock synchronisation: go low with the other master
+			}
+			break;
+		case M_BIT_RISE:
+		case M_STOP_RISE:
+		case M_RESTART_RISE:
+			if(line == SIM_SCL && level){
+				twi -> m_due = sim_now();
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+//===========================================================================//
+//== Slave                                                                 ==//
+//===========================================================================//
+
+static void listener_start(sim_twi_t *twi){
+	if(twi -> lphase == L_RX && twi -> l_bit <= 1){
+		twi_interrupt(twi, 0xA0); // repeated START while addressed as a receiver
+	}
+	twi -> lphase = L_ADDRESS;
+	twi -> l_bit = 0;
+	twi -> l_shift = 0;
+	twi -> s_sda = twi -> s_scl = 0;
+	twi -> l_due = sim_now();
+}
+
+static void listener_stop(sim_twi_t *twi){
+	if(twi -> lphase == L_RX && twi -> l_bit <= 1){
+		twi_interrupt(twi, 0xA0);
+	}
+	twi -> lphase = L_IDLE;
+	twi -> s_sda = twi -> s_scl = 0;
+	twi -> l_due = sim_now();
+}
+
+// Address byte is in: are we addressed?
+static void listener_address(sim_twi_t *twi){
+	uint8_t address = twi -> l_shift;
+	uint8_t twar = twi -> reg[R_TWAR];
+	uint8_t mask = twi -> reg[R_TWAMR] >> 1;
+	int lost = twi -> mphase == M_LISTEN;
+	if(master_owns_bus(twi)){
+		twi -> lphase = L_SKIP; // our own master's address
+		return;
+	}
+	int gcall = address == 0x00 && (twar & 0x01);
+	int match = address != 0x00 && ((((address >> 1) ^ (twar >> 1)) & ~mask & 0x7F) == 0);
+	if((twi -> ctrl & B_TWEA) && !twi -> twint && (gcall || match)){
+		twi -> l_read = address & 1;
+		twi -> l_gcall = gcall;
+		twi -> l_arbitration = lost;
+		twi -> s_sda = 1;
+		twi -> lphase = L_ADDRESS_ACK;
+		twi -> l_due = sim_now();
+		if(lost){
+			twi -> mphase = M_IDLE;
+		}
+	}else{
+		twi -> lphase = L_SKIP;
+		if(lost){
+			twi -> mphase = M_IDLE;
+			twi_interrupt(twi, 0x38);
+		}
+	}
+}
+
+static void listener_hold(sim_twi_t *twi, uint8_t status){
+	twi -> s_sda = 0;
+	twi -> s_scl = 1;
+	twi -> lphase = L_HOLD;
+	twi -> l_due = sim_now();
+	twi_interrupt(twi, status);
+}
+
+static void listener_rise(sim_twi_t *twi){
+	switch(twi -> lphase){
+		case L_ADDRESS:
+		case L_RX:
+			twi -> l_shift = (twi -> l_shift << 1) | twi -> agent.bus -> sda;
+			twi -> l_bit++;
+			break;
+		case L_TX:
+			twi -> l_bit++;
+			break;
+		case L_TX_ACK:
+			twi -> l_master_ack = !twi -> agent.bus -> sda;
+			break;
+		default:
+			break;
+	}
+}
+
+static void listener_fall(sim_twi_t *twi){
+	switch(twi -> lphase){
+		case L_ADDRESS:
+			if(twi -> l_bit == 8){
+				listener_address(twi);
+			}
+			break;
+
+		case L_ADDRESS_ACK:
+			if(twi -> l_read){
+				listener_hold(twi, twi -> l_arbitration ? 0xB0 : 0xA8);
+			}else if(twi -> l_gcall){
+				listener_hold(twi, twi -> l_arbitration ? 0x78 : 0x70);
+			}else{
+				listener_hold(twi, twi -> l_arbitration ? 0x68 : 0x60);
+			}
+			break;
+
+		case L_RX:
+			if(twi -> l_bit == 8){
+				twi -> reg[R_TWDR] = twi -> l_shift;
+				twi -> l_acked = twi -> l_tea;
+				twi -> s_sda = twi -> l_tea;
+				twi -> lphase = L_RX_ACK;
+				twi -> l_due = sim_now();
+			}
+			break;
+
+		case L_RX_ACK:
+			if(twi -> l_gcall){
+				listener_hold(twi, twi -> l_acked ? 0x90 : 0x98);
+			}else{
+				listener_hold(twi, twi -> l_acked ? 0x80 : 0x88);
+			}
+			break;
+
+		case L_TX:
+			if(twi -> l_bit < 8){
+				twi -> s_sda = !((twi -> l_tx_byte >> (7 - twi -> l_bit)) & 1);
+			}else{
+				twi -> s_sda = 0;
+				twi -> lphase = L_TX_ACK;
+			}
+			twi -> l_due = sim_now();
+			break;
+
+		case L_TX_ACK:
+			listener_hold(twi, !twi -> l_master_ack ? 0xC0 : twi -> l_tea ? 0xB8 : 0xC8);
+			break;
+
+		default:
+			break;
+	}
+}
+
+// The firmware has cleared TWINT while we were addressed.
+static void listener_resume(sim_twi_t *twi){
+	uint8_t status = twi -> status;
+	twi -> s_scl = 0;
+	if(twi -> ctrl & B_TWSTO){
+		twi -> ctrl &= ~B_TWSTO; // slave mode: just let go of the bus
+		twi -> s_sda = 0;
+		twi -> lphase = L_SKIP;
+	}else if(status == 0xA8 || status == 0xB0 || status == 0xB8){
+		twi -> l_tx_byte = twi -> reg[R_TWDR];
+		twi -> l_tea = (twi -> ctrl & B_TWEA) != 0;
+		twi -> l_bit = 0;
+		twi -> s_sda = !(twi -> l_tx_byte & 0x80);
+		twi -> lphase = L_TX;
+	}else if(status == 0x60 || status == 0x68 || status == 0x70 || status == 0x78 || status == 0x80 || status == 0x90){
+		twi -> l_tea = (twi -> ctrl & B_TWEA) != 0;
+		twi -> l_bit = 0;
+		twi -> l_shift = 0;
+		twi -> lphase = L_RX;
+	}else{
+		twi -> s_sda = 0;
+		twi -> lphase = L_SKIP; // NACKed / last byte: no longer addressed
+	}
+	twi_apply(twi);
+}
+
+//===========================================================================//
+//== Agent                                                                 ==//
+//===========================================================================//
+
+static void twi_step(sim_agent_t *agent){
+	sim_twi_t *twi = (sim_twi_t*)agent;
+	sim_time_t now = sim_now();
+	if(twi -> l_due <= now){
+		twi -> l_due = SIM_NEVER;
+		twi_apply(twi);
+	}
+	if(twi -> m_due <= now){
+		twi -> m_due = SIM_NEVER;
+		master_step(twi);
+	}
+	twi_schedule(twi);
+}
+
+static void twi_bus_error(sim_twi_t *twi){
+	twi -> mphase = M_IDLE;
+	twi -> lphase = L_IDLE;
+	twi -> m_sda = twi -> m_scl = 0;
+	twi -> s_sda = twi -> s_scl = 0;
+	twi -> m_due = SIM_NEVER;
+	twi -> l_due = sim_now(); // let go of the lines
+	twi_interrupt(twi, 0x00);
+}
+
+static void twi_edge(sim_agent_t *agent, int line, int level){
+	sim_twi_t *twi = (sim_twi_t*)agent;
+	sim_bus_t *bus = agent -> bus;
+	if(!(twi -> ctrl & B_TWEN)){
+		return;
+	}
+	if(line == SIM_SDA && bus -> scl){
+		int mid_byte = (twi -> mphase == M_BIT_LOW || twi -> mphase == M_BIT_RISE || twi -> mphase == M_BIT_HIGH)
+			|| ((twi -> lphase == L_RX || twi -> lphase == L_TX) && twi -> l_bit > 1); // a STOP comes after the first rise
+		if(mid_byte){
+			twi_bus_error(twi); // START or STOP in the middle of a byte
+			twi_schedule(twi);
+			return;
+		}
+		if(!level){
+			if(!master_owns_bus(twi) || twi -> mphase == M_START){
+				listener_start(twi);
+			}
+		}else{
+			listener_stop(twi);
+		}
+	}else if(line == SIM_SCL){
+		if(level){
+			listener_rise(twi);
+		}else{
+			listener_fall(twi);
+		}
+	}
+	master_edge(twi, line, level);
+	twi_schedule(twi);
+}
+
+// Looks for a TWCR write by the firmware.
+static void twi_sync(sim_agent_t *agent){
+	sim_twi_t *twi = (sim_twi_t*)agent;
+	uint8_t written = twi -> reg[R_TWCR];
+	if(written & B_TWWC){
+		return;
+	}
+	uint8_t old = twi -> ctrl;
+	twi -> ctrl = written & CTRL_BITS;
+
+	if(!(twi -> ctrl & B_TWEN)){
+		if(old & B_TWEN){
+			twi_reset(twi);
+			twi_apply(twi);
+		}
+		twi_render(twi);
+		return;
+	}
+	if(!(old & B_TWEN)){
+		twi_reset(twi);
+	}
+
+	if((written & B_TWINT) && twi -> twint){
+		sim_time_t held = sim_now() - twi -> twint_since;
+		twi -> hold[twi -> status >> 3] += held;
+		if(held > twi -> hold_max[twi -> status >> 3]){
+			twi -> hold_max[twi -> status >> 3] = held;
+		}
+		twi -> twint = 0;
+		if(twi -> mphase == M_HOLD){
+			master_resume(twi);
+		}else if(twi -> lphase == L_HOLD){
+			listener_resume(twi);
+		}
+		twi -> status = 0xF8;
+	}
+	if(!twi -> twint && !master_owns_bus(twi)){
+		if((twi -> ctrl & B_TWSTA) && (twi -> mphase == M_IDLE || twi -> mphase == M_START_WAIT)){
+			twi -> mphase = M_START_WAIT;
+			twi -> m_due = sim_now();
+		}else if(!(twi -> ctrl & B_TWSTA) && twi -> mphase == M_START_WAIT){
+			twi -> mphase = M_IDLE;
+			twi -> m_due = SIM_NEVER;
+		}
+	}
+	twi_render(twi);
+	twi_schedule(twi);
+}
+
+int sim_twi_irq(sim_twi_t *twi){
+	return twi -> twint && (twi -> ctrl & B_TWIE) && (twi -> ctrl & B_TWEN);
+}
+
+uint8_t sim_twi_status(sim_twi_t *twi){
+	return twi -> status;
+}
+
+uint64_t sim_twi_entries(sim_twi_t *twi, uint8_t status){
+	return twi -> entries[status >> 3];
+}
+
+sim_time_t sim_twi_hold(sim_twi_t *twi, uint8_t status){
+	return twi -> hold[status >> 3];
+}
+
+sim_time_t sim_twi_hold_max(sim_twi_t *twi, uint8_t status){
+	return twi -> hold_max[status >> 3];
+}
+
+// Status codes reported since the last sim_twi_reset_counts, oldest first
+// (stops recording once the buffer is full).
+const char *sim_twi_status_log(sim_twi_t *twi){
+	return twi -> statuses;
+}
+
+void sim_twi_reset_counts(sim_twi_t *twi){
+	twi -> statuses_len = 0;
+	twi -> statuses[0] = '\0';
+	for(int dex = 0; dex < 32; dex++){
+		twi -> entries[dex] = 0;
+		twi -> hold[dex] = 0;
+		twi -> hold_max[dex] = 0;
+	}
+}
+
+//===========================================================================//
+//== GPIO pins                                                             ==//
+//===========================================================================//
+
+/* A pin pair on a bus: PINx follows the wires, and a pin that is an output
+ * driving low (DDR set, PORT clear) pulls its wire down - unless it
+ * belongs to a TWI that is switched on, which then owns the pins.
+ */
+typedef struct sim_pins_t{
+	sim_agent_t agent; // must stay first
+	sim_node_t *node;
+	sim_twi_t *twi;
+	uint8_t sda_pin;
+	uint8_t sda_mask;
+	uint8_t scl_pin;
+	uint8_t scl_mask;
+} sim_pins_t;
+
+static void pins_show(sim_pins_t *pins){
+	volatile uint8_t *io = pins -> node -> io;
+	sim_bus_t *bus = pins -> agent.bus;
+	io[pins -> sda_pin] = bus -> sda ? io[pins -> sda_pin] | pins -> sda_mask : io[pins -> sda_pin] & ~pins -> sda_mask;
+	io[pins -> scl_pin] = bus -> scl ? io[pins -> scl_pin] | pins -> scl_mask : io[pins -> scl_pin] & ~pins -> scl_mask;
+}
+
+static void pins_sync(sim_agent_t *agent){
+	sim_pins_t *pins = (sim_pins_t*)agent;
+	volatile uint8_t *io = pins -> node -> io;
+	int sda_low = 0;
+	int scl_low = 0;
+	if(pins -> twi == NULL || !(pins -> twi -> ctrl & B_TWEN)){
+		// DDR and PORT sit right after PIN
+		sda_low = (io[pins -> sda_pin + 1] & pins -> sda_mask) && !(io[pins -> sda_pin + 2] & pins -> sda_mask);
+		scl_low = (io[pins -> scl_pin + 1] & pins -> scl_mask) && !(io[pins -> scl_pin + 2] & pins -> scl_mask);
+	}
+	sim_drive(agent, sda_low, scl_low);
+	pins_show(pins);
+}
+
+static void pins_edge(sim_agent_t *agent, int line, int level){
+	(void)line;
+	(void)level;
+	pins_show((sim_pins_t*)agent);
+}
+
+static void pins_step(sim_agent_t *agent){
+	(void)agent;
+}
+
+static sim_pins_t *pins_new(sim_node_t *node, uint8_t sda_pin, uint8_t sda_bit, uint8_t scl_pin, uint8_t scl_bit, sim_bus_t *bus){
+	sim_pins_t *pins = calloc(1, sizeof(sim_pins_t));
+	pins -> node = node;
+	pins -> sda_pin = sda_pin;
+	pins -> sda_mask = 1 << sda_bit;
+	pins -> scl_pin = scl_pin;
+	pins -> scl_mask = 1 << scl_bit;
+	pins -> agent.due = SIM_NEVER;
+	pins -> agent.step = pins_step;
+	pins -> agent.edge = pins_edge;
+	pins -> agent.sync = pins_sync;
+	sim_agent_add(bus, &pins -> agent);
+	sim_node_add_agent(node, &pins -> agent);
+	pins_show(pins);
+	return pins;
+}
+
+// Connects GPIO pins (e.g. for a bit-banged master) to a bus.
+sim_agent_t *sim_connect_pins(sim_node_t *node, uint8_t sda_pin, uint8_t sda_bit, uint8_t scl_pin, uint8_t scl_bit, sim_bus_t *bus){
+	return &pins_new(node, sda_pin, sda_bit, scl_pin, scl_bit, bus) -> agent;
+}
+
+// Connects TWI0 (index 0, on PC4/PC5) or TWI1 (index 1, on PE0/PE1) of a
+// node to a bus.
+sim_twi_t *sim_connect_twi(sim_node_t *node, int index, sim_bus_t *bus){
+	sim_twi_t *twi = calloc(1, sizeof(sim_twi_t));
+	twi -> node = node;
+	twi -> reg = &node -> io[index == 0 ? SIM_TWI0 : SIM_TWI1];
+	twi -> agent.step = twi_step;
+	twi -> agent.edge = twi_edge;
+	twi -> agent.sync = twi_sync;
+	twi_reset(twi);
+	twi -> reg[R_TWBR] = 0;
+	twi -> reg[R_TWSR] = 0xF8;
+	twi -> reg[R_TWAR] = 0xFE;
+	twi -> reg[R_TWDR] = 0xFF;
+	twi -> reg[R_TWAMR] = 0;
+	twi_render(twi);
+	sim_agent_add(bus, &twi -> agent);
+	sim_node_add_agent(node, &twi -> agent);
+	node -> twi[index] = twi;
+
+	sim_pins_t *pins = index == 0 ? pins_new(node, SIM_PINC, 4, SIM_PINC, 5, bus) : pins_new(node, SIM_PINE, 0, SIM_PINE, 1, bus);
+	pins -> twi = twi;
+	return twi;
+}
@@ -0,0 +1,257 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_address_server.c
+ * the address server (built into this binary with ADDRESS_SERVER) against
+ * 100 client boards (fw_client.so) powering up together
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/api.h>
+
+#define CLIENTS 100
+#define CLIENT_TICK SIM_MS(1)
+#define SERVER_TICK SIM_MS(10)
+// the server asks at most a queue's worth of lease holders per tick, so
+// leases that run out together take this many ticks to get through
+#define RELEASE_TICKS ((CLIENTS + IIC_QUEUE_LEN - 2) / (IIC_QUEUE_LEN - 1))
+
+extern const sim_image_t iic_sim_image;
+extern volatile uint8_t address_arr[16]; // the server's allocation bitmap
+
+typedef struct client_t{
+	sim_node_t *node;
+	sim_api_t api;
+	void (*start)(uint16_t, uint8_t, iic_prescaler_t);
+	address_client_state_t (*state)(void);
+	uint8_t (*address)(void);
+	void (*release)(void);
+} client_t;
+
+static sim_bus_t *bus;
+static client_t clients[CLIENTS + 1];
+static uint8_t ring[64];
+static int lease_ticks_on;
+
+static void server_frames(volatile iic_t *iic){
+	uint8_t frame[8];
+	uint8_t len;
+	while((len = iic_slave_read_frame(iic, frame, sizeof(frame), NULL)) != 0){
+		if(!handle_address_negotiation(frame[0], len > 2 ? frame[1] | frame[2] << 8 : 0) && len > 1){
+			handle_address_release(frame[0], frame[1]);
+		}
+	}
+}
+
+static void server_tick(void){
+	if(lease_ticks_on){
+		address_server_tick();
+	}
+}
+
+static void server_watchdog(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static void client_load(client_t *client, int index){
+	char name[16];
+	snprintf(name, sizeof(name), "client%d", index);
+	client -> node = sim_node_load("test/build/fw_client.so", strdup(name));
+	sim_connect_twi(client -> node, 0, bus);
+	sim_api_load(client -> node, &client -> api);
+	client -> start = sim_node_symbol(client -> node, "fw_client_start");
+	client -> state = sim_node_symbol(client -> node, "address_client_state");
+	client -> address = sim_node_symbol(client -> node, "address_client_address");
+	client -> release = sim_node_symbol(client -> node, "address_client_release");
+	sim_every(client -> node, CLIENT_TICK, sim_node_symbol(client -> node, "fw_client_tick"));
+	sim_every(client -> node, SIM_US(100), sim_node_symbol(client -> node, "fw_watchdog"));
+}
+
+// Power-up; the board's id stands in for its serial number.
+static void client_start(int index){
+	clients[index].start(0x1234 + 77 * index, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL));
+}
+
+static bool allocated(uint8_t address){
+	return (address_arr[address >> 3] >> (address & 0x07)) & 1;
+}
+
+static int count_allocated(void){
+	int count = 0;
+	for(uint8_t address = 0x08; address <= 0x77; address++){
+		count += allocated(address);
+	}
+	return count;
+}
+
+typedef struct join_t{
+	int first;
+	int count;
+} join_t;
+
+static int all_addressed(void *arg){
+	join_t *join = arg;
+	for(int dex = join -> first; dex < join -> first + join -> count; dex++){
+		if(clients[dex].state() != ADDRESS_CLIENT_ADDRESSED){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Every board ends up with its own address in 0x08..0x77, the server's
+// bitmap agrees, and each board really answers at it.
+static void check_addresses(int count){
+	uint8_t owner[128];
+	memset(owner, 0xFF, sizeof(owner));
+	for(int dex = 0; dex < count; dex++){
+		uint8_t address = clients[dex].address();
+		SIM_CHECK(address >= 0x08 && address <= 0x77, "client %d got %02x", dex, address);
+		SIM_CHECK(owner[address] == 0xFF, "clients %d and %d both got %02x", owner[address], dex, address);
+		SIM_CHECK(allocated(address), "%02x isn't allocated on the server", address);
+		SIM_CHECK(clients[dex].api.module -> twi -> twar >> 1 == address, "client %d answers at %02x, not %02x", dex, clients[dex].api.module -> twi -> twar >> 1, address);
+		owner[address] = dex;
+	}
+}
+
+// All 100 power up in the same cycle. A second allocation to a board that
+// already had its address is never confirmed, and the server takes it back
+// within the reply window: none are left over.
+static void test_join_storm(void){
+	lease_ticks_on = 1;
+	for(int dex = 0; dex < CLIENTS; dex++){
+		client_start(dex);
+	}
+	join_t join = {0, CLIENTS};
+	sim_time_t start = sim_now();
+	SIM_CHECK(sim_run_until(all_addressed, &join, SIM_MS(2000)), "not every client was addressed");
+	double took = (double)(sim_now() - start) * 1e3 / SIM_F_CPU;
+	int leftover = count_allocated() - CLIENTS;
+	sim_run(SERVER_TICK * (IIC_ADDRESS_OFFER_TICKS + 2));
+	lease_ticks_on = 0;
+	printf("%d clients addressed in %.1f ms, %d addresses left over, %d after the reply window\n", CLIENTS, took, leftover, count_allocated() - CLIENTS);
+	SIM_CHECK(sim_run_until(all_addressed, &join, SIM_MS(500)), "not every client kept its address");
+	check_addresses(CLIENTS);
+	SIM_CHECK(count_allocated() == CLIENTS, "%d addresses out for %d boards", count_allocated(), CLIENTS);
+}
+
+// An allocation to a board that never takes it up (it already had one, or
+// has gone) is probed once the reply window is up, nobody answers, and the
+// address is free again.
+static void test_unconfirmed(void){
+	uint8_t lowest = 0x08;
+	while(allocated(lowest)){
+		lowest++;
+	}
+	lease_ticks_on = 1;
+	handle_address_negotiation(IIC_COMMAND_REQUEST_ADDRESS, 0xBEEF); // no board has this id
+	sim_run(SIM_MS(2));
+	SIM_CHECK(allocated(lowest), "%02x wasn't allocated", lowest);
+	sim_run(SERVER_TICK * (IIC_ADDRESS_OFFER_TICKS + 2));
+	lease_ticks_on = 0;
+	SIM_CHECK(!allocated(lowest), "unconfirmed %02x still allocated", lowest);
+	SIM_CHECK(count_allocated() == CLIENTS, "%d addresses out for %d boards", count_allocated(), CLIENTS);
+}
+
+// A board that leaves frees its address; the next board to ask gets the
+// lowest free one, which is that one.
+static void test_release(void){
+	uint8_t address = clients[40].address();
+	clients[40].release();
+	sim_run(SIM_MS(10));
+	SIM_CHECK(!allocated(address), "%02x still allocated after its release", address);
+	client_start(40);
+	join_t join = {40, 1};
+	SIM_CHECK(sim_run_until(all_addressed, &join, SIM_MS(500)), "client didn't rejoin");
+	SIM_CHECK(clients[40].address() == address, "rejoined at %02x, not the freed %02x", clients[40].address(), address);
+	check_addresses(CLIENTS);
+	SIM_CHECK(count_allocated() == CLIENTS, "server has %d addresses out, %d boards", count_allocated(), CLIENTS);
+}
+
+// Leases run out: every board still there disputes the release request and
+// keeps its address; one that has gone quiet loses it.
+static void test_leases(void){
+	uint8_t gone = clients[7].address();
+	clients[7].api.disable(clients[7].api.module);
+	lease_ticks_on = 1;
+	sim_run(SERVER_TICK * (IIC_ADDRESS_LEASE_TICKS + RELEASE_TICKS + 2 * IIC_ADDRESS_RELEASE_GRACE_TICKS + 4));
+	lease_ticks_on = 0;
+	sim_run(SIM_MS(20));
+	SIM_CHECK(!allocated(gone), "%02x still allocated to a board that's gone", gone);
+	for(int dex = 0; dex < CLIENTS; dex++){
+		if(dex != 7){
+			SIM_CHECK(clients[dex].state() == ADDRESS_CLIENT_ADDRESSED && allocated(clients[dex].address()), "client %d lost %02x", dex, clients[dex].address());
+		}
+	}
+	SIM_CHECK(count_allocated() == CLIENTS - 1, "%d addresses out", count_allocated());
+	uint8_t lowest = 0x08; // allocation is lowest-free
+	while(allocated(lowest)){
+		lowest++;
+	}
+	clients[7].api.enable(clients[7].api.module);
+	client_start(7);
+	join_t join = {7, 1};
+	SIM_CHECK(sim_run_until(all_addressed, &join, SIM_MS(500)), "client 7 didn't rejoin");
+	SIM_CHECK(clients[7].address() == lowest, "rejoined at %02x, not %02x", clients[7].address(), lowest);
+	check_addresses(CLIENTS);
+	SIM_CHECK(count_allocated() == CLIENTS, "server has %d addresses out, %d boards", count_allocated(), CLIENTS);
+}
+
+// Fill the rest of the bus; one board more is told there is no room and
+// keeps backing off without an address.
+static void test_no_room(void){
+	int extra = 0x78 - 0x08 - CLIENTS;
+	for(int dex = 0; dex < extra; dex++){
+		handle_address_negotiation(IIC_COMMAND_REQUEST_ADDRESS, 0); // taken by boards we don't simulate
+		sim_run(SIM_MS(1)); // only IIC_ADDRESS_SERVER_REPLIES replies fit in the queue
+	}
+	SIM_CHECK(count_allocated() == 0x78 - 0x08, "%d addresses out", count_allocated());
+
+	client_load(&clients[CLIENTS], CLIENTS);
+	sim_bus_log(bus, 1);
+	client_start(CLIENTS);
+	sim_run(SIM_MS(100));
+	SIM_CHECK(strstr(sim_bus_log_text(bus), "00w+ a2+") != NULL, "no NO_ROOM_ON_BUS sent: %s", sim_bus_log_text(bus));
+	SIM_CHECK(clients[CLIENTS].state() == ADDRESS_CLIENT_BACKOFF && clients[CLIENTS].address() == 0, "client without room is in state %d at %02x", clients[CLIENTS].state(), clients[CLIENTS].address());
+	sim_bus_log(bus, 0);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *server = sim_node_attach(&iic_sim_image, "server");
+	sim_connect_twi(server, 0, bus);
+	sim_every(server, SERVER_TICK, server_tick);
+	sim_every(server, SIM_US(100), server_watchdog);
+	setup_iic(&IIC_MODULE, IIC_ADDRESS_SERVER_ADDRESS, true, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), server_frames);
+	enable_iic(&IIC_MODULE);
+
+	for(int dex = 0; dex < CLIENTS; dex++){
+		client_load(&clients[dex], dex);
+	}
+
+	test_join_storm();
+	test_unconfirmed();
+	test_leases();
+	test_release();
+	test_no_room();
+	printf("test_address_server: ok\n");
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_bitrate.c
+ * IIC_TWBR_FOR / IIC_PRESCALER_FOR and iic_compute_bitrate, at 1, 8, 16
+ * and 20 MHz from 1 kHz to 1 MHz, plus the SCL the bus model really runs at
+ */
+
+#include <stdio.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static const uint32_t clocks[] = {1000000UL, 8000000UL, 16000000UL, 20000000UL};
+
+// For every target: the macros and the function agree; the result never
+// runs faster than asked; one TWBR step less would; and no smaller
+// prescaler could have done it. Targets out of reach make the function
+// return false, and only those.
+static void check(uint32_t f_cpu, uint32_t scl_hz){
+	uint8_t bitrate;
+	iic_prescaler_t prescaler;
+	bool ok = iic_compute_bitrate(f_cpu, scl_hz, &bitrate, &prescaler);
+	uint32_t divider = IIC_SCL_DIVIDER(f_cpu, scl_hz);
+	if(divider < 16){
+		SIM_CHECK(!ok, "%lu Hz from %lu Hz accepted", (unsigned long)scl_hz, (unsigned long)f_cpu);
+		return;
+	}
+	if(IIC_TWBR_FOR(f_cpu, scl_hz) > 255){
+		SIM_CHECK(!ok && bitrate == 255 && prescaler == IIC_PRESCALER_64_gc, "%lu Hz from %lu Hz: too slow, but accepted", (unsigned long)scl_hz, (unsigned long)f_cpu);
+		SIM_CHECK(IIC_SCL_HZ(f_cpu, 255, IIC_PRESCALER_64_gc) > scl_hz, "%lu Hz from %lu Hz was reachable", (unsigned long)scl_hz, (unsigned long)f_cpu);
+		return;
+	}
+	SIM_CHECK(ok, "%lu Hz from %lu Hz rejected", (unsigned long)scl_hz, (unsigned long)f_cpu);
+	SIM_CHECK(bitrate == IIC_TWBR_FOR(f_cpu, scl_hz) && prescaler == IIC_PRESCALER_FOR(f_cpu, scl_hz),
+		"%lu Hz from %lu Hz: function %d/%d, macros %lu/%d", (unsigned long)scl_hz, (unsigned long)f_cpu,
+		bitrate, prescaler, (unsigned long)IIC_TWBR_FOR(f_cpu, scl_hz), IIC_PRESCALER_FOR(f_cpu, scl_hz));
+
+	uint32_t period = 16 + 2UL * bitrate * IIC_PRESCALER_VALUE(prescaler);
+	SIM_CHECK((uint64_t)period * scl_hz >= f_cpu, "%lu Hz from %lu Hz: TWBR %d runs fast", (unsigned long)scl_hz, (unsigned long)f_cpu, bitrate);
+	if(bitrate > 0){
+		uint32_t faster = period - 2 * IIC_PRESCALER_VALUE(prescaler);
+		SIM_CHECK((uint64_t)faster * scl_hz < f_cpu, "%lu Hz from %lu Hz: TWBR %d is more than needed", (unsigned long)scl_hz, (unsigned long)f_cpu, bitrate);
+	}
+	if(prescaler != IIC_PRESCALER_1_gc){
+		SIM_CHECK(IIC_TWBR_FOR_PRESCALER(f_cpu, scl_hz, IIC_PRESCALER_VALUE(prescaler - 1)) > 255, "%lu Hz from %lu Hz: prescaler %d too coarse", (unsigned long)scl_hz, (unsigned long)f_cpu, prescaler);
+	}
+}
+
+// 1 kHz to 1 MHz in 1% steps, plus the usual bus speeds exactly.
+static int sweep(uint32_t f_cpu){
+	static const uint32_t standard[] = {10000UL, 50000UL, 100000UL, 400000UL, 1000000UL};
+	int count = 0;
+	for(uint32_t scl_hz = 1000; scl_hz <= 1000000UL; scl_hz += scl_hz / 100){
+		check(f_cpu, scl_hz);
+		count++;
+	}
+	for(size_t dex = 0; dex < sizeof(standard) / sizeof(standard[0]); dex++){
+		check(f_cpu, standard[dex]);
+		count++;
+	}
+	return count;
+}
+
+// The bus model times SCL from TWBR/TWPS like the hardware, so a 16-byte
+// write at the chosen setting should take 9 clocks per byte at that rate.
+static void check_on_bus(uint32_t scl_hz){
+	static sim_bus_t *bus;
+	static uint8_t data[16];
+	if(bus == NULL){
+		bus = sim_bus_new("bus");
+		sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+		sim_connect_twi(local, 0, bus);
+		sim_set_isr_cycles(local, 0);
+		sim_device_new(bus, 0x50);
+		setup_iic(&IIC_MODULE, 0x10, false, false, 0, IIC_PRESCALER_1_gc, 3, NULL);
+		enable_iic(&IIC_MODULE);
+	}
+	SIM_CHECK(iic_set_bus_speed(&IIC_MODULE, F_CPU, scl_hz), "%lu Hz rejected", (unsigned long)scl_hz);
+	sim_time_t busy = bus -> busy_cycles;
+	iic_write_many(&IIC_MODULE, 0x50, data, sizeof(data));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(100));
+	double clocks_per_bit = (double)(bus -> busy_cycles - busy) / (9 * (sizeof(data) + 1));
+	double expected = (double)F_CPU / IIC_SCL_ACHIEVED(F_CPU, scl_hz);
+	SIM_CHECK(clocks_per_bit >= expected * 0.98 && clocks_per_bit <= expected * 1.10,
+		"%lu Hz: %.1f cycles per SCL period on the bus, %.1f expected", (unsigned long)scl_hz, clocks_per_bit, expected);
+}
+
+int main(void){
+	int count = 0;
+	for(size_t dex = 0; dex < sizeof(clocks) / sizeof(clocks[0]); dex++){
+		count += sweep(clocks[dex]);
+	}
+	check_on_bus(10000UL);
+	check_on_bus(100000UL);
+	check_on_bus(400000UL);
+	printf("test_bitrate: ok (%d settings)\n", count);
+	return 0;
+}
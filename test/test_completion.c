@@ -0,0 +1,236 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_completion.c
+ * every way a queued master transaction can end fires its callback exactly
+ * once, with the right result and event
+ *
+ * Built with IIC_ARBITRATION_RETRIES=0 (see the Makefile), so a single lost
+ * arbitration ends a transaction instead of parking it for a retry.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_api_t remote;
+static sim_device_t *device;
+
+typedef struct tracked_t{
+	iic_transaction_t transaction; // must stay first
+	int calls;
+	iic_error_t error;
+} tracked_t;
+
+static void done(iic_transaction_t *transaction, iic_error_t error){
+	tracked_t *tracked = (tracked_t*)transaction;
+	tracked -> calls++;
+	tracked -> error = error;
+}
+
+static void local_tick(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static void start_read_after(tracked_t *tracked, iic_state_t direction, uint8_t address, uint8_t *buffer, iic_len_t len, uint8_t flags, uint8_t *read_buffer, iic_len_t read_len){
+	*tracked = (tracked_t){.transaction = {
+		.remote_address = address, .direction = direction, .buffer = buffer, .buffer_len = len,
+		.read_buffer = read_buffer, .read_len = read_len, .flags = flags, .callback = done
+	}};
+	iic_take_events(&IIC_MODULE, 0xFF);
+	SIM_CHECK(iic_enqueue(&IIC_MODULE, &tracked -> transaction), "queue full");
+}
+
+static void start(tracked_t *tracked, iic_state_t direction, uint8_t address, uint8_t *buffer, iic_len_t len, uint8_t flags){
+	start_read_after(tracked, direction, address, buffer, len, flags, NULL, 0);
+}
+
+// Lets the bus settle for a while longer, so a second completion would show.
+static void finish(tracked_t *tracked, iic_error_t expected, const char *what){
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(20));
+	sim_run(SIM_MS(2));
+	SIM_CHECK(tracked -> calls == 1, "%s: %d completions", what, tracked -> calls);
+	SIM_CHECK(tracked -> error == expected && tracked -> transaction.error == expected, "%s: error %d, expected %d", what, tracked -> error, expected);
+	SIM_CHECK(!tracked -> transaction.pending, "%s: still pending", what);
+	uint8_t events = iic_take_events(&IIC_MODULE, IIC_EVENT_MASTER_DONE | IIC_EVENT_MASTER_ERROR);
+	uint8_t wanted = expected == IIC_NO_ERROR ? IIC_EVENT_MASTER_DONE : IIC_EVENT_MASTER_ERROR;
+	SIM_CHECK(events == wanted, "%s: events %02x", what, events);
+	iic_clear_error(&IIC_MODULE);
+	sim_bus_log_clear(bus);
+}
+
+static void test_success(void){
+	tracked_t tracked;
+	uint8_t data[] = {0x00, 0x11, 0x22};
+	uint8_t pointer = 0x00;
+	uint8_t result[2];
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x50, data, 3, 0);
+	finish(&tracked, IIC_NO_ERROR, "write");
+	start(&tracked, IIC_MASTER_RECEIVER, 0x50, result, 2, 0);
+	finish(&tracked, IIC_NO_ERROR, "read (ends on 0x58)");
+	start_read_after(&tracked, IIC_MASTER_TRANSMITTER, 0x50, &pointer, 1, 0, result, 2);
+	finish(&tracked, IIC_NO_ERROR, "write-then-read");
+	SIM_CHECK(result[0] == 0x11 && result[1] == 0x22, "read back %02x %02x", result[0], result[1]);
+}
+
+// 0x20 / 0x48 after all retries, and 0x30 part way through a write. The
+// write-then-read's read half must not run after a failed write half.
+static void test_nacks(void){
+	tracked_t tracked;
+	uint8_t data[] = {0x00, 0x11, 0x22};
+	uint8_t result[2];
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x51, data, 3, IIC_FLAG_IGNORE_PRESENCE);
+	finish(&tracked, IIC_MT_ADDR_NACK, "write to nobody");
+	start(&tracked, IIC_MASTER_RECEIVER, 0x51, result, 2, IIC_FLAG_IGNORE_PRESENCE);
+	finish(&tracked, IIC_MR_ADDR_NACK, "read from nobody");
+
+	device -> nack_after = 1;
+	start_read_after(&tracked, IIC_MASTER_TRANSMITTER, 0x50, data, 3, 0, result, 2);
+	finish(&tracked, IIC_MT_DATA_NACK, "write NACKed");
+	device -> nack_after = -1;
+}
+
+// A probe marks the device absent; the next transaction for it then fails
+// in iic_load_next without going near the bus.
+static void test_known_absent(void){
+	tracked_t tracked;
+	uint8_t data[] = {0x00};
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x52, data, 1, IIC_FLAG_NO_RETRY);
+	finish(&tracked, IIC_MT_ADDR_NACK, "probe");
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x52, data, 1, 0);
+	SIM_CHECK(strcmp(sim_bus_log_text(bus), "") == 0, "absent device addressed: %s", sim_bus_log_text(bus));
+	finish(&tracked, IIC_MT_ADDR_NACK, "absent device");
+	iic_presence_forget(&IIC_MODULE, 0x52);
+}
+
+// 0x38 (as transmitter and as receiver), 0x68 and 0xB0, with no retries
+// left: the other master starts in the same cycle and wins.
+static void test_arbitration(void){
+	tracked_t tracked;
+	uint8_t mine[] = {0x30, 0x55};
+	uint8_t theirs[] = {0x30, 0x33};
+	uint8_t result[2];
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x50, mine, 2, 0);
+	remote.write_many(remote.module, 0x50, theirs, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	finish(&tracked, IIC_MT_ARBITRATION_LOST, "lost in the data");
+
+	start(&tracked, IIC_MASTER_RECEIVER, 0x50, result, 2, 0);
+	remote.write_many(remote.module, 0x50, theirs, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	finish(&tracked, IIC_MR_ARBITRATION_LOST, "lost in the R/W bit");
+
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x50, mine, 2, 0);
+	remote.write_many(remote.module, 0x20, theirs, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	finish(&tracked, IIC_ARBITRATION_LOST_AND_SR_SELECTED, "lost and written to");
+
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x50, mine, 2, 0);
+	remote.read_many(remote.module, 0x20, result, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	finish(&tracked, IIC_ARBITRATION_LOST_AND_ST_SELECTED, "lost and read from");
+	while(iic_slave_read_frame(&IIC_MODULE, result, sizeof(result), NULL) != 0){
+	}
+}
+
+// Something pulls SDA low in the middle of one of our bytes: a START where
+// none may be, status 0x00. The recovery replays the transaction, so it
+// takes IIC_RECOVERY_RETRIES + 1 of these in a row to fail it with
+// IIC_BUS_ERROR. Either way there is one completion.
+typedef struct rogue_t{
+	sim_agent_t agent; // must stay first
+	int pulls; // bus errors still to cause
+	int pulling;
+	uint64_t starts; // one per START, not in the recovery's clocking
+} rogue_t;
+
+static rogue_t rogue;
+
+static void rogue_step(sim_agent_t *agent){
+	if(rogue.pulling){
+		rogue.pulling = 0;
+		sim_drive(agent, 0, 0);
+	}else if(agent -> bus -> scl && agent -> bus -> sda && agent -> bus -> bit > 1 && agent -> bus -> starts != rogue.starts){
+		rogue.starts = agent -> bus -> starts;
+		rogue.pulling = 1;
+		rogue.pulls--;
+		sim_drive(agent, 1, 0);
+		agent -> due = sim_now() + SIM_US(2);
+		return;
+	}
+	agent -> due = rogue.pulls > 0 ? sim_now() + 8 : SIM_NEVER;
+}
+
+static void rogue_start(int pulls){
+	if(rogue.agent.bus == NULL){
+		rogue.agent.step = rogue_step;
+		sim_agent_add(bus, &rogue.agent);
+	}
+	rogue.pulls = pulls;
+	rogue.starts = bus -> starts;
+	rogue.agent.due = sim_now();
+}
+
+static void test_bus_error(void){
+	tracked_t tracked;
+	uint8_t data[] = {0x40, 0x77};
+	rogue_start(1);
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x50, data, 2, 0);
+	finish(&tracked, IIC_NO_ERROR, "replayed after a bus error");
+	SIM_CHECK(rogue.pulls == 0 && device -> mem[0x40] == 0x77, "replay didn't write");
+
+	data[1] = 0x88;
+	rogue_start(IIC_RECOVERY_RETRIES + 1);
+	start(&tracked, IIC_MASTER_TRANSMITTER, 0x50, data, 2, 0);
+	finish(&tracked, IIC_BUS_ERROR, "bus errors every time");
+	SIM_CHECK(rogue.pulls == 0 && device -> mem[0x40] == 0x77, "write went through after all");
+	iic_take_events(&IIC_MODULE, 0xFF);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	sim_every(local, SIM_US(100), local_tick);
+	device = sim_device_new(bus, 0x50);
+	device -> pointer_bytes = 1;
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	uint8_t ring[32];
+	setup_iic(&IIC_MODULE, 0x20, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), NULL);
+	enable_iic(&IIC_MODULE);
+
+	test_success();
+	test_nacks();
+	test_known_absent();
+	test_arbitration();
+	test_bus_error();
+	printf("test_completion: ok\n");
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_dual_bus.c
+ * a 328PB with IIC_MODULE on a 400 kHz bus and IIC_MODULE1 on a 100 kHz
+ * one, both running at the same time
+ *
+ * Built for the 328PB (see the Makefile). Each bus has a device at 0x50,
+ * so anything that reaches the wrong bus lands in the wrong memory.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *fast, *slow;
+static sim_device_t *fast_device, *slow_device;
+static sim_api_t remote; // a second master on the slow bus
+
+static void local_tick(void){
+	iic_watchdog_tick(&IIC_MODULE);
+	iic_watchdog_tick(&IIC_MODULE1);
+}
+
+static int both_idle(void *arg){
+	sim_idle_t fast_idle = {.iic = &IIC_MODULE, .bus = fast};
+	sim_idle_t slow_idle = {.iic = &IIC_MODULE1, .bus = slow};
+	return sim_master_idle(&fast_idle) && sim_master_idle(&slow_idle);
+}
+
+static sim_time_t write_both(uint8_t *fast_data, iic_len_t fast_len, uint8_t *slow_data, iic_len_t slow_len){
+	sim_time_t start = sim_now();
+	if(fast_len != 0){
+		iic_write_many(&IIC_MODULE, 0x50, fast_data, fast_len);
+	}
+	if(slow_len != 0){
+		iic_write_many(&IIC_MODULE1, 0x50, slow_data, slow_len);
+	}
+	SIM_CHECK(sim_run_until(both_idle, NULL, SIM_MS(20)), "buses still busy (%d, %d)", IIC_MODULE.state, IIC_MODULE1.state);
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR && IIC_MODULE1.error_state == IIC_NO_ERROR, "errors %d, %d",
+		IIC_MODULE.error_state, IIC_MODULE1.error_state);
+	return sim_now() - start;
+}
+
+// Each write reaches only its own bus; together they take about as long
+// as the slower one alone.
+static void test_parallel(void){
+	uint8_t fast_data[17] = {0x00};
+	uint8_t slow_data[5] = {0x00};
+	for(int dex = 1; dex < 17; dex++){
+		fast_data[dex] = 0xF0 + dex;
+	}
+	for(int dex = 1; dex < 5; dex++){
+		slow_data[dex] = 0x50 + dex;
+	}
+	sim_time_t fast_alone = write_both(fast_data, 17, NULL, 0);
+	sim_time_t slow_alone = write_both(NULL, 0, slow_data, 5);
+	memset(fast_device -> mem, 0, 32);
+	memset(slow_device -> mem, 0, 32);
+
+	uint64_t fast_bytes = fast -> data_bytes, slow_bytes = slow -> data_bytes;
+	sim_time_t together = write_both(fast_data, 17, slow_data, 5);
+	SIM_CHECK(fast -> data_bytes - fast_bytes == 16 + 1 && slow -> data_bytes - slow_bytes == 4 + 1, "%llu and %llu data bytes",
+		(unsigned long long)(fast -> data_bytes - fast_bytes), (unsigned long long)(slow -> data_bytes - slow_bytes));
+	SIM_CHECK(memcmp(fast_device -> mem, fast_data + 1, 16) == 0 && fast_device -> mem[16] == 0, "fast device holds the wrong bytes");
+	SIM_CHECK(memcmp(slow_device -> mem, slow_data + 1, 4) == 0 && slow_device -> mem[4] == 0, "slow device holds the wrong bytes");
+	sim_time_t longer = fast_alone > slow_alone ? fast_alone : slow_alone;
+	SIM_CHECK(together < longer + longer / 10, "together %llu cycles, alone %llu and %llu",
+		(unsigned long long)together, (unsigned long long)fast_alone, (unsigned long long)slow_alone);
+	printf("alone %.1f us and %.1f us, together %.1f us\n", (double)fast_alone * 1e6 / SIM_F_CPU,
+		(double)slow_alone * 1e6 / SIM_F_CPU, (double)together * 1e6 / SIM_F_CPU);
+}
+
+// A failure on one bus leaves the other's transaction and error alone.
+static void test_errors_stay_apart(void){
+	uint8_t fast_data[] = {0x40, 0x11, 0x22, 0x33};
+	iic_write_many(&IIC_MODULE, 0x50, fast_data, sizeof(fast_data));
+	iic_write_one(&IIC_MODULE1, 0x51, 0x00);
+	SIM_CHECK(sim_run_until(both_idle, NULL, SIM_MS(20)), "buses still busy");
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR && fast_device -> mem[0x42] == 0x33, "fast bus: error %d", IIC_MODULE.error_state);
+	SIM_CHECK(IIC_MODULE1.error_state == IIC_MT_ADDR_NACK, "slow bus: error %d", IIC_MODULE1.error_state);
+	iic_clear_error(&IIC_MODULE1);
+	iic_presence_forget(&IIC_MODULE1, 0x51);
+}
+
+typedef struct chained_t{
+	iic_transaction_t transaction; // must stay first
+	iic_transaction_t next;
+	volatile iic_t *done_on;
+} chained_t;
+
+static void chain(iic_transaction_t *transaction, iic_error_t error){
+	chained_t *chained = (chained_t*)transaction;
+	chained -> done_on = transaction -> iic;
+	iic_enqueue(transaction -> iic, &chained -> next);
+}
+
+// Queued work on both buses; each completion queues its follow-up on the
+// bus it finished on.
+static void test_queues(void){
+	uint8_t a[] = {0x60, 0xA1}, b[] = {0x61, 0xA2}, c[] = {0x60, 0xC1}, d[] = {0x61, 0xC2};
+	chained_t on_fast = {
+		.transaction = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = a, .buffer_len = 2, .callback = chain},
+		.next = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = b, .buffer_len = 2}
+	};
+	chained_t on_slow = {
+		.transaction = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = c, .buffer_len = 2, .callback = chain},
+		.next = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = d, .buffer_len = 2}
+	};
+	SIM_CHECK(iic_enqueue(&IIC_MODULE, &on_fast.transaction) && iic_enqueue(&IIC_MODULE1, &on_slow.transaction), "queue full");
+	SIM_CHECK(sim_run_until(both_idle, NULL, SIM_MS(20)), "buses still busy");
+	SIM_CHECK(on_fast.done_on == &IIC_MODULE && on_slow.done_on == &IIC_MODULE1, "completions reported the wrong bus");
+	SIM_CHECK(fast_device -> mem[0x60] == 0xA1 && fast_device -> mem[0x61] == 0xA2, "fast device holds %02x %02x", fast_device -> mem[0x60], fast_device -> mem[0x61]);
+	SIM_CHECK(slow_device -> mem[0x60] == 0xC1 && slow_device -> mem[0x61] == 0xC2, "slow device holds %02x %02x", slow_device -> mem[0x60], slow_device -> mem[0x61]);
+}
+
+// TWI1 answers as a slave to another master while TWI0 is busy mastering.
+static void test_slave_while_master(void){
+	uint8_t fast_data[9] = {0x70};
+	uint8_t theirs[] = {0x12, 0x34, 0x56};
+	uint8_t frame[8];
+	iic_write_many(&IIC_MODULE, 0x50, fast_data, sizeof(fast_data));
+	remote.write_many(remote.module, 0x30, theirs, sizeof(theirs));
+	sim_wait_master(remote.module, slow, SIM_MS(5));
+	SIM_CHECK(sim_run_until(both_idle, NULL, SIM_MS(20)), "buses still busy");
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR && remote.module -> error_state == IIC_NO_ERROR, "errors %d, %d",
+		IIC_MODULE.error_state, remote.module -> error_state);
+	uint8_t len = iic_slave_read_frame(&IIC_MODULE1, frame, sizeof(frame), NULL);
+	SIM_CHECK(len == 3 && memcmp(frame, theirs, 3) == 0, "TWI1 received %d bytes", len);
+	SIM_CHECK(iic_slave_read_frame(&IIC_MODULE, frame, sizeof(frame), NULL) == 0, "TWI0 received a frame");
+}
+
+int main(void){
+	fast = sim_bus_new("fast");
+	slow = sim_bus_new("slow");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, fast);
+	sim_connect_twi(local, 1, slow);
+	sim_every(local, SIM_US(100), local_tick);
+	fast_device = sim_device_new(fast, 0x50);
+	fast_device -> pointer_bytes = 1;
+	slow_device = sim_device_new(slow, 0x50);
+	slow_device -> pointer_bytes = 1;
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, slow);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	uint8_t ring0[32], ring1[32];
+	setup_iic(&IIC_MODULE, 0x30, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring0, sizeof(ring0), NULL);
+	enable_iic(&IIC_MODULE);
+	setup_iic(&IIC_MODULE1, 0x30, true, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE1, ring1, sizeof(ring1), NULL);
+	enable_iic(&IIC_MODULE1);
+
+	test_parallel();
+	test_errors_stay_apart();
+	test_queues();
+	test_slave_while_master();
+	printf("test_dual_bus: ok\n");
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_led_sync.c
+ * phase alignment of LED nodes (fw_led.so) whose timers tick at the same
+ * rate but at different offsets, after the general-call synchronize
+ * commands; 16-bit levels from WRITE_WORD; and a full pattern sample
+ * leaving the level unscaled
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/api.h>
+
+#define LEDS 8
+#define LED_TICK SIM_MS(1)
+#define STEP 0x0100 // fw_led.c's ramp step
+
+extern const sim_image_t iic_sim_image;
+
+typedef struct led_t{
+	sim_node_t *node;
+	uint8_t address;
+	uint16_t (*phase)(void);
+	uint16_t *levels;
+} led_t;
+
+static sim_bus_t *bus;
+static led_t leds[LEDS];
+
+static void send(uint8_t address, uint8_t *frame, iic_len_t len){
+	iic_write_many(&IIC_MODULE, address, frame, len);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "sending to %02x: error %d", address, IIC_MODULE.error_state);
+}
+
+// True if phase is expected, or up to one tick past it (the nodes tick at
+// different offsets inside each LED_TICK).
+static int near(uint16_t phase, uint16_t expected){
+	return (uint16_t)(phase - expected) <= STEP;
+}
+
+static uint16_t spread(void){
+	uint16_t low = leds[0].phase(), high = low;
+	for(int dex = 1; dex < LEDS; dex++){
+		uint16_t phase = leds[dex].phase();
+		low = phase < low ? phase : low;
+		high = phase > high ? phase : high;
+	}
+	return high - low;
+}
+
+// Each node starts the ramp 5 ticks after the previous one.
+static void scatter(void){
+	uint8_t pattern[] = {IIC_COMMAND_LED_SET_PATTERN, 1};
+	for(int dex = 0; dex < LEDS; dex++){
+		send(leds[dex].address, pattern, 2);
+		sim_run(5 * LED_TICK);
+	}
+	SIM_CHECK(spread() > 4 * STEP * (LEDS - 1), "nodes didn't drift apart (spread %04x)", spread());
+}
+
+// An inclusive synchronize lines every node up on its PHASE; a PHASE with
+// the top bit set must survive the shift into the 16-bit phase.
+static void test_inclusive(void){
+	scatter();
+	uint8_t sync[] = {IIC_COMMAND_LED_INCLUSIVE_SYNCHRONIZE, 0x90};
+	send(0x00, sync, 2);
+	for(int dex = 0; dex < LEDS; dex++){
+		SIM_CHECK(near(leds[dex].phase(), 0x9000), "node %d at %04x after the synchronize", dex, leds[dex].phase());
+	}
+	sim_run(100 * LED_TICK);
+	SIM_CHECK(spread() <= STEP, "nodes drifted apart again (spread %04x)", spread());
+	SIM_CHECK(near(leds[0].phase(), 0x9000 + 100 * STEP - STEP), "node 0 at %04x after 100 ticks", leds[0].phase());
+}
+
+// An excluded node ignores the next synchronize; an included one jumps to
+// its own PHASE on either kind; the exclusive one moves nobody else.
+static void test_include_exclude(void){
+	uint8_t exclude[] = {IIC_COMMAND_LED_EXCLUDE_DEVICE};
+	uint8_t include[] = {IIC_COMMAND_LED_INCLUDE_DEVICE, 0xC0};
+	send(leds[1].address, exclude, 1);
+	send(leds[2].address, include, 2);
+	uint16_t before = leds[1].phase();
+	uint8_t sync[] = {IIC_COMMAND_LED_INCLUSIVE_SYNCHRONIZE, 0x20};
+	send(0x00, sync, 2);
+	SIM_CHECK(near(leds[1].phase(), before), "excluded node moved from %04x to %04x", before, leds[1].phase());
+	SIM_CHECK(near(leds[2].phase(), 0xC000), "included node at %04x", leds[2].phase());
+	for(int dex = 3; dex < LEDS; dex++){
+		SIM_CHECK(near(leds[dex].phase(), 0x2000), "node %d at %04x", dex, leds[dex].phase());
+	}
+
+	uint16_t others[LEDS];
+	for(int dex = 0; dex < LEDS; dex++){
+		others[dex] = leds[dex].phase();
+	}
+	include[1] = 0x80;
+	send(leds[3].address, include, 2);
+	uint8_t exclusive[] = {IIC_COMMAND_LED_EXCLUSIVE_SYNCHRONIZE};
+	send(0x00, exclusive, 1);
+	SIM_CHECK(near(leds[3].phase(), 0x8000), "included node at %04x after the exclusive synchronize", leds[3].phase());
+	for(int dex = 0; dex < LEDS; dex++){
+		if(dex != 3){
+			SIM_CHECK(near(leds[dex].phase(), others[dex]), "node %d moved from %04x to %04x", dex, others[dex], leds[dex].phase());
+		}
+	}
+}
+
+// WRITE_WORD levels with the high byte's top bit set.
+static void test_write_word(void){
+	uint8_t steady[] = {IIC_COMMAND_LED_SET_PATTERN, IIC_LED_PATTERN_STEADY};
+	uint8_t word[] = {IIC_COMMAND_LED_WRITE_WORD, 1, 0xCD, 0xAB};
+	send(leds[0].address, steady, 2);
+	send(leds[0].address, word, 4);
+	sim_run(2 * LED_TICK);
+	SIM_CHECK(leds[0].levels[1] == 0xABCD, "channel 1 at %04x", leds[0].levels[1]);
+}
+
+static int at_sample(void *arg){
+	return leds[0].phase() >> 8 == *(uint8_t*)arg;
+}
+
+// A full sample (255) passes the level through unscaled, 8-bit or 16-bit;
+// sample 0 turns it off.
+static void test_full_sample(void){
+	uint8_t ramp[] = {IIC_COMMAND_LED_SET_PATTERN, 1};
+	uint8_t byte_level[] = {IIC_COMMAND_LED_WRITE_WORD, 0, 0xFF, 0x00};
+	uint8_t word_level[] = {IIC_COMMAND_LED_WRITE_WORD, 1, 0xFF, 0xFF};
+	uint8_t sync[] = {IIC_COMMAND_LED_INCLUSIVE_SYNCHRONIZE, 0xFE};
+	send(leds[0].address, byte_level, 4);
+	send(leds[0].address, word_level, 4);
+	send(leds[0].address, ramp, 2);
+	send(0x00, sync, 2);
+	uint8_t sample = 0xFF;
+	SIM_CHECK(sim_run_until(at_sample, &sample, 2 * LED_TICK), "ramp never reached sample %d (phase %04x)", sample, leds[0].phase());
+	SIM_CHECK(leds[0].levels[0] == 0x00FF, "level 00ff at sample 255 gave %04x", leds[0].levels[0]);
+	SIM_CHECK(leds[0].levels[1] == 0xFFFF, "level ffff at sample 255 gave %04x", leds[0].levels[1]);
+	sample = 0x00;
+	SIM_CHECK(sim_run_until(at_sample, &sample, 2 * LED_TICK), "ramp never wrapped (phase %04x)", leds[0].phase());
+	SIM_CHECK(leds[0].levels[0] == 0 && leds[0].levels[1] == 0, "sample 0 gave %04x %04x", leds[0].levels[0], leds[0].levels[1]);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "master");
+	sim_connect_twi(local, 0, bus);
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	for(int dex = 0; dex < LEDS; dex++){
+		char name[8];
+		snprintf(name, sizeof(name), "led%d", dex);
+		led_t *led = &leds[dex];
+		led -> node = sim_node_load("test/build/fw_led.so", strdup(name));
+		sim_connect_twi(led -> node, 0, bus);
+		led -> address = 0x30 + dex;
+		led -> phase = sim_node_symbol(led -> node, "led_engine_phase");
+		led -> levels = sim_node_symbol(led -> node, "fw_led_levels");
+		void (*start)(uint8_t, uint8_t, iic_prescaler_t) = sim_node_symbol(led -> node, "fw_led_start");
+		start(led -> address, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL));
+		sim_every(led -> node, LED_TICK, sim_node_symbol(led -> node, "fw_led_tick"));
+		sim_every(led -> node, SIM_US(100), sim_node_symbol(led -> node, "fw_watchdog"));
+		sim_run(LED_TICK / LEDS); // spread the tick offsets over one tick
+	}
+
+	test_inclusive();
+	test_include_exclude();
+	test_write_word();
+	test_full_sample();
+	printf("test_led_sync: ok\n");
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_presence.c
+ * the presence cache: probes, the bus scanner, re-probing, and the calls
+ * that must not be affected by them
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_device_t *devices[3];
+static const uint8_t addresses[] = {0x20, 0x48, 0x50};
+
+static void expect_log(const char *expected){
+	SIM_CHECK(strcmp(sim_bus_log_text(bus), expected) == 0, "bus log\n  got:      %s\n  expected: %s", sim_bus_log_text(bus), expected);
+	sim_bus_log_clear(bus);
+}
+
+static void wait_scan(iic_scan_t *scan){
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(50));
+	SIM_CHECK(!scan -> pending, "scan still pending");
+}
+
+// Only the three devices answer, and every other address is then failed
+// without using the bus.
+static void test_scan(iic_scan_t *scan){
+	SIM_CHECK(iic_scan_bus(&IIC_MODULE, scan, IIC_SCAN_FIRST_ADDRESS, IIC_SCAN_LAST_ADDRESS, NULL), "scan not queued");
+	wait_scan(scan);
+	SIM_CHECK(bus -> starts == IIC_SCAN_LAST_ADDRESS - IIC_SCAN_FIRST_ADDRESS + 1, "%llu probes", (unsigned long long)bus -> starts);
+	SIM_CHECK(bus -> restarts == 0, "probes were retried");
+	for(uint8_t address = IIC_SCAN_FIRST_ADDRESS; address <= IIC_SCAN_LAST_ADDRESS; address++){
+		bool expected = memchr(addresses, address, sizeof(addresses)) != NULL;
+		SIM_CHECK(iic_device_present(&IIC_MODULE, address) == expected && iic_device_absent(&IIC_MODULE, address) == !expected, "address %02x", address);
+	}
+	sim_bus_log_clear(bus);
+
+	uint8_t data[] = {0x00};
+	iic_transaction_t transaction = {.remote_address = 0x30, .direction = IIC_MASTER_TRANSMITTER, .buffer = data, .buffer_len = 1};
+	iic_enqueue(&IIC_MODULE, &transaction);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(!transaction.pending && transaction.error == IIC_MT_ADDR_NACK, "error %d", transaction.error);
+	expect_log("");
+}
+
+// A device that turns up later is found by the background re-probe.
+static void test_reprobe(iic_scan_t *scan){
+	sim_device_t *late = sim_device_new(bus, 0x31);
+	for(int dex = 0; dex < 200 && !iic_device_present(&IIC_MODULE, 0x31); dex++){
+		iic_scan_reprobe(scan);
+		wait_scan(scan);
+	}
+	SIM_CHECK(iic_device_present(&IIC_MODULE, 0x31), "re-probing never found 0x31");
+	SIM_CHECK(late -> address_acks == 1, "0x31 probed %llu times after it answered", (unsigned long long)late -> address_acks);
+	sim_bus_log_clear(bus);
+}
+
+// After a probe, the direct calls still retry: no_retry is theirs to reset.
+static void test_direct_calls_retry(void){
+	iic_transaction_t probe = {.remote_address = 0x33, .direction = IIC_MASTER_TRANSMITTER, .flags = IIC_FLAG_NO_RETRY | IIC_FLAG_IGNORE_PRESENCE};
+	static const char *nacked = "S 33w- P S 33w- Sr 33w- Sr 33w- Sr 33w- P";
+	static const char *nacked_read = "S 33w- P S 33r- Sr 33r- Sr 33r- Sr 33r- P";
+	for(int call = 0; call < 4; call++){
+		iic_enqueue(&IIC_MODULE, &probe);
+		sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+		switch(call){
+			case 0: iic_write_one(&IIC_MODULE, 0x33, 0x00); break;
+			case 1: iic_write_two(&IIC_MODULE, 0x33, 0x00, 0x01); break;
+			case 2: iic_read_one(&IIC_MODULE, 0x33); break;
+			case 3: iic_read_two(&IIC_MODULE, 0x33); break;
+		}
+		sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+		expect_log(call < 2 ? nacked : nacked_read);
+		iic_clear_error(&IIC_MODULE);
+	}
+}
+
+// A device that is only busy (an EEPROM in its write cycle) runs an ordinary
+// transaction out of retries, but isn't written off for it.
+static void test_busy_not_absent(void){
+	uint8_t data[] = {0x00, 0x42};
+	devices[2] -> nack_address = 10;
+	iic_transaction_t transaction = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = data, .buffer_len = 2};
+	iic_enqueue(&IIC_MODULE, &transaction);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(transaction.error == IIC_MT_ADDR_NACK, "error %d", transaction.error);
+	SIM_CHECK(!iic_device_absent(&IIC_MODULE, 0x50), "busy device marked absent");
+
+	devices[2] -> nack_address = 0;
+	iic_enqueue(&IIC_MODULE, &transaction);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(transaction.error == IIC_NO_ERROR && devices[2] -> mem[0] == 0x42, "write after the busy spell: error %d", transaction.error);
+	sim_bus_log_clear(bus);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	for(int dex = 0; dex < 3; dex++){
+		devices[dex] = sim_device_new(bus, addresses[dex]);
+		devices[dex] -> pointer_bytes = 1;
+	}
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	iic_scan_t scan;
+	test_scan(&scan);
+	test_reprobe(&scan);
+	test_direct_calls_retry();
+	test_busy_not_absent();
+	printf("test_presence: ok\n");
+	return 0;
+}
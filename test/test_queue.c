@@ -0,0 +1,141 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_queue.c
+ * queued master transactions: status sequence, ordering, completion, and
+ * no idle bus time between them
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static struct sim_twi_t *twi;
+static sim_device_t *device;
+
+static iic_transaction_t *finished[8];
+static int finished_count;
+
+static sim_time_t last_stop;
+static sim_time_t max_gap; // longest STOP -> START gap while the queue was busy
+
+static void record(iic_transaction_t *transaction, iic_error_t error){
+	(void)error;
+	finished[finished_count++] = transaction;
+}
+
+static void watch_gaps(sim_bus_t *bus, int event, uint8_t byte, int ack, void *ctx){
+	(void)bus; (void)byte; (void)ack; (void)ctx;
+	if(event == SIM_EVENT_STOP){
+		last_stop = sim_now();
+	}else if(event == SIM_EVENT_START && last_stop != 0 && sim_now() - last_stop > max_gap){
+		max_gap = sim_now() - last_stop;
+	}
+}
+
+static void expect(const char *what, const char *got, const char *expected){
+	SIM_CHECK(strcmp(got, expected) == 0, "%s\n  got:      %s\n  expected: %s", what, got, expected);
+}
+
+// A write, a read and a write-then-read go out in order, chained with
+// STOP + START from the ISR, and each one completes exactly once.
+static void test_order(void){
+	uint8_t write_data[] = {0x00, 0x11, 0x22};
+	uint8_t read_data[2] = {0};
+	uint8_t pointer = 0x00;
+	uint8_t combined[2] = {0};
+	iic_transaction_t write = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = write_data, .buffer_len = 3, .callback = record};
+	iic_transaction_t read = {.remote_address = 0x50, .direction = IIC_MASTER_RECEIVER, .buffer = read_data, .buffer_len = 2, .callback = record};
+	iic_transaction_t write_read = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = &pointer, .buffer_len = 1,
+		.read_buffer = combined, .read_len = 2, .callback = record};
+
+	SIM_CHECK(iic_enqueue(&IIC_MODULE, &write) && iic_enqueue(&IIC_MODULE, &read) && iic_enqueue(&IIC_MODULE, &write_read), "enqueue failed");
+	SIM_CHECK(write.pending && read.pending && write_read.pending, "not pending after iic_enqueue");
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+
+	expect("bus", sim_bus_log_text(bus), "S 50w+ 00+ 11+ 22+ P S 50r+ 33+ 44- P S 50w+ 00+ Sr 50r+ 11+ 22- P");
+	expect("TWSR", sim_twi_status_log(twi), "08 18 28 28 28 08 40 50 58 08 18 28 10 40 50 58");
+	SIM_CHECK(finished_count == 3 && finished[0] == &write && finished[1] == &read && finished[2] == &write_read, "completion order");
+	SIM_CHECK(!write.pending && !read.pending && !write_read.pending, "still pending");
+	SIM_CHECK(write.error == IIC_NO_ERROR && read.error == IIC_NO_ERROR && write_read.error == IIC_NO_ERROR, "errors %d %d %d", write.error, read.error, write_read.error);
+	SIM_CHECK(read_data[0] == 0x33 && read_data[1] == 0x44, "read %02x %02x", read_data[0], read_data[1]);
+	SIM_CHECK(combined[0] == 0x11 && combined[1] == 0x22, "write-read %02x %02x", combined[0], combined[1]);
+	uint8_t events = iic_take_events(&IIC_MODULE, 0xFF);
+	SIM_CHECK(events == (IIC_EVENT_MASTER_DONE | IIC_EVENT_QUEUE_EMPTY), "events %02x", events);
+	// the next START follows the STOP after the bus free time, with no ISR or main-loop turn in between
+	SIM_CHECK(max_gap <= SIM_US(5), "bus idle for %llu cycles between queued transactions", (unsigned long long)max_gap);
+}
+
+// A failing transaction completes with its error and doesn't hold up the rest.
+static void test_failure_in_queue(void){
+	uint8_t data[] = {0x40, 0x01};
+	iic_transaction_t missing = {.remote_address = 0x51, .direction = IIC_MASTER_TRANSMITTER, .buffer = data, .buffer_len = 2, .callback = record};
+	iic_transaction_t present = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = data, .buffer_len = 2, .callback = record};
+	finished_count = 0;
+	iic_enqueue(&IIC_MODULE, &missing);
+	iic_enqueue(&IIC_MODULE, &present);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(finished_count == 2 && finished[0] == &missing && finished[1] == &present, "completion order");
+	SIM_CHECK(missing.error == IIC_MT_ADDR_NACK && present.error == IIC_NO_ERROR, "errors %d %d", missing.error, present.error);
+	SIM_CHECK(device -> mem[0x40] == 0x01, "second write lost");
+	uint8_t events = iic_take_events(&IIC_MODULE, 0xFF);
+	SIM_CHECK(events == (IIC_EVENT_MASTER_DONE | IIC_EVENT_MASTER_ERROR | IIC_EVENT_QUEUE_EMPTY), "events %02x", events);
+	iic_presence_forget(&IIC_MODULE, 0x51);
+}
+
+// The queue holds IIC_QUEUE_LEN - 1 transactions.
+static void test_full(void){
+	static iic_transaction_t many[IIC_QUEUE_LEN];
+	static uint8_t data = 0;
+	int queued = 0;
+	for(int dex = 0; dex < IIC_QUEUE_LEN; dex++){
+		many[dex] = (iic_transaction_t){.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = &data, .buffer_len = 1};
+		queued += iic_enqueue(&IIC_MODULE, &many[dex]);
+	}
+	SIM_CHECK(queued == IIC_QUEUE_LEN - 1, "queued %d", queued);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(10));
+	for(int dex = 0; dex < queued; dex++){
+		SIM_CHECK(!many[dex].pending && many[dex].error == IIC_NO_ERROR, "transaction %d: error %d", dex, many[dex].error);
+	}
+	iic_take_events(&IIC_MODULE, 0xFF);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	bus -> watch = watch_gaps;
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	twi = sim_connect_twi(local, 0, bus);
+	device = sim_device_new(bus, 0x50);
+	device -> pointer_bytes = 1;
+	device -> mem[0x02] = 0x33; // the read picks up where the first write left the pointer
+	device -> mem[0x03] = 0x44;
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 2, NULL);
+	enable_iic(&IIC_MODULE);
+
+	test_order();
+	test_failure_in_queue();
+	test_full();
+	printf("test_queue: ok\n");
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_recovery.c
+ * a slave stuck holding SDA low (sim_device_stick): the watchdog notices,
+ * iic_recover clocks it free and the queued transaction is replayed; and a
+ * long transfer by another master, which the watchdog must leave alone
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define WATCHDOG_TICK SIM_US(100)
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_device_t *eeprom, *stuck;
+static sim_api_t remote;
+
+static void local_watchdog(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static int done(void *arg){
+	return !((iic_transaction_t*)arg) -> pending;
+}
+
+static void run_write(iic_transaction_t *transaction, uint8_t *data, iic_len_t len){
+	*transaction = (iic_transaction_t){.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = data, .buffer_len = len};
+	iic_take_events(&IIC_MODULE, 0xFF);
+	SIM_CHECK(iic_enqueue(&IIC_MODULE, transaction), "queue full");
+}
+
+// The other slave browns out in the middle of our write and holds SDA
+// low: we lose arbitration on the next 1 and can't get a START out after
+// that. The watchdog recovers the bus and the write is replayed.
+static void test_stuck_mid_transfer(void){
+	uint8_t data[16] = {0x00};
+	for(int dex = 1; dex < 16; dex++){
+		data[dex] = 0xF0 | dex;
+	}
+	iic_transaction_t transaction;
+	run_write(&transaction, data, sizeof(data));
+	sim_run(SIM_US(200)); // a few bytes in
+	sim_time_t stuck_at = sim_now();
+	sim_device_stick(stuck, 5);
+	SIM_CHECK(sim_run_until(done, &transaction, SIM_MS(20)), "write never finished");
+	sim_time_t recovered = sim_now() - stuck_at;
+	SIM_CHECK(transaction.error == IIC_NO_ERROR, "write failed with %d", transaction.error);
+	SIM_CHECK(memcmp(eeprom -> mem, data + 1, 15) == 0, "eeprom holds the wrong bytes");
+	SIM_CHECK(iic_take_events(&IIC_MODULE, IIC_EVENT_BUS_RECOVERY), "no recovery reported");
+	SIM_CHECK(!stuck -> stuck, "slave still stuck");
+	printf("stuck mid-transfer: written %.2f ms after the slave stuck\n", (double)recovered * 1e3 / SIM_F_CPU);
+}
+
+// The slave is already stuck when the write is queued.
+static void test_stuck_before_start(void){
+	uint8_t data[] = {0x20, 0x5A, 0xA5};
+	iic_transaction_t transaction;
+	sim_device_stick(stuck, 3);
+	sim_run(SIM_US(50));
+	run_write(&transaction, data, sizeof(data));
+	SIM_CHECK(sim_run_until(done, &transaction, SIM_MS(20)), "write never finished");
+	SIM_CHECK(transaction.error == IIC_NO_ERROR && eeprom -> mem[0x20] == 0x5A && eeprom -> mem[0x21] == 0xA5, "write failed with %d", transaction.error);
+	SIM_CHECK(iic_take_events(&IIC_MODULE, IIC_EVENT_BUS_RECOVERY), "no recovery reported");
+}
+
+// Another master writes for several watchdog periods while our write waits
+// for the bus. That is not a stuck bus: no recovery, and both writes land.
+static void test_busy_bus_is_not_stuck(void){
+	uint8_t theirs[80] = {0x00};
+	uint8_t mine[] = {0x60, 0x77};
+	for(int dex = 1; dex < 80; dex++){
+		theirs[dex] = dex;
+	}
+	remote.write_many(remote.module, 0x50, theirs, sizeof(theirs));
+	sim_run(SIM_US(300));
+	iic_transaction_t transaction;
+	run_write(&transaction, mine, sizeof(mine));
+	sim_time_t start = sim_now();
+	SIM_CHECK(sim_run_until(done, &transaction, SIM_MS(50)), "write never finished");
+	SIM_CHECK(sim_now() - start > (IIC_WATCHDOG_TICKS + 2) * WATCHDOG_TICK, "the other master wasn't on the bus long enough to matter");
+	SIM_CHECK(!iic_take_events(&IIC_MODULE, IIC_EVENT_BUS_RECOVERY), "recovered a bus another master owned");
+	sim_wait_master(remote.module, bus, SIM_MS(50));
+	SIM_CHECK(remote.module -> error_state == IIC_NO_ERROR && memcmp(eeprom -> mem, theirs + 1, 79) == 0, "the other master's write was cut short (error %d)",
+		remote.module -> error_state);
+	SIM_CHECK(transaction.error == IIC_NO_ERROR && eeprom -> mem[0x60] == 0x77, "our write failed with %d", transaction.error);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	sim_every(local, WATCHDOG_TICK, local_watchdog);
+	eeprom = sim_device_new(bus, 0x50);
+	eeprom -> pointer_bytes = 1;
+	stuck = sim_device_new(bus, 0x3C);
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	setup_iic(&IIC_MODULE, 0x20, false, false, IIC_TWBR_FOR(F_CPU, 100000UL), IIC_PRESCALER_FOR(F_CPU, 100000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	test_stuck_mid_transfer();
+	test_stuck_before_start();
+	test_busy_bus_is_not_stuck();
+	printf("test_recovery: ok\n");
+	return 0;
+}
@@ -0,0 +1,314 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_reference_isr.c
+ * the default ISR against the IIC_REFERENCE_ISR build, side by side
+ *
+ * Each build runs on its own node and bus, with the same EEPROM at 0x50 and
+ * a second master to address it as a slave. Every scenario is run on both;
+ * the bus log, the results and the TWSR codes seen must come out the same.
+ * The only difference allowed is that the reference build leaves scratch
+ * copies in data_buf after 1-2 byte buffer transfers, which isn't recorded.
+ *
+ * With sim_icount, the host instructions per ISR entry are printed per
+ * status code for both builds. They compare the two builds with each
+ * other, not with an AVR.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define SIDES 2
+
+typedef struct side_t{
+	const char *name;
+	sim_node_t *node;
+	sim_bus_t *bus;
+	struct sim_twi_t *twi;
+	sim_device_t *eeprom;
+	sim_api_t api;
+	sim_api_t peer; // a second master, to address this one as a slave
+	void (*write_one)(volatile iic_t*, uint8_t, uint8_t);
+	void (*write_two)(volatile iic_t*, uint8_t, uint8_t, uint8_t);
+	void (*read_one)(volatile iic_t*, uint8_t);
+	void (*read_two)(volatile iic_t*, uint8_t);
+	void (*set_preempt_chunk)(volatile iic_t*, iic_len_t);
+	void (*set_reply)(volatile iic_t*, uint8_t*, uint8_t);
+	void (*clear_error)(volatile iic_t*);
+	uint8_t *registers;
+	char record[4096];
+	size_t record_len;
+} side_t;
+
+static side_t sides[SIDES] = {{.name = "default"}, {.name = "reference"}};
+static side_t *current;
+
+static void note(side_t *side, const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	side -> record_len += vsnprintf(side -> record + side -> record_len, sizeof(side -> record) - side -> record_len, format, args);
+	va_end(args);
+	SIM_CHECK(side -> record_len < sizeof(side -> record), "%s: record full", side -> name);
+}
+
+static void note_bytes(side_t *side, const uint8_t *data, int len){
+	for(int dex = 0; dex < len; dex++){
+		note(side, "%02x ", data[dex]);
+	}
+	note(side, "| ");
+}
+
+// Waits for this side's master, then records its result.
+static void finish(side_t *side){
+	volatile iic_t *iic = side -> api.module;
+	sim_wait_master(iic, side -> bus, SIM_MS(20));
+	note(side, "error %d events %02x | ", iic -> error_state, side -> api.take_events(iic, 0xFF));
+	side -> clear_error(iic);
+}
+
+static void finish_peer(side_t *side){
+	sim_wait_master(side -> peer.module, side -> bus, SIM_MS(20));
+	note(side, "peer error %d | ", side -> peer.module -> error_state);
+}
+
+static void small_writes(side_t *side){
+	volatile iic_t *iic = side -> api.module;
+	uint8_t data[] = {0x14, 0x01, 0x02, 0x03, 0x04, 0x05};
+	side -> write_one(iic, 0x50, 0x10);
+	finish(side);
+	side -> write_two(iic, 0x50, 0x10, 0xA1);
+	finish(side);
+	side -> api.write_many(iic, 0x50, data, sizeof(data));
+	finish(side);
+	side -> api.write_many(iic, 0x50, data, 2);
+	finish(side);
+	note_bytes(side, side -> eeprom -> mem + 0x10, 10);
+}
+
+static void small_reads(side_t *side){
+	volatile iic_t *iic = side -> api.module;
+	uint8_t result[5] = {0};
+	side -> write_one(iic, 0x50, 0x14);
+	finish(side);
+	side -> read_one(iic, 0x50);
+	finish(side);
+	note(side, "%02x | ", iic -> data_buf);
+	side -> read_two(iic, 0x50);
+	finish(side);
+	note(side, "%02x %02x | ", iic -> data_buf, iic -> data_buf_high);
+	for(iic_len_t len = 1; len <= 5; len += 2){
+		memset(result, 0, sizeof(result));
+		side -> api.read_many(iic, 0x50, result, len);
+		finish(side);
+		note_bytes(side, result, sizeof(result));
+	}
+	side -> api.read_many(iic, 0x50, result, 2);
+	finish(side);
+	note_bytes(side, result, sizeof(result));
+}
+
+static void write_read(side_t *side){
+	uint8_t pointer = 0x10, result[4] = {0};
+	side -> api.write_read(side -> api.module, 0x50, &pointer, 1, result, 4);
+	finish(side);
+	note_bytes(side, result, 4);
+	side -> api.write_read(side -> api.module, 0x50, &pointer, 1, result, 1);
+	finish(side);
+	note_bytes(side, result, 4);
+}
+
+static void nacks(side_t *side){
+	volatile iic_t *iic = side -> api.module;
+	uint8_t data[] = {0x30, 0x11, 0x22, 0x33, 0x44};
+	side -> api.write_many(iic, 0x51, data, 2);
+	finish(side);
+	side -> api.read_many(iic, 0x51, data, 1);
+	finish(side);
+	side -> eeprom -> nack_after = 2;
+	side -> api.write_many(iic, 0x50, data, sizeof(data));
+	finish(side);
+	side -> write_two(iic, 0x50, 0x30, 0x55);
+	side -> eeprom -> nack_after = 1;
+	finish(side);
+	side -> eeprom -> nack_after = -1;
+	note_bytes(side, side -> eeprom -> mem + 0x30, 5);
+}
+
+static void segments(side_t *side){
+	uint8_t pointer[] = {0x40}, head[] = {0xA0, 0xA1}, body[] = {0xB0}, tail[] = {0xC0, 0xC1, 0xC2};
+	uint8_t first[2] = {0}, rest[4] = {0};
+	iic_segment_t write_segments[] = {{pointer, 1}, {head, 2}, {body, 1}, {tail, 3}};
+	iic_segment_t read_segments[] = {{first, 2}, {rest, 4}};
+	iic_transaction_t write = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .segments = write_segments, .segment_count = 4};
+	iic_transaction_t set = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = pointer, .buffer_len = 1};
+	iic_transaction_t read = {.remote_address = 0x50, .direction = IIC_MASTER_RECEIVER, .segments = read_segments, .segment_count = 2};
+	SIM_CHECK(side -> api.enqueue(side -> api.module, &write) && side -> api.enqueue(side -> api.module, &set)
+		&& side -> api.enqueue(side -> api.module, &read), "%s: queue full", side -> name);
+	finish(side);
+	note(side, "%d %d %d | ", write.error, set.error, read.error);
+	note_bytes(side, first, 2);
+	note_bytes(side, rest, 4);
+}
+
+// A long preemptible write, split every 8 bytes for an urgent write-read.
+static void preempt(side_t *side){
+	uint8_t data[41] = {0x80};
+	for(int dex = 1; dex < 41; dex++){
+		data[dex] = dex;
+	}
+	uint8_t pointer = 0x10, result[3] = {0};
+	iic_transaction_t bulk = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = data, .buffer_len = sizeof(data), .flags = IIC_FLAG_PREEMPTIBLE};
+	iic_transaction_t urgent = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = &pointer, .buffer_len = 1,
+		.read_buffer = result, .read_len = 3, .flags = IIC_FLAG_URGENT};
+	side -> set_preempt_chunk(side -> api.module, 8);
+	side -> api.enqueue(side -> api.module, &bulk);
+	sim_run(SIM_US(300));
+	side -> api.enqueue(side -> api.module, &urgent);
+	finish(side);
+	side -> set_preempt_chunk(side -> api.module, 0);
+	note(side, "%d %d | ", bulk.error, urgent.error);
+	note_bytes(side, result, 3);
+	note_bytes(side, side -> eeprom -> mem + 0x80, 40);
+}
+
+static uint8_t slave_callback(volatile iic_t *iic, uint8_t dat){
+	note(current, "cb %02x | ", dat);
+	return dat ^ 0x5A;
+}
+
+// The other master writes to us and reads back, in each slave mode.
+static void slave(side_t *side){
+	volatile iic_t *iic = side -> api.module;
+	volatile iic_t *peer = side -> peer.module;
+	uint8_t data[] = {0x04, 0x61, 0x62, 0x63}, result[4] = {0}, ring[32], reply[] = {0x71, 0x72, 0x73};
+
+	side -> api.slave_register_map(iic, side -> registers, 16, NULL, NULL);
+	side -> peer.write_many(peer, 0x20, data, sizeof(data));
+	finish_peer(side);
+	side -> peer.write_read(peer, 0x20, data, 1, result, 4);
+	finish_peer(side);
+	note_bytes(side, result, 4);
+
+	side -> api.slave_buffers(iic, ring, sizeof(ring), NULL);
+	side -> set_reply(iic, reply, sizeof(reply));
+	side -> peer.write_many(peer, 0x20, data, sizeof(data));
+	finish_peer(side);
+	side -> peer.read_many(peer, 0x20, result, 4);
+	finish_peer(side);
+	note_bytes(side, result, 4);
+	uint8_t frame[8];
+	note(side, "frame %d | ", side -> api.slave_read_frame(iic, frame, sizeof(frame), NULL));
+
+	side -> api.setup(iic, 0x20, true, true, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, slave_callback);
+	side -> api.enable(iic);
+	side -> peer.write_many(peer, 0x20, data, 2);
+	finish_peer(side);
+	side -> peer.write_many(peer, 0x00, data + 2, 1); // general call
+	finish_peer(side);
+	side -> peer.read_many(peer, 0x20, result, 1);
+	finish_peer(side);
+	note_bytes(side, result, 1);
+	note(side, "events %02x | ", side -> api.take_events(iic, 0xFF));
+	side -> clear_error(iic);
+}
+
+static void run(const char *name, void (*scenario)(side_t *side)){
+	for(int dex = 0; dex < SIDES; dex++){
+		side_t *side = &sides[dex];
+		current = side;
+		side -> record_len = 0;
+		side -> record[0] = '\0';
+		sim_bus_log_clear(side -> bus);
+		scenario(side);
+		note(side, "bus: %s", sim_bus_log_text(side -> bus));
+	}
+	SIM_CHECK(strcmp(sides[0].record, sides[1].record) == 0, "%s differs\n  %-10s %s\n  %-10s %s", name,
+		sides[0].name, sides[0].record, sides[1].name, sides[1].record);
+}
+
+static void setup_side(side_t *side, const char *path){
+	side -> bus = sim_bus_new(side -> name);
+	sim_bus_log(side -> bus, 1);
+	side -> node = sim_node_load(path, side -> name);
+	side -> twi = sim_connect_twi(side -> node, 0, side -> bus);
+	sim_every(side -> node, SIM_US(100), sim_node_symbol(side -> node, "fw_watchdog"));
+	sim_api_load(side -> node, &side -> api);
+	side -> write_one = sim_node_symbol(side -> node, "iic_write_one");
+	side -> write_two = sim_node_symbol(side -> node, "iic_write_two");
+	side -> read_one = sim_node_symbol(side -> node, "iic_read_one");
+	side -> read_two = sim_node_symbol(side -> node, "iic_read_two");
+	side -> set_preempt_chunk = sim_node_symbol(side -> node, "iic_set_preempt_chunk");
+	side -> set_reply = sim_node_symbol(side -> node, "iic_slave_set_reply");
+	side -> clear_error = sim_node_symbol(side -> node, "iic_clear_error");
+	side -> registers = sim_node_symbol(side -> node, "fw_registers");
+	side -> eeprom = sim_device_new(side -> bus, 0x50);
+	side -> eeprom -> pointer_bytes = 1;
+	for(int dex = 0; dex < 0x100; dex++){
+		side -> eeprom -> mem[dex] = dex ^ 0xC3;
+	}
+
+	sim_node_t *peer = sim_node_load("test/build/fw_node.so", "peer");
+	sim_connect_twi(peer, 0, side -> bus);
+	sim_api_load(peer, &side -> peer);
+	side -> peer.setup(side -> peer.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	side -> peer.enable(side -> peer.module);
+
+	side -> api.setup(side -> api.module, 0x20, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	side -> api.enable(side -> api.module);
+}
+
+static void print_counts(void){
+	printf("%-6s %8s %12s %12s %12s %12s\n", "TWSR", "entries", "default avg", "ref avg", "default max", "ref max");
+	for(int status = 0; status < 32; status++){
+		uint64_t counted = sides[0].node -> isr_counted[status];
+		if(counted == 0){
+			continue;
+		}
+		printf("%02x     %8llu %12.1f %12.1f %12llu %12llu\n", status << 3, (unsigned long long)counted,
+			(double)sides[0].node -> isr_instructions[status] / counted, (double)sides[1].node -> isr_instructions[status] / counted,
+			(unsigned long long)sides[0].node -> isr_instructions_max[status], (unsigned long long)sides[1].node -> isr_instructions_max[status]);
+	}
+}
+
+int main(void){
+	setup_side(&sides[0], "test/build/fw_node.so");
+	setup_side(&sides[1], "test/build/fw_reference.so");
+	bool counting = sim_icount_enable();
+
+	run("small writes", small_writes);
+	run("small reads", small_reads);
+	run("write-read", write_read);
+	run("nacks", nacks);
+	run("segments", segments);
+	run("preempt", preempt);
+	run("slave", slave);
+
+	for(int status = 0; status < 32; status++){
+		SIM_CHECK(sim_twi_entries(sides[0].twi, status << 3) == sim_twi_entries(sides[1].twi, status << 3), "TWSR %02x: %llu interrupts against %llu",
+			status << 3, (unsigned long long)sim_twi_entries(sides[0].twi, status << 3), (unsigned long long)sim_twi_entries(sides[1].twi, status << 3));
+	}
+	if(counting){
+		printf("host instructions per ISR entry, default build against IIC_REFERENCE_ISR:\n");
+		print_counts();
+	}
+	printf("test_reference_isr: ok\n");
+	return 0;
+}
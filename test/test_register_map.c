@@ -0,0 +1,128 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_register_map.c
+ * register-map slave mode: pointer, wrap-around, read-only registers,
+ * per-bit write masks and the dirty range
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_api_t remote;
+static uint8_t registers[8];
+static const uint8_t read_only[1] = {1 << 1}; // register 1
+static int dirty_calls;
+static uint8_t dirty_first;
+static uint8_t dirty_last;
+
+static void dirty(volatile iic_t *iic, uint8_t first, uint8_t last){
+	(void)iic;
+	dirty_calls++;
+	dirty_first = first;
+	dirty_last = last;
+}
+
+static void write_to(uint8_t address, uint8_t *data, iic_len_t len){
+	dirty_calls = 0;
+	remote.write_many(remote.module, address, data, len);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+}
+
+static void write_registers(uint8_t *data, iic_len_t len){
+	write_to(0x20, data, len);
+}
+
+// Writes past the end wrap to register 0; the read-only register keeps its
+// value but the pointer still moves past it.
+static void test_pointer(void){
+	memset(registers, 0xEE, sizeof(registers));
+	write_registers((uint8_t[]){6, 0x66, 0x77, 0x00, 0x11}, 5);
+	SIM_CHECK(memcmp(registers, (uint8_t[]){0x00, 0xEE, 0xEE, 0xEE, 0xEE, 0xEE, 0x66, 0x77}, 8) == 0, "registers after wrap %02x %02x %02x", registers[0], registers[1], registers[6]);
+	SIM_CHECK(dirty_calls == 1 && dirty_first == 0 && dirty_last == 7, "dirty %d: %d..%d", dirty_calls, dirty_first, dirty_last);
+
+	uint8_t pointer = 6;
+	uint8_t result[4] = {0};
+	remote.write_read(remote.module, 0x20, &pointer, 1, result, 4);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	SIM_CHECK(memcmp(result, (uint8_t[]){0x66, 0x77, 0x00, 0xEE}, 4) == 0, "read %02x %02x %02x %02x", result[0], result[1], result[2], result[3]);
+}
+
+// Only the bits in a register's mask change; a mask of 0 is read-only and
+// doesn't count as dirty.
+static void test_write_mask(void){
+	static const uint8_t mask[8] = {0xFF, 0xFF, 0x0F, 0x80, 0x00, 0xFF, 0xFF, 0xFF};
+	iic_slave_register_write_mask(&IIC_MODULE, mask);
+	memset(registers, 0xA5, sizeof(registers));
+	write_registers((uint8_t[]){1, 0x00, 0x00, 0x00, 0x00}, 5);
+	SIM_CHECK(registers[1] == 0xA5, "read-only bitmap ignored: %02x", registers[1]);
+	SIM_CHECK(registers[2] == 0xA0 && registers[3] == 0x25 && registers[4] == 0xA5, "masked writes %02x %02x %02x", registers[2], registers[3], registers[4]);
+	SIM_CHECK(dirty_calls == 1 && dirty_first == 2 && dirty_last == 3, "dirty %d: %d..%d", dirty_calls, dirty_first, dirty_last);
+
+	write_registers((uint8_t[]){4, 0x00}, 2);
+	SIM_CHECK(registers[4] == 0xA5 && dirty_calls == 0, "masked-off register written");
+
+	iic_slave_register_write_mask(&IIC_MODULE, NULL);
+	write_registers((uint8_t[]){3, 0x00, 0x00}, 3);
+	SIM_CHECK(registers[3] == 0x00 && registers[4] == 0x00, "mask still applied after clearing it: %02x %02x", registers[3], registers[4]);
+	write_registers((uint8_t[]){1, 0x00}, 2);
+	SIM_CHECK(registers[1] == 0xA5, "clearing the mask made a read-only register writable");
+}
+
+// A multicast reaches the map of members only, and as an ordinary write:
+// the header is skipped and the payload sets the pointer, then the data.
+static void test_group(void){
+	uint8_t frame[] = {IIC_COMMAND_GROUP_MULTICAST, 9, 5, 0x55};
+	memset(registers, 0, sizeof(registers));
+	write_to(0x00, frame, sizeof(frame));
+	SIM_CHECK(registers[5] == 0 && dirty_calls == 0, "a non-member's map took a multicast");
+
+	iic_join_group(&IIC_MODULE, 9);
+	write_to(0x00, frame, sizeof(frame));
+	// taken as a write, the header would have put the group ID in register 0
+	SIM_CHECK(registers[5] == 0x55 && registers[0] == 0, "member's registers %02x %02x", registers[5], registers[0]);
+	SIM_CHECK(dirty_calls == 1 && dirty_first == 5 && dirty_last == 5, "dirty %d: %d..%d", dirty_calls, dirty_first, dirty_last);
+	iic_leave_group(&IIC_MODULE, 9);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	setup_iic(&IIC_MODULE, 0x20, true, true, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	iic_slave_register_map(&IIC_MODULE, registers, sizeof(registers), read_only, dirty);
+	enable_iic(&IIC_MODULE);
+
+	test_pointer();
+	test_write_mask();
+	test_group();
+	printf("test_register_map: ok\n");
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_segments.c
+ * scatter/gather transfers are byte-for-byte the same on the wire as the
+ * contiguous ones, and iic_eeprom_write built on them splits at pages
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define MAX_LEN 40
+#define MAX_SEGMENTS 6
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_device_t *device, *eeprom;
+static uint32_t seed = 12345;
+
+static uint32_t next_random(void){
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+// Cuts len bytes of data into up to MAX_SEGMENTS pieces, empty ones included.
+static uint8_t split(uint8_t *data, int len, iic_segment_t *segments){
+	uint8_t count = 1 + next_random() % MAX_SEGMENTS;
+	int offset = 0;
+	for(uint8_t dex = 0; dex < count; dex++){
+		int piece = dex == count - 1 ? len - offset : (int)(next_random() % (len - offset + 1));
+		segments[dex].data = data + offset;
+		segments[dex].len = piece;
+		offset += piece;
+	}
+	return count;
+}
+
+static char *take_log(void){
+	char *text = strdup(sim_bus_log_text(bus));
+	sim_bus_log_clear(bus);
+	return text;
+}
+
+static void test_write(int len){
+	uint8_t data[MAX_LEN];
+	iic_segment_t segments[MAX_SEGMENTS];
+	for(int dex = 0; dex < len; dex++){
+		data[dex] = next_random();
+	}
+	data[0] = 0x00; // pointer
+
+	iic_write_many(&IIC_MODULE, 0x50, data, len);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	char *contiguous = take_log();
+
+	memset(device -> mem, 0, MAX_LEN);
+	uint8_t count = split(data, len, segments);
+	iic_write_segments(&IIC_MODULE, 0x50, segments, count);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	char *gathered = take_log();
+
+	SIM_CHECK(strcmp(contiguous, gathered) == 0, "%d bytes in %d segments\n  contiguous: %s\n  segments:   %s", len, count, contiguous, gathered);
+	SIM_CHECK(memcmp(device -> mem, data + 1, len - 1) == 0, "%d bytes in %d segments: device memory differs", len, count);
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "error %d", IIC_MODULE.error_state);
+	free(contiguous);
+	free(gathered);
+}
+
+static void test_read(int len){
+	uint8_t contiguous[MAX_LEN];
+	uint8_t scattered[MAX_LEN + 1];
+	iic_segment_t segments[MAX_SEGMENTS];
+	uint8_t pointer = 0x00;
+
+	iic_write_many(&IIC_MODULE, 0x50, &pointer, 1);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	iic_read_many(&IIC_MODULE, 0x50, contiguous, len);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+
+	memset(scattered, 0xEE, sizeof(scattered));
+	uint8_t count = split(scattered, len, segments);
+	iic_write_many(&IIC_MODULE, 0x50, &pointer, 1);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	iic_read_segments(&IIC_MODULE, 0x50, segments, count);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+
+	SIM_CHECK(memcmp(contiguous, scattered, len) == 0, "%d bytes in %d segments: read differs", len, count);
+	SIM_CHECK(scattered[len] == 0xEE, "%d bytes in %d segments: wrote past the last segment", len, count);
+	SIM_CHECK(memcmp(contiguous, device -> mem, len) == 0, "%d bytes: read the wrong bytes", len);
+	sim_bus_log_clear(bus);
+}
+
+// A write across two page boundaries goes out as three transactions, each
+// inside one page of the EEPROM (which would wrap a write that crossed
+// one); a page size of 0 is refused.
+static void test_eeprom_pages(void){
+	static iic_eeprom_write_t job;
+	uint8_t data[40];
+	for(int dex = 0; dex < (int)sizeof(data); dex++){
+		data[dex] = 0x80 + dex;
+	}
+	SIM_CHECK(!iic_eeprom_write(&IIC_MODULE, &job, 0x51, 0x0100, data, sizeof(data), 0, NULL) && !job.pending, "page size 0 accepted");
+	uint64_t transfers = eeprom -> transfers;
+	SIM_CHECK(iic_eeprom_write(&IIC_MODULE, &job, 0x51, 0x0110, data, sizeof(data), 16, NULL), "couldn't queue");
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(10));
+	sim_bus_log_clear(bus);
+	SIM_CHECK(!job.pending && job.transaction.error == IIC_NO_ERROR, "job: pending %d, error %d", job.pending, job.transaction.error);
+	SIM_CHECK(eeprom -> transfers - transfers == 3, "%d transactions", (int)(eeprom -> transfers - transfers));
+	SIM_CHECK(memcmp(eeprom -> mem + 0x0110, data, sizeof(data)) == 0, "the EEPROM holds the wrong bytes");
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	device = sim_device_new(bus, 0x50);
+	device -> pointer_bytes = 1;
+	eeprom = sim_device_new(bus, 0x51);
+	eeprom -> pointer_bytes = 2;
+	eeprom -> page_size = 16;
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 1, NULL);
+	enable_iic(&IIC_MODULE);
+
+	for(int round = 0; round < 20; round++){
+		for(int len = 1; len <= MAX_LEN; len++){
+			test_write(len);
+			test_read(len);
+		}
+	}
+	test_eeprom_pages();
+	printf("test_segments: ok\n");
+	return 0;
+}
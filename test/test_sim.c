@@ -0,0 +1,156 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_sim.c
+ * the harness itself: the unmodified library against the bus model, a
+ * simulated EEPROM, a second node and a second master
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define TWBR_400K IIC_TWBR_FOR(F_CPU, 400000UL)
+#define PRESCALER_400K IIC_PRESCALER_FOR(F_CPU, 400000UL)
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+static sim_device_t *eeprom;
+
+static void expect_log(const char *expected){
+	SIM_CHECK(strcmp(sim_bus_log_text(bus), expected) == 0, "bus log\n  got:      %s\n  expected: %s", sim_bus_log_text(bus), expected);
+	sim_bus_log_clear(bus);
+}
+
+static void test_write(void){
+	uint8_t data[] = {0x10, 0xAA, 0xBB};
+	iic_write_many(&IIC_MODULE, 0x50, data, sizeof(data));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 50w+ 10+ aa+ bb+ P");
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "error %d", IIC_MODULE.error_state);
+	SIM_CHECK(eeprom -> mem[0x10] == 0xAA && eeprom -> mem[0x11] == 0xBB, "eeprom holds %02x %02x", eeprom -> mem[0x10], eeprom -> mem[0x11]);
+}
+
+static void test_write_read(void){
+	uint8_t pointer = 0x10;
+	uint8_t result[2] = {0};
+	iic_write_read(&IIC_MODULE, 0x50, &pointer, 1, result, 2);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 50w+ 10+ Sr 50r+ aa+ bb- P");
+	SIM_CHECK(IIC_MODULE.data_ready && result[0] == 0xAA && result[1] == 0xBB, "read %02x %02x", result[0], result[1]);
+}
+
+// A missing device is retried retry_max times with repeated STARTs, then
+// given up on.
+static void test_address_nack(void){
+	iic_write_one(&IIC_MODULE, 0x51, 0x00);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 51w- Sr 51w- Sr 51w- Sr 51w- P");
+	SIM_CHECK(IIC_MODULE.error_state == IIC_MT_ADDR_NACK, "error %d", IIC_MODULE.error_state);
+	iic_clear_error(&IIC_MODULE);
+	iic_presence_forget(&IIC_MODULE, 0x51);
+}
+
+// The device holds SCL after every ACK; the transfer slows down but the
+// bytes are the same.
+static void test_clock_stretch(void){
+	uint8_t data[] = {0x20, 1, 2, 3, 4};
+	sim_time_t start = sim_now();
+	iic_write_many(&IIC_MODULE, 0x50, data, sizeof(data));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	sim_time_t plain = sim_now() - start;
+	sim_bus_log_clear(bus);
+
+	eeprom -> stretch = SIM_US(40);
+	data[1] = 5;
+	start = sim_now();
+	iic_write_many(&IIC_MODULE, 0x50, data, sizeof(data));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	sim_time_t stretched = sim_now() - start;
+	eeprom -> stretch = 0;
+	expect_log("S 50w+ 20+ 05+ 02+ 03+ 04+ P");
+	// each stretch overlaps the master's own hold while its ISR runs
+	SIM_CHECK(stretched >= plain + 5 * (SIM_US(40) - local -> isr_cycles), "stretching didn't slow the bus (%llu vs %llu cycles)", (unsigned long long)stretched, (unsigned long long)plain);
+	SIM_CHECK(memcmp(&eeprom -> mem[0x20], (uint8_t[]){5, 2, 3, 4}, 4) == 0, "stretched write came out wrong");
+}
+
+// A second node serving a register map, written and read back by us.
+static void test_node_to_node(sim_api_t *remote, uint8_t *registers){
+	uint8_t data[] = {0x04, 0x11, 0x22, 0x33};
+	iic_write_many(&IIC_MODULE, 0x20, data, sizeof(data));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 20w+ 04+ 11+ 22+ 33+ P");
+	SIM_CHECK(memcmp(&registers[4], &data[1], 3) == 0, "registers hold %02x %02x %02x", registers[4], registers[5], registers[6]);
+	SIM_CHECK(remote -> take_events(remote -> module, IIC_EVENT_SLAVE_RX) == IIC_EVENT_SLAVE_RX, "slave saw no frame");
+
+	uint8_t pointer = 0x05;
+	uint8_t result[2] = {0};
+	iic_write_read(&IIC_MODULE, 0x20, &pointer, 1, result, 2);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 20w+ 05+ Sr 20r+ 22+ 33- P");
+	SIM_CHECK(result[0] == 0x22 && result[1] == 0x33, "read %02x %02x", result[0], result[1]);
+}
+
+// Two masters start in the same cycle. They agree up to the second data
+// byte, where the one sending the first 1 against a 0 drops out.
+static void test_arbitration(sim_api_t *remote){
+	uint8_t mine[] = {0x30, 0x55};
+	uint8_t theirs[] = {0x30, 0x33};
+	iic_write_many(&IIC_MODULE, 0x50, mine, sizeof(mine));
+	remote -> write_many(remote -> module, 0x50, theirs, sizeof(theirs));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	sim_wait_master(remote -> module, bus, SIM_MS(5));
+	expect_log("S 50w+ 30+ 33+ P");
+	SIM_CHECK(IIC_MODULE.error_state == IIC_MT_ARBITRATION_LOST, "loser has error %d", IIC_MODULE.error_state);
+	SIM_CHECK(remote -> module -> error_state == IIC_NO_ERROR, "winner has error %d", remote -> module -> error_state);
+	SIM_CHECK(eeprom -> mem[0x30] == 0x33, "eeprom holds %02x", eeprom -> mem[0x30]);
+	iic_clear_error(&IIC_MODULE);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	eeprom = sim_device_new(bus, 0x50);
+	eeprom -> pointer_bytes = 1;
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_t remote;
+	sim_api_load(node, &remote);
+	uint8_t *registers = sim_node_symbol(node, "fw_registers");
+	remote.setup(remote.module, 0x20, true, false, TWBR_400K, PRESCALER_400K, 3, NULL);
+	remote.slave_register_map(remote.module, registers, 64, NULL, NULL);
+	remote.enable(remote.module);
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, TWBR_400K, PRESCALER_400K, 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	test_write();
+	test_write_read();
+	test_address_nack();
+	test_clock_stretch();
+	test_node_to_node(&remote, registers);
+	test_arbitration(&remote);
+	printf("test_sim: ok\n");
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_slave.c
+ * buffered slave mode, including being addressed right after losing
+ * arbitration as a master (0x68 / 0x78 / 0xB0)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_extras.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+static struct sim_twi_t *twi;
+static sim_api_t remote;
+static sim_device_t *device;
+static uint8_t ring[64];
+static uint8_t reply[] = {0xC0, 0xFF, 0xEE};
+static int callbacks;
+
+static void expect_log(const char *expected){
+	SIM_CHECK(strcmp(sim_bus_log_text(bus), expected) == 0, "bus log\n  got:      %s\n  expected: %s", sim_bus_log_text(bus), expected);
+	sim_bus_log_clear(bus);
+}
+
+static void expect_frame(const uint8_t *expected, uint8_t len, bool general_call){
+	uint8_t frame[32];
+	bool gcall = false;
+	uint8_t got = iic_slave_read_frame(&IIC_MODULE, frame, sizeof(frame), &gcall);
+	SIM_CHECK(got == len && memcmp(frame, expected, len) == 0 && gcall == general_call, "frame of %d bytes (gc %d)", got, gcall);
+}
+
+static void local_tick(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static void test_frames(void){
+	uint8_t data[] = {1, 2, 3, 4, 5};
+	uint8_t result[3] = {0};
+	remote.write_many(remote.module, 0x20, data, 5);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	remote.write_many(remote.module, 0x00, data, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	remote.read_many(remote.module, 0x20, result, 3);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	expect_log("S 20w+ 01+ 02+ 03+ 04+ 05+ P S 00w+ 01+ 02+ P S 20r+ c0+ ff+ ee- P");
+	expect_frame(data, 5, false);
+	expect_frame(data, 2, true);
+	SIM_CHECK(iic_slave_read_frame(&IIC_MODULE, result, 3, NULL) == 0, "extra frame");
+	SIM_CHECK(memcmp(result, reply, 3) == 0, "master read %02x %02x %02x", result[0], result[1], result[2]);
+	SIM_CHECK(iic_take_events(&IIC_MODULE, IIC_EVENT_SLAVE_RX | IIC_EVENT_SLAVE_TX) == (IIC_EVENT_SLAVE_RX | IIC_EVENT_SLAVE_TX), "slave events");
+}
+
+// We start a write to 0x30 in the same cycle as the other master starts
+// one to us (0x20): we lose in the address byte and are addressed by the
+// winner. A direct call fails with the "selected" error; the frame is
+// still received.
+static void test_lost_and_selected_rx(void){
+	uint8_t mine[] = {0x00, 0x01};
+	uint8_t theirs[] = {0xAB, 0xCD};
+	sim_twi_reset_counts(twi);
+	iic_write_many(&IIC_MODULE, 0x30, mine, 2);
+	remote.write_many(remote.module, 0x20, theirs, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 20w+ ab+ cd+ P");
+	SIM_CHECK(strcmp(sim_twi_status_log(twi), "08 68 80 80 a0") == 0, "TWSR %s", sim_twi_status_log(twi));
+	SIM_CHECK(IIC_MODULE.error_state == IIC_ARBITRATION_LOST_AND_SR_SELECTED, "error %d", IIC_MODULE.error_state);
+	expect_frame(theirs, 2, false);
+	iic_clear_error(&IIC_MODULE);
+	iic_take_events(&IIC_MODULE, 0xFF);
+}
+
+// Same, but the other master is reading from us, and ours is queued: it
+// backs off, serves the read, and goes out afterwards.
+static void test_lost_and_selected_tx(void){
+	uint8_t mine[] = {0x00, 0x02};
+	uint8_t result[3] = {0};
+	iic_transaction_t write = {.remote_address = 0x30, .direction = IIC_MASTER_TRANSMITTER, .buffer = mine, .buffer_len = 2};
+	sim_twi_reset_counts(twi);
+	iic_enqueue(&IIC_MODULE, &write);
+	remote.read_many(remote.module, 0x20, result, 3);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 20r+ c0+ ff+ ee- P S 30w+ 00+ 02+ P");
+	SIM_CHECK(strncmp(sim_twi_status_log(twi), "08 b0 b8 b8 c0 08 18 28 28", 26) == 0, "TWSR %s", sim_twi_status_log(twi));
+	SIM_CHECK(memcmp(result, reply, 3) == 0, "master read %02x %02x %02x", result[0], result[1], result[2]);
+	SIM_CHECK(!write.pending && write.error == IIC_NO_ERROR && device -> mem[0] == 0x02, "parked write: error %d", write.error);
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "error %d", IIC_MODULE.error_state);
+}
+
+// And a general call that beats our write: 0x78.
+static void test_lost_and_general_call(void){
+	uint8_t mine[] = {0x00, 0x03};
+	uint8_t theirs[] = {0x42};
+	sim_twi_reset_counts(twi);
+	iic_write_many(&IIC_MODULE, 0x30, mine, 2);
+	remote.write_many(remote.module, 0x00, theirs, 1);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(strcmp(sim_twi_status_log(twi), "08 78 90 a0") == 0, "TWSR %s", sim_twi_status_log(twi));
+	expect_frame(theirs, 1, true);
+	iic_clear_error(&IIC_MODULE);
+	sim_bus_log_clear(bus);
+}
+
+static uint8_t deferred_reply(volatile iic_t *iic, uint8_t dat){
+	SIM_CHECK(!local -> in_isr, "deferred callback ran in the ISR");
+	return 0x10 + ++callbacks;
+}
+
+static uint8_t read_one(void){
+	uint8_t result = 0;
+	remote.read_many(remote.module, 0x20, &result, 1);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	return result;
+}
+
+// Deferred callback mode: a read gets the preloaded byte, and the callback
+// only runs when the main loop calls iic_slave_poll. Until it has, a
+// master reading again gets the same byte again.
+static void test_deferred(void){
+	disable_iic(&IIC_MODULE);
+	setup_iic(&IIC_MODULE, 0x20, true, true, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, deferred_reply);
+	iic_slave_defer_callback(&IIC_MODULE, true, 0x10);
+	enable_iic(&IIC_MODULE);
+	uint8_t first = read_one(), again = read_one();
+	SIM_CHECK(first == 0x10 && again == 0x10 && callbacks == 0, "read %02x, %02x with %d callbacks", first, again, callbacks);
+	SIM_CHECK(iic_slave_poll(&IIC_MODULE) && callbacks == 1, "iic_slave_poll didn't run the callback");
+	SIM_CHECK(!iic_slave_poll(&IIC_MODULE), "iic_slave_poll ran the callback again without a read");
+	uint8_t next = read_one();
+	SIM_CHECK(next == 0x11, "read %02x after iic_slave_poll", next);
+	sim_bus_log_clear(bus);
+}
+
+static uint8_t heard[8];
+static int heard_len;
+
+static uint8_t record(volatile iic_t *iic, uint8_t dat){
+	if(heard_len < (int)sizeof(heard)){
+		heard[heard_len++] = dat;
+	}
+	return 0;
+}
+
+// Callback mode filters multicasts too: outside the group the payload is
+// NACKed and the callback hears nothing, not even the command; a member's
+// callback gets the whole frame.
+static void test_group_callback(void){
+	uint8_t frame[] = {IIC_COMMAND_GROUP_MULTICAST, 7, 0xAA, 0xBB};
+	setup_iic(&IIC_MODULE, 0x20, true, true, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, record);
+	iic_slave_defer_callback(&IIC_MODULE, false, 0);
+	heard_len = 0;
+	remote.write_many(remote.module, 0x00, frame, sizeof(frame));
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	SIM_CHECK(strncmp(sim_bus_log_text(bus), "S 00w+ 30+ 07+ aa-", 18) == 0, "payload not NACKed: %s", sim_bus_log_text(bus));
+	sim_bus_log_clear(bus);
+	SIM_CHECK(heard_len == 0, "a non-member's callback heard %d bytes", heard_len);
+
+	iic_join_group(&IIC_MODULE, 7);
+	remote.write_many(remote.module, 0x00, frame, sizeof(frame));
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	expect_log("S 00w+ 30+ 07+ aa+ bb+ P");
+	SIM_CHECK(heard_len == sizeof(frame) && memcmp(heard, frame, sizeof(frame)) == 0, "a member's callback heard %d bytes", heard_len);
+	iic_leave_group(&IIC_MODULE, 7);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	local = sim_node_attach(&iic_sim_image, "local");
+	twi = sim_connect_twi(local, 0, bus);
+	sim_every(local, SIM_US(100), local_tick);
+	device = sim_device_new(bus, 0x30);
+	device -> pointer_bytes = 1;
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	setup_iic(&IIC_MODULE, 0x20, true, true, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), NULL);
+	iic_slave_set_reply(&IIC_MODULE, reply, sizeof(reply));
+	enable_iic(&IIC_MODULE);
+
+	test_frames();
+	test_lost_and_selected_rx();
+	test_lost_and_selected_tx();
+	test_lost_and_general_call();
+	test_deferred();
+	test_group_callback();
+	printf("test_slave: ok\n");
+	return 0;
+}
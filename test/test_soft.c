@@ -0,0 +1,203 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_soft.c
+ * the bit-banged master (iic_soft) on PD2/PD3 against the simulated
+ * EEPROM, and the same driver code running on it and on the hardware TWI
+ * through iic_bus_t
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <iic/iic_soft.h>
+#include <iic/iic_bus.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define SOFT_TICK (SIM_F_CPU / IIC_SOFT_TICK_HZ(100000)) // cycles per iic_soft_tick at 100 kHz
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *hw_bus, *soft_bus;
+static sim_device_t *hw_eeprom, *soft_eeprom;
+static volatile iic_soft_t soft;
+
+static void soft_tick(void){
+	iic_soft_tick(&soft);
+}
+
+static void local_watchdog(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static void expect_log(const char *expected){
+	SIM_CHECK(strcmp(sim_bus_log_text(soft_bus), expected) == 0, "bus log\n  got:      %s\n  expected: %s", sim_bus_log_text(soft_bus), expected);
+	sim_bus_log_clear(soft_bus);
+}
+
+static int done(void *arg){
+	return !((iic_transaction_t*)arg) -> pending;
+}
+
+static void wait(iic_transaction_t *transaction){
+	SIM_CHECK(sim_run_until(done, transaction, SIM_MS(20)), "transaction to %02x still pending", transaction -> remote_address);
+	sim_run(SIM_US(20)); // let the bus go quiet before the next check
+}
+
+static void test_write(void){
+	uint8_t data[] = {0x10, 0xAA, 0xBB};
+	SIM_CHECK(iic_soft_write_many(&soft, 0x50, data, sizeof(data)), "not queued");
+	SIM_CHECK(!iic_soft_write_many(&soft, 0x50, data, sizeof(data)), "second direct call queued while the first is pending");
+	wait((iic_transaction_t*)&soft.direct);
+	expect_log("S 50w+ 10+ aa+ bb+ P");
+	SIM_CHECK(soft.direct.error == IIC_NO_ERROR, "error %d", soft.direct.error);
+	SIM_CHECK(soft_eeprom -> mem[0x10] == 0xAA && soft_eeprom -> mem[0x11] == 0xBB, "eeprom holds %02x %02x", soft_eeprom -> mem[0x10], soft_eeprom -> mem[0x11]);
+	SIM_CHECK(iic_soft_take_events(&soft, 0xFF) == (IIC_EVENT_MASTER_DONE | IIC_EVENT_QUEUE_EMPTY), "wrong events");
+}
+
+// SCL runs at the tick rate over 2 * tick_divider.
+static void test_scl_rate(void){
+	uint8_t data[] = {0x20, 0x01};
+	for(uint8_t divider = 1; divider <= 2; divider++){
+		iic_soft_setup(&soft, &PIND, 2, &PIND, 3, divider, 16, 3);
+		soft_eeprom -> fastest_clock = 0;
+		iic_soft_write_many(&soft, 0x50, data, sizeof(data));
+		wait((iic_transaction_t*)&soft.direct);
+		SIM_CHECK(soft_eeprom -> fastest_clock >= 2 * divider * SOFT_TICK && soft_eeprom -> fastest_clock < 2 * divider * SOFT_TICK + SOFT_TICK / 2,
+			"divider %d: SCL period %llu cycles, expected %llu", divider, (unsigned long long)soft_eeprom -> fastest_clock, (unsigned long long)(2 * divider * SOFT_TICK));
+	}
+	iic_soft_setup(&soft, &PIND, 2, &PIND, 3, 1, 16, 3);
+	sim_bus_log_clear(soft_bus);
+}
+
+// The EEPROM holds SCL after every ACK; the bus waits for it.
+static void test_write_read_stretched(void){
+	uint8_t pointer = 0x10;
+	uint8_t result[2] = {0};
+	soft_eeprom -> stretch = SIM_US(30);
+	iic_soft_write_read(&soft, 0x50, &pointer, 1, result, 2);
+	wait((iic_transaction_t*)&soft.direct);
+	soft_eeprom -> stretch = 0;
+	expect_log("S 50w+ 10+ Sr 50r+ aa+ bb- P");
+	SIM_CHECK(soft.direct.error == IIC_NO_ERROR && result[0] == 0xAA && result[1] == 0xBB, "error %d, read %02x %02x", soft.direct.error, result[0], result[1]);
+}
+
+// retry_max repeated STARTs, then the NACK is reported; a probe gives up
+// on the first one.
+static void test_address_nack(void){
+	uint8_t data[] = {0x00};
+	iic_soft_write_many(&soft, 0x51, data, 1);
+	wait((iic_transaction_t*)&soft.direct);
+	expect_log("S 51w- Sr 51w- Sr 51w- Sr 51w- P");
+	SIM_CHECK(soft.direct.error == IIC_MT_ADDR_NACK, "error %d", soft.direct.error);
+
+	iic_transaction_t probe = {.remote_address = 0x51, .direction = IIC_MASTER_RECEIVER, .buffer = data, .buffer_len = 1, .flags = IIC_FLAG_NO_RETRY};
+	iic_soft_enqueue(&soft, &probe);
+	wait(&probe);
+	expect_log("S 51r- P");
+	SIM_CHECK(probe.error == IIC_MR_ADDR_NACK, "probe error %d", probe.error);
+}
+
+// A segment list goes out as one write; two queued reads follow it.
+static void test_queue(void){
+	uint8_t pointer[] = {0x30}, body[] = {0x01, 0x02, 0x03}, first[2], second[2];
+	iic_segment_t segments[] = {{pointer, 1}, {body, 3}};
+	iic_transaction_t write = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .segments = segments, .segment_count = 2};
+	iic_transaction_t set = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = pointer, .buffer_len = 1, .read_buffer = first, .read_len = 2};
+	iic_transaction_t read = {.remote_address = 0x50, .direction = IIC_MASTER_RECEIVER, .buffer = second, .buffer_len = 2};
+	SIM_CHECK(iic_soft_enqueue(&soft, &write) && iic_soft_enqueue(&soft, &set) && iic_soft_enqueue(&soft, &read), "queue full");
+	wait(&read);
+	expect_log("S 50w+ 30+ 01+ 02+ 03+ P S 50w+ 30+ Sr 50r+ 01+ 02- P S 50r+ 03+ 00- P");
+	SIM_CHECK(!write.pending && !set.pending && write.error == IIC_NO_ERROR && set.error == IIC_NO_ERROR && read.error == IIC_NO_ERROR, "errors %d %d %d",
+		write.error, set.error, read.error);
+	SIM_CHECK(first[0] == 0x01 && first[1] == 0x02 && second[0] == 0x03, "read %02x %02x %02x", first[0], first[1], second[0]);
+}
+
+// Device code written once against iic_bus_t: store a block, read it back.
+static bool eeprom_round_trip(const iic_bus_t *bus, uint8_t address, uint8_t *block, uint8_t *result){
+	iic_transaction_t transaction = {0};
+	uint8_t pointer = block[0];
+	if(!iic_bus_write_many(bus, &transaction, address, block, 5)){
+		return false;
+	}
+	wait(&transaction);
+	if(transaction.error != IIC_NO_ERROR || !iic_bus_write_read(bus, &transaction, address, &pointer, 1, result, 4)){
+		return false;
+	}
+	wait(&transaction);
+	return transaction.error == IIC_NO_ERROR && (iic_bus_take_events(bus, IIC_EVENT_MASTER_DONE) & IIC_EVENT_MASTER_DONE);
+}
+
+static void test_common_interface(void){
+	iic_bus_t hw = IIC_BUS_HW(&IIC_MODULE);
+	iic_bus_t bitbang = IIC_BUS_SOFT(&soft);
+	uint8_t block[] = {0x40, 0x11, 0x22, 0x33, 0x44};
+	uint8_t hw_result[4] = {0}, soft_result[4] = {0};
+	SIM_CHECK(eeprom_round_trip(&hw, 0x50, block, hw_result), "round trip on the hardware bus failed");
+	SIM_CHECK(eeprom_round_trip(&bitbang, 0x50, block, soft_result), "round trip on the software bus failed");
+	SIM_CHECK(memcmp(hw_result, block + 1, 4) == 0 && memcmp(soft_result, block + 1, 4) == 0, "read back differs");
+	SIM_CHECK(memcmp(hw_eeprom -> mem + 0x40, block + 1, 4) == 0 && memcmp(soft_eeprom -> mem + 0x40, block + 1, 4) == 0, "eeproms differ");
+	sim_bus_log_clear(soft_bus);
+}
+
+// A slave that holds SCL for longer than stretch_max half periods fails
+// the transaction with IIC_BUS_ERROR; the bus works again afterwards.
+static void test_stretch_timeout(void){
+	uint8_t data[] = {0x50, 0x01};
+	soft_eeprom -> stretch = SIM_MS(1);
+	iic_soft_write_many(&soft, 0x50, data, sizeof(data));
+	wait((iic_transaction_t*)&soft.direct);
+	SIM_CHECK(soft.direct.error == IIC_BUS_ERROR, "error %d", soft.direct.error);
+	soft_eeprom -> stretch = 0;
+	sim_run(SIM_MS(2));
+	sim_bus_log_clear(soft_bus);
+
+	iic_soft_write_many(&soft, 0x50, data, sizeof(data));
+	wait((iic_transaction_t*)&soft.direct);
+	expect_log("Sr 50w+ 50+ 01+ P"); // the aborted transfer never sent a STOP
+	SIM_CHECK(soft.direct.error == IIC_NO_ERROR && soft_eeprom -> mem[0x50] == 0x01, "error %d after the timeout", soft.direct.error);
+}
+
+int main(void){
+	hw_bus = sim_bus_new("hw");
+	soft_bus = sim_bus_new("soft");
+	sim_bus_log(soft_bus, 1);
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, hw_bus);
+	sim_connect_pins(local, SIM_PIND, 2, SIM_PIND, 3, soft_bus);
+	sim_every(local, SOFT_TICK, soft_tick);
+	sim_every(local, SIM_US(100), local_watchdog);
+	hw_eeprom = sim_device_new(hw_bus, 0x50);
+	hw_eeprom -> pointer_bytes = 1;
+	soft_eeprom = sim_device_new(soft_bus, 0x50);
+	soft_eeprom -> pointer_bytes = 1;
+
+	setup_iic(&IIC_MODULE, 0x20, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+	iic_soft_setup(&soft, &PIND, 2, &PIND, 3, 1, 16, 3);
+
+	test_write();
+	test_scl_rate();
+	test_write_read_stretched();
+	test_address_nack();
+	test_queue();
+	test_common_interface();
+	test_stretch_timeout();
+	printf("test_soft: ok\n");
+	return 0;
+}
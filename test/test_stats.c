@@ -0,0 +1,184 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_stats.c
+ * IIC_STATS read back on the host: status counts, the transaction time and
+ * retry histograms and the arbitration counters after known traffic
+ *
+ * Built with IIC_ENABLE_STATS (see the Makefile); fw_node.so is built
+ * without it and must not have the stats at all. The simulator sets TCNT1
+ * to the cycle count when an ISR body starts and charges the whole ISR
+ * (isr_cycles) before that, so the per-ISR times read 0 here; the
+ * transaction times span several ISRs and are real.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <util/twi.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_node_t *local;
+static sim_api_t remote;
+static sim_device_t *device;
+
+static void local_tick(void){
+	iic_watchdog_tick(&IIC_MODULE);
+}
+
+static uint16_t count(uint8_t status){
+	return IIC_STATS.status_count[status >> 3];
+}
+
+static int histogram_total(volatile uint16_t *histogram){
+	int total = 0;
+	for(int dex = 0; dex < IIC_STATS_BUCKETS; dex++){
+		total += histogram[dex];
+	}
+	return total;
+}
+
+// The time_histogram bucket a transaction of this many cycles lands in.
+static int time_bucket(sim_time_t cycles){
+	uint32_t elapsed = cycles >> IIC_STATS_TIME_SHIFT;
+	int bucket = 0;
+	while(elapsed != 0 && bucket < IIC_STATS_BUCKETS - 1){
+		elapsed >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void write_and_wait(uint8_t address, uint8_t *data, iic_len_t len){
+	iic_write_many(&IIC_MODULE, address, data, len);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(20));
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "write to %02x: error %d", address, IIC_MODULE.error_state);
+}
+
+static void test_reset(void){
+	iic_stats_reset();
+	SIM_CHECK(IIC_STATS.isr_count == 0 && IIC_STATS.isr_total == 0 && IIC_STATS.isr_max == 0, "ISR figures survived the reset");
+	SIM_CHECK(IIC_STATS.isr_min == 0xFFFF, "isr_min %u after the reset", IIC_STATS.isr_min);
+	SIM_CHECK(histogram_total(IIC_STATS.time_histogram) == 0 && histogram_total(IIC_STATS.retry_histogram) == 0, "histograms survived the reset");
+	SIM_CHECK(iic_stats_isr_mean() == 0, "mean %u with no ISRs", iic_stats_isr_mean());
+}
+
+// One ISR per status, all of them counted, and one transaction of the
+// length it took on the bus.
+static void test_write(void){
+	uint8_t data[] = {0x00, 0x11, 0x22};
+	iic_stats_reset();
+	uint64_t entries = local -> isr_entries;
+	sim_time_t start = sim_now();
+	write_and_wait(0x50, data, 3);
+	sim_time_t elapsed = sim_now() - start;
+
+	SIM_CHECK(count(TW_START) == 1 && count(TW_MT_SLA_ACK) == 1 && count(TW_MT_DATA_ACK) == 3, "counts %u %u %u",
+		count(TW_START), count(TW_MT_SLA_ACK), count(TW_MT_DATA_ACK));
+	SIM_CHECK(IIC_STATS.isr_count == local -> isr_entries - entries, "%u ISRs timed, %llu taken",
+		(unsigned)IIC_STATS.isr_count, (unsigned long long)(local -> isr_entries - entries));
+	SIM_CHECK(IIC_STATS.isr_min <= IIC_STATS.isr_max && iic_stats_isr_mean() <= IIC_STATS.isr_max, "min %u mean %u max %u",
+		IIC_STATS.isr_min, iic_stats_isr_mean(), IIC_STATS.isr_max);
+	SIM_CHECK(histogram_total(IIC_STATS.time_histogram) == 1 && IIC_STATS.retry_histogram[0] == 1, "transaction not counted once");
+	int bucket = time_bucket(elapsed);
+	SIM_CHECK(IIC_STATS.time_histogram[bucket] == 1 || IIC_STATS.time_histogram[bucket - 1] == 1,
+		"a %llu-cycle transaction isn't in bucket %d", (unsigned long long)elapsed, bucket);
+	SIM_CHECK(!IIC_STATS.in_transaction, "still in a transaction");
+}
+
+// Two NACKed addresses, then the write goes through: two repeated STARTs
+// and a transaction in retry_histogram[2].
+static void test_retries(void){
+	uint8_t data[] = {0x00, 0x33};
+	iic_stats_reset();
+	device -> nack_address = 2;
+	write_and_wait(0x50, data, 2);
+	SIM_CHECK(count(TW_MT_SLA_NACK) == 2 && count(TW_REP_START) == 2, "%u NACKs, %u repeated STARTs", count(TW_MT_SLA_NACK), count(TW_REP_START));
+	SIM_CHECK(IIC_STATS.retry_histogram[2] == 1 && histogram_total(IIC_STATS.retry_histogram) == 1, "retry histogram %u %u %u",
+		IIC_STATS.retry_histogram[0], IIC_STATS.retry_histogram[1], IIC_STATS.retry_histogram[2]);
+}
+
+// The other master starts in the same cycle and wins in the data; ours
+// backs off, retries and still counts as one transaction.
+static void test_arbitration(void){
+	uint8_t mine[] = {0x30, 0x55};
+	uint8_t theirs[] = {0x30, 0x33};
+	iic_stats_reset();
+	iic_transaction_t transaction = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = mine, .buffer_len = 2};
+	SIM_CHECK(iic_enqueue(&IIC_MODULE, &transaction), "queue full");
+	remote.write_many(remote.module, 0x50, theirs, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(20));
+	SIM_CHECK(!transaction.pending, "retry never finished");
+	SIM_CHECK(transaction.error == IIC_NO_ERROR && device -> mem[0x30] == 0x55, "retry failed with %d", transaction.error);
+	SIM_CHECK(count(TW_MT_ARB_LOST) == 1 && IIC_STATS.arb_lost == 1 && IIC_STATS.arb_lost_max == 1, "%u losses counted, %u recorded, max %u",
+		count(TW_MT_ARB_LOST), IIC_STATS.arb_lost, IIC_STATS.arb_lost_max);
+	SIM_CHECK(histogram_total(IIC_STATS.time_histogram) == 1, "%d transactions counted", histogram_total(IIC_STATS.time_histogram));
+}
+
+// Another master reads our two-byte reply as a slave.
+static void test_slave_read(void){
+	uint8_t reply[] = {0xA1, 0xA2};
+	uint8_t result[2];
+	iic_slave_set_reply(&IIC_MODULE, reply, 2);
+	iic_stats_reset();
+	remote.read_many(remote.module, 0x20, result, 2);
+	sim_wait_master(remote.module, bus, SIM_MS(5));
+	SIM_CHECK(result[0] == 0xA1 && result[1] == 0xA2, "read back %02x %02x", result[0], result[1]);
+	SIM_CHECK(count(TW_ST_SLA_ACK) == 1 && count(TW_ST_DATA_ACK) == 1 && count(TW_ST_DATA_NACK) == 1, "slave counts %u %u %u",
+		count(TW_ST_SLA_ACK), count(TW_ST_DATA_ACK), count(TW_ST_DATA_NACK));
+	SIM_CHECK(histogram_total(IIC_STATS.time_histogram) == 0, "a slave transfer counted as a transaction");
+}
+
+// Compiled out, there is nothing to read.
+static void test_compiled_out(sim_node_t *node){
+	SIM_CHECK(dlsym(node -> handle, "IIC_STATS") == NULL && dlsym(node -> handle, "iic_stats_reset") == NULL, "fw_node.so has the stats");
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	sim_every(local, SIM_US(100), local_tick);
+	device = sim_device_new(bus, 0x50);
+	device -> pointer_bytes = 1;
+
+	sim_node_t *node = sim_node_load("test/build/fw_node.so", "remote");
+	sim_connect_twi(node, 0, bus);
+	sim_api_load(node, &remote);
+	remote.setup(remote.module, 0x40, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	remote.enable(remote.module);
+
+	uint8_t ring[32];
+	setup_iic(&IIC_MODULE, 0x20, true, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	iic_slave_buffers(&IIC_MODULE, ring, sizeof(ring), NULL);
+	enable_iic(&IIC_MODULE);
+
+	test_reset();
+	test_write();
+	test_retries();
+	test_arbitration();
+	test_slave_read();
+	test_compiled_out(node);
+	printf("test_stats: ok\n");
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_write_read.c
+ * repeated-START write-then-read, and the calls that must not inherit its
+ * read half
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_device_t *device;
+
+static void expect_log(const char *expected){
+	SIM_CHECK(strcmp(sim_bus_log_text(bus), expected) == 0, "bus log\n  got:      %s\n  expected: %s", sim_bus_log_text(bus), expected);
+	sim_bus_log_clear(bus);
+}
+
+static void test_register_read(void){
+	uint8_t pointer = 0x08;
+	uint8_t result[3] = {0};
+	iic_write_read(&IIC_MODULE, 0x50, &pointer, 1, result, 3);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 50w+ 08+ Sr 50r+ 80+ 90+ a0- P");
+	SIM_CHECK(IIC_MODULE.data_ready && memcmp(result, (uint8_t[]){0x80, 0x90, 0xA0}, 3) == 0, "read %02x %02x %02x", result[0], result[1], result[2]);
+}
+
+// With a write_len of 0 there is no write half: once the address is ACKed
+// a repeated START goes straight into the read, rather than the write
+// ending there as an address-only probe.
+static void test_empty_write_half(void){
+	uint8_t result[2] = {0};
+	iic_write_read(&IIC_MODULE, 0x50, NULL, 0, result, 2);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 50w+ Sr 50r+ b0+ c0- P"); // the pointer is where test_register_read left it
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR && result[0] == 0xB0 && result[1] == 0xC0, "error %d, read %02x %02x", IIC_MODULE.error_state, result[0], result[1]);
+}
+
+// A write-then-read that fails in its write half leaves no read half
+// behind for the next write, whichever call that is.
+static void test_no_stale_read(void){
+	uint8_t pointer = 0x08;
+	uint8_t result[3];
+	uint8_t data[] = {0x09, 0x99};
+
+	iic_write_read(&IIC_MODULE, 0x51, &pointer, 1, result, 3);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	SIM_CHECK(IIC_MODULE.error_state == IIC_MT_ADDR_NACK, "error %d", IIC_MODULE.error_state);
+	iic_clear_error(&IIC_MODULE);
+	sim_bus_log_clear(bus);
+
+	iic_write_one(&IIC_MODULE, 0x50, 0x0A);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 50w+ 0a+ P");
+
+	iic_write_read(&IIC_MODULE, 0x51, &pointer, 1, result, 3);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	iic_clear_error(&IIC_MODULE);
+	sim_bus_log_clear(bus);
+
+	iic_write_two(&IIC_MODULE, 0x50, 0x0B, 0xBB);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 50w+ 0b+ bb+ P");
+
+	iic_write_many(&IIC_MODULE, 0x50, data, 2);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(5));
+	expect_log("S 50w+ 09+ 99+ P");
+	SIM_CHECK(IIC_MODULE.error_state == IIC_NO_ERROR, "error %d", IIC_MODULE.error_state);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	device = sim_device_new(bus, 0x50);
+	device -> pointer_bytes = 1;
+	for(int dex = 0; dex < 16; dex++){
+		device -> mem[dex] = dex << 4;
+	}
+
+	setup_iic(&IIC_MODULE, 0x10, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 1, NULL);
+	enable_iic(&IIC_MODULE);
+
+	test_register_read();
+	test_empty_write_half();
+	test_no_stale_read();
+	printf("test_write_read: ok\n");
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * test_yield.c
+ * multi-master arbitration: a master that loses goes again at the next
+ * STOP, a master that wins yields its next START to the ones that lost,
+ * and none of it needs iic_watchdog_tick - this test never calls it
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iic/iic.h>
+#include <sim/sim.h>
+#include <sim/device.h>
+#include <sim/api.h>
+
+#define PEERS 2
+#define ROUNDS 10
+
+extern const sim_image_t iic_sim_image;
+
+static sim_bus_t *bus;
+static sim_api_t peers[PEERS];
+static sim_time_t last_stop, first_gap;
+static uint8_t winners[3 * ROUNDS + 8];
+static int winner_count;
+
+static void watch_gap(sim_bus_t *bus, int event, uint8_t byte, int ack, void *ctx){
+	if(event == SIM_EVENT_STOP){
+		last_stop = sim_now();
+	}else if(event == SIM_EVENT_START && last_stop != 0 && first_gap == 0){
+		first_gap = sim_now() - last_stop;
+	}
+}
+
+// The address after each START is the master that won it.
+static void watch_winners(sim_bus_t *bus, int event, uint8_t byte, int ack, void *ctx){
+	static bool after_start;
+	if(event == SIM_EVENT_START){
+		after_start = true;
+	}else if(event == SIM_EVENT_ADDRESS && after_start){
+		after_start = false;
+		if(winner_count < (int)sizeof(winners)){
+			winners[winner_count++] = byte >> 1;
+		}
+	}
+}
+
+static void expect_log(const char *expected){
+	SIM_CHECK(strcmp(sim_bus_log_text(bus), expected) == 0, "bus log\n  got:      %s\n  expected: %s", sim_bus_log_text(bus), expected);
+	sim_bus_log_clear(bus);
+}
+
+static void settle(void){
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(20));
+	for(int dex = 0; dex < PEERS; dex++){
+		sim_wait_master(peers[dex].module, bus, SIM_MS(20));
+	}
+	iic_take_events(&IIC_MODULE, 0xFF);
+	sim_bus_log_clear(bus);
+}
+
+// Alone on the bus, the yield costs a master next to nothing: the START
+// chained onto its STOP waits 1.75 us for the free bus instead of 1.25 us
+// (400 kHz).
+static void test_alone_no_gap(void){
+	uint8_t first[] = {0x00, 0x01}, second[] = {0x02, 0x03};
+	iic_transaction_t a = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = first, .buffer_len = 2};
+	iic_transaction_t b = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = second, .buffer_len = 2};
+	last_stop = first_gap = 0;
+	bus -> watch = watch_gap;
+	iic_enqueue(&IIC_MODULE, &a);
+	iic_enqueue(&IIC_MODULE, &b);
+	settle();
+	bus -> watch = NULL;
+	SIM_CHECK(a.error == IIC_NO_ERROR && b.error == IIC_NO_ERROR, "errors %d %d", a.error, b.error);
+	SIM_CHECK(first_gap <= SIM_US(2), "gap between the writes %.2f us", (double)first_gap * 1e6 / SIM_F_CPU);
+}
+
+// Two masters queue one write each at the same moment; the one to the
+// higher address loses, and with no watchdog tick to wake it it must still
+// go out at the STOP.
+static void test_loser_goes_at_stop(void){
+	uint8_t mine[] = {0x00, 0xAA}, theirs[] = {0x00, 0xBB};
+	iic_transaction_t write = {.remote_address = 0x51, .direction = IIC_MASTER_TRANSMITTER, .buffer = mine, .buffer_len = 2};
+	iic_enqueue(&IIC_MODULE, &write);
+	peers[0].write_many(peers[0].module, 0x50, theirs, 2);
+	settle();
+	SIM_CHECK(!write.pending && write.error == IIC_NO_ERROR, "write: pending %d, error %d", write.pending, write.error);
+}
+
+typedef struct writer_t{
+	iic_transaction_t transaction;
+	uint8_t data[9];
+	int left;
+	sim_api_t *api; // NULL for the local node
+} writer_t;
+
+static writer_t writers[1 + PEERS];
+
+static void write_done(iic_transaction_t *transaction, iic_error_t error){
+	writer_t *writer = (writer_t*)transaction;
+	SIM_CHECK(error == IIC_NO_ERROR, "write to %02x failed with %d", transaction -> remote_address, error);
+	if(--writer -> left > 0){
+		if(writer -> api == NULL){
+			iic_enqueue(&IIC_MODULE, transaction);
+		}else{
+			writer -> api -> enqueue(writer -> api -> module, transaction);
+		}
+	}
+}
+
+// Three masters keep the bus saturated. Each round every one of them gets
+// exactly one write through, lowest address first, so no write waits for
+// more than two others and none runs out of retries.
+static void test_round_robin(void){
+	winner_count = 0;
+	bus -> watch = watch_winners;
+	for(int dex = 0; dex <= PEERS; dex++){
+		writer_t *writer = &writers[dex];
+		writer -> api = dex == 0 ? NULL : &peers[dex - 1];
+		writer -> left = ROUNDS;
+		writer -> transaction = (iic_transaction_t){.remote_address = 0x50 + dex, .direction = IIC_MASTER_TRANSMITTER,
+			.buffer = writer -> data, .buffer_len = sizeof(writer -> data), .callback = write_done};
+	}
+	// the highest address first, so no one starts with the lowest's head start
+	for(int dex = PEERS; dex >= 0; dex--){
+		if(writers[dex].api == NULL){
+			iic_enqueue(&IIC_MODULE, &writers[dex].transaction);
+		}else{
+			writers[dex].api -> enqueue(writers[dex].api -> module, &writers[dex].transaction);
+		}
+	}
+	settle();
+	bus -> watch = NULL;
+	SIM_CHECK(winner_count == 3 * ROUNDS, "%d writes went out, expected %d", winner_count, 3 * ROUNDS);
+	for(int dex = 0; dex < winner_count; dex++){
+		SIM_CHECK(winners[dex] == 0x50 + dex % 3, "write %d went to %02x", dex, winners[dex]);
+	}
+}
+
+static int on_bus(void *arg){
+	return IIC_MODULE.current == arg;
+}
+
+// A transaction to a device the presence cache knows is absent fails
+// without touching the bus. The write queued behind it goes straight on,
+// and must still be preemptible for urgent work at once.
+static void test_absent_device_skipped(void){
+	uint8_t probe_data;
+	iic_transaction_t probe = {.remote_address = 0x5F, .direction = IIC_MASTER_RECEIVER, .buffer = &probe_data, .buffer_len = 1, .flags = IIC_FLAG_NO_RETRY};
+	iic_enqueue(&IIC_MODULE, &probe);
+	settle();
+	SIM_CHECK(iic_device_absent(&IIC_MODULE, 0x5F), "probe didn't mark 0x5f absent");
+
+	uint8_t lead_data[] = {0x30, 0x31}, gone[] = {0x00}, data[12], pointer = 0x30, result[2] = {0};
+	for(int dex = 0; dex < 12; dex++){
+		data[dex] = 0x10 + dex;
+	}
+	iic_transaction_t lead = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = lead_data, .buffer_len = 2};
+	iic_transaction_t absent = {.remote_address = 0x5F, .direction = IIC_MASTER_TRANSMITTER, .buffer = gone, .buffer_len = 1};
+	iic_transaction_t bulk = {.remote_address = 0x3C, .direction = IIC_MASTER_TRANSMITTER, .buffer = data, .buffer_len = sizeof(data), .flags = IIC_FLAG_PREEMPTIBLE};
+	iic_transaction_t urgent = {.remote_address = 0x50, .direction = IIC_MASTER_TRANSMITTER, .buffer = &pointer, .buffer_len = 1,
+		.read_buffer = result, .read_len = 2, .flags = IIC_FLAG_URGENT};
+	iic_set_preempt_chunk(&IIC_MODULE, 4);
+	iic_enqueue(&IIC_MODULE, &lead);
+	iic_enqueue(&IIC_MODULE, &absent);
+	iic_enqueue(&IIC_MODULE, &bulk);
+	SIM_CHECK(sim_run_until(on_bus, &bulk, SIM_MS(5)), "bulk write never started");
+	SIM_CHECK(!absent.pending && absent.error == IIC_MT_ADDR_NACK, "absent write: pending %d, error %d", absent.pending, absent.error);
+	sim_run(SIM_US(20));
+	iic_enqueue(&IIC_MODULE, &urgent);
+	sim_wait_master(&IIC_MODULE, bus, SIM_MS(20));
+	expect_log("S 50w+ 30+ 31+ P S 3cw+ 10+ 11+ 12+ 13+ Sr 50w+ 30+ Sr 50r+ 31+ 00- P S 3cw+ 14+ 15+ 16+ 17+ 18+ 19+ 1a+ 1b+ P");
+	settle();
+	iic_set_preempt_chunk(&IIC_MODULE, 0);
+	SIM_CHECK(bulk.error == IIC_NO_ERROR && urgent.error == IIC_NO_ERROR, "errors %d %d", bulk.error, urgent.error);
+	SIM_CHECK(result[0] == 0x31, "urgent read %02x", result[0]);
+}
+
+int main(void){
+	bus = sim_bus_new("bus");
+	sim_bus_log(bus, 1);
+	sim_node_t *local = sim_node_attach(&iic_sim_image, "local");
+	sim_connect_twi(local, 0, bus);
+	for(int dex = 0; dex <= PEERS; dex++){
+		sim_device_new(bus, 0x50 + dex) -> pointer_bytes = 1;
+	}
+	sim_device_new(bus, 0x3C); // a display: plain data, no register pointer
+	for(int dex = 0; dex < PEERS; dex++){
+		char name[8];
+		snprintf(name, sizeof(name), "peer%d", dex);
+		sim_node_t *node = sim_node_load("test/build/fw_node.so", name);
+		sim_connect_twi(node, 0, bus);
+		sim_api_load(node, &peers[dex]);
+		peers[dex].setup(peers[dex].module, 0x41 + dex, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+		peers[dex].enable(peers[dex].module);
+	}
+
+	setup_iic(&IIC_MODULE, 0x20, false, false, IIC_TWBR_FOR(F_CPU, 400000UL), IIC_PRESCALER_FOR(F_CPU, 400000UL), 3, NULL);
+	enable_iic(&IIC_MODULE);
+
+	test_alone_no_gap();
+	test_loser_goes_at_stop();
+	test_round_robin();
+	test_absent_device_skipped();
+	printf("test_yield: ok\n");
+	return 0;
+}
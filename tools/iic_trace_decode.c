@@ -0,0 +1,171 @@
+/*
+   Copyright 2018 Alexander Shuping
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ * iic_trace_decode.c
+ * host-side decoder for iic_trace_dump output (see iic_trace.h)
+ *
+ * Reads a raw dump from a file (or stdin) and prints one line per bus
+ * event, with the timer ticks since the previous event, split into
+ * transactions at each START. Build with `make TRACE_DECODE`.
+ *
+ * usage: iic_trace_decode [dump.bin]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IIC_TRACE_VERSION 1 // must match include/iic/iic_trace.h
+
+// TWSR status codes, as in <util/twi.h> (not available off-target)
+static const char *status_name(uint8_t status){
+	switch(status){
+		case 0x08: return "START";
+		case 0x10: return "REP_START";
+		case 0x18: return "MT_SLA_ACK";
+		case 0x20: return "MT_SLA_NACK";
+		case 0x28: return "MT_DATA_ACK";
+		case 0x30: return "MT_DATA_NACK";
+		case 0x38: return "ARB_LOST";
+		case 0x40: return "MR_SLA_ACK";
+		case 0x48: return "MR_SLA_NACK";
+		case 0x50: return "MR_DATA_ACK";
+		case 0x58: return "MR_DATA_NACK";
+		case 0x60: return "SR_SLA_ACK";
+		case 0x68: return "SR_ARB_LOST_SLA_ACK";
+		case 0x70: return "SR_GCALL_ACK";
+		case 0x78: return "SR_ARB_LOST_GCALL_ACK";
+		case 0x80: return "SR_DATA_ACK";
+		case 0x88: return "SR_DATA_NACK";
+		case 0x90: return "SR_GCALL_DATA_ACK";
+		case 0x98: return "SR_GCALL_DATA_NACK";
+		case 0xA0: return "SR_STOP";
+		case 0xA8: return "ST_SLA_ACK";
+		case 0xB0: return "ST_ARB_LOST_SLA_ACK";
+		case 0xB8: return "ST_DATA_ACK";
+		case 0xC0: return "ST_DATA_NACK";
+		case 0xC8: return "ST_LAST_DATA";
+		case 0xF8: return "NO_INFO";
+		case 0x00: return "BUS_ERROR";
+		default:   return "?";
+	}
+}
+
+// iic_error_t, with the letter project.c prints for it
+static const char *error_name(uint8_t error){
+	static const char *names[] = {
+		"no error",
+		"A: MT arbitration lost",
+		"B: MR arbitration lost",
+		"C: arbitration lost, addressed as slave transmitter",
+		"D: arbitration lost, addressed as slave receiver",
+		"E: MT address NACK",
+		"F: MT data NACK",
+		"G: MR address NACK",
+		"H: MR data NACK",
+		"I: ST data NACK",
+		"J: SR data NACK",
+		"K: SR stop",
+		"L: bus error",
+		"M: queue full"
+	};
+	return error < sizeof(names) / sizeof(names[0]) ? names[error] : "unknown error";
+}
+
+// What the TWDR byte in an entry means for its status code
+static void describe_data(uint8_t status, uint8_t data){
+	switch(status){
+		case 0x18: case 0x20: case 0x40: case 0x48:
+			printf("  addr 0x%02X %s", data >> 1, (data & 1) ? "R" : "W");
+			break;
+		case 0x28: case 0x30: case 0x50: case 0x58:
+		case 0x80: case 0x88: case 0x90: case 0x98:
+		case 0xB8: case 0xC0: case 0xC8:
+			printf("  data 0x%02X", data);
+			break;
+		default:
+			break;
+	}
+}
+
+static int get_byte(FILE *in){
+	int c = fgetc(in);
+	if(c == EOF){
+		fprintf(stderr, "iic_trace_decode: dump is truncated\n");
+	}
+	return c;
+}
+
+int main(int argc, char **argv){
+	FILE *in = stdin;
+	if(argc > 1){
+		in = fopen(argv[1], "rb");
+		if(in == NULL){
+			perror(argv[1]);
+			return 1;
+		}
+	}
+
+	int header[5];
+	for(int i = 0; i < 5; i++){
+		if((header[i] = get_byte(in)) == EOF){
+			return 1;
+		}
+	}
+	if(header[0] != 'I' || header[1] != 'T'){
+		fprintf(stderr, "iic_trace_decode: not an iic trace dump\n");
+		return 1;
+	}
+	if(header[2] != IIC_TRACE_VERSION){
+		fprintf(stderr, "iic_trace_decode: trace version %d, expected %d\n", header[2], IIC_TRACE_VERSION);
+		return 1;
+	}
+
+	uint8_t count = header[3];
+	printf("%u entries, %s\n", count, header[4] == 0 ? "not frozen by an error" : "frozen by error");
+	if(header[4] != 0){
+		printf("freeze error: %s\n", error_name(header[4]));
+	}
+
+	uint16_t last_tick = 0;
+	unsigned transaction = 0;
+	uint32_t elapsed = 0; // ticks since the first entry
+	for(unsigned i = 0; i < count; i++){
+		int raw[4];
+		for(int j = 0; j < 4; j++){
+			if((raw[j] = get_byte(in)) == EOF){
+				return 1;
+			}
+		}
+		uint8_t status = raw[0];
+		uint8_t data = raw[1];
+		uint16_t tick = raw[2] | (raw[3] << 8);
+		uint16_t delta = i == 0 ? 0 : (uint16_t)(tick - last_tick); // the timer is free-running, so this survives one wrap
+		elapsed += delta;
+		last_tick = tick;
+
+		if(status == 0x08 || i == 0){
+			printf("\n-- transaction %u%s\n", ++transaction, status == 0x08 ? "" : " (started before the trace)");
+		}
+		printf("%8lu  +%-6u %-22s", (unsigned long) elapsed, delta, status_name(status));
+		describe_data(status, data);
+		printf("\n");
+	}
+
+	if(in != stdin){
+		fclose(in);
+	}
+	return 0;
+}